@@ -41,12 +41,23 @@
 #include <fetch.h>
 #include <paths.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include "pkg.h"
 #include "private/event.h"
 #include "private/pkg.h"
 #include "private/utils.h"
 
+/* Mirror lists are built lazily and shared by concurrent fetches */
+static pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * libfetch reports errors through process wide globals: the requests
+ * which may set them run under `fetch_lock' and the error is copied
+ * before it is released.
+ */
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void
 gethttpmirrors(struct pkg_repo *repo, const char *url) {
 	FILE *f;
@@ -98,7 +109,7 @@ pkg_fetch_file(struct pkg_repo *repo, const char *url, char *dest, time_t t)
 		return(EPKG_FATAL);
 	}
 
-	retcode = pkg_fetch_file_to_fd(repo, url, fd, &t);
+	retcode = pkg_fetch_file_to_fd(repo, url, fd, &t, NULL);
 
 	if (t != 0) {
 		struct timeval ftimes[2] = {
@@ -256,18 +267,26 @@ ssh_close(void *data)
 
 	write(repo->sshio.out, "quit\n", 5);
 
+	/*
+	 * The server may still be sending a reply nobody will read, do not
+	 * let it block on us.
+	 */
+	close(repo->sshio.in);
+	close(repo->sshio.out);
+	free(repo->sshio.pending);
+	repo->sshio.pending = NULL;
+	repo->ssh = NULL;
+
 	while (waitpid(repo->sshio.pid, &pstat, 0) == -1) {
 		if (errno != EINTR)
 			return (EPKG_FATAL);
 	}
 
-	repo->ssh = NULL;
-
 	return (WEXITSTATUS(pstat));
 }
 
 static int
-start_ssh(struct pkg_repo *repo, struct url *u, off_t *sz)
+start_ssh(struct pkg_repo *repo, struct url *u, off_t *sz, const char *next)
 {
 	char *line = NULL;
 	size_t linecap = 0;
@@ -281,6 +300,18 @@ start_ssh(struct pkg_repo *repo, struct url *u, off_t *sz)
 
 	ssh_args = pkg_object_string(pkg_config_get("PKG_SSH_ARGS"));
 
+	/*
+	 * The reply to a request sent ahead of time comes first, if that
+	 * is not the file wanted now the channel is useless: restart it.
+	 */
+	if (repo->ssh != NULL && repo->sshio.pending != NULL &&
+	    (u->offset != 0 || u->ims_time != 0 ||
+	    strcmp(repo->sshio.pending, u->doc) != 0)) {
+		pkg_debug(1, "ssh: %s was not fetched, restarting",
+		    repo->sshio.pending);
+		fclose(repo->ssh);
+	}
+
 	if (repo->ssh == NULL) {
 		/* Use socket pair because pipe have blocking issues */
 		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sshin) <0 ||
@@ -355,10 +386,45 @@ start_ssh(struct pkg_repo *repo, struct url *u, off_t *sz)
 			return (EPKG_FATAL);
 		}
 	}
-	fprintf(repo->ssh, "get %s %" PRIdMAX "\n", u->doc, (intmax_t)u->ims_time);
+	if (repo->sshio.pending != NULL) {
+		/* already asked for */
+		free(repo->sshio.pending);
+		repo->sshio.pending = NULL;
+	} else if (u->offset > 0)
+		fprintf(repo->ssh, "get %s %" PRIdMAX " %" PRIdMAX "\n", u->doc,
+		    (intmax_t)u->ims_time, (intmax_t)u->offset);
+	else
+		fprintf(repo->ssh, "get %s %" PRIdMAX "\n", u->doc,
+		    (intmax_t)u->ims_time);
+
+	/*
+	 * Pipeline the next request so the server goes on with it as soon
+	 * as this reply is sent. Not behind a resumed request: it may be
+	 * refused and asked again, which would reorder the replies.
+	 */
+	if (next != NULL && u->offset == 0) {
+		fprintf(repo->ssh, "get %s 0\n", next);
+		repo->sshio.pending = strdup(next);
+	}
 	if ((linelen = getline(&line, &linecap, repo->ssh)) > 0) {
 		if (line[linelen -1 ] == '\n')
 			line[linelen -1 ] = '\0';
+		/*
+		 * Servers which do not know about offsets reject the
+		 * request, ask again for the whole file.
+		 */
+		if (u->offset > 0 && strncmp(line, "ko:", 3) == 0) {
+			pkg_debug(1, "ssh: server cannot resume, restarting");
+			u->offset = 0;
+			fprintf(repo->ssh, "get %s %" PRIdMAX "\n", u->doc,
+			    (intmax_t)u->ims_time);
+			if ((linelen = getline(&line, &linecap, repo->ssh)) <= 0) {
+				free(line);
+				return (EPKG_FATAL);
+			}
+			if (line[linelen -1 ] == '\n')
+				line[linelen -1 ] = '\0';
+		}
 		if (strncmp(line, "ok:", 3) == 0) {
 			*sz = strtonum(line + 4, 0, LONG_MAX, &errstr);
 			if (errstr) {
@@ -384,10 +450,11 @@ start_ssh(struct pkg_repo *repo, struct url *u, off_t *sz)
 #define URL_SCHEME_PREFIX	"pkg+"
 
 int
-pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t)
+pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest,
+    time_t *t, struct pkg_fetch_ctx *ctx)
 {
 	FILE		*remote = NULL;
-	struct url	*u = NULL;
+	struct url	*u = NULL, *next;
 	struct url_stat	 st;
 	off_t		 done = 0;
 	off_t		 r;
@@ -396,8 +463,10 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 	int64_t		 fetch_timeout;
 	time_t		 begin_dl;
 	time_t		 last = 0;
-	char		 buf[10240];
+	char		*buf = NULL;
+	size_t		 bufsize;
 	char		*doc = NULL;
+	const char	*nexturl;
 	char		 docpath[MAXPATHLEN];
 	int		 retcode = EPKG_OK;
 	char		 zone[MAXHOSTNAMELEN + 13];
@@ -405,6 +474,8 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 	struct http_mirror	*http_current = NULL;
 	off_t		 sz = 0;
 	bool		 pkg_url_scheme = false;
+	int		 errcode;
+	char		 errstr[MAXERRSTRING];
 
 	max_retry = pkg_object_int(pkg_config_get("FETCH_RETRY"));
 	fetch_timeout = pkg_object_int(pkg_config_get("FETCH_TIMEOUT"));
@@ -444,9 +515,23 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 	u = fetchParseURL(url);
 	if (t != NULL)
 		u->ims_time = *t;
+	if (ctx != NULL)
+		u->offset = ctx->offset;
 
 	if (strcmp(u->scheme, "ssh") == 0) {
-		if ((retcode = start_ssh(repo, u, &sz)) != EPKG_OK)
+		next = NULL;
+		if (ctx != NULL && ctx->next != NULL) {
+			nexturl = ctx->next;
+			if (strncmp(URL_SCHEME_PREFIX, nexturl,
+			    strlen(URL_SCHEME_PREFIX)) == 0)
+				nexturl += strlen(URL_SCHEME_PREFIX);
+			next = fetchParseURL(nexturl);
+		}
+		retcode = start_ssh(repo, u, &sz,
+		    next != NULL ? next->doc : NULL);
+		if (next != NULL)
+			fetchFreeURL(next);
+		if (retcode != EPKG_OK)
 			goto cleanup;
 		remote = repo->ssh;
 	}
@@ -454,6 +539,7 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 	doc = u->doc;
 	while (remote == NULL) {
 		if (retry == max_retry) {
+			pthread_mutex_lock(&mirror_lock);
 			if (repo != NULL && repo->mirror_type == SRV &&
 			    (strncmp(u->scheme, "http", 4) == 0
 			     || strcmp(u->scheme, "ftp") == 0)) {
@@ -476,6 +562,7 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 					gethttpmirrors(repo, zone);
 				http_current = repo->http;
 			}
+			pthread_mutex_unlock(&mirror_lock);
 		}
 
 		if (repo != NULL && repo->mirror_type == SRV && repo->srv != NULL) {
@@ -496,16 +583,19 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 		    u->user[0] != '\0' ? "@" : "",
 		    u->host,
 		    u->doc);
+		pthread_mutex_lock(&fetch_lock);
 		remote = fetchXGet(u, &st, "i");
+		errcode = fetchLastErrCode;
+		strlcpy(errstr, fetchLastErrString, sizeof(errstr));
+		pthread_mutex_unlock(&fetch_lock);
 		if (remote == NULL) {
-			if (fetchLastErrCode == FETCH_OK) {
+			if (errcode == FETCH_OK) {
 				retcode = EPKG_UPTODATE;
 				goto cleanup;
 			}
 			--retry;
-			if (retry <= 0 || fetchLastErrCode == FETCH_UNAVAIL) {
-				pkg_emit_error("%s: %s", url,
-				    fetchLastErrString);
+			if (retry <= 0 || errcode == FETCH_UNAVAIL) {
+				pkg_emit_error("%s: %s", url, errstr);
 				retcode = EPKG_FATAL;
 				goto cleanup;
 			}
@@ -531,14 +621,45 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 			} else if (strncmp(u->scheme, "http", 4) == 0)
 				*t = st.mtime;
 		}
-		sz = st.size;
+		sz = st.size - u->offset;
+	}
+
+	/*
+	 * fetch(3) and start_ssh() leave in u->offset where the server
+	 * actually starts, if the range was not honoured start over.
+	 */
+	if (ctx != NULL && u->offset != ctx->offset) {
+		if (u->offset != 0 || ftruncate(dest, 0) == -1 ||
+		    lseek(dest, 0, SEEK_SET) == -1) {
+			pkg_emit_error("%s: cannot resume the download", url);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		if (ctx->hash)
+			SHA256_Init(&ctx->sha);
+		__sync_fetch_and_sub(&ctx->done, ctx->offset);
+		ctx->offset = 0;
+	}
+
+	bufsize = pkg_object_int(pkg_config_get("FETCH_BUFFER_SIZE"));
+	if (bufsize < BUFSIZ)
+		bufsize = BUFSIZ;
+	if ((buf = malloc(bufsize)) == NULL) {
+		pkg_emit_errno("malloc", "fetch buffer");
+		retcode = EPKG_FATAL;
+		goto cleanup;
 	}
 
 	begin_dl = time(NULL);
 	while (done < sz) {
 		time_t	now;
 
-		if ((r = fread(buf, 1, sizeof(buf), remote)) < 1)
+		if (ctx != NULL && ctx->cancel != NULL && *ctx->cancel) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+
+		if ((r = fread(buf, 1, bufsize, remote)) < 1)
 			break;
 
 		if (write(dest, buf, r) != r) {
@@ -548,6 +669,13 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 		}
 
 		done += r;
+		if (ctx != NULL) {
+			__sync_fetch_and_add(&ctx->done, r);
+			if (ctx->hash)
+				SHA256_Update(&ctx->sha, buf, r);
+			if (ctx->batched)
+				continue;
+		}
 		now = time(NULL);
 		/* Only call the callback every second */
 		if (now > last || done == sz) {
@@ -563,13 +691,24 @@ pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url, int dest, time_t *t
 	}
 
 	if (strcmp(u->scheme, "ssh") != 0 && ferror(remote)) {
-		pkg_emit_error("%s: %s", url, fetchLastErrString);
+		pthread_mutex_lock(&fetch_lock);
+		strlcpy(errstr, fetchLastErrString, sizeof(errstr));
+		pthread_mutex_unlock(&fetch_lock);
+		pkg_emit_error("%s: %s", url, errstr);
 		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
 
 	cleanup:
 
+	free(buf);
+
+	/* Whatever is left of the reply would be read as the next one */
+	if (remote != NULL && repo != NULL && remote == repo->ssh && done < sz) {
+		fclose(repo->ssh);
+		remote = NULL;
+	}
+
 	if (u != NULL) {
 		if (remote != NULL &&  repo != NULL && remote != repo->ssh)
 			fclose(remote);
@@ -32,16 +32,16 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "private/event.h"
 #include "private/pkg.h"
 #include "private/utils.h"
 
-static ucl_object_t *manifest_schema = NULL;
-
 int
 pkg_new(struct pkg **pkg, pkg_t type)
 {
@@ -50,12 +50,31 @@ pkg_new(struct pkg **pkg, pkg_t type)
 		return EPKG_FATAL;
 	}
 
-	(*pkg)->fields = ucl_object_typed_new(UCL_OBJECT);
 	(*pkg)->type = type;
 
 	return (EPKG_OK);
 }
 
+static void
+pkg_fields_free(struct pkg *pkg)
+{
+	int i;
+
+	for (i = 1; i < PKG_NUM_FIELDS; i++) {
+		switch (pkg_keys[i].type) {
+		case UCL_STRING:
+			free(pkg->fields[i].v.str);
+			break;
+		case UCL_OBJECT:
+		case UCL_ARRAY:
+			if (pkg->fields[i].v.obj != NULL)
+				ucl_object_unref(pkg->fields[i].v.obj);
+			break;
+		}
+	}
+	memset(pkg->fields, 0, sizeof(pkg->fields));
+}
+
 void
 pkg_reset(struct pkg *pkg, pkg_t type)
 {
@@ -64,8 +83,7 @@ pkg_reset(struct pkg *pkg, pkg_t type)
 	if (pkg == NULL)
 		return;
 
-	ucl_object_unref(pkg->fields);
-	pkg->fields = ucl_object_typed_new(UCL_OBJECT);
+	pkg_fields_free(pkg);
 	pkg->flags &= ~PKG_LOAD_CATEGORIES;
 	pkg->flags &= ~PKG_LOAD_LICENSES;
 	pkg->flags &= ~PKG_LOAD_ANNOTATIONS;
@@ -91,7 +109,7 @@ pkg_free(struct pkg *pkg)
 	if (pkg == NULL)
 		return;
 
-	ucl_object_unref(pkg->fields);
+	pkg_fields_free(pkg);
 
 	for (int i = 0; i < PKG_NUM_SCRIPTS; i++)
 		sbuf_free(pkg->scripts[i]);
@@ -117,103 +135,69 @@ pkg_type(const struct pkg * restrict pkg)
 	return (pkg->type);
 }
 
-static ucl_object_t *
-manifest_schema_open(pkg_t type __unused)
-{
-	struct ucl_parser *parser;
-	static const char manifest_schema_str[] = ""
-		"{"
-		"  type = object;"
-		"  properties {"
-		"    origin = { type = string };"
-		"    name = { type = string };"
-		"    comment = { type = string };"
-		"    desc = { type = string };"
-		"    mtree = { type = string };"
-		"    message = { type = string };"
-		"    maintainer = { type = string };"
-		"    arch = { type = string };"
-		"    www = { type = string };"
-		"    prefix = { type = string };"
-		"    digest = { type = string };"
-		"    repopath = { type = string };"
-		"    sum = { type = string };"
-		"    oldversion = { type = string };"
-		"    reponame = { type = string };"
-		"    repourl = { type = string };"
-		"    reason = { type = string };"
-		"    flatsize = { type = integer }; "
-		"    oldflatsize = { type = integer }; "
-		"    pkgsize = { type = integer }; "
-		"    locked = { type = boolean }; "
-		"    rowid = { type = integer }; "
-		"    time = { type = integer }; "
-		"    annotations = { type = object }; "
-		"    licenses = { "
-		"      type = array; "
-		"      items = { type = string }; "
-		"      uniqueItems = true ;"
-		"    };"
-		"    categories = { "
-		"      type = array; "
-		"      items = { type = string }; "
-		"      uniqueItems = true ;"
-		"    };"
-		"  }\n"
-		"  required = ["
-		"    origin,"
-		"    name,"
-		"    comment,"
-		"    desc,"
-		"    maintainer,"
-		"    arch,"
-		"    www,"
-		"    prefix,"
-		"  ]"
-		"}";
-
-	if (manifest_schema != NULL)
-		return (manifest_schema);
-
-	parser = ucl_parser_new(0);
-	if (!ucl_parser_add_chunk(parser, manifest_schema_str,
-	    sizeof(manifest_schema_str) -1)) {
-		pkg_emit_error("Cannot parse manifest schema: %s",
-		    ucl_parser_get_error(parser));
-		ucl_parser_free(parser);
-		return (NULL);
-	}
-
-	manifest_schema = ucl_parser_get_object(parser);
-	ucl_parser_free(parser);
-
-	return (manifest_schema);
-}
-
 int
 pkg_is_valid(const struct pkg * restrict pkg)
 {
-	ucl_object_t *schema;
-	struct ucl_schema_error err;
+	int i;
+	static const struct {
+		pkg_attr attr;
+		const char *name;
+	} required[] = {
+		{ PKG_ORIGIN, "origin" },
+		{ PKG_NAME, "name" },
+		{ PKG_VERSION, "version" },
+		{ PKG_COMMENT, "comment" },
+		{ PKG_DESC, "description" },
+		{ PKG_ARCH, "architecture" },
+		{ PKG_MAINTAINER, "maintainer" },
+		{ PKG_WWW, "www" },
+		{ PKG_PREFIX, "prefix" },
+	};
 
-	schema = manifest_schema_open(pkg->type);
+	/* Fields are typed by pkg_keys, so only check the required ones */
+	for (i = 0; i < (int)NELEM(required); i++) {
+		if (pkg->fields[required[i].attr].v.str == NULL) {
+			pkg_emit_error("package field incomplete: %s",
+			    required[i].name);
+			return (EPKG_FATAL);
+		}
+	}
 
-	if (schema == NULL)
-		return (EPKG_FATAL);
+	return (EPKG_OK);
+}
 
-	if (!ucl_object_validate(schema, pkg->fields, &err)) {
-		pkg_emit_error("Invalid package: %s", err.msg);
-		return (EPKG_FATAL);
+/*
+ * Build an UCL object for an attribute, e.g. to emit a manifest; the caller
+ * owns the result which is NULL if the attribute is not set
+ */
+ucl_object_t *
+pkg_attr_to_ucl(const struct pkg *pkg, pkg_attr attr)
+{
+	const struct pkg_field *f = &pkg->fields[attr];
+
+	switch (pkg_keys[attr].type) {
+	case UCL_STRING:
+		if (f->v.str == NULL)
+			return (NULL);
+		return (ucl_object_fromstring_common(f->v.str,
+		    strlen(f->v.str), 0));
+	case UCL_BOOLEAN:
+		return (f->set ? ucl_object_frombool(f->v.boolean) : NULL);
+	case UCL_INT:
+		return (f->set ? ucl_object_fromint(f->v.num) : NULL);
+	case UCL_OBJECT:
+	case UCL_ARRAY:
+		return (f->v.obj != NULL ? ucl_object_ref(f->v.obj) : NULL);
 	}
 
-	return (EPKG_OK);
+	return (NULL);
 }
 
 static int
 pkg_vget(const struct pkg * restrict pkg, va_list ap)
 {
 	int attr;
-	const ucl_object_t *obj;
+	const struct pkg_field *f;
 
 	while ((attr = va_arg(ap, int)) > 0) {
 
@@ -222,32 +206,20 @@ pkg_vget(const struct pkg * restrict pkg, va_list ap)
 			return (EPKG_FATAL);
 		}
 
-		obj = ucl_object_find_key(pkg->fields, pkg_keys[attr].name);
+		f = &pkg->fields[attr];
 		switch (pkg_keys[attr].type) {
 		case UCL_STRING:
-			if (obj == NULL) {
-				*va_arg(ap, const char **) = NULL;
-				break;
-			}
-			*va_arg(ap, const char **) = ucl_object_tostring_forced(obj);
+			*va_arg(ap, const char **) = f->v.str;
 			break;
 		case UCL_BOOLEAN:
-			if (obj == NULL) {
-				*va_arg(ap, bool *) = false;
-				break;
-			}
-			*va_arg(ap, bool *) = ucl_object_toboolean(obj);
+			*va_arg(ap, bool *) = f->set ? f->v.boolean : false;
 			break;
 		case UCL_INT:
-			if (obj == NULL) {
-				*va_arg(ap, int64_t *) = 0;
-				break;
-			}
-			*va_arg(ap, int64_t *) = ucl_object_toint(obj);
+			*va_arg(ap, int64_t *) = f->set ? f->v.num : 0;
 			break;
 		case UCL_OBJECT:
 		case UCL_ARRAY:
-			*va_arg(ap, const pkg_object **) = obj;
+			*va_arg(ap, const pkg_object **) = f->v.obj;
 			break;
 		default:
 			va_arg(ap, void *); /* ignore */
@@ -273,14 +245,67 @@ pkg_get2(const struct pkg * restrict pkg, ...)
 	return (ret);
 }
 
+/*
+ * Typed setters, pkg_set() dispatches to them after parsing its arguments
+ */
+int
+pkg_set_string(struct pkg *pkg, pkg_attr attr, const char *str)
+{
+	struct pkg_field *f = &pkg->fields[attr];
+	struct pkg_repo *r;
+	char *buf = NULL, *copy = NULL;
+	const char *data = str;
+
+	if (attr == PKG_MTREE && !STARTS_WITH(str, "#mtree")) {
+		asprintf(&buf, "#mtree\n%s", str);
+		data = buf;
+	}
+
+	if (attr == PKG_REPOURL) {
+		r = pkg_repo_find_ident(str);
+		if (r == NULL)
+			return (EPKG_OK);
+		data = pkg_repo_url(r);
+	}
+
+	/* Copy first: the new value may be the current one */
+	if (data != NULL && (copy = strdup(data)) == NULL) {
+		pkg_emit_errno("strdup", pkg_keys[attr].name);
+		free(buf);
+		return (EPKG_FATAL);
+	}
+	free(f->v.str);
+	f->v.str = copy;
+	f->set = (copy != NULL);
+
+	free(buf);
+
+	return (EPKG_OK);
+}
+
+int
+pkg_set_int(struct pkg *pkg, pkg_attr attr, int64_t val)
+{
+	pkg->fields[attr].v.num = val;
+	pkg->fields[attr].set = true;
+
+	return (EPKG_OK);
+}
+
+int
+pkg_set_bool(struct pkg *pkg, pkg_attr attr, bool val)
+{
+	pkg->fields[attr].v.boolean = val;
+	pkg->fields[attr].set = true;
+
+	return (EPKG_OK);
+}
+
 static int
 pkg_vset(struct pkg *pkg, va_list ap)
 {
 	int attr;
-	struct pkg_repo *r;
-	char *buf = NULL;
-	const char *data;
-	const char *str;
+	struct pkg_field *f;
 	ucl_object_t *o;
 
 	while ((attr = va_arg(ap, int)) > 0) {
@@ -289,49 +314,26 @@ pkg_vset(struct pkg *pkg, va_list ap)
 			return (EPKG_FATAL);
 		}
 
+		f = &pkg->fields[attr];
 		switch (pkg_keys[attr].type) {
 		case UCL_STRING:
-			str = va_arg(ap, const char *);
-			data = str;
-
-			if (attr == PKG_MTREE && !STARTS_WITH(str, "#mtree")) {
-				asprintf(&buf, "#mtree\n%s", str);
-				data = buf;
-			}
-
-			if (attr == PKG_REPOURL) {
-				r = pkg_repo_find_ident(str);
-				if (r == NULL)
-					break;
-				data = pkg_repo_url(r);
-			}
-
-			if (data == NULL)
-				ucl_object_delete_key(pkg->fields, pkg_keys[attr].name);
-			else
-				ucl_object_replace_key(pkg->fields,
-				    ucl_object_fromstring_common(data, strlen(data), 0),
-				    pkg_keys[attr].name, strlen(pkg_keys[attr].name), false);
-
-			if (buf != NULL)
-				free(buf);
-
+			if (pkg_set_string(pkg, attr,
+			    va_arg(ap, const char *)) != EPKG_OK)
+				return (EPKG_FATAL);
 			break;
 		case UCL_BOOLEAN:
-			ucl_object_replace_key(pkg->fields,
-			    ucl_object_frombool((bool)va_arg(ap, int)),
-			    pkg_keys[attr].name, strlen(pkg_keys[attr].name), false);
+			pkg_set_bool(pkg, attr, (bool)va_arg(ap, int));
 			break;
 		case UCL_INT:
-			ucl_object_replace_key(pkg->fields,
-			    ucl_object_fromint(va_arg(ap, int64_t)),
-			    pkg_keys[attr].name, strlen(pkg_keys[attr].name), false);
+			pkg_set_int(pkg, attr, va_arg(ap, int64_t));
 			break;
 		case UCL_OBJECT:
 		case UCL_ARRAY:
 			o = va_arg(ap, ucl_object_t *);
-			ucl_object_replace_key(pkg->fields, o,
-			    pkg_keys[attr].name, strlen(pkg_keys[attr].name), false);
+			if (f->v.obj != NULL && f->v.obj != o)
+				ucl_object_unref(f->v.obj);
+			f->v.obj = o;
+			f->set = (o != NULL);
 			break;
 		default:
 			(void) va_arg(ap, void *);
@@ -546,9 +548,7 @@ pkg_adduid(struct pkg *pkg, const char *name, const char *uidstr)
 	strlcpy(u->name, name, sizeof(u->name));
 
 	if (uidstr != NULL)
-		strlcpy(u->uidstr, uidstr, sizeof(u->uidstr));
-	else
-		u->uidstr[0] = '\0';
+		u->uidstr = strdup(uidstr);
 
 	HASH_ADD_STR(pkg->users, name, u);
 
@@ -584,9 +584,7 @@ pkg_addgid(struct pkg *pkg, const char *name, const char *gidstr)
 
 	strlcpy(g->name, name, sizeof(g->name));
 	if (gidstr != NULL)
-		strlcpy(g->gidstr, gidstr, sizeof(g->gidstr));
-	else
-		g->gidstr[0] = '\0';
+		g->gidstr = strdup(gidstr);
 
 	HASH_ADD_STR(pkg->groups, name, g);
 
@@ -693,22 +691,26 @@ pkg_addfile_attr(struct pkg *pkg, const char *path, const char *sha256, const ch
 		}
 	}
 
-	pkg_file_new(&f);
-	strlcpy(f->path, path, sizeof(f->path));
+	if (pkg_file_new(&pkg->files_arena, &f) != EPKG_OK)
+		return (EPKG_FATAL);
+	if ((f->path = pkg_arena_strdup(&pkg->files_arena, path)) == NULL)
+		return (EPKG_FATAL);
 
 	if (sha256 != NULL)
 		strlcpy(f->sum, sha256, sizeof(f->sum));
 
-	if (uname != NULL)
-		strlcpy(f->uname, uname, sizeof(f->uname));
+	if (uname != NULL &&
+	    (f->uname = pkg_arena_intern(&pkg->files_arena, uname)) == NULL)
+		return (EPKG_FATAL);
 
-	if (gname != NULL)
-		strlcpy(f->gname, gname, sizeof(f->gname));
+	if (gname != NULL &&
+	    (f->gname = pkg_arena_intern(&pkg->files_arena, gname)) == NULL)
+		return (EPKG_FATAL);
 
 	if (perm != 0)
 		f->perm = perm;
 
-	HASH_ADD_STR(pkg->files, path, f);
+	HASH_ADD_KEYPTR(hh, pkg->files, f->path, strlen(f->path), f);
 
 	return (EPKG_OK);
 }
@@ -775,21 +777,25 @@ pkg_adddir_attr(struct pkg *pkg, const char *path, const char *uname, const char
 		}
 	}
 
-	pkg_dir_new(&d);
-	strlcpy(d->path, path, sizeof(d->path));
+	if (pkg_dir_new(&pkg->dirs_arena, &d) != EPKG_OK)
+		return (EPKG_FATAL);
+	if ((d->path = pkg_arena_strdup(&pkg->dirs_arena, path)) == NULL)
+		return (EPKG_FATAL);
 
-	if (uname != NULL)
-		strlcpy(d->uname, uname, sizeof(d->uname));
+	if (uname != NULL &&
+	    (d->uname = pkg_arena_intern(&pkg->dirs_arena, uname)) == NULL)
+		return (EPKG_FATAL);
 
-	if (gname != NULL)
-		strlcpy(d->gname, gname, sizeof(d->gname));
+	if (gname != NULL &&
+	    (d->gname = pkg_arena_intern(&pkg->dirs_arena, gname)) == NULL)
+		return (EPKG_FATAL);
 
 	if (perm != 0)
 		d->perm = perm;
 
 	d->try = try;
 
-	HASH_ADD_STR(pkg->dirs, path, d);
+	HASH_ADD_KEYPTR(hh, pkg->dirs, d->path, strlen(d->path), d);
 
 	return (EPKG_OK);
 }
@@ -1207,11 +1213,13 @@ pkg_list_free(struct pkg *pkg, pkg_list list)  {
 		pkg->flags &= ~PKG_LOAD_OPTIONS;
 		break;
 	case PKG_FILES:
-		HASH_FREE(pkg->files, pkg_file_free);
+		HASH_CLEAR(hh, pkg->files);
+		pkg_arena_free(&pkg->files_arena);
 		pkg->flags &= ~PKG_LOAD_FILES;
 		break;
 	case PKG_DIRS:
-		HASH_FREE(pkg->dirs, pkg_dir_free);
+		HASH_CLEAR(hh, pkg->dirs);
+		pkg_arena_free(&pkg->dirs_arena);
 		pkg->flags &= ~PKG_LOAD_DIRS;
 		break;
 	case PKG_USERS:
@@ -1277,9 +1285,10 @@ pkg_open_fd(struct pkg **pkg_p, int fd, struct pkg_manifest_key *keys, int flags
 	return (EPKG_OK);
 }
 
-int
-pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
-    const char *path, struct pkg_manifest_key *keys, int flags, int fd)
+static int
+pkg_read_archive(struct pkg **pkg_p, struct archive **a,
+    struct archive_entry **ae, const char *path,
+    struct pkg_manifest_key *keys, int flags)
 {
 	struct pkg	*pkg;
 	pkg_error_t	 retcode = EPKG_OK;
@@ -1291,7 +1300,6 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 	off_t		 offset = 0;
 	struct sbuf	*sbuf;
 	int		 i, r;
-	bool		 read_from_stdin = 0;
 
 	struct {
 		const char *name;
@@ -1301,35 +1309,6 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 		{ NULL, 0 }
 	};
 
-	*a = archive_read_new();
-	archive_read_support_filter_all(*a);
-	archive_read_support_format_tar(*a);
-
-	/* archive_read_open_filename() treats a path of NULL as
-	 * meaning "read from stdin," but we want this behaviour if
-	 * path is exactly "-". In the unlikely event of wanting to
-	 * read an on-disk file called "-", just say "./-" or some
-	 * other leading path. */
-
-	if (fd == -1) {
-		read_from_stdin = (strncmp(path, "-", 2) == 0);
-
-		if (archive_read_open_filename(*a,
-		    read_from_stdin ? NULL : path, 4096) != ARCHIVE_OK) {
-			pkg_emit_error("archive_read_open_filename(%s): %s", path,
-			    archive_error_string(*a));
-			retcode = EPKG_FATAL;
-			goto cleanup;
-		}
-	} else {
-		if (archive_read_open_fd(*a, fd, 4096) != ARCHIVE_OK) {
-			pkg_emit_error("archive_read_open_fd: %s",
-			    archive_error_string(*a));
-			retcode = EPKG_FATAL;
-			goto cleanup;
-		}
-	}
-
 	if (*pkg_p == NULL) {
 		retcode = pkg_new(pkg_p, PKG_FILE);
 		if (retcode != EPKG_OK)
@@ -1436,6 +1415,155 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 	return (retcode);
 }
 
+int
+pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
+    const char *path, struct pkg_manifest_key *keys, int flags, int fd)
+{
+	bool	read_from_stdin = 0;
+
+	*a = archive_read_new();
+	archive_read_support_filter_all(*a);
+	archive_read_support_format_tar(*a);
+
+	/* archive_read_open_filename() treats a path of NULL as
+	 * meaning "read from stdin," but we want this behaviour if
+	 * path is exactly "-". In the unlikely event of wanting to
+	 * read an on-disk file called "-", just say "./-" or some
+	 * other leading path. */
+
+	if (fd == -1) {
+		read_from_stdin = (strncmp(path, "-", 2) == 0);
+
+		if (archive_read_open_filename(*a,
+		    read_from_stdin ? NULL : path, 4096) != ARCHIVE_OK) {
+			pkg_emit_error("archive_read_open_filename(%s): %s", path,
+			    archive_error_string(*a));
+			goto error;
+		}
+	} else {
+		if (archive_read_open_fd(*a, fd, 4096) != ARCHIVE_OK) {
+			pkg_emit_error("archive_read_open_fd: %s",
+			    archive_error_string(*a));
+			goto error;
+		}
+	}
+
+	return (pkg_read_archive(pkg_p, a, ae, path, keys, flags));
+
+error:
+	archive_read_close(*a);
+	archive_read_free(*a);
+	*a = NULL;
+	*ae = NULL;
+
+	return (EPKG_FATAL);
+}
+
+/*
+ * Input layer that feeds libarchive from a plain file descriptor and
+ * hashes every raw (still compressed) byte on its way through, so that the
+ * checksum of the whole archive can be computed while reading the manifest.
+ * There is deliberately no skip callback: libarchive has to read the file
+ * sequentially for the digest to cover every byte exactly once.
+ */
+struct pkg_hash_input {
+	int		 fd;
+	SHA256_CTX	 ctx;
+	char		 buf[65536];
+};
+
+static ssize_t
+pkg_hash_input_read(struct archive *a, void *data, const void **buf)
+{
+	struct pkg_hash_input *in = data;
+	ssize_t r;
+
+	while ((r = read(in->fd, in->buf, sizeof(in->buf))) == -1) {
+		if (errno != EINTR) {
+			archive_set_error(a, errno, "read failed");
+			return (-1);
+		}
+	}
+
+	SHA256_Update(&in->ctx, in->buf, r);
+	*buf = in->buf;
+
+	return (r);
+}
+
+int
+pkg_open_cksum(struct pkg **pkg_p, const char *path,
+    struct pkg_manifest_key *keys, int flags,
+    char cksum[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	struct pkg_hash_input	*in;
+	struct archive		*a;
+	struct archive_entry	*ae;
+	unsigned char		 hash[SHA256_DIGEST_LENGTH];
+	ssize_t			 r;
+	int			 ret;
+
+	cksum[0] = '\0';
+
+	if ((in = malloc(sizeof(struct pkg_hash_input))) == NULL) {
+		pkg_emit_errno("malloc", "pkg_hash_input");
+		return (EPKG_FATAL);
+	}
+
+	if ((in->fd = open(path, O_RDONLY)) == -1) {
+		pkg_emit_errno("open", path);
+		free(in);
+		return (EPKG_FATAL);
+	}
+	SHA256_Init(&in->ctx);
+
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_tar(a);
+
+	if (archive_read_open(a, in, NULL, pkg_hash_input_read,
+	    NULL) != ARCHIVE_OK) {
+		pkg_emit_error("archive_read_open(%s): %s", path,
+		    archive_error_string(a));
+		archive_read_free(a);
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	ret = pkg_read_archive(pkg_p, &a, &ae, path, keys, flags);
+	if (ret != EPKG_OK && ret != EPKG_END) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+	archive_read_close(a);
+	archive_read_free(a);
+
+	/*
+	 * Whatever libarchive has not consumed yet is hashed straight from
+	 * the descriptor: there is no need to decompress the payload.
+	 */
+	while ((r = read(in->fd, in->buf, sizeof(in->buf))) != 0) {
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			pkg_emit_errno("read", path);
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+		SHA256_Update(&in->ctx, in->buf, r);
+	}
+
+	SHA256_Final(hash, &in->ctx);
+	sha256_hash(hash, cksum);
+	ret = EPKG_OK;
+
+cleanup:
+	close(in->fd);
+	free(in);
+
+	return (ret);
+}
+
 int
 pkg_copy_tree(struct pkg *pkg, const char *src, const char *dest)
 {
@@ -1482,49 +1610,171 @@ pkg_copy_tree(struct pkg *pkg, const char *src, const char *dest)
 	return (packing_finish(pack));
 }
 
-int
-pkg_test_filesum(struct pkg *pkg)
+/* below this number of files, threads cost more than they save */
+#define FILESUM_PARALLEL_MIN	64
+
+struct pkg_filesum_item {
+	struct pkg *pkg;
+	struct pkg_file *f;
+	const char *func;	/* the call that failed, if any */
+	int error;
+	int rc;
+	bool mismatch;
+};
+
+struct pkg_filesum_data {
+	struct pkg_filesum_item *items;
+	unsigned int nitems;
+	unsigned int next;
+	unsigned flags;
+};
+
+/*
+ * Check one file, failures are recorded in the item to be reported in
+ * order once every file has been processed.
+ */
+static void
+pkg_test_file(struct pkg_filesum_data *d, struct pkg_filesum_item *it)
 {
-	struct pkg_file *f = NULL;
-	const char *path;
-	const char *sum;
+	const char *path = pkg_file_path(it->f);
 	struct stat	 st;
 	char sha256[SHA256_DIGEST_LENGTH * 2 + 1];
-	int rc = EPKG_OK, ret;
+	char linkbuf[MAXPATHLEN];
+	ssize_t len;
+	int fd;
+
+	it->rc = EPKG_FATAL;
+	if (lstat(path, &st) == -1) {
+		it->func = "lstat";
+		it->error = errno;
+		return;
+	}
+	/* untouched since the installation, no need to read it */
+	if ((d->flags & PKG_FILESUM_MODIFIED) && it->f->mtime != 0 &&
+	    st.st_size == it->f->size && st.st_mtime == it->f->mtime) {
+		it->rc = EPKG_OK;
+		return;
+	}
+	if (S_ISLNK(st.st_mode)) {
+		if ((len = readlink(path, linkbuf, sizeof(linkbuf))) == -1) {
+			it->func = "readlink";
+			it->error = errno;
+			return;
+		}
+		sha256_buf(linkbuf, len, sha256);
+	} else {
+		if ((fd = open(path, O_RDONLY)) == -1) {
+			it->func = "open";
+			it->error = errno;
+			return;
+		}
+		if (sha256_read(fd, sha256) != EPKG_OK) {
+			it->func = "read";
+			it->error = errno;
+			close(fd);
+			return;
+		}
+		close(fd);
+	}
+	if (strcmp(sha256, pkg_file_cksum(it->f)) != 0) {
+		it->mismatch = true;
+		return;
+	}
+	it->rc = EPKG_OK;
+}
 
-	assert(pkg != NULL);
+static void *
+pkg_test_filesum_worker(void *data)
+{
+	struct pkg_filesum_data *d = data;
+	unsigned int i;
 
-	while (pkg_files(pkg, &f) == EPKG_OK) {
-		path = pkg_file_path(f);
-		sum = pkg_file_cksum(f);
-		if (*sum != '\0') {
-			if (lstat(path, &st) == -1) {
-				pkg_emit_errno("pkg_create_from_dir", "lstat failed");
-				return (EPKG_FATAL);
-			}
-			if (S_ISLNK(st.st_mode)) {
-				char linkbuf[MAXPATHLEN];
-				if ((ret = readlink(path, linkbuf, sizeof(linkbuf))) == -1) {
-					pkg_emit_errno("pkg_create_from_dir", "readlink failed");
-					return (EPKG_FATAL);
-				}
-				sha256_buf(linkbuf, ret, sha256);
-			}
-			else {
-				if (sha256_file(path, sha256) != EPKG_OK)
-					return (EPKG_FATAL);
+	while ((i = __sync_fetch_and_add(&d->next, 1)) < d->nitems)
+		pkg_test_file(d, &d->items[i]);
 
-			}
-			if (strcmp(sha256, sum) != 0) {
-				pkg_emit_file_mismatch(pkg, f, sum);
-				rc = EPKG_FATAL;
-			}
+	return (NULL);
+}
+
+int
+pkg_test_filesums(struct pkg **pkgs, int npkgs, unsigned flags)
+{
+	struct pkg_filesum_data d;
+	struct pkg_filesum_item *it;
+	struct pkg_file *f;
+	pthread_t *tids = NULL;
+	unsigned int i, nfiles = 0;
+	int n, num_workers = 1, nworkers, rc = EPKG_OK;
+
+	memset(&d, 0, sizeof(d));
+	d.flags = flags;
+
+	for (n = 0; n < npkgs; n++) {
+		assert(pkgs[n] != NULL);
+		nfiles += HASH_COUNT(pkgs[n]->files);
+	}
+	d.items = calloc(nfiles, sizeof(*d.items));
+	if (d.items == NULL && nfiles > 0) {
+		pkg_emit_errno("calloc", "pkg_filesum_data");
+		return (EPKG_FATAL);
+	}
+
+	/* files of all the packages form a single queue */
+	for (n = 0; n < npkgs; n++) {
+		f = NULL;
+		while (pkg_files(pkgs[n], &f) == EPKG_OK) {
+			if (*pkg_file_cksum(f) == '\0')
+				continue;
+			it = &d.items[d.nitems++];
+			it->pkg = pkgs[n];
+			it->f = f;
+		}
+	}
+
+	if (d.nitems >= FILESUM_PARALLEL_MIN)
+		num_workers = get_workers_count();
+	if (num_workers > 1)
+		tids = calloc(num_workers, sizeof(pthread_t));
+
+	nworkers = 0;
+	if (tids != NULL) {
+		for (; nworkers < num_workers; nworkers++) {
+			if (pthread_create(&tids[nworkers], NULL,
+			    pkg_test_filesum_worker, &d) != 0)
+				break;
+		}
+	}
+	/* Whatever the workers have not taken yet is hashed from here */
+	pkg_test_filesum_worker(&d);
+	for (int t = 0; t < nworkers; t++)
+		pthread_join(tids[t], NULL);
+	free(tids);
+
+	for (i = 0; i < d.nitems; i++) {
+		it = &d.items[i];
+		if (it->rc == EPKG_OK)
+			continue;
+		rc = EPKG_FATAL;
+		if (it->mismatch)
+			pkg_emit_file_mismatch(it->pkg, it->f,
+			    pkg_file_cksum(it->f));
+		else if (it->func != NULL) {
+			errno = it->error;
+			pkg_emit_errno(it->func, pkg_file_path(it->f));
 		}
 	}
+	free(d.items);
 
 	return (rc);
 }
 
+int
+pkg_test_filesum(struct pkg *pkg)
+{
+	assert(pkg != NULL);
+
+	return (pkg_test_filesums(&pkg, 1, 0));
+}
+
 int
 pkg_recompute(struct pkgdb *db, struct pkg *pkg)
 {
@@ -1543,6 +1793,8 @@ pkg_recompute(struct pkgdb *db, struct pkg *pkg)
 		path = pkg_file_path(f);
 		sum = pkg_file_cksum(f);
 		if (lstat(path, &st) == 0) {
+			f->size = st.st_size;
+			f->mtime = st.st_mtime;
 			regular = true;
 			if (S_ISLNK(st.st_mode)) {
 				regular = false;
@@ -1564,6 +1816,9 @@ pkg_recompute(struct pkgdb *db, struct pkg *pkg)
 			pkgdb_file_set_cksum(db, f, sha256);
 	}
 	HASH_FREE(hl, free);
+	/* the stat of a file whose hash could not be updated is stale */
+	if (rc == EPKG_OK)
+		rc = pkgdb_set_files_stat(db, pkg);
 
 	pkg_get(pkg, PKG_FLATSIZE, &oldflatsize);
 	if (flatsize != oldflatsize)
@@ -30,6 +30,7 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -41,44 +42,289 @@
 #include "private/utils.h"
 #include "private/pkg.h"
 
+/*
+ * Find the manifest entry of an archive member, archive paths may have
+ * lost their leading '/'.
+ */
+static struct pkg_file *
+do_extract_lookup(struct pkg *pkg, const char *path)
+{
+	struct pkg_file *f = NULL;
+	char abspath[MAXPATHLEN];
+
+	HASH_FIND_STR(pkg->files, path, f);
+	if (f == NULL && *path != '/') {
+		snprintf(abspath, sizeof(abspath), "/%s", path);
+		HASH_FIND_STR(pkg->files, abspath, f);
+	}
+
+	return (f);
+}
+
+static void
+do_extract_zeros(SHA256_CTX *sha, int64_t len)
+{
+	static const char zeros[4096];
+
+	while (len > 0) {
+		SHA256_Update(sha, zeros, MIN((int64_t)sizeof(zeros), len));
+		len -= MIN((int64_t)sizeof(zeros), len);
+	}
+}
+
+/*
+ * Write one entry to disk. The data of regular files is copied block
+ * by block and hashed on the way, so that it can be checked against the
+ * sum recorded in the manifest without reading the file back. `sum' is
+ * left empty for entries which have nothing to check.
+ */
+static int
+do_extract_entry(struct archive *a, struct archive *aw,
+    struct archive_entry *ae, char sum[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	SHA256_CTX sha;
+	const char *target;
+	const void *buf;
+	size_t size;
+	int64_t offset, pos = 0;
+	int ret;
+
+	sum[0] = '\0';
+
+	if (archive_write_header(aw, ae) != ARCHIVE_OK) {
+		/*
+		 * show error except when the failure is during
+		 * extracting a directory and that the directory already
+		 * exists.
+		 * this allow to install packages linux_base from
+		 * package for example
+		 */
+		if (archive_entry_filetype(ae) != AE_IFDIR ||
+		    !is_dir(archive_entry_pathname(ae))) {
+			pkg_emit_error("archive_write_header(): %s",
+			    archive_error_string(aw));
+			return (EPKG_FATAL);
+		}
+		return (EPKG_OK);
+	}
+
+	if (archive_entry_filetype(ae) == AE_IFLNK) {
+		target = archive_entry_symlink(ae);
+		sha256_buf(__DECONST(char *, target), strlen(target), sum);
+	} else if (archive_entry_filetype(ae) == AE_IFREG &&
+	    archive_entry_hardlink(ae) == NULL) {
+		SHA256_Init(&sha);
+		while ((ret = archive_read_data_block(a, &buf, &size,
+		    &offset)) == ARCHIVE_OK) {
+			/* holes of sparse files read as zeros */
+			do_extract_zeros(&sha, offset - pos);
+			SHA256_Update(&sha, buf, size);
+			pos = offset + size;
+			if (archive_write_data_block(aw, buf, size, offset) !=
+			    ARCHIVE_OK) {
+				pkg_emit_error("archive_write_data_block(): %s",
+				    archive_error_string(aw));
+				return (EPKG_FATAL);
+			}
+		}
+		if (ret != ARCHIVE_EOF) {
+			pkg_emit_error("archive_read_data_block(): %s",
+			    archive_error_string(a));
+			return (EPKG_FATAL);
+		}
+		do_extract_zeros(&sha, archive_entry_size(ae) - pos);
+		SHA256_Final(digest, &sha);
+		sha256_hash(digest, sum);
+	}
+
+	if (archive_write_finish_entry(aw) != ARCHIVE_OK) {
+		pkg_emit_error("archive_write_finish_entry(): %s",
+		    archive_error_string(aw));
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * During upgrades the files which already exist are not overwritten in
+ * place: they are written to a temporary sibling, and once a batch of
+ * them is complete the batch is synced and renamed over the old files.
+ * The old version of a file stays usable until its replacement is
+ * fully on disk.
+ */
+#define STAGE_BATCH 64
+
+struct stage {
+	char *tmp[STAGE_BATCH];
+	char *dest[STAGE_BATCH];
+	int n;
+};
+
+static bool
+do_extract_stage(struct archive_entry *ae, const char *pathname, char *tmp,
+    size_t tmplen)
+{
+	struct stat st;
+	unsigned long set, clear;
+	const char *base;
+	int fd;
+
+	if ((archive_entry_filetype(ae) != AE_IFREG &&
+	    archive_entry_filetype(ae) != AE_IFLNK) ||
+	    archive_entry_hardlink(ae) != NULL)
+		return (false);
+
+	/* immutable files could not be renamed */
+	archive_entry_fflags(ae, &set, &clear);
+	if (set != 0)
+		return (false);
+
+	if (lstat(pathname, &st) == -1 || S_ISDIR(st.st_mode))
+		return (false);
+
+	if ((base = strrchr(pathname, '/')) == NULL)
+		return (false);
+	if (snprintf(tmp, tmplen, "%.*s/.pkgtemp.%s.XXXXXX",
+	    (int)(base - pathname), pathname, base + 1) >= (int)tmplen)
+		return (false);
+	if ((fd = mkstemp(tmp)) == -1)
+		return (false);
+	close(fd);
+
+	return (true);
+}
+
 static int
-do_extract(struct archive *a, struct archive_entry *ae, const char *location,
-		int nfiles, struct pkg *pkg)
+do_extract_flush(struct stage *stage)
 {
+	struct stat st;
+	int fd, i, retcode = EPKG_OK;
+
+	for (i = 0; i < stage->n; i++) {
+		if (lstat(stage->tmp[i], &st) == -1 || S_ISLNK(st.st_mode))
+			continue;
+		if ((fd = open(stage->tmp[i], O_RDONLY)) != -1) {
+			fsync(fd);
+			close(fd);
+		}
+	}
+
+	for (i = 0; i < stage->n; i++) {
+		if (retcode == EPKG_OK &&
+		    rename(stage->tmp[i], stage->dest[i]) == -1) {
+			pkg_emit_errno("rename", stage->dest[i]);
+			retcode = EPKG_FATAL;
+		}
+		if (retcode != EPKG_OK)
+			unlink(stage->tmp[i]);
+		free(stage->tmp[i]);
+		free(stage->dest[i]);
+	}
+	stage->n = 0;
+
+	return (retcode);
+}
+
+static void
+do_extract_discard(struct stage *stage)
+{
+	int i;
+
+	for (i = 0; i < stage->n; i++) {
+		unlink(stage->tmp[i]);
+		free(stage->tmp[i]);
+		free(stage->dest[i]);
+	}
+	stage->n = 0;
+}
+
+static int
+do_extract(struct pkg_add_ctx *ctx)
+{
+	struct archive *a = ctx->a;
+	struct archive_entry *ae = ctx->ae;
+	struct pkg *pkg = ctx->pkg;
+	const char *location = ctx->location;
+	bool	upgrade = (ctx->flags & PKG_ADD_UPGRADE) != 0;
+	int	nfiles = HASH_COUNT(pkg->files);
 	int	retcode = EPKG_OK;
 	int	ret = 0, cur_file = 0;
-	char	path[MAXPATHLEN], pathname[MAXPATHLEN];
+	char	path[MAXPATHLEN], pathname[MAXPATHLEN], tmp[MAXPATHLEN];
+	char	sum[SHA256_DIGEST_LENGTH * 2 + 1];
 	struct stat st;
+	struct stage stage;
+	struct archive *aw;
+	struct pkg_file *f;
 	const char *name;
+	bool	staged;
 
 	pkg_get(pkg, PKG_NAME, &name);
-	pkg_emit_progress_start("Installing %s", name);
+	if (ctx->progress)
+		pkg_emit_progress_start("Installing %s", name);
+
+	aw = archive_write_disk_new();
+	archive_write_disk_set_options(aw, EXTRACT_ARCHIVE_FLAGS);
+	archive_write_disk_set_standard_lookup(aw);
+	stage.n = 0;
 
 	do {
+		f = do_extract_lookup(pkg, archive_entry_pathname(ae));
 		snprintf(pathname, sizeof(pathname), "%s/%s",
 		    location ? location : "",
 		    archive_entry_pathname(ae)
 		);
-		archive_entry_set_pathname(ae, pathname);
 
-		ret = archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS);
-		if (ret != ARCHIVE_OK) {
-			/*
-			 * show error except when the failure is during
-			 * extracting a directory and that the directory already
-			 * exists.
-			 * this allow to install packages linux_base from
-			 * package for example
-			 */
-			if (archive_entry_filetype(ae) != AE_IFDIR ||
-			    !is_dir(pathname)) {
-				pkg_emit_error("archive_read_extract(): %s",
-				    archive_error_string(a));
+		/* a hardlink may point to a file not renamed yet */
+		if (archive_entry_hardlink(ae) != NULL &&
+		    do_extract_flush(&stage) != EPKG_OK) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+
+		staged = upgrade &&
+		    do_extract_stage(ae, pathname, tmp, sizeof(tmp));
+		archive_entry_set_pathname(ae, staged ? tmp : pathname);
+		if (staged) {
+			stage.tmp[stage.n] = strdup(tmp);
+			stage.dest[stage.n] = strdup(pathname);
+			stage.n++;
+			if (stage.tmp[stage.n - 1] == NULL ||
+			    stage.dest[stage.n - 1] == NULL) {
+				pkg_emit_errno("strdup", pathname);
+				unlink(tmp);
 				retcode = EPKG_FATAL;
 				goto cleanup;
 			}
 		}
-		pkg_emit_progress_tick(cur_file++, nfiles);
+
+		if (do_extract_entry(a, aw, ae, sum) != EPKG_OK) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		if (f != NULL && lstat(archive_entry_pathname(ae), &st) == 0) {
+			f->size = st.st_size;
+			f->mtime = st.st_mtime;
+		}
+
+		/* old packages may carry md5 sums, only sha256 is checked */
+		if (f != NULL && sum[0] != '\0' &&
+		    strlen(f->sum) == SHA256_DIGEST_LENGTH * 2 &&
+		    strcmp(sum, f->sum) != 0) {
+			pkg_emit_error("%s: checksum mismatch, the package is "
+			    "corrupted", pathname);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		if (ctx->progress)
+			pkg_emit_progress_tick(cur_file++, nfiles);
+
+		if (stage.n == STAGE_BATCH &&
+		    do_extract_flush(&stage) != EPKG_OK) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
 
 		/*
 		 * if the file is a configuration file and the configuration
@@ -108,6 +354,11 @@ do_extract(struct archive *a, struct archive_entry *ae, const char *location,
 	}
 
 cleanup:
+	archive_write_free(aw);
+	if (retcode == EPKG_OK)
+		retcode = do_extract_flush(&stage);
+	else
+		do_extract_discard(&stage);
 
 	return (retcode);
 }
@@ -160,20 +411,20 @@ cleanup:
 	return (retcode);
 }
 
-static int
-pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
-    struct pkg_manifest_key *keys, const char *location, struct pkg *remote)
+int
+pkg_add_begin(struct pkg_add_ctx *ctx, struct pkgdb *db, const char *path,
+    unsigned flags, struct pkg_manifest_key *keys, const char *location,
+    struct pkg *remote)
 {
 	const char	*arch;
 	const char	*origin;
 	const char	*name;
-	struct archive	*a;
-	struct archive_entry *ae;
+	struct archive	*a = NULL;
+	struct archive_entry *ae = NULL;
 	struct pkg	*pkg = NULL;
 	struct pkg_dep	*dep = NULL;
 	struct pkg      *pkg_inst = NULL;
 	bool		 extract = true;
-	bool		 handle_rc = false;
 	bool		 disable_mtree;
 	char		 dpath[MAXPATHLEN];
 	const char	*basedir;
@@ -182,7 +433,6 @@ pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
 	char		*prefix;
 	int		 retcode = EPKG_OK;
 	int		 ret;
-	int nfiles;
 
 	assert(path != NULL);
 
@@ -203,7 +453,8 @@ pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
 
 	if (pkg_is_valid(pkg) != EPKG_OK) {
 		pkg_emit_error("the package is not valid");
-		return (EPKG_FATAL);
+		retcode = EPKG_FATAL;
+		goto cleanup;
 	}
 
 	if (flags & PKG_ADD_AUTOMATIC)
@@ -321,6 +572,7 @@ pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
 
 	if (retcode != EPKG_OK)
 		goto cleanup;
+	ctx->registered = true;
 
 	/* MTREE replicates much of the standard functionality
 	 * inplicit in the way pkg works.  It has to remain available
@@ -333,7 +585,7 @@ pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
 	if (!disable_mtree) {
 		pkg_get(pkg, PKG_PREFIX, &prefix, PKG_MTREE, &mtree);
 		if ((retcode = do_extract_mtree(mtree, prefix)) != EPKG_OK)
-			goto cleanup_reg;
+			goto cleanup;
 	}
 
 	/*
@@ -345,14 +597,56 @@ pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
 	/* add the user and group if necessary */
 	/* pkg_add_user_group(pkg); */
 
-	nfiles = HASH_COUNT(pkg->files);
+cleanup:
+	ctx->db = db;
+	ctx->pkg = pkg;
+	ctx->a = a;
+	ctx->ae = ae;
+	ctx->location = location;
+	ctx->flags = flags;
+	ctx->extract = extract;
+	ctx->retcode = retcode;
+
+	if (pkg_inst != NULL)
+		pkg_free(pkg_inst);
+
+	return (retcode);
+}
+
+int
+pkg_add_extract(struct pkg_add_ctx *ctx)
+{
+	if (ctx->retcode != EPKG_OK || !ctx->extract)
+		return (ctx->retcode);
+
 	/*
 	 * Extract the files on disk.
 	 */
-	if (extract && (retcode = do_extract(a, ae, location, nfiles, pkg)) != EPKG_OK) {
+	if ((ctx->retcode = do_extract(ctx)) != EPKG_OK) {
 		/* If the add failed, clean up (silently) */
+		pkg_delete_files(ctx->pkg, 2);
+		pkg_delete_dirs(ctx->db, ctx->pkg, 1);
+	}
+
+	return (ctx->retcode);
+}
+
+int
+pkg_add_end(struct pkg_add_ctx *ctx)
+{
+	struct pkg	*pkg = ctx->pkg;
+	unsigned	 flags = ctx->flags;
+	int		 retcode = ctx->retcode;
+	bool		 handle_rc = false;
+
+	if (retcode != EPKG_OK)
+		goto cleanup_reg;
+
+	/* Like a failed extraction, nothing of the package is kept */
+	if ((retcode = pkgdb_set_files_stat(ctx->db, pkg)) != EPKG_OK) {
+		ctx->retcode = retcode;
 		pkg_delete_files(pkg, 2);
-		pkg_delete_dirs(db, pkg, 1);
+		pkg_delete_dirs(ctx->db, pkg, 1);
 		goto cleanup_reg;
 	}
 
@@ -376,26 +670,39 @@ pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
 		pkg_start_stop_rc_scripts(pkg, PKG_RC_START);
 
 	cleanup_reg:
-	if ((flags & PKG_ADD_UPGRADE) == 0)
-		pkgdb_register_finale(db, retcode);
+	if (ctx->registered) {
+		if ((flags & PKG_ADD_UPGRADE) == 0)
+			pkgdb_register_finale(ctx->db, retcode);
 
-	if (retcode == EPKG_OK && (flags & PKG_ADD_UPGRADE) == 0)
-		pkg_emit_install_finished(pkg);
+		if (retcode == EPKG_OK && (flags & PKG_ADD_UPGRADE) == 0)
+			pkg_emit_install_finished(pkg);
+	}
 
-	cleanup:
-	if (a != NULL) {
-		archive_read_close(a);
-		archive_read_free(a);
+	if (ctx->a != NULL) {
+		archive_read_close(ctx->a);
+		archive_read_free(ctx->a);
 	}
 
 	pkg_free(pkg);
 
-	if (pkg_inst != NULL)
-		pkg_free(pkg_inst);
-
 	return (retcode);
 }
 
+static int
+pkg_add_common(struct pkgdb *db, const char *path, unsigned flags,
+    struct pkg_manifest_key *keys, const char *location, struct pkg *remote)
+{
+	struct pkg_add_ctx ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.progress = true;
+	if (pkg_add_begin(&ctx, db, path, flags, keys, location, remote) ==
+	    EPKG_OK)
+		pkg_add_extract(&ctx);
+
+	return (pkg_add_end(&ctx));
+}
+
 int
 pkg_add(struct pkgdb *db, const char *path, unsigned flags,
     struct pkg_manifest_key *keys, const char *location)
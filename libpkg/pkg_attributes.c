@@ -28,6 +28,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -92,23 +93,20 @@ pkg_dep_is_locked(struct pkg_dep const * const d)
  */
 
 int
-pkg_file_new(struct pkg_file **file)
+pkg_file_new(struct pkg_arena *a, struct pkg_file **file)
 {
-	if ((*file = calloc(1, sizeof(struct pkg_file))) == NULL)
+	if ((*file = pkg_arena_alloc(a, sizeof(struct pkg_file))) == NULL)
 		return (EPKG_FATAL);
 
+	memset(*file, 0, sizeof(struct pkg_file));
+	(*file)->uname = "";
+	(*file)->gname = "";
 	(*file)->perm = 0;
 	(*file)->keep = 0;
 
 	return (EPKG_OK);
 }
 
-void
-pkg_file_free(struct pkg_file *file)
-{
-	free(file);
-}
-
 const char *
 pkg_file_get(struct pkg_file const * const f, const pkg_file_attr attr)
 {
@@ -154,11 +152,14 @@ pkg_file_keep(struct pkg_file const * const f)
  */
 
 int
-pkg_dir_new(struct pkg_dir **d)
+pkg_dir_new(struct pkg_arena *a, struct pkg_dir **d)
 {
-	if ((*d = calloc(1, sizeof(struct pkg_dir))) == NULL)
+	if ((*d = pkg_arena_alloc(a, sizeof(struct pkg_dir))) == NULL)
 		return (EPKG_FATAL);
 
+	memset(*d, 0, sizeof(struct pkg_dir));
+	(*d)->uname = "";
+	(*d)->gname = "";
 	(*d)->perm = 0;
 	(*d)->keep = 0;
 	(*d)->try = false;
@@ -166,12 +167,6 @@ pkg_dir_new(struct pkg_dir **d)
 	return (EPKG_OK);
 }
 
-void
-pkg_dir_free(struct pkg_dir *d)
-{
-	free(d);
-}
-
 const char *
 pkg_dir_get(struct pkg_dir const * const d, const pkg_dir_attr attr)
 {
@@ -233,6 +228,10 @@ pkg_user_new(struct pkg_user **u)
 void
 pkg_user_free(struct pkg_user *u)
 {
+	if (u == NULL)
+		return;
+
+	free(u->uidstr);
 	free(u);
 }
 
@@ -249,7 +248,7 @@ pkg_user_uidstr(struct pkg_user const * const u)
 {
 	assert(u != NULL);
 
-	return (u->uidstr);
+	return (u->uidstr != NULL ? u->uidstr : "");
 }
 
 /*
@@ -270,6 +269,10 @@ pkg_group_new(struct pkg_group **g)
 void
 pkg_group_free(struct pkg_group *g)
 {
+	if (g == NULL)
+		return;
+
+	free(g->gidstr);
 	free(g);
 }
 
@@ -286,7 +289,7 @@ pkg_group_gidstr(struct pkg_group const * const g)
 {
 	assert(g != NULL);
 
-	return (g->gidstr);
+	return (g->gidstr != NULL ? g->gidstr : "");
 }
 
 /*
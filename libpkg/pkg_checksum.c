@@ -82,7 +82,7 @@ static const struct _pkg_cksum_type {
 };
 
 static void
-pkg_checksum_add_object(const ucl_object_t *o, const char *key,
+pkg_checksum_add_entry(const char *key, const char *value,
 	struct pkg_checksum_entry **entries)
 {
 	struct pkg_checksum_entry *e;
@@ -94,7 +94,7 @@ pkg_checksum_add_object(const ucl_object_t *o, const char *key,
 	}
 
 	e->field = key;
-	e->value = ucl_object_tostring(o);
+	e->value = value;
 	DL_APPEND(*entries, e);
 }
 
@@ -144,7 +144,7 @@ pkg_checksum_generate(struct pkg *pkg, char *dest, size_t destlen,
 	unsigned char *bdigest;
 	size_t blen;
 	struct pkg_checksum_entry *entries = NULL;
-	const ucl_object_t *o;
+	const char *value;
 	struct pkg_option *option = NULL;
 	int i;
 	int recopies[] = {
@@ -165,8 +165,8 @@ pkg_checksum_generate(struct pkg *pkg, char *dest, size_t destlen,
 
 	for (i = 0; recopies[i] != -1; i++) {
 		key = pkg_keys[recopies[i]].name;
-		if ((o = ucl_object_find_key(pkg->fields, key)))
-			pkg_checksum_add_object(o, key, &entries);
+		if ((value = pkg->fields[recopies[i]].v.str) != NULL)
+			pkg_checksum_add_entry(key, value, &entries);
 	}
 
 	while (pkg_options(pkg, &option) == EPKG_OK) {
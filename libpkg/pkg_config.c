@@ -222,6 +222,30 @@ static struct config_entry c[] = {
 		"30",
 		"Number of seconds before fetch(3) times out",
 	},
+	{
+		PKG_INT,
+		"FETCH_CONCURRENCY",
+		"4",
+		"How many packages are downloaded at the same time",
+	},
+	{
+		PKG_INT,
+		"FETCH_MIRROR_CONNECTIONS",
+		"4",
+		"How many packages are downloaded at the same time from one repository",
+	},
+	{
+		PKG_INT,
+		"FETCH_BUFFER_SIZE",
+		"65536",
+		"Size in bytes of the buffer used to copy downloaded files",
+	},
+	{
+		PKG_INT,
+		"INSTALL_CONCURRENCY",
+		"1",
+		"How many packages are extracted at the same time",
+	},
 	{
 		PKG_BOOL,
 		"UNSET_TIMESTAMP",
@@ -306,6 +330,12 @@ static struct config_entry c[] = {
 		"NO",
 		"Profile sqlite queries"
 	},
+	{
+		PKG_INT,
+		"WORKERS_COUNT",
+		"0",
+		"How many workers are used for pkg-repo, pkg-update and deletions (hw.ncpu if 0)",
+	},
 };
 
 static bool parsed = false;
@@ -123,7 +123,7 @@ pkg_conflicts_request_resolve(struct pkg_jobs *j)
 			continue;
 
 		HASH_ITER(hh, req->item->pkg->conflicts, c, ctmp) {
-			HASH_FIND_STR(j->request_add, pkg_conflict_uniqueid(c), found);
+			HASH_FIND_ATOM(j, j->request_add, pkg_conflict_uniqueid(c), found);
 			if (found && !found->skip) {
 				pkg_conflicts_request_add_chain(&chain, found);
 			}
@@ -138,6 +138,8 @@ pkg_conflicts_request_resolve(struct pkg_jobs *j)
 				return (EPKG_FATAL);
 			}
 			LL_FREE(chain, free);
+			/* Some requests of the chain are skipped now */
+			j->generation++;
 		}
 	}
 
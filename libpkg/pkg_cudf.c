@@ -379,7 +379,7 @@ pkg_jobs_cudf_add_package(struct pkg_jobs *j, struct pkg_cudf_entry *entry)
 	const char *origin, *oldversion;
 	int ver, n;
 
-	HASH_FIND(hh, j->universe, entry->origin, strlen(entry->origin), it);
+	HASH_FIND_ATOM(j, j->universe, entry->origin, it);
 	if (it == NULL) {
 		pkg_emit_error("package %s is found in CUDF output but not in the universe",
 				entry->origin);
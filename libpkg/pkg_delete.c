@@ -30,6 +30,8 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -131,6 +133,77 @@ pkg_delete(struct pkg *pkg, struct pkgdb *db, unsigned flags)
 	return (pkgdb_unregister_pkg(db, id));
 }
 
+/* below this number of files, threads cost more than they save */
+#define DELETE_PARALLEL_MIN	64
+
+struct pkg_delete_item {
+	const char *path;
+	const char *sum;
+	const char *func;	/* the call that failed, if any */
+	int error;
+	bool mismatch;
+};
+
+struct pkg_delete_data {
+	struct pkg_delete_item *items;
+	unsigned int nitems;
+	unsigned int next;
+	const char *prefix;
+	unsigned force;
+};
+
+/*
+ * Check and remove one file, failures are recorded in the item to be
+ * reported in order once every file has been processed.
+ */
+static void
+pkg_delete_file(struct pkg_delete_data *d, struct pkg_delete_item *it)
+{
+	char	 sha256[SHA256_DIGEST_LENGTH * 2 + 1];
+	char	 fpath[MAXPATHLEN];
+	int	 fd;
+
+	snprintf(fpath, sizeof(fpath), "%s%s", d->prefix, it->path);
+
+	/* Regular files and links */
+	/* check sha256 */
+	if (!d->force && it->sum[0] != '\0') {
+		if ((fd = open(fpath, O_RDONLY)) == -1) {
+			it->func = "fopen";
+			it->error = errno;
+			return;
+		}
+		if (sha256_read(fd, sha256) != EPKG_OK) {
+			it->func = "read";
+			it->error = errno;
+			close(fd);
+			return;
+		}
+		close(fd);
+		if (strcmp(sha256, it->sum)) {
+			it->mismatch = true;
+			return;
+		}
+	}
+
+	if (unlink(fpath) == -1) {
+		it->func = "unlink";
+		it->error = errno;
+	}
+}
+
+static void *
+pkg_delete_worker(void *data)
+{
+	struct pkg_delete_data *d = data;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&d->next, 1)) < d->nitems)
+		pkg_delete_file(d, &d->items[i]);
+
+	return (NULL);
+}
+
 int
 pkg_delete_files(struct pkg *pkg, unsigned force)
 	/* force: 0 ... be careful and vocal about it. 
@@ -139,58 +212,119 @@ pkg_delete_files(struct pkg *pkg, unsigned force)
 	 */
 {
 	struct pkg_file	*file = NULL;
-	char		 sha256[SHA256_DIGEST_LENGTH * 2 + 1];
-	const char	*path;
+	struct pkg_delete_data d;
+	struct pkg_delete_item *it;
+	const ucl_object_t *obj, *an;
 	char		fpath[MAXPATHLEN];
+	pthread_t	*tids = NULL;
+	unsigned int	 i;
+	int		 num_workers = 1, nworkers;
 
-	while (pkg_files(pkg, &file) == EPKG_OK) {
-		const char *sum = pkg_file_cksum(file);
-		const ucl_object_t *obj, *an;
+	memset(&d, 0, sizeof(d));
+	d.force = force;
+	pkg_get(pkg, PKG_ANNOTATIONS, &an);
+	obj = pkg_object_find(an, "relocated");
+	d.prefix = obj ? pkg_object_string(obj) : "";
 
+	d.items = calloc(HASH_COUNT(pkg->files), sizeof(*d.items));
+	if (d.items == NULL && HASH_COUNT(pkg->files) > 0) {
+		pkg_emit_errno("calloc", "pkg_delete_data");
+		return (EPKG_FATAL);
+	}
+	while (pkg_files(pkg, &file) == EPKG_OK) {
 		if (file->keep == 1)
 			continue;
+		it = &d.items[d.nitems++];
+		it->path = pkg_file_path(file);
+		it->sum = pkg_file_cksum(file);
+	}
 
-		path = pkg_file_path(file);
-		pkg_get(pkg, PKG_ANNOTATIONS, &an);
-		obj = pkg_object_find(an, "relocated");
-		snprintf(fpath, sizeof(fpath), "%s%s",
-		    obj ? pkg_object_string(obj) : "" , path );
-
-		/* Regular files and links */
-		/* check sha256 */
-		if (!force && sum[0] != '\0') {
-			if (sha256_file(fpath, sha256) != EPKG_OK)
-				continue;
-			if (strcmp(sha256, sum)) {
-				pkg_emit_error("%s fails original SHA256 "
-				    "checksum, not removing", path);
-				continue;
-			}
+	/*
+	 * Hashing dominates the removal of big packages, spread it over
+	 * several threads.
+	 */
+	if (d.nitems >= DELETE_PARALLEL_MIN)
+		num_workers = get_workers_count();
+	if (num_workers > 1)
+		tids = calloc(num_workers, sizeof(pthread_t));
+
+	nworkers = 0;
+	if (tids != NULL) {
+		for (; nworkers < num_workers; nworkers++) {
+			if (pthread_create(&tids[nworkers], NULL,
+			    pkg_delete_worker, &d) != 0)
+				break;
 		}
+	}
+	/* Whatever the workers have not taken yet is removed from here */
+	pkg_delete_worker(&d);
+	for (int t = 0; t < nworkers; t++)
+		pthread_join(tids[t], NULL);
+	free(tids);
 
-		if (unlink(fpath) == -1) {
-			if (force < 2)
-				pkg_emit_errno("unlink", fpath);
-			continue;
+	for (i = 0; i < d.nitems; i++) {
+		it = &d.items[i];
+		snprintf(fpath, sizeof(fpath), "%s%s", d.prefix, it->path);
+		if (it->mismatch)
+			pkg_emit_error("%s fails original SHA256 "
+			    "checksum, not removing", it->path);
+		else if (it->func != NULL &&
+		    (force < 2 || strcmp(it->func, "unlink") != 0)) {
+			errno = it->error;
+			pkg_emit_errno(it->func, fpath);
 		}
 	}
+	free(d.items);
 
 	return (EPKG_OK);
 }
 
+/* deepest directories first, so that parents are empty when reached */
+static int
+pkg_delete_dirs_cmp(const void *a, const void *b)
+{
+	const char *pa = pkg_dir_path(*(struct pkg_dir * const *)a);
+	const char *pb = pkg_dir_path(*(struct pkg_dir * const *)b);
+	const char *p;
+	int da = 0, db = 0;
+
+	for (p = pa; *p != '\0'; p++)
+		da += (*p == '/' && p[1] != '\0');
+	for (p = pb; *p != '\0'; p++)
+		db += (*p == '/' && p[1] != '\0');
+
+	if (da != db)
+		return (db - da);
+	return (strcmp(pb, pa));
+}
+
 int
-pkg_delete_dirs(__unused struct pkgdb *db, struct pkg *pkg, bool force)
+pkg_delete_dirs(struct pkgdb *db, struct pkg *pkg, bool force)
 {
 	struct pkg_dir		*dir = NULL;
+	struct pkg_dir		**dirs;
 	const ucl_object_t 	*obj, *an;
 	char			 fpath[MAXPATHLEN];
+	unsigned int		 i, ndirs = 0;
 
+	dirs = calloc(HASH_COUNT(pkg->dirs), sizeof(*dirs));
+	if (dirs == NULL && HASH_COUNT(pkg->dirs) > 0) {
+		pkg_emit_errno("calloc", "pkg_delete_dirs");
+		return (EPKG_FATAL);
+	}
 	while (pkg_dirs(pkg, &dir) == EPKG_OK) {
 		if (dir->keep == 1)
 			continue;
+		dirs[ndirs++] = dir;
+	}
+	if (ndirs > 1)
+		qsort(dirs, ndirs, sizeof(*dirs), pkg_delete_dirs_cmp);
+
+	pkg_get(pkg, PKG_ANNOTATIONS, &an);
+	obj = pkg_object_find(an, "relocated");
 
-		pkg_get(pkg, PKG_ANNOTATIONS, &an);
-		obj = pkg_object_find(an, "relocated");
+	for (i = 0; i < ndirs; i++) {
+		dir = dirs[i];
 		snprintf(fpath, sizeof(fpath), "%s%s",
 		    obj ? pkg_object_string(obj) : "" , pkg_dir_path(dir) );
 
@@ -203,6 +337,7 @@ pkg_delete_dirs(__unused struct pkgdb *db, struct pkg *pkg, bool force)
 				pkg_emit_errno("rmdir", fpath);
 		}
 	}
+	free(dirs);
 
 	return (EPKG_OK);
 }
@@ -26,6 +26,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <syslog.h>
 
@@ -37,6 +38,32 @@
 static pkg_event_cb _cb = NULL;
 static void *_data = NULL;
 
+/*
+ * Events may be emitted from the fetch workers, serialize them so the
+ * callback never sees two at once. The lock is recursive because a
+ * callback is free to emit further events.
+ */
+static pthread_once_t ev_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ev_lock;
+
+/*
+ * The messages of a thread can also be held back, see pkg_emit_hold(),
+ * `ev_held' then points to the list they go to.
+ */
+static pthread_key_t ev_held;
+
+static void
+ev_lock_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ev_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_key_create(&ev_held, NULL);
+}
+
 static char *
 sbuf_json_escape(struct sbuf *buf, const char *str)
 {
@@ -383,17 +410,110 @@ pkg_event_register(pkg_event_cb cb, void *data)
 	_data = data;
 }
 
+static bool
+pkg_emit_held_add(struct pkg_event *ev)
+{
+	struct pkg_event_held **list, *h;
+	const char *msg;
+
+	if ((list = pthread_getspecific(ev_held)) == NULL)
+		return (false);
+
+	switch (ev->type) {
+	case PKG_EVENT_ERROR:
+		msg = ev->e_pkg_error.msg;
+		break;
+	case PKG_EVENT_NOTICE:
+		msg = ev->e_pkg_notice.msg;
+		break;
+	case PKG_EVENT_DEBUG:
+		msg = ev->e_debug.msg;
+		break;
+	default:
+		return (false);
+	}
+
+	if ((h = calloc(1, sizeof(*h))) == NULL ||
+	    (h->msg = strdup(msg)) == NULL) {
+		free(h);
+		return (false);
+	}
+	h->type = ev->type;
+	if (ev->type == PKG_EVENT_DEBUG)
+		h->level = ev->e_debug.level;
+	DL_APPEND(*list, h);
+
+	return (true);
+}
+
 static int
 pkg_emit_event(struct pkg_event *ev)
 {
 	int ret = 0;
+
+	pthread_once(&ev_once, ev_lock_init);
+	if (pkg_emit_held_add(ev))
+		return (0);
+	pthread_mutex_lock(&ev_lock);
 	pkg_plugins_hook_run(PKG_PLUGIN_HOOK_EVENT, ev, NULL);
 	if (_cb != NULL)
 		ret = _cb(_data, ev);
 	pipeevent(ev);
+	pthread_mutex_unlock(&ev_lock);
 	return (ret);
 }
 
+/*
+ * Until it is called again with NULL, keep the errors, notices and debug
+ * messages of the calling thread in `*list' instead of emitting them.
+ * They come out in order, from whichever thread, with pkg_emit_held().
+ */
+void
+pkg_emit_hold(struct pkg_event_held **list)
+{
+	pthread_once(&ev_once, ev_lock_init);
+	pthread_setspecific(ev_held, list);
+}
+
+void
+pkg_emit_held(struct pkg_event_held *list)
+{
+	struct pkg_event_held *h, *htmp;
+	struct pkg_event ev;
+
+	DL_FOREACH_SAFE(list, h, htmp) {
+		ev.type = h->type;
+		switch (h->type) {
+		case PKG_EVENT_ERROR:
+			ev.e_pkg_error.msg = h->msg;
+			break;
+		case PKG_EVENT_NOTICE:
+			ev.e_pkg_notice.msg = h->msg;
+			break;
+		default:
+			ev.e_debug.level = h->level;
+			ev.e_debug.msg = h->msg;
+			break;
+		}
+		pkg_emit_event(&ev);
+		DL_DELETE(list, h);
+		free(h->msg);
+		free(h);
+	}
+}
+
+void
+pkg_emit_held_free(struct pkg_event_held *list)
+{
+	struct pkg_event_held *h, *htmp;
+
+	DL_FOREACH_SAFE(list, h, htmp) {
+		DL_DELETE(list, h);
+		free(h->msg);
+		free(h);
+	}
+}
+
 void
 pkg_emit_error(const char *fmt, ...)
 {
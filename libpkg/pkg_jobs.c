@@ -37,11 +37,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <libutil.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -146,6 +148,9 @@ pkg_jobs_free(struct pkg_jobs *j)
 	HASH_FREE(j->patterns, pkg_jobs_pattern_free);
 	HASH_FREE(j->provides, pkg_jobs_provide_free);
 	LL_FREE(j->jobs, free);
+	if (j->problem != NULL)
+		pkg_solve_problem_free(j->problem);
+	pkg_arena_free(&j->atoms);
 
 	free(j);
 }
@@ -262,7 +267,10 @@ pkg_jobs_add_req(struct pkg_jobs *j, const char *uid,
 	else
 		head = &j->request_delete;
 
-	HASH_FIND(hh, *head, uid, strlen(uid), test);
+	if ((uid = pkg_arena_intern(&j->atoms, uid)) == NULL)
+		return;
+
+	HASH_FIND_PTR(*head, &uid, test);
 
 	if (test != NULL)
 		return;
@@ -273,8 +281,10 @@ pkg_jobs_add_req(struct pkg_jobs *j, const char *uid,
 		return;
 	}
 	req->item = item;
+	req->uid = uid;
 
-	HASH_ADD_KEYPTR(hh, *head, uid, strlen(uid), req);
+	HASH_ADD_PTR(*head, uid, req);
+	j->generation++;
 }
 
 enum pkg_priority_update_type {
@@ -335,7 +345,7 @@ pkg_jobs_update_universe_priority(struct pkg_jobs *j,
 		}
 
 		while (deps_func(it->pkg, &d) == EPKG_OK) {
-			HASH_FIND_STR(j->universe, d->uid, found);
+			HASH_FIND_ATOM(j, j->universe, d->uid, found);
 			if (found != NULL) {
 				LL_FOREACH(found, cur) {
 					if (cur->priority < priority + 1)
@@ -348,7 +358,7 @@ pkg_jobs_update_universe_priority(struct pkg_jobs *j,
 		d = NULL;
 		maxpri = priority;
 		while (rdeps_func(it->pkg, &d) == EPKG_OK) {
-			HASH_FIND_STR(j->universe, d->uid, found);
+			HASH_FIND_ATOM(j, j->universe, d->uid, found);
 			if (found != NULL) {
 				LL_FOREACH(found, cur) {
 					if (cur->priority >= maxpri) {
@@ -364,7 +374,7 @@ pkg_jobs_update_universe_priority(struct pkg_jobs *j,
 		}
 		if (it->pkg->type != PKG_INSTALLED) {
 			while (pkg_conflicts(it->pkg, &c) == EPKG_OK) {
-				HASH_FIND_STR(j->universe, pkg_conflict_uniqueid(c), found);
+				HASH_FIND_ATOM(j, j->universe, pkg_conflict_uniqueid(c), found);
 				if (found != NULL) {
 					LL_FOREACH(found, cur) {
 						if (cur->pkg->type == PKG_INSTALLED) {
@@ -391,7 +401,7 @@ pkg_jobs_update_conflict_priority(struct pkg_jobs *j, struct pkg_solved *req)
 
 	while (pkg_conflicts(lp, &c) == EPKG_OK) {
 		rit = NULL;
-		HASH_FIND_STR(j->universe, pkg_conflict_uniqueid(c), found);
+		HASH_FIND_ATOM(j, j->universe, pkg_conflict_uniqueid(c), found);
 		assert(found != NULL);
 
 		LL_FOREACH(found, cur) {
@@ -523,7 +533,7 @@ pkg_jobs_handle_pkg_universe(struct pkg_jobs *j, struct pkg *pkg,
 		pkg_get(pkg, PKG_DIGEST, &digest);
 	}
 
-	HASH_FIND_STR(j->seen, digest, seen);
+	HASH_FIND_ATOM(j, j->seen, digest, seen);
 	if (seen != NULL) {
 		cur = seen->un;
 		if (found != NULL)
@@ -543,18 +553,25 @@ pkg_jobs_handle_pkg_universe(struct pkg_jobs *j, struct pkg *pkg,
 	}
 
 	item->pkg = pkg;
+	item->uid = pkg_arena_intern(&j->atoms, uid);
+	item->digest = pkg_arena_intern(&j->atoms, digest);
+	if (item->uid == NULL || item->digest == NULL) {
+		free(item);
+		return (EPKG_FATAL);
+	}
 
-	HASH_FIND_STR(j->universe, uid, tmp);
+	HASH_FIND_PTR(j->universe, &item->uid, tmp);
 	if (tmp == NULL) {
-		HASH_ADD_KEYPTR(hh, j->universe, uid, strlen(uid), item);
+		HASH_ADD_PTR(j->universe, uid, item);
 	}
 
 	DL_APPEND(tmp, item);
+	j->generation++;
 
 	seen = calloc(1, sizeof(struct pkg_job_seen));
-	seen->digest = digest;
+	seen->digest = item->digest;
 	seen->un = item;
-	HASH_ADD_KEYPTR(hh, j->seen, seen->digest, strlen(seen->digest), seen);
+	HASH_ADD_PTR(j->seen, digest, seen);
 
 	j->total++;
 
@@ -598,7 +615,7 @@ pkg_jobs_add_universe(struct pkg_jobs *j, struct pkg *pkg,
 	/* Go through all depends */
 	while (pkg_deps(pkg, &d) == EPKG_OK) {
 		/* XXX: this assumption can be applied only for the current plain dependencies */
-		HASH_FIND_STR(j->universe, d->uid, unit);
+		HASH_FIND_ATOM(j, j->universe, d->uid, unit);
 		if (unit != NULL) {
 			continue;
 		}
@@ -655,7 +672,7 @@ pkg_jobs_add_universe(struct pkg_jobs *j, struct pkg *pkg,
 	d = NULL;
 	while (pkg_rdeps(pkg, &d) == EPKG_OK) {
 		/* XXX: this assumption can be applied only for the current plain dependencies */
-		HASH_FIND_STR(j->universe, d->uid, unit);
+		HASH_FIND_ATOM(j, j->universe, d->uid, unit);
 		if (unit != NULL)
 			continue;
 
@@ -671,7 +688,7 @@ pkg_jobs_add_universe(struct pkg_jobs *j, struct pkg *pkg,
 		/* Examine conflicts */
 		while (pkg_conflicts(pkg, &c) == EPKG_OK) {
 			/* XXX: this assumption can be applied only for the current plain dependencies */
-			HASH_FIND_STR(j->universe, pkg_conflict_uniqueid(c), unit);
+			HASH_FIND_ATOM(j, j->universe, pkg_conflict_uniqueid(c), unit);
 			if (unit != NULL)
 				continue;
 
@@ -710,7 +727,7 @@ pkg_jobs_add_universe(struct pkg_jobs *j, struct pkg *pkg,
 	/* For remote packages we should also handle shlib deps */
 	if (pkg->type != PKG_INSTALLED && !IS_DELETE(j)) {
 		while (pkg_shlibs_required(pkg, &shlib) == EPKG_OK) {
-			HASH_FIND_STR(j->provides, pkg_shlib_name(shlib), pr);
+			HASH_FIND_ATOM(j, j->provides, pkg_shlib_name(shlib), pr);
 			if (pr != NULL)
 				continue;
 
@@ -722,7 +739,7 @@ pkg_jobs_add_universe(struct pkg_jobs *j, struct pkg *pkg,
 				while (pkgdb_it_next(it, &rpkg, flags) == EPKG_OK) {
 					pkg_get(rpkg, PKG_DIGEST, &digest, PKG_UNIQUEID, &uid);
 					/* Check for local packages */
-					HASH_FIND_STR(j->universe, uid, unit);
+					HASH_FIND_ATOM(j, j->universe, uid, unit);
 					if (unit != NULL) {
 						if (pkg_need_upgrade (rpkg, unit->pkg, false)) {
 							/* Remote provide is newer, so we can add it */
@@ -750,7 +767,7 @@ pkg_jobs_add_universe(struct pkg_jobs *j, struct pkg *pkg,
 					}
 					/* Skip seen packages */
 					if (unit == NULL) {
-						HASH_FIND_STR(j->seen, digest, seen);
+						HASH_FIND_ATOM(j, j->seen, digest, seen);
 						if (seen == NULL) {
 							pkg_jobs_add_universe(j, rpkg, recursive, false,
 									&unit);
@@ -770,11 +787,15 @@ pkg_jobs_add_universe(struct pkg_jobs *j, struct pkg *pkg,
 						return (EPKG_FATAL);
 					}
 					pr->un = unit;
-					pr->provide = pkg_shlib_name(shlib);
+					pr->provide = pkg_arena_intern(&j->atoms,
+					    pkg_shlib_name(shlib));
+					if (pr->provide == NULL) {
+						free(pr);
+						return (EPKG_FATAL);
+					}
 					if (prhead == NULL) {
 						DL_APPEND(prhead, pr);
-						HASH_ADD_KEYPTR(hh, j->provides, pr->provide,
-								strlen(pr->provide), prhead);
+						HASH_ADD_PTR(j->provides, provide, prhead);
 					}
 					else {
 						DL_APPEND(prhead, pr);
@@ -813,7 +834,7 @@ pkg_jobs_test_automatic(struct pkg_jobs *j, struct pkg *p)
 	bool automatic;
 
 	while (pkg_rdeps(p, &d) == EPKG_OK && ret) {
-		HASH_FIND_STR(j->universe, d->uid, unit);
+		HASH_FIND_ATOM(j, j->universe, d->uid, unit);
 		if (unit != NULL) {
 			pkg_get(unit->pkg, PKG_AUTOMATIC, &automatic);
 			if (!automatic) {
@@ -905,7 +926,7 @@ pkg_jobs_process_remote_pkg(struct pkg_jobs *j, struct pkg *p,
 		}
 		pkg_get(p, PKG_DIGEST, &digest);
 	}
-	HASH_FIND_STR(j->seen, digest, seen);
+	HASH_FIND_ATOM(j, j->seen, digest, seen);
 	if (seen != NULL) {
 		/* We have already added exactly the same package to the universe */
 		pkg_debug(3, "already seen package %s-%s(%c) in the universe, do not add it again",
@@ -917,7 +938,7 @@ pkg_jobs_process_remote_pkg(struct pkg_jobs *j, struct pkg *p,
 		}
 		else {
 			/* However, we may want to add it to the job request */
-			HASH_FIND_STR(j->request_add, uid, jreq);
+			HASH_FIND_ATOM(j, j->request_add, uid, jreq);
 			if (jreq == NULL)
 				pkg_jobs_add_req(j, uid, seen->un);
 			if (force)
@@ -925,7 +946,7 @@ pkg_jobs_process_remote_pkg(struct pkg_jobs *j, struct pkg *p,
 		}
 		return (EPKG_OK);
 	}
-	HASH_FIND_STR(j->universe, uid, jit);
+	HASH_FIND_ATOM(j, j->universe, uid, jit);
 	if (jit != NULL) {
 		/* We have a more recent package */
 		if (!force && !pkg_need_upgrade(p, jit->pkg, false)) {
@@ -997,7 +1018,7 @@ pkg_jobs_try_remote_candidate(struct pkg_jobs *j, const char *pattern,
 		sbuf_finish(qmsg);
 		if (pkg_emit_query_yesno(true, sbuf_data(qmsg))) {
 			/* Change the origin of the local package */
-			HASH_FIND(hh, j->universe, uid, strlen(uid), unit);
+			HASH_FIND_ATOM(j, j->universe, uid, unit);
 			if (it != NULL)
 				pkg_set(unit->pkg, PKG_UNIQUEID, fuid);
 
@@ -1506,6 +1527,13 @@ pkg_conflicts_register_universe(struct pkg_jobs *j,
 {
 
 	pkg_conflicts_register(u1->pkg, u2->pkg, type);
+
+	/* Keep the solver problem in sync, so that it can be resumed */
+	if (j->problem != NULL &&
+	    pkg_solve_add_conflict(j->problem, u1->pkg, u2->pkg) != EPKG_OK) {
+		pkg_solve_problem_free(j->problem);
+		j->problem = NULL;
+	}
 }
 
 static void
@@ -1516,8 +1544,8 @@ pkg_conflicts_add_from_pkgdb_local(const char *o1, const char *o2, void *ud)
 	struct pkg_conflict *c;
 	const char *dig1, *dig2;
 
-	HASH_FIND_STR(j->universe, o1, u1);
-	HASH_FIND_STR(j->universe, o2, u2);
+	HASH_FIND_ATOM(j, j->universe, o1, u1);
+	HASH_FIND_ATOM(j, j->universe, o2, u2);
 
 	if (u1 == NULL && u2 == NULL) {
 		pkg_emit_error("cannot register conflict with non-existing %s and %s",
@@ -1527,12 +1555,12 @@ pkg_conflicts_add_from_pkgdb_local(const char *o1, const char *o2, void *ud)
 	else if (u1 == NULL) {
 		if (pkg_conflicts_add_missing(j, o1) != EPKG_OK)
 			return;
-		HASH_FIND_STR(j->universe, o1, u1);
+		HASH_FIND_ATOM(j, j->universe, o1, u1);
 	}
 	else if (u2 == NULL) {
 		if (pkg_conflicts_add_missing(j, o2) != EPKG_OK)
 			return;
-		HASH_FIND_STR(j->universe, o2, u2);
+		HASH_FIND_ATOM(j, j->universe, o2, u2);
 	}
 	else {
 		/* Maybe we have registered this conflict already */
@@ -1577,8 +1605,8 @@ pkg_conflicts_add_from_pkgdb_remote(const char *o1, const char *o2, void *ud)
 	struct pkg_conflict *c;
 	const char *dig1, *dig2;
 
-	HASH_FIND_STR(j->universe, o1, u1);
-	HASH_FIND_STR(j->universe, o2, u2);
+	HASH_FIND_ATOM(j, j->universe, o1, u1);
+	HASH_FIND_ATOM(j, j->universe, o2, u2);
 
 	/*
 	 * In case of remote conflict we need to register it only between remote
@@ -1605,7 +1633,8 @@ pkg_conflicts_add_from_pkgdb_remote(const char *o1, const char *o2, void *ud)
 					HASH_FIND(hh, cur2->pkg->conflicts, o1, strlen(o1), c);
 					if (c == NULL && cur2->pkg->type != PKG_INSTALLED) {
 						/* No need to update priorities */
-						pkg_conflicts_register(cur1->pkg, cur2->pkg, PKG_CONFLICT_REMOTE_REMOTE);
+						pkg_conflicts_register_universe(j, cur1, cur2, false,
+								PKG_CONFLICT_REMOTE_REMOTE);
 						j->conflicts_registered ++;
 						pkg_get(cur1->pkg, PKG_DIGEST, &dig1);
 						pkg_get(cur2->pkg, PKG_DIGEST, &dig2);
@@ -1650,7 +1679,7 @@ pkg_jobs_propagate_automatic(struct pkg_jobs *j)
 			 * we search them in the corresponding request
 			 */
 			pkg_get(unit->pkg, PKG_UNIQUEID, &uid);
-			HASH_FIND_STR(j->request_add, uid, req);
+			HASH_FIND_PTR(j->request_add, &unit->uid, req);
 			if (req == NULL) {
 				automatic = 1;
 				pkg_debug(2, "set automatic flag for %s", uid);
@@ -1702,10 +1731,10 @@ pkg_jobs_find_deinstall_request(struct pkg_job_universe_item *item,
 		return (NULL);
 	}
 
-	HASH_FIND_STR(j->request_delete, uid, found);
+	HASH_FIND_PTR(j->request_delete, &item->uid, found);
 	if (found == NULL) {
 		while (pkg_deps(pkg, &d) == EPKG_OK) {
-			HASH_FIND_STR(j->universe, d->uid, dep_item);
+			HASH_FIND_ATOM(j, j->universe, d->uid, dep_item);
 			if (dep_item) {
 				found = pkg_jobs_find_deinstall_request(dep_item, j, rec_level + 1);
 				if (found)
@@ -1805,7 +1834,7 @@ jobs_solve_autoremove(struct pkg_jobs *j)
 			== EPKG_OK) {
 		// Check if the pkg is locked
 		pkg_get(pkg, PKG_UNIQUEID, &uid);
-		HASH_FIND_STR(j->universe, uid, unit);
+		HASH_FIND_ATOM(j, j->universe, uid, unit);
 		if (unit == NULL) {
 			pkg_jobs_add_universe(j, pkg, false, false, &unit);
 			if(pkg_is_locked(pkg)) {
@@ -2103,7 +2132,20 @@ pkg_jobs_solve(struct pkg_jobs *j)
 			waitpid(pchild, &pstatus, WNOHANG);
 		}
 		else {
-			problem = pkg_solve_jobs_to_sat(j);
+			/*
+			 * Resume the problem of the previous round if only conflicts
+			 * have been discovered since then
+			 */
+			problem = j->problem;
+			if (problem != NULL && !pkg_solve_problem_valid(problem)) {
+				pkg_solve_problem_free(problem);
+				problem = NULL;
+			}
+			if (problem == NULL)
+				problem = pkg_solve_jobs_to_sat(j);
+			else
+				pkg_debug(1, "solver: resume the problem with registered conflicts");
+			j->problem = problem;
 			if (problem != NULL) {
 				if ((solver = pkg_object_string(pkg_config_get("SAT_SOLVER"))) != NULL) {
 					pchild = process_spawn_pipe(spipe, solver);
@@ -2171,48 +2213,142 @@ pkg_jobs_type(struct pkg_jobs *j)
 	return (j->type);
 }
 
+/*
+ * Files which the new version of a package ships again are replaced by
+ * the extraction, which renames the new content over them. Mark them, and
+ * the directories holding them, to be kept when the old version is
+ * deleted: there is no need to checksum and unlink them first.
+ */
+static void
+pkg_jobs_keep_replaced(struct pkg_jobs *j, struct pkg *old, const char *target,
+    struct pkg_manifest_key *keys)
+{
+	struct pkg *new = NULL;
+	struct pkg_file *f = NULL, *nf;
+	struct pkg_dir *d;
+	const ucl_object_t *an;
+	char dpath[MAXPATHLEN], *p;
+
+	if (pkgdb_load_files(j->db, old) != EPKG_OK ||
+	    pkgdb_load_dirs(j->db, old) != EPKG_OK ||
+	    pkgdb_load_annotations(j->db, old) != EPKG_OK)
+		return;
+
+	/* the files of a relocated package do not live at their path */
+	pkg_get(old, PKG_ANNOTATIONS, &an);
+	if (pkg_object_find(an, "relocated") != NULL)
+		return;
+
+	if (pkg_open(&new, target, keys, 0) != EPKG_OK) {
+		pkg_free(new);
+		return;
+	}
+
+	while (pkg_files(old, &f) == EPKG_OK) {
+		HASH_FIND_STR(new->files, pkg_file_path(f), nf);
+		if (nf == NULL)
+			continue;
+		f->keep = true;
+
+		strlcpy(dpath, pkg_file_path(f), sizeof(dpath));
+		while ((p = strrchr(dpath, '/')) != NULL && p != dpath) {
+			p[1] = '\0';
+			HASH_FIND_STR(old->dirs, dpath, d);
+			if (d == NULL) {
+				*p = '\0';
+				HASH_FIND_STR(old->dirs, dpath, d);
+			} else
+				*p = '\0';
+			if (d != NULL)
+				d->keep = true;
+		}
+	}
+
+	pkg_free(new);
+}
+
+static unsigned
+pkg_jobs_add_flags(struct pkg_jobs *j, struct pkg *new)
+{
+	unsigned flags = 0;
+	bool automatic;
+
+	pkg_get(new, PKG_AUTOMATIC, &automatic);
+
+	if ((j->flags & PKG_FLAG_FORCE) == PKG_FLAG_FORCE)
+		flags |= PKG_ADD_FORCE;
+	if ((j->flags & PKG_FLAG_NOSCRIPT) == PKG_FLAG_NOSCRIPT)
+		flags |= PKG_ADD_NOSCRIPT;
+	if ((j->flags & PKG_FLAG_FORCE_MISSING) == PKG_FLAG_FORCE_MISSING)
+		flags |= PKG_ADD_FORCE_MISSING;
+	flags |= PKG_ADD_UPGRADE;
+	if (automatic || (j->flags & PKG_FLAG_AUTOMATIC) == PKG_FLAG_AUTOMATIC)
+		flags |= PKG_ADD_AUTOMATIC;
+
+	return (flags);
+}
+
+/*
+ * Find the archive of the package to install. A reinstalled package is
+ * replaced by its remote counterpart, which the caller has to free.
+ */
+static int
+pkg_jobs_install_target(struct pkg_jobs *j, struct pkg_solved *ps,
+    struct pkg **new, bool *need_free, char *path, size_t len,
+    const char **target)
+{
+	const char *uid;
+
+	*new = ps->items[0]->pkg;
+	*need_free = false;
+
+	if (ps->items[0]->jp != NULL && ps->items[0]->jp->is_file) {
+		/*
+		 * We have package as a file
+		 */
+		*target = ps->items[0]->jp->path;
+		return (EPKG_OK);
+	}
+
+	if ((*new)->type == PKG_INSTALLED) {
+		/* We need to find the corresponding remote package */
+		pkg_get(*new, PKG_UNIQUEID, &uid);
+		*new = get_remote_pkg(j, uid, 0);
+		if (*new == NULL) {
+			pkg_emit_error("no remote package found for reinstallation of %s",
+					uid);
+			return (EPKG_FATAL);
+		}
+		*need_free = true;
+	}
+	pkg_snprintf(path, len, "%R", *new);
+	if (*path != '/')
+		pkg_repo_cached_name(*new, path, len);
+	*target = path;
+
+	return (EPKG_OK);
+}
+
 static int
 pkg_jobs_handle_install(struct pkg_solved *ps, struct pkg_jobs *j, bool handle_rc,
 		struct pkg_manifest_key *keys)
 {
 	struct pkg *new, *old;
-	const char *pkguid, *oldversion = NULL;
-	char path[MAXPATHLEN], *target;
-	bool automatic, need_free = false;
-	int flags = 0;
+	const char *oldversion = NULL, *target;
+	char path[MAXPATHLEN];
+	bool need_free;
+	unsigned flags;
 	int retcode = EPKG_FATAL;
 
 	old = ps->items[1] ? ps->items[1]->pkg : NULL;
-	new = ps->items[0]->pkg;
+	flags = pkg_jobs_add_flags(j, ps->items[0]->pkg);
 
-	pkg_get(new, PKG_UNIQUEID, &pkguid, PKG_AUTOMATIC, &automatic);
 	if (old != NULL)
 		pkg_get(old, PKG_VERSION, &oldversion);
 
-	if (ps->items[0]->jp != NULL && ps->items[0]->jp->is_file) {
-		/*
-		 * We have package as a file
-		 */
-		target = ps->items[0]->jp->path;
-	}
-	else {
-		if (new->type == PKG_INSTALLED) {
-			/* We need to find the corresponding remote package */
-			const char *uid;
-			pkg_get(new, PKG_UNIQUEID, &uid);
-			new = get_remote_pkg(j, uid, 0);
-			if (new == NULL) {
-				pkg_emit_error("no remote package found for reinstallation of %s",
-						uid);
-				return (EPKG_FATAL);
-			}
-			need_free = true;
-		}
-		pkg_snprintf(path, sizeof(path), "%R", new);
-		if (*path != '/')
-			pkg_repo_cached_name(new, path, sizeof(path));
-		target = path;
-	}
+	if (pkg_jobs_install_target(j, ps, &new, &need_free, path, sizeof(path),
+	    &target) != EPKG_OK)
+		return (EPKG_FATAL);
 
 	if (oldversion != NULL) {
 		pkg_set(new, PKG_OLD_VERSION, oldversion);
@@ -2221,17 +2357,8 @@ pkg_jobs_handle_install(struct pkg_solved *ps, struct pkg_jobs *j, bool handle_r
 		pkg_emit_install_begin(new);
 	}
 
-	if ((j->flags & PKG_FLAG_FORCE) == PKG_FLAG_FORCE)
-		flags |= PKG_ADD_FORCE;
-	if ((j->flags & PKG_FLAG_NOSCRIPT) == PKG_FLAG_NOSCRIPT)
-		flags |= PKG_ADD_NOSCRIPT;
-	if ((j->flags & PKG_FLAG_FORCE_MISSING) == PKG_FLAG_FORCE_MISSING)
-		flags |= PKG_ADD_FORCE_MISSING;
-	flags |= PKG_ADD_UPGRADE;
-	if (automatic || (j->flags & PKG_FLAG_AUTOMATIC) == PKG_FLAG_AUTOMATIC)
-		flags |= PKG_ADD_AUTOMATIC;
-
 	if (old != NULL && !ps->already_deleted) {
+		pkg_jobs_keep_replaced(j, old, target, keys);
 		if ((retcode = pkg_delete(old, j->db, PKG_DELETE_UPGRADE)) != EPKG_OK) {
 			pkgdb_transaction_rollback(j->db->sqlite, "upgrade");
 			goto cleanup;
@@ -2258,14 +2385,216 @@ cleanup:
 	return (retcode);
 }
 
+struct pkg_extract_item {
+	struct pkg *new;
+	bool need_free;
+	char path[MAXPATHLEN];
+	struct pkg_add_ctx ctx;
+};
+
+struct pkg_extract_data {
+	struct pkg_extract_item *items;
+	unsigned int nitems;
+	unsigned int next;
+	unsigned int ndone;
+	pthread_mutex_t m;
+	pthread_cond_t changed;
+};
+
+static void *
+pkg_jobs_extract_worker(void *data)
+{
+	struct pkg_extract_data *d = data;
+	struct pkg_extract_item *it;
+
+	pthread_mutex_lock(&d->m);
+	while (d->next < d->nitems) {
+		it = &d->items[d->next++];
+		pthread_mutex_unlock(&d->m);
+
+		pkg_add_extract(&it->ctx);
+
+		pthread_mutex_lock(&d->m);
+		d->ndone++;
+		pthread_cond_broadcast(&d->changed);
+	}
+	pthread_mutex_unlock(&d->m);
+
+	return (NULL);
+}
+
+/*
+ * A fresh install can be extracted along with the jobs of the batch
+ * when it does not need any of them, either as a dependency or for a
+ * shared library. The jobs are sorted so that dependencies come first:
+ * the batch can only hold dependencies of `ps', never packages depending
+ * on it.
+ */
+static bool
+pkg_jobs_extract_independent(struct pkg_solved *ps, struct pkg_solved *first)
+{
+	struct pkg_solved *cur;
+	struct pkg *pkg, *other;
+	struct pkg_dep *dep;
+	struct pkg_shlib *shlib, *provided;
+	const char *origin;
+
+	if (ps->type != PKG_SOLVED_INSTALL || ps->items[1] != NULL)
+		return (false);
+
+	pkg = ps->items[0]->pkg;
+	for (cur = first; cur != ps; cur = cur->next) {
+		other = cur->items[0]->pkg;
+		pkg_get(other, PKG_ORIGIN, &origin);
+		dep = NULL;
+		while (pkg_deps(pkg, &dep) == EPKG_OK) {
+			if (strcmp(pkg_dep_origin(dep), origin) == 0)
+				return (false);
+		}
+		shlib = NULL;
+		while (pkg_shlibs_required(pkg, &shlib) == EPKG_OK) {
+			HASH_FIND_STR(other->shlibs_provided,
+			    pkg_shlib_name(shlib), provided);
+			if (provided != NULL)
+				return (false);
+		}
+	}
+
+	return (true);
+}
+
+/*
+ * Install `n' independent jobs starting at `first'. Registration and
+ * pre-install scripts run first, in order, the archives are then
+ * extracted by `num_workers' threads, and the post-install scripts are
+ * finally run in order as well.
+ * If a job cannot be registered nothing is extracted and the whole
+ * transaction is rolled back, as for a job installed on its own. A job
+ * whose extraction fails is unregistered, the others of the batch are
+ * completed and stay installed.
+ */
+static int
+pkg_jobs_extract_batch(struct pkg_jobs *j, struct pkg_solved *first,
+    unsigned int n, int num_workers, struct pkg_manifest_key *keys)
+{
+	struct pkg_extract_data d;
+	struct pkg_extract_item *it;
+	struct pkg_solved *ps;
+	struct timespec ts;
+	const char *target;
+	pthread_t *tids;
+	unsigned int i, nprepared;
+	int64_t id;
+	bool finished;
+	int nworkers, ret, rc = EPKG_OK;
+
+	memset(&d, 0, sizeof(d));
+	d.items = calloc(n, sizeof(*d.items));
+	if ((unsigned int)num_workers > n)
+		num_workers = n;
+	tids = calloc(num_workers, sizeof(pthread_t));
+	if (d.items == NULL || tids == NULL) {
+		pkg_emit_errno("calloc", "pkg_extract_data");
+		free(d.items);
+		free(tids);
+		return (EPKG_FATAL);
+	}
+
+	for (i = 0, ps = first; i < n; i++, ps = ps->next) {
+		it = &d.items[i];
+		if (pkg_jobs_install_target(j, ps, &it->new, &it->need_free,
+		    it->path, sizeof(it->path), &target) != EPKG_OK) {
+			rc = EPKG_FATAL;
+			break;
+		}
+		pkg_emit_install_begin(it->new);
+		if ((ret = pkg_add_begin(&it->ctx, j->db, target,
+		    pkg_jobs_add_flags(j, ps->items[0]->pkg), keys, NULL,
+		    it->new)) != EPKG_OK) {
+			pkg_add_end(&it->ctx);
+			rc = ret;
+			break;
+		}
+	}
+	nprepared = i;
+
+	if (rc != EPKG_OK) {
+		/* release the jobs already prepared without extracting them */
+		for (i = 0; i < nprepared; i++) {
+			d.items[i].ctx.retcode = EPKG_FATAL;
+			pkg_add_end(&d.items[i].ctx);
+		}
+		pkgdb_transaction_rollback(j->db->sqlite, "upgrade");
+		goto cleanup;
+	}
+	d.nitems = nprepared;
+
+	pthread_mutex_init(&d.m, NULL);
+	pthread_cond_init(&d.changed, NULL);
+
+	for (nworkers = 0; nworkers < num_workers; nworkers++) {
+		if (pthread_create(&tids[nworkers], NULL,
+		    pkg_jobs_extract_worker, &d) != 0)
+			break;
+	}
+
+	pkg_emit_progress_start("Extracting %u packages", d.nitems);
+	/* Without any worker the archives are extracted here */
+	if (nworkers == 0)
+		pkg_jobs_extract_worker(&d);
+	do {
+		pthread_mutex_lock(&d.m);
+		finished = d.ndone == d.nitems;
+		if (!finished) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&d.changed, &d.m, &ts);
+		}
+		i = d.ndone;
+		pthread_mutex_unlock(&d.m);
+
+		pkg_emit_progress_tick(i, d.nitems);
+	} while (!finished);
+
+	for (int t = 0; t < nworkers; t++)
+		pthread_join(tids[t], NULL);
+
+	pthread_mutex_destroy(&d.m);
+	pthread_cond_destroy(&d.changed);
+
+	for (i = 0; i < nprepared; i++) {
+		it = &d.items[i];
+		if (it->ctx.retcode != EPKG_OK && it->ctx.registered) {
+			/* its files are already gone */
+			pkg_get(it->ctx.pkg, PKG_ROWID, &id);
+			pkgdb_unregister_pkg(j->db, id);
+		}
+		if ((ret = pkg_add_end(&it->ctx)) == EPKG_OK)
+			pkg_emit_install_finished(it->new);
+		else if (rc == EPKG_OK)
+			rc = ret;
+	}
+
+cleanup:
+	for (i = 0; i < n; i++) {
+		if (d.items[i].need_free)
+			pkg_free(d.items[i].new);
+	}
+	free(d.items);
+	free(tids);
+
+	return (rc);
+}
+
 static int
 pkg_jobs_execute(struct pkg_jobs *j)
 {
 	struct pkg *p = NULL;
-	struct pkg_solved *ps;
+	struct pkg_solved *ps, *last;
 	struct pkg_manifest_key *keys = NULL;
 	const char *name;
-	int flags = 0;
+	unsigned int n;
+	int flags = 0, concurrency;
 	int retcode = EPKG_FATAL;
 	bool handle_rc = false;
 
@@ -2292,7 +2621,33 @@ pkg_jobs_execute(struct pkg_jobs *j)
 
 	pkg_jobs_set_priorities(j);
 
+	concurrency = pkg_object_int(pkg_config_get("INSTALL_CONCURRENCY"));
+
 	DL_FOREACH(j->jobs, ps) {
+		/*
+		 * Gather the following independent installs, no more than
+		 * twice the number of workers to bound the archives kept
+		 * open at once.
+		 */
+		n = 0;
+		if (concurrency > 1) {
+			last = ps;
+			while (last != NULL && n < (unsigned)concurrency * 2 &&
+			    pkg_jobs_extract_independent(last, ps)) {
+				last = last->next;
+				n++;
+			}
+		}
+		if (n > 1) {
+			retcode = pkg_jobs_extract_batch(j, ps, n, concurrency,
+			    keys);
+			if (retcode != EPKG_OK)
+				goto cleanup;
+			while (--n > 0)
+				ps = ps->next;
+			continue;
+		}
+
 		switch (ps->type) {
 		case PKG_SOLVED_DELETE:
 		case PKG_SOLVED_UPGRADE_REMOVE:
@@ -2441,10 +2796,16 @@ pkg_jobs_apply(struct pkg_jobs *j)
 			int64_t pkgsize;														\
 			pkg_get(p, PKG_PKGSIZE, &pkgsize);				\
 			pkg_repo_cached_name(p, cachedpath, sizeof(cachedpath));				\
-			if (stat(cachedpath, &st) == -1)										\
-				dlsize += pkgsize;													\
-			else																	\
+			if (stat(cachedpath, &st) == 0) {										\
+				dlsize += pkgsize - st.st_size;										\
+				continue;															\
+			}																		\
+			/* a partial download will be resumed */								\
+			strlcat(cachedpath, ".part", sizeof(cachedpath));						\
+			if (stat(cachedpath, &st) == 0 && st.st_size < pkgsize)					\
 				dlsize += pkgsize - st.st_size;										\
+			else																	\
+				dlsize += pkgsize;													\
 		}																			\
 	}																				\
 } while(0)
@@ -2455,12 +2816,260 @@ pkg_jobs_apply(struct pkg_jobs *j)
 			p = ps->items[0]->pkg;													\
 			if (p->type != PKG_REMOTE)												\
 				continue;															\
-			if (pkg_repo_fetch_package(p) != EPKG_OK)								\
+			if (pkg_repo_fetch_package(p, NULL) != EPKG_OK)							\
 				return (EPKG_FATAL);												\
 		}																			\
 	}																				\
 } while(0)
 
+/*
+ * Concurrent fetching: workers pick the first package which has not been
+ * started yet and whose repository is below its connection limit. The
+ * main thread only reports the aggregated progress, and the first failure
+ * stops everything: nothing new is started and the transfers in flight
+ * are abandoned. EPKG_END is returned when no worker could be started,
+ * the packages are then fetched sequentially.
+ */
+struct pkg_fetch_mirror {
+	struct pkg_repo *repo;
+	int active;
+	int limit;
+	bool pipeline; /* ssh: request the next package ahead of time */
+	UT_hash_handle hh;
+};
+
+struct pkg_fetch_item {
+	struct pkg *pkg;
+	struct pkg_fetch_mirror *mirror;
+	struct pkg_fetch_ctx ctx;
+	int64_t size;
+	int rc;
+	bool started;
+	bool done;
+};
+
+struct pkg_fetch_data {
+	struct pkg_fetch_item *items;
+	struct pkg_fetch_mirror *mirrors;
+	unsigned int nitems;
+	unsigned int next; /* first item not started yet */
+	unsigned int ndone;
+	unsigned int active;
+	volatile bool cancel;
+
+	/* `m' protects everything but the transfer state of the items */
+	pthread_mutex_t m;
+	pthread_cond_t changed;
+};
+
+static void *
+pkg_jobs_fetch_worker(void *data)
+{
+	struct pkg_fetch_data *d = data;
+	struct pkg_fetch_item *it;
+	struct pkg *next;
+	char nexturl[MAXPATHLEN];
+	unsigned int i;
+	int rc;
+
+	pthread_mutex_lock(&d->m);
+	while (!d->cancel && d->next < d->nitems) {
+		it = NULL;
+		for (i = d->next; i < d->nitems; i++) {
+			if (!d->items[i].started &&
+			    d->items[i].mirror->active < d->items[i].mirror->limit) {
+				it = &d->items[i];
+				break;
+			}
+		}
+		if (it == NULL) {
+			pthread_cond_wait(&d->changed, &d->m);
+			continue;
+		}
+		it->started = true;
+		it->mirror->active++;
+		d->active++;
+		while (d->next < d->nitems && d->items[d->next].started)
+			d->next++;
+		/*
+		 * The repository has a single connection, its next package
+		 * is the next one asked for on it.
+		 */
+		next = NULL;
+		if (it->mirror->pipeline) {
+			for (i++; i < d->nitems; i++) {
+				if (!d->items[i].started &&
+				    d->items[i].mirror == it->mirror) {
+					next = d->items[i].pkg;
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&d->m);
+
+		it->ctx.next = NULL;
+		if (next != NULL &&
+		    pkg_repo_fetch_next(next, nexturl, sizeof(nexturl)))
+			it->ctx.next = nexturl;
+		rc = pkg_repo_fetch_package(it->pkg, &it->ctx);
+
+		pthread_mutex_lock(&d->m);
+		it->rc = rc;
+		it->done = true;
+		it->mirror->active--;
+		d->active--;
+		d->ndone++;
+		if (rc != EPKG_OK)
+			d->cancel = true;
+		pthread_cond_broadcast(&d->changed);
+	}
+	pthread_mutex_unlock(&d->m);
+
+	return (NULL);
+}
+
+static int
+pkg_jobs_fetch_parallel(struct pkg_jobs *j, int num_workers)
+{
+	struct pkg_fetch_data d;
+	struct pkg_fetch_item *it;
+	struct pkg_fetch_mirror *mirror, *mtmp;
+	struct pkg_solved *ps;
+	struct pkg_repo *repo;
+	struct pkg *p;
+	struct timespec ts;
+	pthread_t *tids;
+	const char *reponame, *url;
+	int64_t total = 0, done;
+	unsigned int i;
+	bool finished;
+	int limit, nworkers, rc = EPKG_OK;
+
+	memset(&d, 0, sizeof(d));
+	DL_FOREACH(j->jobs, ps) {
+		if (ps->type != PKG_SOLVED_DELETE &&
+		    ps->type != PKG_SOLVED_UPGRADE_REMOVE &&
+		    ps->items[0]->pkg->type == PKG_REMOTE)
+			d.nitems++;
+	}
+	if (d.nitems == 0)
+		return (EPKG_OK);
+
+	if ((unsigned int)num_workers > d.nitems)
+		num_workers = d.nitems;
+	d.items = calloc(d.nitems, sizeof(*d.items));
+	tids = calloc(num_workers, sizeof(pthread_t));
+	if (d.items == NULL || tids == NULL) {
+		pkg_emit_errno("calloc", "pkg_fetch_data");
+		free(d.items);
+		free(tids);
+		return (EPKG_FATAL);
+	}
+
+	limit = pkg_object_int(pkg_config_get("FETCH_MIRROR_CONNECTIONS"));
+	if (limit < 1)
+		limit = 1;
+
+	i = 0;
+	DL_FOREACH(j->jobs, ps) {
+		if (ps->type == PKG_SOLVED_DELETE ||
+		    ps->type == PKG_SOLVED_UPGRADE_REMOVE)
+			continue;
+		p = ps->items[0]->pkg;
+		if (p->type != PKG_REMOTE)
+			continue;
+		it = &d.items[i++];
+		it->pkg = p;
+		it->ctx.cancel = &d.cancel;
+		it->ctx.batched = true;
+		pkg_get(p, PKG_REPONAME, &reponame, PKG_PKGSIZE, &it->size);
+		total += it->size;
+
+		repo = pkg_repo_find_name(reponame);
+		HASH_FIND_PTR(d.mirrors, &repo, mirror);
+		if (mirror == NULL) {
+			if ((mirror = calloc(1, sizeof(*mirror))) == NULL) {
+				pkg_emit_errno("calloc", "pkg_fetch_mirror");
+				rc = EPKG_FATAL;
+				goto cleanup;
+			}
+			mirror->repo = repo;
+			mirror->limit = limit;
+			/* the ssh channel of a repository is not shareable */
+			url = repo != NULL ? pkg_repo_url(repo) : NULL;
+			if (url != NULL && (strncmp(url, "ssh://", 6) == 0 ||
+			    strncmp(url, "pkg+ssh://", 10) == 0)) {
+				mirror->limit = 1;
+				mirror->pipeline = true;
+			}
+			HASH_ADD_PTR(d.mirrors, repo, mirror);
+		}
+		it->mirror = mirror;
+	}
+
+	pthread_mutex_init(&d.m, NULL);
+	pthread_cond_init(&d.changed, NULL);
+
+	for (nworkers = 0; nworkers < num_workers; nworkers++) {
+		if (pthread_create(&tids[nworkers], NULL,
+		    pkg_jobs_fetch_worker, &d) != 0)
+			break;
+	}
+	if (nworkers == 0) {
+		/* Let the caller fetch the packages one after the other */
+		rc = EPKG_END;
+		goto destroy;
+	}
+
+	pkg_emit_progress_start("Fetching %u packages", d.nitems);
+	do {
+		pthread_mutex_lock(&d.m);
+		finished = d.ndone == d.nitems || (d.cancel && d.active == 0);
+		if (!finished) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&d.changed, &d.m, &ts);
+		}
+		done = 0;
+		for (i = 0; i < d.nitems; i++) {
+			it = &d.items[i];
+			if (it->done)
+				done += it->size;
+			else
+				done += MIN(__sync_fetch_and_add(&it->ctx.done,
+				    0), it->size);
+		}
+		pthread_mutex_unlock(&d.m);
+
+		if (!d.cancel)
+			pkg_emit_progress_tick(done, total);
+	} while (!finished);
+
+	for (int t = 0; t < nworkers; t++)
+		pthread_join(tids[t], NULL);
+
+	for (i = 0; i < d.nitems; i++) {
+		if (d.items[i].done && d.items[i].rc != EPKG_OK) {
+			rc = d.items[i].rc;
+			break;
+		}
+	}
+
+destroy:
+	pthread_mutex_destroy(&d.m);
+	pthread_cond_destroy(&d.changed);
+
+cleanup:
+	HASH_ITER(hh, d.mirrors, mirror, mtmp) {
+		HASH_DEL(d.mirrors, mirror);
+		free(mirror);
+	}
+	free(d.items);
+	free(tids);
+
+	return (rc);
+}
+
 static int
 pkg_jobs_fetch(struct pkg_jobs *j)
 {
@@ -2469,6 +3078,7 @@ pkg_jobs_fetch(struct pkg_jobs *j)
 	struct statfs fs;
 	struct stat st;
 	int64_t dlsize = 0;
+	int concurrency, ret;
 	const char *cachedir = NULL;
 	char cachedpath[MAXPATHLEN];
 	
@@ -2505,6 +3115,11 @@ pkg_jobs_fetch(struct pkg_jobs *j)
 		return (EPKG_OK); /* don't download anything */
 
 	/* Fetch */
+	concurrency = pkg_object_int(pkg_config_get("FETCH_CONCURRENCY"));
+	if (concurrency > 1 &&
+	    (ret = pkg_jobs_fetch_parallel(j, concurrency)) != EPKG_END)
+		return (ret);
+
 	PKG_JOBS_DO_FETCH(j->jobs);
 
 	return (EPKG_OK);
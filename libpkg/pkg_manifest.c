@@ -802,8 +802,8 @@ pkg_parse_manifest_file(struct pkg *pkg, const char *file, struct pkg_manifest_k
 	return (rc);
 }
 
-int
-pkg_emit_filelist(struct pkg *pkg, FILE *f)
+static ucl_object_t *
+emit_filelist(struct pkg *pkg)
 {
 	ucl_object_t *obj = NULL, *seq;
 	struct pkg_file *file = NULL;
@@ -826,11 +826,31 @@ pkg_emit_filelist(struct pkg *pkg, FILE *f)
 	if (seq != NULL)
 		ucl_object_insert_key(obj, seq, "files", 5, false);
 
-	ucl_object_emit_file(obj, UCL_EMIT_JSON_COMPACT, f);
-
 	if (b != NULL)
 		sbuf_delete(b);
 
+	return (obj);
+}
+
+int
+pkg_emit_filelist(struct pkg *pkg, FILE *f)
+{
+	ucl_object_t *obj;
+
+	obj = emit_filelist(pkg);
+	ucl_object_emit_file(obj, UCL_EMIT_JSON_COMPACT, f);
+	ucl_object_unref(obj);
+
+	return (EPKG_OK);
+}
+
+int
+pkg_emit_filelist_sbuf(struct pkg *pkg, struct sbuf **b)
+{
+	ucl_object_t *obj;
+
+	obj = emit_filelist(pkg);
+	ucl_object_emit_sbuf(obj, UCL_EMIT_JSON_COMPACT, b);
 	ucl_object_unref(obj);
 
 	return (EPKG_OK);
@@ -857,7 +877,7 @@ emit_manifest(struct pkg *pkg, struct sbuf **out, short flags)
 	ucl_object_t *annotations, *categories, *licenses;
 	ucl_object_t *map, *seq, *submap;
 	ucl_object_t *top = ucl_object_typed_new(UCL_OBJECT);
-	const ucl_object_t *o;
+	ucl_object_t *o;
 	const char *key;
 	int recopies[] = {
 		PKG_NAME,
@@ -881,9 +901,8 @@ emit_manifest(struct pkg *pkg, struct sbuf **out, short flags)
 	pkg_debug(4, "Emitting basic metadata");
 	for (i = 0; recopies[i] != -1; i++) {
 		key = pkg_keys[recopies[i]].name;
-		if ((o = ucl_object_find_key(pkg->fields, key)))
-			ucl_object_insert_key(top, ucl_object_ref(o),
-			    key, strlen(key), false);
+		if ((o = pkg_attr_to_ucl(pkg, recopies[i])))
+			ucl_object_insert_key(top, o, key, strlen(key), false);
 	}
 	if (comment)
 		ucl_object_insert_key(top, ucl_object_fromstring_common(comment, 0, UCL_STRING_TRIM), "comment", 7, false);
@@ -37,6 +37,7 @@
 #include <archive_entry.h>
 #include <assert.h>
 #include <fts.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <sqlite3.h>
 #include <string.h>
@@ -110,8 +111,199 @@ pkg_repo_cached_name(struct pkg *pkg, char *dest, size_t destlen)
 	}
 }
 
+/*
+ * What is saved in <file>.part.sha when a download is interrupted: the
+ * SHA-256 state after the first `offset' bytes of the .part file. The
+ * state is only meaningful to the same build of the same crypto library,
+ * `magic' and `size' reject whatever else wrote the file.
+ */
+#define PKG_FETCH_STATE_MAGIC	0x706b6753	/* "pkgS" */
+
+struct pkg_fetch_state {
+	uint32_t magic;
+	uint32_t size;
+	int64_t offset;
+	SHA256_CTX sha;
+};
+
+static int
+pkg_repo_part_load(const char *path, struct pkg_fetch_state *state)
+{
+	int fd;
+	ssize_t r;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (errno == ENOENT ? EPKG_END : EPKG_FATAL);
+	r = read(fd, state, sizeof(*state));
+	close(fd);
+
+	if (r != sizeof(*state) || state->magic != PKG_FETCH_STATE_MAGIC ||
+	    state->size != sizeof(*state))
+		return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
+static void
+pkg_repo_part_save(const char *path, struct pkg_fetch_state *state)
+{
+	int fd;
+
+	state->magic = PKG_FETCH_STATE_MAGIC;
+	state->size = sizeof(*state);
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
+		return;
+	if (write(fd, state, sizeof(*state)) != sizeof(*state))
+		unlink(path);
+	close(fd);
+}
+
+static int
+pkg_repo_part_hash(int fd, off_t len, SHA256_CTX *sha)
+{
+	char buf[BUFSIZ];
+	off_t pos = 0;
+	ssize_t r;
+
+	while (pos < len) {
+		r = pread(fd, buf, MIN((off_t)sizeof(buf), len - pos), pos);
+		if (r <= 0)
+			return (EPKG_FATAL);
+		SHA256_Update(sha, buf, r);
+		pos += r;
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Download `url' into `dest' through `dest'.part, resuming whatever a
+ * previous attempt left there. The SHA-256 state of the bytes received
+ * so far is kept in `dest'.part.sha when the transfer is interrupted so
+ * that a resumed download does not have to hash them again, without it
+ * they are read back from the .part file, a state which cannot be used
+ * discards the .part. A .part which is already complete is only renamed
+ * into place if it matches `sum'.
+ */
+static int
+pkg_repo_fetch_part(struct pkg_repo *repo, const char *url, const char *dest,
+    int64_t pkgsize, const char *sum, struct pkg_fetch_ctx *ctx,
+    char cksum[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	char part[MAXPATHLEN], statepath[MAXPATHLEN];
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	struct pkg_fetch_state state;
+	struct stat st;
+	SHA256_CTX sha;
+	int64_t start;
+	int fd, ret, retcode;
+
+	if (snprintf(part, sizeof(part), "%s.part", dest) >=
+	    (int)sizeof(part) ||
+	    snprintf(statepath, sizeof(statepath), "%s.part.sha", dest) >=
+	    (int)sizeof(statepath)) {
+		pkg_emit_error("%s: path too long", dest);
+		return (EPKG_FATAL);
+	}
+
+	if ((fd = open(part, O_RDWR|O_CREAT, 0644)) == -1) {
+		pkg_emit_errno("open", part);
+		return (EPKG_FATAL);
+	}
+	if (fstat(fd, &st) == -1) {
+		pkg_emit_errno("fstat", part);
+		close(fd);
+		return (EPKG_FATAL);
+	}
+
+	ctx->hash = true;
+	ctx->offset = 0;
+	SHA256_Init(&ctx->sha);
+
+	/*
+	 * Nothing is left to fetch, and asking for it would fail: check
+	 * what the previous attempt received.
+	 */
+	if (st.st_size > 0 && st.st_size == pkgsize) {
+		if (pkg_repo_part_load(statepath, &state) == EPKG_OK &&
+		    state.offset == st.st_size)
+			sha = state.sha;
+		else {
+			SHA256_Init(&sha);
+			if (pkg_repo_part_hash(fd, st.st_size, &sha) != EPKG_OK)
+				SHA256_Init(&sha);
+		}
+		SHA256_Final(digest, &sha);
+		sha256_hash(digest, cksum);
+		if (sum != NULL && strcmp(cksum, sum) == 0) {
+			close(fd);
+			unlink(statepath);
+			if (rename(part, dest) == -1) {
+				pkg_emit_errno("rename", part);
+				unlink(part);
+				return (EPKG_FATAL);
+			}
+			__sync_fetch_and_add(&ctx->done, st.st_size);
+			return (EPKG_OK);
+		}
+		pkg_debug(1, "Fetch: %s does not match its checksum", part);
+	}
+
+	if (st.st_size > 0 && st.st_size < pkgsize) {
+		ret = pkg_repo_part_load(statepath, &state);
+		if (ret == EPKG_OK &&
+		    state.offset > 0 && state.offset <= st.st_size) {
+			ctx->sha = state.sha;
+			ctx->offset = state.offset;
+		} else if (ret == EPKG_END &&
+		    pkg_repo_part_hash(fd, st.st_size, &ctx->sha) == EPKG_OK) {
+			/* no saved state, the interrupted run could not write it */
+			ctx->offset = st.st_size;
+		} else
+			SHA256_Init(&ctx->sha);
+	}
+	unlink(statepath);
+
+	/* Drop anything past what has been hashed */
+	if (ftruncate(fd, ctx->offset) == -1 ||
+	    lseek(fd, ctx->offset, SEEK_SET) == -1) {
+		pkg_emit_errno("ftruncate", part);
+		close(fd);
+		return (EPKG_FATAL);
+	}
+	if (ctx->offset > 0)
+		pkg_debug(1, "Fetch: resuming %s at %" PRId64, part,
+		    (int64_t)ctx->offset);
+
+	start = ctx->done;
+	__sync_fetch_and_add(&ctx->done, ctx->offset);
+	retcode = pkg_fetch_file_to_fd(repo, url, fd, NULL, ctx);
+	close(fd);
+
+	if (retcode != EPKG_OK) {
+		state.offset = ctx->done - start;
+		state.sha = ctx->sha;
+		if (state.offset > 0)
+			pkg_repo_part_save(statepath, &state);
+		else
+			unlink(part);
+		return (retcode == EPKG_UPTODATE ? EPKG_FATAL : retcode);
+	}
+
+	SHA256_Final(digest, &ctx->sha);
+	sha256_hash(digest, cksum);
+
+	if (rename(part, dest) == -1) {
+		pkg_emit_errno("rename", part);
+		unlink(part);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
 int
-pkg_repo_fetch_package(struct pkg *pkg)
+pkg_repo_fetch_package(struct pkg *pkg, struct pkg_fetch_ctx *ctx)
 {
 	char dest[MAXPATHLEN], link_dest[MAXPATHLEN];
 	char url[MAXPATHLEN];
@@ -119,7 +311,8 @@ pkg_repo_fetch_package(struct pkg *pkg)
 	char cksum[SHA256_DIGEST_LENGTH * 2 +1];
 	int64_t pkgsize;
 	struct stat st;
-	char *path = NULL;
+	struct pkg_fetch_ctx lctx;
+	char *path = NULL, *p;
 	const char *packagesite = NULL, *dest_fname = NULL, *ext = NULL;
 
 	int retcode = EPKG_OK;
@@ -137,12 +330,17 @@ pkg_repo_fetch_package(struct pkg *pkg)
 	if (access(dest, F_OK) == 0)
 		goto checksum;
 
-	/* Create the dirs in cachedir */
-	if ((path = strdup(dirname(dest))) == NULL) {
-		pkg_emit_errno("dirname", dest);
+	/*
+	 * Create the dirs in cachedir, dirname(3) is avoided as it may
+	 * use a static buffer and we can run in several threads at once.
+	 */
+	if ((path = strdup(dest)) == NULL) {
+		pkg_emit_errno("strdup", dest);
 		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
+	if ((p = strrchr(path, '/')) != NULL && p != path)
+		*p = '\0';
 
 	if ((retcode = mkdirs(path)) != EPKG_OK)
 		goto cleanup;
@@ -171,7 +369,14 @@ pkg_repo_fetch_package(struct pkg *pkg)
 		return (EPKG_OK);
 	}
 
-	retcode = pkg_fetch_file(repo, url, dest, 0);
+	if (ctx == NULL) {
+		memset(&lctx, 0, sizeof(lctx));
+		ctx = &lctx;
+	}
+
+	/* The checksum is computed while downloading */
+	retcode = pkg_repo_fetch_part(repo, url, dest, pkgsize, sum, ctx,
+	    cksum);
 	fetched = 1;
 
 	if (retcode != EPKG_OK)
@@ -180,14 +385,21 @@ pkg_repo_fetch_package(struct pkg *pkg)
 	checksum:
 	/*	checksum calculation is expensive, if size does not
 		match, skip it and assume failed checksum. */
+	if (fetched == 1 && (stat(dest, &st) == -1 || pkgsize != st.st_size)) {
+		pkg_emit_error("%s-%s: size mismatch from repository",
+		    name, version);
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
 	if (stat(dest, &st) == -1 || pkgsize != st.st_size) {
 		pkg_emit_error("cached package %s-%s: "
 			"size mismatch, fetching from remote",
 			name, version);
 		unlink(dest);
-		return (pkg_repo_fetch_package(pkg));
+		return (pkg_repo_fetch_package(pkg, ctx));
 	}
-	retcode = sha256_file(dest, cksum);
+	if (fetched == 0)
+		retcode = sha256_file(dest, cksum);
 	if (retcode == EPKG_OK) {
 		if (strcmp(cksum, sum)) {
 			if (fetched == 1) {
@@ -199,7 +411,7 @@ pkg_repo_fetch_package(struct pkg *pkg)
 				    "checksum mismatch, fetching from remote",
 				    name, version);
 				unlink(dest);
-				return (pkg_repo_fetch_package(pkg));
+				return (pkg_repo_fetch_package(pkg, ctx));
 			}
 		}
 	}
@@ -224,6 +436,34 @@ pkg_repo_fetch_package(struct pkg *pkg)
 	return (retcode);
 }
 
+/*
+ * Tell whether `pkg' will have to be downloaded from scratch, filling
+ * `url' with where from so that a transfer can ask for it ahead of time.
+ */
+bool
+pkg_repo_fetch_next(struct pkg *pkg, char *url, size_t urllen)
+{
+	char dest[MAXPATHLEN], part[MAXPATHLEN];
+	const char *reponame, *packagesite;
+
+	pkg_repo_cached_name(pkg, dest, sizeof(dest));
+	snprintf(part, sizeof(part), "%s.part", dest);
+	if (access(dest, F_OK) == 0 || access(part, F_OK) == 0)
+		return (false);
+
+	pkg_get(pkg, PKG_REPONAME, &reponame);
+	packagesite = pkg_repo_url(pkg_repo_find_name(reponame));
+	if (packagesite == NULL || packagesite[0] == '\0')
+		return (false);
+
+	if (packagesite[strlen(packagesite) - 1] == '/')
+		pkg_snprintf(url, urllen, "%S%R", packagesite, pkg);
+	else
+		pkg_snprintf(url, urllen, "%S/%R", packagesite, pkg);
+
+	return (true);
+}
+
 static int
 pkg_repo_fetch_remote_tmp(struct pkg_repo *repo,
 		const char *filename, const char *extension, time_t *t, int *rc)
@@ -265,7 +505,7 @@ pkg_repo_fetch_remote_tmp(struct pkg_repo *repo,
 	}
 	(void)unlink(tmp);
 
-	if ((*rc = pkg_fetch_file_to_fd(repo, url, fd, t)) != EPKG_OK) {
+	if ((*rc = pkg_fetch_file_to_fd(repo, url, fd, t, NULL)) != EPKG_OK) {
 		close(fd);
 		fd = -1;
 	}
@@ -854,22 +1094,43 @@ cleanup:
 	return rc;
 }
 
+/*
+ * Fetch the archive holding filename and extract it into dest_fd once its
+ * signature has been checked
+ */
+int
+pkg_repo_fetch_remote_extract_fd(struct pkg_repo *repo, const char *filename,
+		time_t *t, int dest_fd)
+{
+	int fd, rc;
+
+	fd = pkg_repo_fetch_remote_tmp(repo, filename,
+			packing_format_to_string(repo->meta->packing_format), t, &rc);
+	if (fd == -1)
+		return (rc);
+
+	if (pkg_repo_archive_extract_check_archive(fd, filename, NULL, repo, dest_fd)
+			!= EPKG_OK)
+		rc = EPKG_FATAL;
+	else
+		rc = EPKG_OK;
+
+	/* Thus removing archived file as well */
+	close(fd);
+
+	return (rc);
+}
+
 FILE *
 pkg_repo_fetch_remote_extract_tmp(struct pkg_repo *repo, const char *filename,
 		time_t *t, int *rc)
 {
-	int fd, dest_fd;
+	int dest_fd;
 	mode_t mask;
 	FILE *res = NULL;
 	const char *tmpdir;
 	char tmp[MAXPATHLEN];
 
-	fd = pkg_repo_fetch_remote_tmp(repo, filename,
-			packing_format_to_string(repo->meta->packing_format), t, rc);
-	if (fd == -1) {
-		return (NULL);
-	}
-
 	tmpdir = getenv("TMPDIR");
 	if (tmpdir == NULL)
 		tmpdir = "/tmp";
@@ -882,14 +1143,13 @@ pkg_repo_fetch_remote_extract_tmp(struct pkg_repo *repo, const char *filename,
 		pkg_emit_error("Could not create temporary file %s, "
 				"aborting update.\n", tmp);
 		*rc = EPKG_FATAL;
-		goto cleanup;
+		return (NULL);
 	}
 	(void)unlink(tmp);
-	if (pkg_repo_archive_extract_check_archive(fd, filename, NULL, repo, dest_fd)
-			!= EPKG_OK) {
-		*rc = EPKG_FATAL;
+
+	*rc = pkg_repo_fetch_remote_extract_fd(repo, filename, t, dest_fd);
+	if (*rc != EPKG_OK)
 		goto cleanup;
-	}
 
 	res = fdopen(dest_fd, "r");
 	if (res == NULL) {
@@ -898,13 +1158,10 @@ pkg_repo_fetch_remote_extract_tmp(struct pkg_repo *repo, const char *filename,
 		goto cleanup;
 	}
 	dest_fd = -1;
-	*rc = EPKG_OK;
 
 cleanup:
 	if (dest_fd != -1)
 		close(dest_fd);
-	/* Thus removing archived file as well */
-	close(fd);
 	return (res);
 }
 
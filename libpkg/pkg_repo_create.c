@@ -31,18 +31,20 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/sysctl.h>
 
 #include <archive_entry.h>
 #include <assert.h>
+#include <dirent.h>
 #include <fts.h>
 #include <libgen.h>
 #include <sqlite3.h>
+#include <stdint.h>
 #include <string.h>
 #define _WITH_GETLINE
 #include <stdio.h>
 #include <stdbool.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -60,6 +62,11 @@ struct digest_list_entry {
 	long manifest_pos;
 	long files_pos;
 	long manifest_length;
+	long files_length;
+	char *path;
+	off_t size;
+	time_t mtime;
+	ino_t ino;
 	struct digest_list_entry *prev, *next;
 };
 
@@ -69,54 +76,153 @@ struct pkg_conflict_bulk {
 	UT_hash_handle hh;
 };
 
+static void
+pkg_repo_publish_result(struct thd_data *d, struct pkg_result *r)
+{
+	pthread_mutex_lock(&d->ring_m);
+	while (d->ring_count == d->ring_size)
+		pthread_cond_wait(&d->ring_room, &d->ring_m);
+	d->ring[(d->ring_head + d->ring_count) % d->ring_size] = r;
+	d->ring_count++;
+	pthread_cond_signal(&d->ring_filled);
+	pthread_mutex_unlock(&d->ring_m);
+}
+
+static struct pkg_result *
+pkg_repo_consume_result(struct thd_data *d)
+{
+	struct pkg_result *r;
+
+	pthread_mutex_lock(&d->ring_m);
+	while (d->ring_count == 0)
+		pthread_cond_wait(&d->ring_filled, &d->ring_m);
+	r = d->ring[d->ring_head];
+	d->ring_head = (d->ring_head + 1) % d->ring_size;
+	d->ring_count--;
+	pthread_cond_signal(&d->ring_room);
+	pthread_mutex_unlock(&d->ring_m);
+
+	return (r);
+}
+
 static void
 pkg_read_pkg_file(void *data)
 {
 	struct thd_data *d = (struct thd_data*) data;
 	struct pkg_result *r;
 	struct pkg_manifest_key *keys = NULL;
+	struct pkg_repo_file *f;
+	unsigned int idx;
+	int flags;
 
-	FTSENT *fts_ent = NULL;
-	char fts_accpath[MAXPATHLEN];
-	char fts_path[MAXPATHLEN];
-	char fts_name[MAXPATHLEN];
-	off_t st_size;
-	int fts_info, flags;
-
-	char *ext = NULL;
 	char *pkg_path;
+	const char *origin;
 
 	pkg_manifest_keys_new(&keys);
 
+	if (d->read_files)
+		flags = PKG_OPEN_MANIFEST_ONLY;
+	else
+		flags = PKG_OPEN_MANIFEST_ONLY | PKG_OPEN_MANIFEST_COMPACT;
+
 	for (;;) {
-		fts_ent = NULL;
+		idx = __sync_fetch_and_add(&d->next_file, 1);
+
+		/* There is no more jobs, exit the main loop. */
+		if (idx >= d->num_files)
+			break;
+
+		f = &d->files[idx];
+		pkg_path = f->path;
+		pkg_path += strlen(d->root_path);
+		while (pkg_path[0] == '/')
+			pkg_path++;
+
+		r = calloc(1, sizeof(struct pkg_result));
+		strlcpy(r->path, pkg_path, sizeof(r->path));
+		r->size = f->size;
+		r->mtime = f->mtime;
+		r->ino = f->ino;
+
+		/* Unchanged since the previous run: reuse its manifest */
+		if (d->index != NULL) {
+			HASH_FIND_STR(d->index, pkg_path, r->cached);
+			if (r->cached != NULL &&
+			    r->cached->size == f->size &&
+			    r->cached->mtime == f->mtime &&
+			    r->cached->ino == f->ino) {
+				r->origin = strdup(r->cached->origin);
+				r->digest = strdup(r->cached->digest);
+				goto publish;
+			}
+			r->cached = NULL;
+		}
 
 		/*
-		 * Get a file to read from.
-		 * Copy the data we need from the fts entry localy because as soon as
-		 * we unlock the fts_m mutex, we can not access it.
+		 * The archive checksum is computed on the same bytes libarchive
+		 * reads, so every package is read from disk only once.
 		 */
-		pthread_mutex_lock(&d->fts_m);
-		if (!d->stop)
-			fts_ent = fts_read(d->fts);
-		if (fts_ent != NULL) {
-			strlcpy(fts_accpath, fts_ent->fts_accpath, sizeof(fts_accpath));
-			strlcpy(fts_path, fts_ent->fts_path, sizeof(fts_path));
-			strlcpy(fts_name, fts_ent->fts_name, sizeof(fts_name));
-			st_size = fts_ent->fts_statp->st_size;
-			fts_info = fts_ent->fts_info;
-		}
-		pthread_mutex_unlock(&d->fts_m);
+		if (pkg_open_cksum(&r->pkg, f->path, keys, flags,
+		    r->cksum) != EPKG_OK) {
+			r->retcode = EPKG_WARN;
+		} else {
+			pkg_set(r->pkg, PKG_CKSUM, r->cksum,
+			    PKG_REPOPATH, pkg_path,
+			    PKG_PKGSIZE, f->size);
+
+			/*
+			 * Serialize everything here so that the main thread
+			 * only has to append bytes to the catalogue.
+			 */
+			r->manifest = sbuf_new_auto();
+			pkg_emit_manifest_sbuf(r->pkg, r->manifest,
+			    PKG_MANIFEST_EMIT_COMPACT, &r->digest);
+			if (d->read_files)
+				pkg_emit_filelist_sbuf(r->pkg, &r->files);
+			pkg_get(r->pkg, PKG_ORIGIN, &origin);
+			r->origin = strdup(origin);
+		}
 
-		/* There is no more jobs, exit the main loop. */
-		if (fts_ent == NULL)
-			break;
+publish:
+		pkg_repo_publish_result(d, r);
+	}
+
+	pkg_manifest_keys_free(keys);
+}
 
+/*
+ * Walk the repository once and record every package archive it contains,
+ * the workers then only have to pick the next entry of the array.
+ */
+static int
+pkg_repo_scan(char *path, struct pkg_repo_file **files, unsigned int *nfiles)
+{
+	FTS *fts;
+	FTSENT *fts_ent;
+	struct pkg_repo_file *f;
+	char *repopath[2];
+	char name[MAXPATHLEN];
+	char *ext;
+	unsigned int cap = 0;
+
+	*files = NULL;
+	*nfiles = 0;
+
+	repopath[0] = path;
+	repopath[1] = NULL;
+
+	if ((fts = fts_open(repopath, FTS_PHYSICAL|FTS_NOCHDIR, NULL)) == NULL) {
+		pkg_emit_errno("fts_open", path);
+		return (EPKG_FATAL);
+	}
+
+	while ((fts_ent = fts_read(fts)) != NULL) {
 		/* Skip everything that is not a file */
-		if (fts_info != FTS_F)
+		if (fts_ent->fts_info != FTS_F)
 			continue;
 
-		ext = strrchr(fts_name, '.');
+		strlcpy(name, fts_ent->fts_name, sizeof(name));
+		ext = strrchr(name, '.');
 
 		if (ext == NULL)
 			continue;
@@ -129,64 +235,66 @@ pkg_read_pkg_file(void *data)
 
 		*ext = '\0';
 
-		if (strcmp(fts_name, repo_db_archive) == 0 ||
-			strcmp(fts_name, repo_packagesite_archive) == 0 ||
-			strcmp(fts_name, repo_filesite_archive) == 0 ||
-			strcmp(fts_name, repo_digests_archive) == 0 ||
-			strcmp(fts_name, repo_conflicts_archive) == 0)
+		if (strcmp(name, repo_db_archive) == 0 ||
+			strcmp(name, repo_packagesite_archive) == 0 ||
+			strcmp(name, repo_filesite_archive) == 0 ||
+			strcmp(name, repo_digests_archive) == 0 ||
+			strcmp(name, repo_conflicts_archive) == 0 ||
+			strcmp(name, repo_fulldb_archive) == 0 ||
+			strcmp(name, repo_meta_archive) == 0 ||
+			strncmp(name, repo_delta_archive,
+			    sizeof(repo_delta_archive) - 1) == 0)
 			continue;
-		*ext = '.';
-
-		pkg_path = fts_path;
-		pkg_path += strlen(d->root_path);
-		while (pkg_path[0] == '/')
-			pkg_path++;
 
-		r = calloc(1, sizeof(struct pkg_result));
-		strlcpy(r->path, pkg_path, sizeof(r->path));
-
-		if (d->read_files)
-			flags = PKG_OPEN_MANIFEST_ONLY;
-		else
-			flags = PKG_OPEN_MANIFEST_ONLY | PKG_OPEN_MANIFEST_COMPACT;
-
-		if (pkg_open(&r->pkg, fts_accpath, keys, flags) != EPKG_OK) {
-			r->retcode = EPKG_WARN;
-		} else {
-			sha256_file(fts_accpath, r->cksum);
-			pkg_set(r->pkg, PKG_CKSUM, r->cksum,
-			    PKG_REPOPATH, pkg_path,
-			    PKG_PKGSIZE, st_size);
+		if (*nfiles == cap) {
+			cap = cap == 0 ? 1024 : cap * 2;
+			*files = reallocf(*files, cap * sizeof(**files));
+			if (*files == NULL) {
+				pkg_emit_errno("realloc", "pkg_repo_file");
+				*nfiles = 0;
+				fts_close(fts);
+				return (EPKG_FATAL);
+			}
 		}
+		f = &(*files)[(*nfiles)++];
+		f->path = strdup(fts_ent->fts_path);
+		f->size = fts_ent->fts_statp->st_size;
+		f->mtime = fts_ent->fts_statp->st_mtime;
+		f->ino = fts_ent->fts_statp->st_ino;
+	}
 
+	fts_close(fts);
 
-		/* Add result to the FIFO and notify */
-		pthread_mutex_lock(&d->results_m);
-		while (d->num_results >= d->max_results) {
-			pthread_cond_wait(&d->has_room, &d->results_m);
-		}
-		DL_APPEND(d->results, r);
-		d->num_results++;
-		pthread_cond_signal(&d->has_result);
-		pthread_mutex_unlock(&d->results_m);
-	}
+	return (EPKG_OK);
+}
 
-	/*
-	 * This thread is about to exit.
-	 * Notify the main thread that we are done.
-	 */
-	pthread_mutex_lock(&d->results_m);
-	d->thd_finished++;
-	pthread_cond_signal(&d->has_result);
-	pthread_mutex_unlock(&d->results_m);
-	pkg_manifest_keys_free(keys);
+static void
+pkg_result_free(struct pkg_result *r)
+{
+	pkg_free(r->pkg);
+	free(r->origin);
+	free(r->digest);
+	if (r->manifest != NULL)
+		sbuf_delete(r->manifest);
+	if (r->files != NULL)
+		sbuf_delete(r->files);
+	free(r);
 }
 
+/*
+ * Results arrive in whatever order the workers finish: sort them by
+ * origin (and path, for several packages sharing an origin) so that
+ * the catalogue is byte-identical from one run to another.
+ */
 static int
-pkg_digest_sort_compare_func(struct digest_list_entry *d1,
-		struct digest_list_entry *d2)
+pkg_result_sort_compare_func(struct pkg_result *r1, struct pkg_result *r2)
 {
-	return strcmp(d1->origin, d2->origin);
+	int ret;
+
+	if ((ret = strcmp(r1->origin, r2->origin)) != 0)
+		return (ret);
+
+	return (strcmp(r1->path, r2->path));
 }
 
 static void
@@ -264,27 +372,233 @@ out:
 	return;
 }
 
+static void
+pkg_repo_index_free(struct pkg_repo_index_entry *index)
+{
+	struct pkg_repo_index_entry *cur, *tmp;
+
+	HASH_ITER(hh, index, cur, tmp) {
+		HASH_DEL(index, cur);
+		free(cur->path);
+		free(cur->origin);
+		free(cur->digest);
+		free(cur);
+	}
+}
+
+/*
+ * Read the file called `name' out of a repository archive previously
+ * produced by pkg_finish_repo()
+ */
+static int
+pkg_repo_read_archive_file(const char *archive, const char *name,
+    char **buf, size_t *len)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	int ret = EPKG_FATAL;
+
+	*buf = NULL;
+	*len = 0;
+
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_tar(a);
+
+	if (archive_read_open_filename(a, archive, 4096) != ARCHIVE_OK)
+		goto cleanup;
+
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		if (strcmp(archive_entry_pathname(ae), name) != 0)
+			continue;
+
+		*len = archive_entry_size(ae);
+		if ((*buf = malloc(*len + 1)) == NULL) {
+			pkg_emit_errno("malloc", name);
+			break;
+		}
+		if (archive_read_data(a, *buf, *len) != (ssize_t)*len) {
+			free(*buf);
+			*buf = NULL;
+			break;
+		}
+		(*buf)[*len] = '\0';
+		ret = EPKG_OK;
+		break;
+	}
+
+cleanup:
+	archive_read_close(a);
+	archive_read_free(a);
+
+	return (ret);
+}
+
+/*
+ * Load the index written by the previous run along with the packagesite
+ * (and filesite) it describes. The index is only trusted if the catalogue
+ * extracted from the archives is exactly the one it was written for.
+ */
+static struct pkg_repo_index_entry *
+pkg_repo_index_load(const char *output_dir, bool filelist,
+    char **manifests, size_t *manifests_len,
+    char **files, size_t *files_len)
+{
+	struct pkg_repo_index_entry *index = NULL, *ie;
+	FILE *fp;
+	char path[MAXPATHLEN];
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char cur[SHA256_DIGEST_LENGTH * 2 + 1];
+	char *line = NULL, *p, *fields[10];
+	size_t linecap = 0;
+	ssize_t linelen;
+	int i, had_files;
+	bool valid = false;
+
+	*manifests = *files = NULL;
+	*manifests_len = *files_len = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, repo_index_file);
+	if ((fp = fopen(path, "r")) == NULL)
+		return (NULL);
+
+	/* Header: <sha256 of packagesite>:<filelist> */
+	if ((linelen = getline(&line, &linecap, fp)) <= 0 ||
+	    sscanf(line, "%64[0-9a-f]:%d", sum, &had_files) != 2)
+		goto cleanup;
+
+	if (filelist && !had_files)
+		goto cleanup;
+
+	snprintf(path, sizeof(path), "%s/%s.txz", output_dir,
+	    repo_packagesite_archive);
+	if (pkg_repo_read_archive_file(path, repo_packagesite_file,
+	    manifests, manifests_len) != EPKG_OK)
+		goto cleanup;
+
+	sha256_buf(*manifests, *manifests_len, cur);
+	if (strcmp(cur, sum) != 0)
+		goto cleanup;
+
+	if (filelist) {
+		snprintf(path, sizeof(path), "%s/%s.txz", output_dir,
+		    repo_filesite_archive);
+		if (pkg_repo_read_archive_file(path, repo_filesite_file,
+		    files, files_len) != EPKG_OK)
+			goto cleanup;
+	}
+
+	/* <origin>:<digest>:<size>:<mtime>:<ino>:<mpos>:<mlen>:<fpos>:<flen>:<path> */
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[linelen - 1] = '\0';
+		p = line;
+		for (i = 0; i < 9; i++) {
+			if ((fields[i] = strsep(&p, ":")) == NULL)
+				goto cleanup;
+		}
+		if (p == NULL || *p == '\0')
+			goto cleanup;
+		fields[9] = p;
+
+		ie = calloc(1, sizeof(struct pkg_repo_index_entry));
+		if (ie == NULL) {
+			pkg_emit_errno("calloc", "pkg_repo_index_entry");
+			goto cleanup;
+		}
+		ie->origin = strdup(fields[0]);
+		ie->digest = strdup(fields[1]);
+		ie->size = strtoll(fields[2], NULL, 10);
+		ie->mtime = strtoll(fields[3], NULL, 10);
+		ie->ino = strtoull(fields[4], NULL, 10);
+		ie->manifest_pos = strtol(fields[5], NULL, 10);
+		ie->manifest_length = strtol(fields[6], NULL, 10);
+		ie->files_pos = strtol(fields[7], NULL, 10);
+		ie->files_length = strtol(fields[8], NULL, 10);
+		ie->path = strdup(fields[9]);
+		HASH_ADD_KEYPTR(hh, index, ie->path, strlen(ie->path), ie);
+
+		if (ie->manifest_pos < 0 || ie->manifest_length < 0 ||
+		    (size_t)(ie->manifest_pos + ie->manifest_length) >
+		    *manifests_len)
+			goto cleanup;
+		if (filelist && (ie->files_pos < 0 || ie->files_length < 0 ||
+		    (size_t)(ie->files_pos + ie->files_length) > *files_len))
+			goto cleanup;
+	}
+	valid = true;
+
+cleanup:
+	free(line);
+	fclose(fp);
+
+	if (!valid) {
+		pkg_repo_index_free(index);
+		free(*manifests);
+		free(*files);
+		*manifests = *files = NULL;
+		return (NULL);
+	}
+
+	return (index);
+}
+
+static int
+pkg_repo_index_write(const char *output_dir, bool filelist,
+    struct digest_list_entry *dlist)
+{
+	struct digest_list_entry *cur;
+	FILE *fp;
+	char path[MAXPATHLEN];
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir,
+	    repo_packagesite_file);
+	if (sha256_file(path, sum) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, repo_index_file);
+	if ((fp = fopen(path, "w")) == NULL) {
+		pkg_emit_errno("fopen", path);
+		return (EPKG_FATAL);
+	}
+
+	fprintf(fp, "%s:%d\n", sum, filelist ? 1 : 0);
+	LL_FOREACH(dlist, cur) {
+		fprintf(fp, "%s:%s:%jd:%jd:%ju:%ld:%ld:%ld:%ld:%s\n",
+		    cur->origin, cur->digest, (intmax_t)cur->size,
+		    (intmax_t)cur->mtime, (uintmax_t)cur->ino,
+		    cur->manifest_pos, cur->manifest_length,
+		    cur->files_pos, cur->files_length, cur->path);
+	}
+	fclose(fp);
+
+	return (EPKG_OK);
+}
+
 int
 pkg_create_repo(char *path, const char *output_dir, bool filelist,
-		void (progress)(struct pkg *pkg, void *data), void *data)
+		bool incremental, void (progress)(struct pkg *pkg, void *data),
+		void *data)
 {
-	FTS *fts = NULL;
 	struct thd_data thd_data;
 	struct pkg_conflict *c, *ctmp;
 	struct pkg_conflict_bulk *conflicts = NULL, *curcb, *tmpcb;
-	int num_workers;
-	size_t len;
+	int num_workers, nworkers = 0, err = 0;
 	pthread_t *tids = NULL;
 	struct digest_list_entry *dlist = NULL, *cur_dig, *dtmp;
+	struct pkg_result *done = NULL, *r, *rtmp;
 
 	int retcode = EPKG_OK;
 
-	char *repopath[2];
 	char repodb[MAXPATHLEN];
-	char *manifest_digest;
 	FILE *psyml, *fsyml, *mandigests, *fconflicts;
+	struct pkg_repo_index_entry *index = NULL;
+	char *prev_manifests = NULL, *prev_files = NULL;
+	size_t prev_manifests_len, prev_files_len;
 
 	psyml = fsyml = mandigests = fconflicts = NULL;
+	memset(&thd_data, 0, sizeof(thd_data));
 
 	if (!is_dir(path)) {
 		pkg_emit_error("%s is not a directory", path);
@@ -296,19 +610,21 @@ pkg_create_repo(char *path, const char *output_dir, bool filelist,
 		return (EPKG_FATAL);
 	}
 
-	repopath[0] = path;
-	repopath[1] = NULL;
-
-	len = sizeof(num_workers);
-	if (sysctlbyname("hw.ncpu", &num_workers, &len, NULL, 0) == -1)
-		num_workers = 6;
-
-	if ((fts = fts_open(repopath, FTS_PHYSICAL|FTS_NOCHDIR, NULL)) == NULL) {
-		pkg_emit_errno("fts_open", path);
+	if (pkg_repo_scan(path, &thd_data.files, &thd_data.num_files) != EPKG_OK) {
 		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
 
+	num_workers = get_workers_count();
+	if ((unsigned int)num_workers > thd_data.num_files)
+		num_workers = thd_data.num_files;
+
+	/* Must be done before the previous catalogue gets overwritten */
+	if (incremental)
+		index = pkg_repo_index_load(output_dir, filelist,
+		    &prev_manifests, &prev_manifests_len,
+		    &prev_files, &prev_files_len);
+
 	snprintf(repodb, sizeof(repodb), "%s/%s", output_dir,
 	    repo_packagesite_file);
 	if ((psyml = fopen(repodb, "w")) == NULL) {
@@ -337,49 +653,46 @@ pkg_create_repo(char *path, const char *output_dir, bool filelist,
 	}
 
 	thd_data.root_path = path;
-	thd_data.max_results = num_workers;
-	thd_data.num_results = 0;
-	thd_data.stop = false;
-	thd_data.fts = fts;
 	thd_data.read_files = filelist;
-	pthread_mutex_init(&thd_data.fts_m, NULL);
-	thd_data.results = NULL;
-	thd_data.thd_finished = 0;
-	pthread_mutex_init(&thd_data.results_m, NULL);
-	pthread_cond_init(&thd_data.has_result, NULL);
-	pthread_cond_init(&thd_data.has_room, NULL);
+	thd_data.index = index;
+	thd_data.next_file = 0;
+	thd_data.ring_size = 4 * (num_workers > 0 ? num_workers : 1);
+	thd_data.ring = calloc(thd_data.ring_size, sizeof(struct pkg_result *));
+	if (thd_data.ring == NULL) {
+		pkg_emit_errno("calloc", "pkg_result ring");
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+	thd_data.ring_head = thd_data.ring_count = 0;
+	pthread_mutex_init(&thd_data.ring_m, NULL);
+	pthread_cond_init(&thd_data.ring_room, NULL);
+	pthread_cond_init(&thd_data.ring_filled, NULL);
 
 	/* Launch workers */
 	tids = calloc(num_workers, sizeof(pthread_t));
-	for (int i = 0; i < num_workers; i++) {
-		pthread_create(&tids[i], NULL, (void *)&pkg_read_pkg_file, &thd_data);
+	if (tids == NULL && num_workers > 0) {
+		pkg_emit_errno("calloc", "pthread_t");
+		retcode = EPKG_FATAL;
+		goto cleanup;
 	}
-
-	for (;;) {
-		struct pkg_result *r;
-		const char *origin;
-
-		long manifest_pos, files_pos, manifest_length;
-
-		pthread_mutex_lock(&thd_data.results_m);
-		while ((r = thd_data.results) == NULL) {
-			if (thd_data.thd_finished == num_workers) {
-				break;
-			}
-			pthread_cond_wait(&thd_data.has_result, &thd_data.results_m);
-		}
-		if (r != NULL) {
-			DL_DELETE(thd_data.results, thd_data.results);
-			thd_data.num_results--;
-			pthread_cond_signal(&thd_data.has_room);
-		}
-		pthread_mutex_unlock(&thd_data.results_m);
-		if (r == NULL) {
+	for (nworkers = 0; nworkers < num_workers; nworkers++) {
+		if ((err = pthread_create(&tids[nworkers], NULL,
+		    (void *)&pkg_read_pkg_file, &thd_data)) != 0)
 			break;
-		}
+	}
+	if (nworkers == 0 && thd_data.num_files > 0) {
+		errno = err;
+		pkg_emit_errno("pthread_create", "pkg_read_pkg_file");
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	/* Every file of the scan yields exactly one result */
+	for (unsigned int i = 0; i < thd_data.num_files; i++) {
+		r = pkg_repo_consume_result(&thd_data);
 
 		if (r->retcode != EPKG_OK) {
-			free(r);
+			pkg_result_free(r);
 			continue;
 		}
 
@@ -388,33 +701,60 @@ pkg_create_repo(char *path, const char *output_dir, bool filelist,
 		if (progress != NULL)
 			progress(r->pkg, data);
 
-		manifest_pos = ftell(psyml);
-		pkg_emit_manifest_file(r->pkg, psyml, PKG_MANIFEST_EMIT_COMPACT, &manifest_digest);
-		manifest_length = ftell(psyml) - manifest_pos;
+		/* Only the serialized form is needed from now on */
+		pkg_free(r->pkg);
+		r->pkg = NULL;
+
+		/*
+		 * Only the manifests have to be sorted, the file lists are
+		 * found through their offset and can go out right away.
+		 */
 		if (filelist) {
-			files_pos = ftell(fsyml);
-			pkg_emit_filelist(r->pkg, fsyml);
-		} else {
-			files_pos = 0;
+			r->files_pos = ftell(fsyml);
+			if (r->cached != NULL)
+				fwrite(prev_files + r->cached->files_pos, 1,
+				    r->cached->files_length, fsyml);
+			else {
+				fwrite(sbuf_data(r->files), 1,
+				    sbuf_len(r->files), fsyml);
+				sbuf_delete(r->files);
+				r->files = NULL;
+			}
+			r->files_length = ftell(fsyml) - r->files_pos;
 		}
+		DL_APPEND(done, r);
+	}
 
-		pkg_get(r->pkg, PKG_ORIGIN, &origin);
+	DL_SORT(done, pkg_result_sort_compare_func);
+
+	DL_FOREACH_SAFE(done, r, rtmp) {
+		cur_dig = calloc(1, sizeof (struct digest_list_entry));
+		cur_dig->manifest_pos = ftell(psyml);
+		if (r->cached != NULL) {
+			/* Copy the previous record as is */
+			fwrite(prev_manifests + r->cached->manifest_pos, 1,
+			    r->cached->manifest_length, psyml);
+		} else
+			fprintf(psyml, "%s\n", sbuf_data(r->manifest));
+		cur_dig->manifest_length = ftell(psyml) - cur_dig->manifest_pos;
+		if (filelist) {
+			cur_dig->files_pos = r->files_pos;
+			cur_dig->files_length = r->files_length;
+		}
 
-		cur_dig = malloc(sizeof (struct digest_list_entry));
-		cur_dig->origin = strdup(origin);
-		cur_dig->digest = manifest_digest;
-		cur_dig->manifest_pos = manifest_pos;
-		cur_dig->files_pos = files_pos;
-		cur_dig->manifest_length = manifest_length;
+		cur_dig->origin = r->origin;
+		cur_dig->digest = r->digest;
+		r->origin = r->digest = NULL;
+		cur_dig->path = strdup(r->path);
+		cur_dig->size = r->size;
+		cur_dig->mtime = r->mtime;
+		cur_dig->ino = r->ino;
 		DL_APPEND(dlist, cur_dig);
 
-		pkg_free(r->pkg);
-		free(r);
+		DL_DELETE(done, r);
+		pkg_result_free(r);
 	}
 
-	/* Now sort all digests */
-	DL_SORT(dlist, pkg_digest_sort_compare_func);
-
 	pkg_repo_write_conflicts(conflicts, fconflicts);
 cleanup:
 	HASH_ITER (hh, conflicts, curcb, tmpcb) {
@@ -426,30 +766,27 @@ cleanup:
 		HASH_DEL(conflicts, curcb);
 		free(curcb);
 	}
-	LL_FOREACH_SAFE(dlist, cur_dig, dtmp) {
+	LL_FOREACH(dlist, cur_dig) {
 		fprintf(mandigests, "%s:%s:%ld:%ld:%ld\n", cur_dig->origin,
 		    cur_dig->digest, cur_dig->manifest_pos, cur_dig->files_pos,
 		    cur_dig->manifest_length);
-		free(cur_dig->digest);
-		free(cur_dig->origin);
-		free(cur_dig);
 	}
 	if (tids != NULL) {
-		/* Cancel running threads */
-		if (retcode != EPKG_OK) {
-			pthread_mutex_lock(&thd_data.fts_m);
-			thd_data.stop = true;
-			pthread_mutex_unlock(&thd_data.fts_m);
-		}
 		/* Join on threads to release thread IDs */
-		for (int i = 0; i < num_workers; i++) {
+		for (int i = 0; i < nworkers; i++) {
 			pthread_join(tids[i], NULL);
 		}
 		free(tids);
 	}
-
-	if (fts != NULL)
-		fts_close(fts);
+	if (thd_data.ring != NULL) {
+		pthread_mutex_destroy(&thd_data.ring_m);
+		pthread_cond_destroy(&thd_data.ring_room);
+		pthread_cond_destroy(&thd_data.ring_filled);
+		free(thd_data.ring);
+	}
+	for (unsigned int i = 0; i < thd_data.num_files; i++)
+		free(thd_data.files[i].path);
+	free(thd_data.files);
 
 	if (fsyml != NULL)
 		fclose(fsyml);
@@ -463,6 +800,24 @@ cleanup:
 	if (mandigests != NULL)
 		fclose(mandigests);
 
+	/* Record what the next incremental run can reuse */
+	if (retcode == EPKG_OK)
+		pkg_repo_index_write(output_dir, filelist, dlist);
+
+	DL_FOREACH_SAFE(done, r, rtmp) {
+		DL_DELETE(done, r);
+		pkg_result_free(r);
+	}
+	LL_FOREACH_SAFE(dlist, cur_dig, dtmp) {
+		free(cur_dig->digest);
+		free(cur_dig->origin);
+		free(cur_dig->path);
+		free(cur_dig);
+	}
+	pkg_repo_index_free(index);
+	free(prev_manifests);
+	free(prev_files);
+
 	return (retcode);
 }
 
@@ -604,13 +959,398 @@ pkg_repo_pack_db(const char *name, const char *archive, char *path,
 	return (EPKG_OK);
 }
 
+/*
+ * Load the catalogue which has just been written into a repo database
+ * that clients can use as is instead of parsing the catalogue themselves
+ */
+static int
+pkg_repo_build_fulldb(const char *output_dir)
+{
+	char path[MAXPATHLEN];
+	FILE *fdigests = NULL;
+	char *manifests = NULL, *line = NULL, *p;
+	const char *origin, *digest, *offset, *length;
+	off_t len;
+	size_t linecap = 0;
+	long num_offset, num_length;
+	struct pkg_manifest_key *keys = NULL;
+	struct pkg *pkg = NULL;
+	sqlite3 *sqlite = NULL;
+	int rc;
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir,
+	    repo_packagesite_file);
+	if (file_to_buffer(path, &manifests, &len) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, repo_digests_file);
+	if ((fdigests = fopen(path, "r")) == NULL) {
+		pkg_emit_errno("fopen", path);
+		free(manifests);
+		return (EPKG_FATAL);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, repo_fulldb_file);
+	if ((rc = pkgdb_repo_open_bulk(path, &sqlite)) != EPKG_OK)
+		goto cleanup;
+	if ((rc = pkgdb_transaction_begin(sqlite, NULL)) != EPKG_OK)
+		goto cleanup;
+
+	pkg_manifest_keys_new(&keys);
+	while (getline(&line, &linecap, fdigests) > 0) {
+		p = line;
+		origin = strsep(&p, ":");
+		digest = strsep(&p, ":");
+		offset = strsep(&p, ":");
+		/* files offset */
+		strsep(&p, ":");
+		length = strsep(&p, ":");
+
+		if (origin == NULL || digest == NULL || offset == NULL ||
+		    length == NULL) {
+			pkg_emit_error("invalid digest file format");
+			rc = EPKG_FATAL;
+			break;
+		}
+		num_offset = strtol(offset, NULL, 10);
+		num_length = strtol(length, NULL, 10);
+		if (num_offset < 0 || num_length <= 0 ||
+		    num_offset + num_length > len) {
+			pkg_emit_error("invalid digest file format");
+			rc = EPKG_FATAL;
+			break;
+		}
+
+		if (pkg == NULL)
+			rc = pkg_new(&pkg, PKG_REMOTE);
+		else
+			pkg_reset(pkg, PKG_REMOTE);
+		if (rc == EPKG_OK)
+			rc = pkg_parse_manifest(pkg, manifests + num_offset,
+			    num_length, keys);
+		if (rc != EPKG_OK)
+			break;
+
+		pkg_set(pkg, PKG_DIGEST, digest);
+		if ((rc = pkgdb_repo_add_package(pkg, NULL, sqlite, true))
+		    != EPKG_OK)
+			break;
+	}
+
+	if (rc == EPKG_OK)
+		rc = pkgdb_repo_bulk_finish(sqlite);
+
+	if (pkgdb_repo_close(sqlite, rc == EPKG_OK) != EPKG_OK)
+		rc = EPKG_FATAL;
+
+cleanup:
+	pkgdb_repo_finalize_statements();
+	if (sqlite != NULL)
+		sqlite3_close(sqlite);
+	if (rc != EPKG_OK)
+		unlink(path);
+	if (pkg != NULL)
+		pkg_free(pkg);
+	pkg_manifest_keys_free(keys);
+	free(line);
+	free(manifests);
+	fclose(fdigests);
+
+	return (rc);
+}
+
+static int
+pkg_repo_write_meta(const char *output_dir, struct pkg_repo_meta *meta)
+{
+	char path[MAXPATHLEN];
+	ucl_object_t *obj;
+	unsigned char *str;
+	FILE *f;
+	int rc = EPKG_OK;
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, repo_meta_file);
+	if ((f = fopen(path, "w")) == NULL) {
+		pkg_emit_errno("fopen", path);
+		return (EPKG_FATAL);
+	}
+
+	obj = pkg_repo_meta_to_ucl(meta);
+	str = ucl_object_emit(obj, UCL_EMIT_CONFIG);
+	if (str == NULL || fputs((char *)str, f) == EOF)
+		rc = EPKG_FATAL;
+
+	free(str);
+	ucl_object_unref(obj);
+	if (fclose(f) != 0)
+		rc = EPKG_FATAL;
+
+	return (rc);
+}
+
+/*
+ * Read the revision and the chain identifier of the previously published
+ * meta, if it was written by pkg repo -D.
+ */
+static bool
+pkg_repo_read_prev_meta(const char *output_dir, int64_t *revision,
+    char **source)
+{
+	char path[MAXPATHLEN];
+	char *prev_meta = NULL;
+	size_t prev_meta_len;
+	struct ucl_parser *parser;
+	ucl_object_t *top = NULL;
+	const ucl_object_t *obj;
+
+	*revision = 0;
+	*source = NULL;
+
+	snprintf(path, sizeof(path), "%s/%s.txz", output_dir, repo_meta_archive);
+	if (pkg_repo_read_archive_file(path, repo_meta_file, &prev_meta,
+	    &prev_meta_len) == EPKG_OK) {
+		parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE);
+		if (ucl_parser_add_chunk(parser, prev_meta, prev_meta_len))
+			top = ucl_parser_get_object(parser);
+		ucl_parser_free(parser);
+	}
+	free(prev_meta);
+	if (top == NULL)
+		return (false);
+
+	obj = ucl_object_find_key(top, "revision");
+	if (obj != NULL && obj->type == UCL_INT)
+		*revision = ucl_object_toint(obj);
+	obj = ucl_object_find_key(top, "source_identifier");
+	if (obj != NULL && obj->type == UCL_STRING)
+		*source = strdup(ucl_object_tostring(obj));
+	ucl_object_unref(top);
+
+	return (*revision > 0);
+}
+
+/*
+ * A run without -D breaks the chain of revisions: the next delta could
+ * not be computed against what clients have. Remove the deltas and the
+ * meta announcing their revision, a later -D run starts a new chain.
+ */
+static int
+pkg_repo_remove_deltas(const char *output_dir)
+{
+	char path[MAXPATHLEN];
+	char *source;
+	int64_t revision;
+	struct dirent *dp;
+	DIR *d;
+	int rc = EPKG_OK;
+
+	if (pkg_repo_read_prev_meta(output_dir, &revision, &source)) {
+		snprintf(path, sizeof(path), "%s/%s.txz", output_dir,
+		    repo_meta_archive);
+		if (unlink(path) == -1 && errno != ENOENT) {
+			pkg_emit_errno("unlink", path);
+			rc = EPKG_FATAL;
+		}
+	}
+	free(source);
+
+	if ((d = opendir(output_dir)) == NULL) {
+		pkg_emit_errno("opendir", output_dir);
+		return (EPKG_FATAL);
+	}
+	while ((dp = readdir(d)) != NULL) {
+		if (strncmp(dp->d_name, repo_delta_archive,
+		    sizeof(repo_delta_archive) - 1) != 0 ||
+		    dp->d_name[sizeof(repo_delta_archive) - 1] != '-')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", output_dir, dp->d_name);
+		if (unlink(path) == -1 && errno != ENOENT) {
+			pkg_emit_errno("unlink", path);
+			rc = EPKG_FATAL;
+		}
+	}
+	closedir(d);
+
+	return (rc);
+}
+
+struct pkg_repo_delta_entry {
+	char *origin;
+	char *digest;
+	bool seen; /* still in the catalogue */
+	UT_hash_handle hh;
+};
+
+/*
+ * Move meta to the revision following the one of the previously published
+ * meta and write the delta from that revision to packagesite-delta-<rev>:
+ * one line per package, either "-:origin" when it is gone or
+ * "+:origin:digest:manifest" when it is new or has changed. The removals
+ * come first so that they never undo an addition.
+ * Without a previous revision a new chain of revisions is started.
+ */
+static int
+pkg_repo_write_delta(const char *output_dir, struct pkg_repo_meta *meta)
+{
+	char path[MAXPATHLEN], delta[MAXPATHLEN];
+	char *prev_digests = NULL, *manifests = NULL;
+	char *line = NULL, *rec, *p;
+	const char *origin, *digest, *offset, *length;
+	size_t prev_digests_len, linecap = 0;
+	off_t len;
+	long num_offset, num_length;
+	struct pkg_repo_delta_entry *prev = NULL, *e, *etmp;
+	int64_t prev_revision = 0;
+	FILE *fdigests = NULL, *fdelta = NULL;
+	int rc = EPKG_OK;
+
+	pkg_repo_read_prev_meta(output_dir, &prev_revision,
+	    &meta->source_identifier);
+
+	if (meta->source_identifier == NULL || prev_revision <= 0) {
+		free(meta->source_identifier);
+		asprintf(&meta->source_identifier, "%jx.%jx",
+		    (uintmax_t)time(NULL), (uintmax_t)getpid());
+		prev_revision = 0;
+	}
+	meta->revision = prev_revision + 1;
+
+	if (prev_revision == 0)
+		return (EPKG_OK);
+
+	/* Deltas older than what clients would chain are of no use */
+	if (meta->revision > REPO_DELTA_MAX) {
+		snprintf(path, sizeof(path), "%s/%s-%jd.txz", output_dir,
+		    repo_delta_archive,
+		    (intmax_t)(meta->revision - REPO_DELTA_MAX));
+		unlink(path);
+	}
+
+	/* Without the previous digests clients will use the full catalogue */
+	snprintf(path, sizeof(path), "%s/%s.txz", output_dir,
+	    repo_digests_archive);
+	if (pkg_repo_read_archive_file(path, repo_digests_file, &prev_digests,
+	    &prev_digests_len) != EPKG_OK)
+		return (EPKG_OK);
+
+	p = prev_digests;
+	while ((rec = strsep(&p, "\n")) != NULL) {
+		origin = strsep(&rec, ":");
+		digest = strsep(&rec, ":");
+		if (digest == NULL)
+			continue;
+		/* Several packages may share an origin, keep the first one */
+		HASH_FIND_STR(prev, origin, e);
+		if (e != NULL)
+			continue;
+		if ((e = calloc(1, sizeof(*e))) == NULL) {
+			pkg_emit_errno("calloc", "pkg_repo_delta_entry");
+			rc = EPKG_FATAL;
+			goto cleanup;
+		}
+		e->origin = (char *)origin;
+		e->digest = (char *)digest;
+		HASH_ADD_KEYPTR(hh, prev, e->origin, strlen(e->origin), e);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir,
+	    repo_packagesite_file);
+	if (file_to_buffer(path, &manifests, &len) != EPKG_OK) {
+		rc = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", output_dir, repo_digests_file);
+	if ((fdigests = fopen(path, "r")) == NULL) {
+		pkg_emit_errno("fopen", path);
+		rc = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	snprintf(delta, sizeof(delta), "%s/%s-%jd", output_dir,
+	    repo_delta_archive, (intmax_t)meta->revision);
+	if ((fdelta = fopen(delta, "w")) == NULL) {
+		pkg_emit_errno("fopen", delta);
+		rc = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	while (getline(&line, &linecap, fdigests) > 0) {
+		p = line;
+		origin = strsep(&p, ":");
+		HASH_FIND_STR(prev, origin, e);
+		if (e != NULL)
+			e->seen = true;
+	}
+	HASH_ITER(hh, prev, e, etmp) {
+		if (!e->seen)
+			fprintf(fdelta, "-:%s\n", e->origin);
+	}
+
+	rewind(fdigests);
+	while (getline(&line, &linecap, fdigests) > 0) {
+		p = line;
+		origin = strsep(&p, ":");
+		digest = strsep(&p, ":");
+		offset = strsep(&p, ":");
+		/* files offset */
+		strsep(&p, ":");
+		length = strsep(&p, ":");
+
+		if (origin == NULL || digest == NULL || offset == NULL ||
+		    length == NULL) {
+			pkg_emit_error("invalid digest file format");
+			rc = EPKG_FATAL;
+			goto cleanup;
+		}
+		num_offset = strtol(offset, NULL, 10);
+		num_length = strtol(length, NULL, 10);
+		if (num_offset < 0 || num_length <= 0 ||
+		    num_offset + num_length > len) {
+			pkg_emit_error("invalid digest file format");
+			rc = EPKG_FATAL;
+			goto cleanup;
+		}
+
+		HASH_FIND_STR(prev, origin, e);
+		if (e != NULL && strcmp(e->digest, digest) == 0)
+			continue;
+		/* The manifest record already ends with a newline */
+		fprintf(fdelta, "+:%s:%s:", origin, digest);
+		fwrite(manifests + num_offset, 1, num_length, fdelta);
+	}
+
+	if (ferror(fdelta))
+		rc = EPKG_FATAL;
+
+cleanup:
+	HASH_ITER(hh, prev, e, etmp) {
+		HASH_DEL(prev, e);
+		free(e);
+	}
+	if (fdelta != NULL) {
+		if (fclose(fdelta) != 0)
+			rc = EPKG_FATAL;
+		if (rc != EPKG_OK)
+			unlink(delta);
+	}
+	if (fdigests != NULL)
+		fclose(fdigests);
+	free(line);
+	free(manifests);
+	free(prev_digests);
+
+	return (rc);
+}
+
 int
 pkg_finish_repo(const char *output_dir, pem_password_cb *password_cb,
-    char **argv, int argc, bool filelist)
+    char **argv, int argc, bool filelist, bool fulldb, bool delta)
 {
 	char repo_path[MAXPATHLEN];
 	char repo_archive[MAXPATHLEN];
+	char delta_name[MAXPATHLEN];
 	struct rsa_key *rsa = NULL;
+	struct pkg_repo_meta *meta = NULL;
 	struct stat st;
 	int ret = EPKG_OK;
 
@@ -631,6 +1371,48 @@ pkg_finish_repo(const char *output_dir, pem_password_cb *password_cb,
 		argv++;
 	}
 
+	if (!delta && pkg_repo_remove_deltas(output_dir) != EPKG_OK) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	/* A database left by an earlier run would not match the catalogue */
+	if (!fulldb) {
+		snprintf(repo_archive, sizeof(repo_archive), "%s/%s.txz",
+		    output_dir, repo_fulldb_archive);
+		if (unlink(repo_archive) == -1 && errno != ENOENT) {
+			pkg_emit_errno("unlink", repo_archive);
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
+	/*
+	 * Needs the catalogue before it gets packed, and the previous
+	 * archives before they get overwritten
+	 */
+	if (fulldb || delta) {
+		if ((meta = pkg_repo_meta_default()) == NULL) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+		if (fulldb) {
+			meta->fulldb = strdup(repo_fulldb_file);
+			if (pkg_repo_build_fulldb(output_dir) != EPKG_OK) {
+				ret = EPKG_FATAL;
+				goto cleanup;
+			}
+		}
+		if (delta && pkg_repo_write_delta(output_dir, meta) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+		if (pkg_repo_write_meta(output_dir, meta) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
 	snprintf(repo_path, sizeof(repo_path), "%s/%s", output_dir,
 	    repo_packagesite_file);
 	snprintf(repo_archive, sizeof(repo_archive), "%s/%s", output_dir,
@@ -668,6 +1450,44 @@ pkg_finish_repo(const char *output_dir, pem_password_cb *password_cb,
 		goto cleanup;
 	}
 
+	if (fulldb) {
+		snprintf(repo_path, sizeof(repo_path), "%s/%s", output_dir,
+		    repo_fulldb_file);
+		snprintf(repo_archive, sizeof(repo_archive), "%s/%s",
+		    output_dir, repo_fulldb_archive);
+		if (pkg_repo_pack_db(repo_fulldb_file, repo_archive, repo_path, rsa, argv, argc) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
+	if (delta) {
+		snprintf(delta_name, sizeof(delta_name), "%s-%jd",
+		    repo_delta_archive, (intmax_t)meta->revision);
+		snprintf(repo_path, sizeof(repo_path), "%s/%s", output_dir,
+		    delta_name);
+		snprintf(repo_archive, sizeof(repo_archive), "%s/%s",
+		    output_dir, delta_name);
+		/* There is no delta for the first revision of a chain */
+		if (access(repo_path, F_OK) == 0 &&
+		    pkg_repo_pack_db(delta_name, repo_archive, repo_path, rsa, argv, argc) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
+	/* Last, so that clients never see a meta ahead of its files */
+	if (meta != NULL) {
+		snprintf(repo_path, sizeof(repo_path), "%s/%s", output_dir,
+		    repo_meta_file);
+		snprintf(repo_archive, sizeof(repo_archive), "%s/%s",
+		    output_dir, repo_meta_archive);
+		if (pkg_repo_pack_db(repo_meta_file, repo_archive, repo_path, rsa, argv, argc) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
 	/* Now we need to set the equal mtime for all archives in the repo */
 	snprintf(repo_archive, sizeof(repo_archive), "%s/%s.txz",
 	    output_dir, repo_db_archive);
@@ -693,11 +1513,22 @@ pkg_finish_repo(const char *output_dir, pem_password_cb *password_cb,
 			    "%s/%s.txz", output_dir, repo_filesite_archive);
 			utimes(repo_archive, ftimes);
 		}
+		if (fulldb) {
+			snprintf(repo_archive, sizeof(repo_archive),
+			    "%s/%s.txz", output_dir, repo_fulldb_archive);
+			utimes(repo_archive, ftimes);
+		}
+		if (meta != NULL) {
+			snprintf(repo_archive, sizeof(repo_archive),
+			    "%s/%s.txz", output_dir, repo_meta_archive);
+			utimes(repo_archive, ftimes);
+		}
 	}
 
 cleanup:
 	if (rsa)
 		rsa_free(rsa);
+	pkg_repo_meta_free(meta);
 
 	return (ret);
 }
@@ -208,6 +208,8 @@ pkg_repo_meta_parse(ucl_object_t *top, struct pkg_repo_meta **target, int versio
 			HASH_ADD_STR(meta->keys, name, cert);
 	}
 
+	*target = meta;
+
 	return (EPKG_OK);
 }
 
@@ -233,7 +235,7 @@ pkg_repo_meta_load(const char *file, struct pkg_repo_meta **target)
 	struct ucl_parser *parser;
 	ucl_object_t *top, *schema;
 	struct ucl_schema_error err;
-	int version;
+	int version, ret;
 
 	parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE);
 
@@ -272,7 +274,10 @@ pkg_repo_meta_load(const char *file, struct pkg_repo_meta **target)
 		return (EPKG_FATAL);
 	}
 
-	return (pkg_repo_meta_parse(top, target, version));
+	ret = pkg_repo_meta_parse(top, target, version);
+	ucl_object_unref(top);
+
+	return (ret);
 }
 
 struct pkg_repo_meta *
@@ -290,3 +295,43 @@ pkg_repo_meta_default(void)
 
 	return (meta);
 }
+
+#define META_EMIT_STRING(field) do {						\
+	if (meta->field != NULL)						\
+		ucl_object_insert_key(top,					\
+		    ucl_object_fromstring(meta->field), #field, 0, false);	\
+} while (0)
+
+ucl_object_t *
+pkg_repo_meta_to_ucl(struct pkg_repo_meta *meta)
+{
+	ucl_object_t *top;
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+
+	ucl_object_insert_key(top, ucl_object_fromint(1), "version", 0, false);
+	ucl_object_insert_key(top,
+	    ucl_object_fromstring(packing_format_to_string(meta->packing_format)),
+	    "packing_format", 0, false);
+
+	META_EMIT_STRING(maintainer);
+	META_EMIT_STRING(source);
+
+	META_EMIT_STRING(conflicts);
+	META_EMIT_STRING(digests);
+	META_EMIT_STRING(manifests);
+	META_EMIT_STRING(fulldb);
+
+	META_EMIT_STRING(source_identifier);
+
+	if (meta->revision != 0)
+		ucl_object_insert_key(top, ucl_object_fromint(meta->revision),
+		    "revision", 0, false);
+	if (meta->eol != 0)
+		ucl_object_insert_key(top, ucl_object_fromint(meta->eol),
+		    "eol", 0, false);
+
+	return (top);
+}
+
+#undef META_EMIT_STRING
@@ -36,7 +36,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -48,30 +51,27 @@
 #include "private/repodb.h"
 #include "private/pkg.h"
 
+/* A NULL value removes the key */
 static int
-pkg_repo_register(struct pkg_repo *repo, sqlite3 *sqlite)
+pkg_repo_set_repodata(sqlite3 *sqlite, const char *key, const char *value)
 {
 	sqlite3_stmt *stmt;
-	const char sql[] = ""
-	    "INSERT OR REPLACE INTO repodata (key, value) "
-	    "VALUES (\"packagesite\", ?1);";
+	const char *sql;
 
-	/* register the packagesite */
-	if (sql_exec(sqlite, "CREATE TABLE IF NOT EXISTS repodata ("
-			"   key TEXT UNIQUE NOT NULL,"
-			"   value TEXT NOT NULL"
-			");") != EPKG_OK) {
-		pkg_emit_error("Unable to register the packagesite in the "
-				"database");
-		return (EPKG_FATAL);
-	}
+	if (value != NULL)
+		sql = "INSERT OR REPLACE INTO repodata (key, value) "
+		    "VALUES (?1, ?2);";
+	else
+		sql = "DELETE FROM repodata WHERE key = ?1;";
 
 	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
 		ERROR_SQLITE(sqlite, sql);
 		return (EPKG_FATAL);
 	}
 
-	sqlite3_bind_text(stmt, 1, pkg_repo_url(repo), -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+	if (value != NULL)
+		sqlite3_bind_text(stmt, 2, value, -1, SQLITE_STATIC);
 
 	if (sqlite3_step(stmt) != SQLITE_DONE) {
 		ERROR_SQLITE(sqlite, sql);
@@ -84,11 +84,70 @@ pkg_repo_register(struct pkg_repo *repo, sqlite3 *sqlite)
 	return (EPKG_OK);
 }
 
+static char *
+pkg_repo_get_repodata(sqlite3 *sqlite, const char *key)
+{
+	sqlite3_stmt *stmt;
+	char *value = NULL;
+	const char sql[] = "SELECT value FROM repodata WHERE key = ?1;";
+
+	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK)
+		return (NULL);
+
+	sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		value = strdup((const char *)sqlite3_column_text(stmt, 0));
+
+	sqlite3_finalize(stmt);
+
+	return (value);
+}
+
+/*
+ * Record the packagesite along with the revision of the catalogue the
+ * database now matches, which is where the next update starts from
+ */
 static int
-pkg_repo_add_from_manifest(char *buf, const char *origin, const char *digest,
-		long offset, sqlite3 *sqlite,
-		struct pkg_manifest_key **keys, struct pkg **p, bool is_legacy,
-		struct pkg_repo *repo)
+pkg_repo_register(struct pkg_repo *repo, sqlite3 *sqlite)
+{
+	char revision[32];
+	const char *rev = NULL;
+
+	/* register the packagesite */
+	if (sql_exec(sqlite, "CREATE TABLE IF NOT EXISTS repodata ("
+			"   key TEXT UNIQUE NOT NULL,"
+			"   value TEXT NOT NULL"
+			");") != EPKG_OK) {
+		pkg_emit_error("Unable to register the packagesite in the "
+				"database");
+		return (EPKG_FATAL);
+	}
+
+	if (pkg_repo_set_repodata(sqlite, "packagesite",
+	    pkg_repo_url(repo)) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (repo->meta->revision > 0 && repo->meta->source_identifier != NULL) {
+		snprintf(revision, sizeof(revision), "%jd",
+		    (intmax_t)repo->meta->revision);
+		rev = revision;
+	}
+	if (pkg_repo_set_repodata(sqlite, "revision", rev) != EPKG_OK ||
+	    pkg_repo_set_repodata(sqlite, "source_identifier",
+	    rev != NULL ? repo->meta->source_identifier : NULL) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Turn one manifest of the catalogue into a package ready to be inserted.
+ * This does not touch the database and may run concurrently.
+ */
+static int
+pkg_repo_parse_from_manifest(char *buf, const char *origin, const char *digest,
+		long offset, struct pkg_manifest_key *keys, struct pkg **p,
+		bool is_legacy, struct pkg_repo *repo)
 {
 	int rc = EPKG_OK;
 	struct pkg *pkg;
@@ -104,8 +163,7 @@ pkg_repo_add_from_manifest(char *buf, const char *origin, const char *digest,
 
 	pkg = *p;
 
-	pkg_manifest_keys_new(keys);
-	rc = pkg_parse_manifest(pkg, buf, offset, *keys);
+	rc = pkg_parse_manifest(pkg, buf, offset, keys);
 	if (rc != EPKG_OK) {
 		goto cleanup;
 	}
@@ -137,8 +195,6 @@ pkg_repo_add_from_manifest(char *buf, const char *origin, const char *digest,
 		pkg_set(pkg, PKG_DIGEST, digest);
 	}
 
-	rc = pkgdb_repo_add_package(pkg, NULL, sqlite, true);
-
 cleanup:
 	return (rc);
 }
@@ -152,6 +208,192 @@ struct pkg_increment_task_item {
 	UT_hash_handle hh;
 };
 
+/*
+ * Catalogue entries are parsed by a pool of threads while the calling
+ * thread, the only one touching the database, inserts them in order.
+ * At most `window' parsed packages wait for the writer at any time.
+ * The messages of a worker are held with its package, the writer emits
+ * them when it reaches that package.
+ */
+struct pkg_repo_parsed {
+	struct pkg *pkg;
+	struct pkg_event_held *events;
+	int rc;
+	bool done;
+};
+
+struct pkg_repo_parse_data {
+	struct pkg_increment_task_item **items;
+	struct pkg_repo_parsed *parsed;
+	unsigned int nitems;
+	unsigned int next;
+	unsigned int written;
+	unsigned int window;
+	bool stop;
+	char *map;
+	size_t len;
+	bool legacy;
+	struct pkg_repo *repo;
+
+	/* `m' protects `next', `written', `stop' and every `parsed[].done' */
+	pthread_mutex_t m;
+	pthread_cond_t has_result;
+	pthread_cond_t has_room;
+};
+
+static void
+pkg_repo_parse_item(struct pkg_repo_parse_data *d, unsigned int idx,
+    struct pkg_manifest_key *keys)
+{
+	struct pkg_increment_task_item *item = d->items[idx];
+	struct pkg_event_held *events = NULL;
+	struct pkg *pkg = NULL;
+	long length;
+	int rc;
+
+	length = item->length != 0 ? item->length :
+	    (long)d->len - item->offset;
+	pkg_emit_hold(&events);
+	rc = pkg_repo_parse_from_manifest(d->map + item->offset,
+	    item->origin, item->digest, length, keys, &pkg, d->legacy,
+	    d->repo);
+	pkg_emit_hold(NULL);
+
+	pthread_mutex_lock(&d->m);
+	d->parsed[idx].pkg = pkg;
+	d->parsed[idx].events = events;
+	d->parsed[idx].rc = rc;
+	d->parsed[idx].done = true;
+	pthread_cond_signal(&d->has_result);
+	pthread_mutex_unlock(&d->m);
+}
+
+static void *
+pkg_repo_parse_worker(void *data)
+{
+	struct pkg_repo_parse_data *d = data;
+	struct pkg_manifest_key *keys = NULL;
+	unsigned int idx;
+
+	pkg_manifest_keys_new(&keys);
+
+	for (;;) {
+		pthread_mutex_lock(&d->m);
+		while (!d->stop && d->next < d->nitems &&
+		    d->next >= d->written + d->window)
+			pthread_cond_wait(&d->has_room, &d->m);
+		if (d->stop || d->next >= d->nitems) {
+			pthread_mutex_unlock(&d->m);
+			break;
+		}
+		idx = d->next++;
+		pthread_mutex_unlock(&d->m);
+
+		pkg_repo_parse_item(d, idx, keys);
+	}
+
+	pkg_manifest_keys_free(keys);
+
+	return (NULL);
+}
+
+static int
+pkg_repo_add_parsed(struct pkg_increment_task_item *ladd, char *map,
+		size_t len, sqlite3 *sqlite, bool legacy, struct pkg_repo *repo)
+{
+	struct pkg_repo_parse_data d;
+	struct pkg_increment_task_item *item, *tmp_item;
+	struct pkg_manifest_key *keys = NULL;
+	pthread_t *tids;
+	unsigned int i, n;
+	int num_workers, nworkers, rc = EPKG_OK;
+
+	memset(&d, 0, sizeof(d));
+	d.nitems = HASH_COUNT(ladd);
+	if (d.nitems == 0)
+		return (EPKG_OK);
+
+	d.items = calloc(d.nitems, sizeof(*d.items));
+	d.parsed = calloc(d.nitems, sizeof(*d.parsed));
+	num_workers = get_workers_count();
+	tids = calloc(num_workers, sizeof(pthread_t));
+	if (d.items == NULL || d.parsed == NULL || tids == NULL) {
+		pkg_emit_errno("calloc", "pkg_repo_parse_data");
+		free(d.items);
+		free(d.parsed);
+		free(tids);
+		return (EPKG_FATAL);
+	}
+
+	n = 0;
+	HASH_ITER(hh, ladd, item, tmp_item)
+		d.items[n++] = item;
+
+	d.window = num_workers * 16;
+	d.map = map;
+	d.len = len;
+	d.legacy = legacy;
+	d.repo = repo;
+	pthread_mutex_init(&d.m, NULL);
+	pthread_cond_init(&d.has_result, NULL);
+	pthread_cond_init(&d.has_room, NULL);
+
+	for (nworkers = 0; nworkers < num_workers; nworkers++) {
+		if (pthread_create(&tids[nworkers], NULL,
+		    pkg_repo_parse_worker, &d) != 0)
+			break;
+	}
+	/* Without any worker every entry is parsed right before its insert */
+	if (nworkers == 0)
+		pkg_manifest_keys_new(&keys);
+
+	pkg_emit_progress_start("Adding new entries");
+	for (i = 0; i < d.nitems && rc == EPKG_OK; i++) {
+		if (nworkers == 0)
+			pkg_repo_parse_item(&d, i, keys);
+		pthread_mutex_lock(&d.m);
+		while (!d.parsed[i].done)
+			pthread_cond_wait(&d.has_result, &d.m);
+		pthread_mutex_unlock(&d.m);
+
+		pkg_emit_held(d.parsed[i].events);
+		d.parsed[i].events = NULL;
+		pkg_emit_progress_tick(i + 1, d.nitems);
+		rc = d.parsed[i].rc;
+		if (rc == EPKG_OK)
+			rc = pkgdb_repo_add_package(d.parsed[i].pkg, NULL,
+			    sqlite, true);
+		pkg_free(d.parsed[i].pkg);
+		d.parsed[i].pkg = NULL;
+
+		pthread_mutex_lock(&d.m);
+		d.written = i + 1;
+		if (rc != EPKG_OK)
+			d.stop = true;
+		pthread_cond_broadcast(&d.has_room);
+		pthread_mutex_unlock(&d.m);
+	}
+
+	for (int t = 0; t < nworkers; t++)
+		pthread_join(tids[t], NULL);
+	pkg_manifest_keys_free(keys);
+
+	/* Whatever was parsed after a failure is not needed */
+	for (; i < d.nitems; i++) {
+		pkg_free(d.parsed[i].pkg);
+		pkg_emit_held_free(d.parsed[i].events);
+	}
+
+	pthread_mutex_destroy(&d.m);
+	pthread_cond_destroy(&d.has_result);
+	pthread_cond_destroy(&d.has_room);
+	free(tids);
+	free(d.items);
+	free(d.parsed);
+
+	return (rc);
+}
+
 static void
 pkg_repo_update_increment_item_new(struct pkg_increment_task_item **head, const char *origin,
 		const char *digest, long offset, long length)
@@ -216,23 +458,20 @@ pkg_repo_update_incremental(const char *name, struct pkg_repo *repo, time_t *mti
 	const char *origin, *digest, *offset, *length;
 	struct pkgdb_it *it = NULL;
 	char *linebuf = NULL, *p;
-	int updated = 0, removed = 0, added = 0, processed = 0, pushed = 0;
+	int updated = 0, removed = 0, added = 0, processed = 0;
 	long num_offset, num_length;
 	time_t local_t = *mtime;
 	time_t digest_t;
 	time_t packagesite_t;
 	struct pkg_increment_task_item *ldel = NULL, *ladd = NULL,
 			*item, *tmp_item;
-	struct pkg_manifest_key *keys = NULL;
 	size_t linecap = 0;
 	ssize_t linelen;
 	char *map = MAP_FAILED;
 	size_t len = 0;
 	int hash_it = 0;
-	bool in_trans = false, new_repo = true, legacy_repo = false, reuse_repo;
-
-	if (access(name, R_OK) != -1)
-		new_repo = false;
+	char bulkname[MAXPATHLEN];
+	bool in_trans = false, legacy_repo = false, reuse_repo;
 
 	pkg_debug(1, "Pkgrepo, begin incremental update of '%s'", name);
 	if ((rc = pkgdb_repo_open(name, false, &sqlite, &reuse_repo)) != EPKG_OK) {
@@ -240,50 +479,41 @@ pkg_repo_update_incremental(const char *name, struct pkg_repo *repo, time_t *mti
 	}
 
 	if (!reuse_repo) {
+		/*
+		 * The whole catalogue is loaded into a temporary database
+		 * which is renamed into place once complete.
+		 */
 		pkg_debug(1, "Pkgrepo, need to re-create database '%s'", name);
 		local_t = 0;
 		*mtime = 0;
-	}
-
-	if ((rc = pkgdb_repo_init(sqlite)) != EPKG_OK) {
+		if (snprintf(bulkname, sizeof(bulkname), "%s.new", name) >=
+		    (int)sizeof(bulkname)) {
+			/* the cleanup would unlink the truncated path */
+			pkg_emit_error("%s: path too long", name);
+			return (EPKG_FATAL);
+		}
+		if ((rc = pkgdb_repo_open_bulk(bulkname, &sqlite)) != EPKG_OK)
+			goto cleanup;
+	} else if ((rc = pkgdb_repo_init(sqlite)) != EPKG_OK) {
 		goto cleanup;
 	}
 
-	if ((rc = pkg_repo_register(repo, sqlite)) != EPKG_OK)
-		goto cleanup;
-
 	it = pkgdb_repo_origins(sqlite);
 	if (it == NULL) {
 		rc = EPKG_FATAL;
 		goto cleanup;
 	}
 
-	if (pkg_repo_fetch_meta(repo, NULL) == EPKG_FATAL)
-		pkg_emit_notice("repository %s has no meta file, using "
-		    "default settings", repo->name);
-
 	fdigests = pkg_repo_fetch_remote_extract_tmp(repo,
 			repo->meta->digests, &local_t, &rc);
-	if (fdigests == NULL) {
-		if (rc == EPKG_FATAL)
-			/* Destroy repo completely */
-			if (new_repo)
-				unlink(name);
-
+	if (fdigests == NULL)
 		goto cleanup;
-	}
 	digest_t = local_t;
 	local_t = *mtime;
 	fmanifest = pkg_repo_fetch_remote_extract_tmp(repo,
 			repo->meta->manifests, &local_t, &rc);
-	if (fmanifest == NULL) {
-		if (rc == EPKG_FATAL)
-			/* Destroy repo completely */
-			if (new_repo)
-				unlink(name);
-
+	if (fmanifest == NULL)
 		goto cleanup;
-	}
 	packagesite_t = digest_t;
 	*mtime = packagesite_t > digest_t ? packagesite_t : digest_t;
 	/*fconflicts = repo_fetch_remote_extract_tmp(repo,
@@ -417,31 +647,23 @@ pkg_repo_update_incremental(const char *name, struct pkg_repo *repo, time_t *mti
 		goto cleanup;
 	}
 
-	hash_it = 0;
-	pushed = HASH_COUNT(ladd);
-	pkg_emit_progress_start("Adding new entries");
+	if (rc == EPKG_OK)
+		rc = pkg_repo_add_parsed(ladd, map, len, sqlite, legacy_repo,
+		    repo);
 	HASH_ITER(hh, ladd, item, tmp_item) {
-		pkg_emit_progress_tick(++hash_it, pushed);
-		if (rc == EPKG_OK) {
-			if (item->length != 0) {
-				rc = pkg_repo_add_from_manifest(map + item->offset, item->origin,
-				    item->digest, item->length, sqlite, &keys, &pkg, legacy_repo,
-				    repo);
-			}
-			else {
-				rc = pkg_repo_add_from_manifest(map + item->offset, item->origin,
-				    item->digest, len - item->offset, sqlite, &keys, &pkg,
-				    legacy_repo, repo);
-			}
-		}
 		free(item->origin);
 		free(item->digest);
 		HASH_DEL(ladd, item);
 		free(item);
 	}
-	pkg_manifest_keys_free(keys);
 	pkg_emit_incremental_update(updated, removed, added, processed);
 
+	if (rc == EPKG_OK)
+		rc = pkg_repo_register(repo, sqlite);
+
+	if (rc == EPKG_OK && !reuse_repo)
+		rc = pkgdb_repo_bulk_finish(sqlite);
+
 cleanup:
 
 	if (in_trans) {
@@ -473,6 +695,214 @@ cleanup:
 
 	sqlite3_close(sqlite);
 
+	if (!reuse_repo) {
+		if (rc == EPKG_OK && rename(bulkname, name) == -1) {
+			pkg_emit_errno("rename", name);
+			rc = EPKG_FATAL;
+		}
+		/* Destroy repo completely */
+		if (rc != EPKG_OK)
+			unlink(bulkname);
+	}
+
+	return (rc);
+}
+
+/*
+ * Bring the repo database up to the revision of the remote catalogue by
+ * applying the deltas published since its own revision.  Anything else
+ * than EPKG_OK or EPKG_UPTODATE means the deltas cannot be used.
+ */
+static int
+pkg_repo_update_delta(const char *name, struct pkg_repo *repo)
+{
+	sqlite3 *sqlite = NULL;
+	struct pkg_manifest_key *keys = NULL;
+	struct pkg *pkg = NULL;
+	FILE *fdelta;
+	char delta[MAXPATHLEN];
+	char *source = NULL, *revision = NULL, *line = NULL, *p;
+	const char *op, *origin, *digest;
+	size_t linecap = 0;
+	ssize_t linelen;
+	int64_t rev, local_rev;
+	time_t t;
+	bool reuse_repo, in_trans = false;
+	int rc = EPKG_END;
+
+	if (repo->meta->revision <= 0 || repo->meta->source_identifier == NULL)
+		return (EPKG_END);
+
+	if (pkgdb_repo_open(name, false, &sqlite, &reuse_repo) != EPKG_OK ||
+	    !reuse_repo)
+		goto cleanup;
+
+	source = pkg_repo_get_repodata(sqlite, "source_identifier");
+	revision = pkg_repo_get_repodata(sqlite, "revision");
+	if (source == NULL || revision == NULL ||
+	    strcmp(source, repo->meta->source_identifier) != 0)
+		goto cleanup;
+
+	local_rev = strtoll(revision, NULL, 10);
+	if (local_rev == repo->meta->revision) {
+		rc = EPKG_UPTODATE;
+		goto cleanup;
+	}
+	if (local_rev <= 0 || local_rev > repo->meta->revision ||
+	    repo->meta->revision - local_rev > REPO_DELTA_MAX)
+		goto cleanup;
+
+	pkg_debug(1, "Pkgrepo, applying deltas %jd to %jd for '%s'",
+	    (intmax_t)local_rev + 1, (intmax_t)repo->meta->revision, name);
+
+	if ((rc = pkgdb_repo_init(sqlite)) != EPKG_OK)
+		goto cleanup;
+
+	sql_exec(sqlite, "CREATE TABLE IF NOT EXISTS repo_update (x INTEGER);");
+
+	in_trans = true;
+	if ((rc = pkgdb_transaction_begin(sqlite, "REPO")) != EPKG_OK)
+		goto cleanup;
+
+	pkg_manifest_keys_new(&keys);
+	for (rev = local_rev + 1; rc == EPKG_OK && rev <= repo->meta->revision;
+	    rev++) {
+		snprintf(delta, sizeof(delta), "%s-%jd", repo_delta_archive,
+		    (intmax_t)rev);
+		t = 0;
+		fdelta = pkg_repo_fetch_remote_extract_tmp(repo, delta, &t, &rc);
+		if (fdelta == NULL) {
+			/* The chain is broken */
+			rc = EPKG_END;
+			break;
+		}
+
+		while ((linelen = getline(&line, &linecap, fdelta)) > 0) {
+			if (line[linelen - 1] == '\n')
+				line[--linelen] = '\0';
+			p = line;
+			op = strsep(&p, ":");
+			origin = strsep(&p, ":");
+			if (origin == NULL) {
+				rc = EPKG_FATAL;
+			} else if (strcmp(op, "-") == 0) {
+				rc = pkgdb_repo_remove_package(origin);
+			} else if (strcmp(op, "+") == 0 &&
+			    (digest = strsep(&p, ":")) != NULL && p != NULL) {
+				rc = pkg_repo_parse_from_manifest(p, origin,
+				    digest, linelen - (p - line), keys, &pkg,
+				    false, repo);
+				if (rc == EPKG_OK)
+					rc = pkgdb_repo_add_package(pkg, NULL,
+					    sqlite, true);
+			} else {
+				rc = EPKG_FATAL;
+			}
+			if (rc != EPKG_OK) {
+				pkg_emit_error("invalid delta %s", delta);
+				break;
+			}
+		}
+		fclose(fdelta);
+	}
+
+	if (rc == EPKG_OK)
+		rc = pkg_repo_register(repo, sqlite);
+
+cleanup:
+	if (in_trans) {
+		if (rc != EPKG_OK)
+			pkgdb_transaction_rollback(sqlite, "REPO");
+
+		if (pkgdb_transaction_commit(sqlite, "REPO") != EPKG_OK)
+			rc = EPKG_FATAL;
+	}
+
+	pkgdb_repo_finalize_statements();
+
+	if (rc == EPKG_OK)
+		sql_exec(sqlite, "DROP TABLE repo_update;");
+	if (sqlite != NULL)
+		sqlite3_close(sqlite);
+	if (pkg != NULL)
+		pkg_free(pkg);
+	pkg_manifest_keys_free(keys);
+	free(line);
+	free(source);
+	free(revision);
+
+	return (rc);
+}
+
+/*
+ * Replace the repo database by the one prebuilt by pkg repo, if the
+ * repository publishes one with the schema we know about.  Anything else
+ * than EPKG_OK means the catalogue has to be used.
+ */
+static int
+pkg_repo_update_fulldb(const char *name, struct pkg_repo *repo, time_t *mtime)
+{
+	char tmp[MAXPATHLEN];
+	sqlite3 *sqlite = NULL;
+	time_t local_t = *mtime;
+	int64_t reposcver;
+	int fd, rc;
+
+	if (repo->meta->fulldb == NULL)
+		return (EPKG_END);
+
+	if (snprintf(tmp, sizeof(tmp), "%s.new", name) >= (int)sizeof(tmp)) {
+		pkg_emit_error("%s: path too long", name);
+		return (EPKG_FATAL);
+	}
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) {
+		pkg_emit_errno("open", tmp);
+		return (EPKG_FATAL);
+	}
+
+	pkg_debug(1, "Pkgrepo, fetching prebuilt database for '%s'", name);
+	rc = pkg_repo_fetch_remote_extract_fd(repo, repo->meta->fulldb,
+	    &local_t, fd);
+	close(fd);
+	if (rc != EPKG_OK)
+		goto cleanup;
+
+	if (sqlite3_open(tmp, &sqlite) != SQLITE_OK) {
+		rc = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	if (get_pragma(sqlite, "PRAGMA user_version;", &reposcver,
+	    false) != EPKG_OK) {
+		rc = EPKG_FATAL;
+		goto cleanup;
+	}
+	if (reposcver != REPO_SCHEMA_VERSION) {
+		pkg_debug(1, "Pkgrepo, prebuilt database has schema %d, "
+		    "expected %d", (int)reposcver, REPO_SCHEMA_VERSION);
+		rc = EPKG_END;
+		goto cleanup;
+	}
+
+	if ((rc = pkg_repo_register(repo, sqlite)) != EPKG_OK)
+		goto cleanup;
+
+	sqlite3_close(sqlite);
+	sqlite = NULL;
+
+	if (rename(tmp, name) == -1) {
+		pkg_emit_errno("rename", name);
+		rc = EPKG_FATAL;
+		goto cleanup;
+	}
+	*mtime = local_t;
+
+cleanup:
+	if (sqlite != NULL)
+		sqlite3_close(sqlite);
+	if (rc != EPKG_OK)
+		unlink(tmp);
+
 	return (rc);
 }
 
@@ -569,6 +999,25 @@ pkg_repo_update_binary_pkgs(struct pkg_repo *repo, bool force)
 		}
 	}
 
+	if (pkg_repo_fetch_meta(repo, NULL) == EPKG_FATAL)
+		pkg_emit_notice("repository %s has no meta file, using "
+		    "default settings", repo->name);
+
+	/* Deltas need a database which was known to be usable */
+	if (t != 0) {
+		res = pkg_repo_update_delta(filepath, repo);
+		if (res == EPKG_OK || res == EPKG_UPTODATE)
+			goto cleanup;
+	}
+
+	/*
+	 * An up to date prebuilt database may still be older than the
+	 * catalogue, let the catalogue decide.
+	 */
+	res = pkg_repo_update_fulldb(filepath, repo, &t);
+	if (res == EPKG_OK)
+		goto cleanup;
+
 	res = pkg_repo_update_incremental(filepath, repo, &t);
 	if (res != EPKG_OK && res != EPKG_UPTODATE) {
 		pkg_emit_notice("Unable to find catalogs");
@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #define _WITH_GETLINE
 #include <stdio.h>
@@ -42,74 +43,73 @@
 #include "private/pkg.h"
 #include "private/pkgdb.h"
 
-struct pkg_solve_item;
+/*
+ * Variables are stored in a single array and identified by their index
+ * there.  A literal is 2 * var for the atom and 2 * var + 1 for its
+ * negation, a clause is a range of the literal arena.
+ */
+#define SOLVE_LIT(var, inverse)	(((unsigned int)(var) << 1) | ((inverse) ? 1 : 0))
+#define SOLVE_LIT_VAR(lit)	((lit) >> 1)
+#define SOLVE_LIT_NEG(lit)	((lit) ^ 1)
+#define SOLVE_LIT_INVERSE(lit)	((lit) & 1)
+
+#define PKG_SOLVE_VAR_ID(problem, var)	((unsigned int)((var) - (problem)->variables))
 
 struct pkg_solve_variable {
 	struct pkg_job_universe_item *unit;
 	bool to_install;
-	int guess;
+	bool resolved;
 	int priority;
 	const char *digest;
 	const char *uid;
-	bool resolved;
-	struct _pkg_solve_var_rule {
-		struct pkg_solve_item *rule;
-		struct _pkg_solve_var_rule *next;
-	} *rules;
-	int nrules;
 	UT_hash_handle hd;
 	UT_hash_handle ho;
 	struct pkg_solve_variable *next, *prev;
 };
 
-struct pkg_solve_item {
-	int nitems;
-	int nresolved;
-	struct pkg_solve_variable *var;
-	bool inverse;
-	struct pkg_solve_item *next;
-};
-
-struct pkg_solve_rule {
-	struct pkg_solve_item *items;
-	struct pkg_solve_rule *next;
+struct pkg_solve_clause {
+	size_t start;
+	unsigned int len;
+	bool learnt;
 };
 
 struct pkg_solve_problem {
 	struct pkg_jobs *j;
+	/* Number of clauses not learned by the solver */
 	unsigned int rules_count;
-	struct pkg_solve_rule *rules;
-	struct pkg_solve_variable *variables_by_uid;
-	struct pkg_solve_variable *variables_by_digest;
-};
+	/* Generation of the jobs the problem has been built for */
+	unsigned int generation;
 
-/*
- * Use XOR here to implement the following logic:
- * atom is true if it is installed and not inverted or
- * if it is not installed but inverted
- */
-#define PKG_SOLVE_CHECK_ITEM(item)				\
-	((item)->var->to_install ^ (item)->inverse)
+	struct pkg_solve_variable *variables;
+	unsigned int nvars;
+	unsigned int vars_cap;
 
-/**
- * Updates rules related to a single variable
- * @param var
- */
-static void
-pkg_solve_update_var_resolved (struct pkg_solve_variable *var)
-{
-	struct _pkg_solve_var_rule *rul;
+	unsigned int *lits;
+	size_t nlits;
+	size_t lits_cap;
+	struct pkg_solve_clause *clauses;
+	size_t nclauses;
+	size_t clauses_cap;
 
-	LL_FOREACH(var->rules, rul) {
-		rul->rule->nresolved ++;
-	}
-}
+	/* Rules of each variable, occ[occ_start[v]] .. occ[occ_start[v + 1] - 1] */
+	size_t *occ_start;
+	unsigned int *occ;
+
+	/* Rule being built */
+	size_t rule_start;
+	bool rule_tautology;
+
+	struct pkg_solve_variable *variables_by_uid;
+	struct pkg_solve_variable *variables_by_digest;
+};
 
 static void
-pkg_debug_print_rule (struct pkg_solve_item *rule)
+pkg_debug_print_rule (struct pkg_solve_problem *problem, size_t idx)
 {
-	struct pkg_solve_item *it;
+	struct pkg_solve_variable *var;
+	struct pkg_solve_clause *c;
 	struct sbuf *sb;
+	unsigned int i, lit;
 	int64_t expectlevel;
 
 	/* Avoid expensive printing if debug level is less than required */
@@ -122,19 +122,22 @@ pkg_debug_print_rule (struct pkg_solve_item *rule)
 
 	sbuf_printf(sb, "%s", "rule: (");
 
-	LL_FOREACH(rule, it) {
-		if (it->var->resolved) {
-			sbuf_printf(sb, "%s%s%s(%c)%s", it->inverse ? "!" : "",
-					it->var->uid,
-					(it->var->unit->pkg->type == PKG_INSTALLED) ? "(l)" : "(r)",
-					(it->var->to_install) ? '+' : '-',
-					it->next ? " | " : ")");
+	c = &problem->clauses[idx];
+	for (i = 0; i < c->len; i ++) {
+		lit = problem->lits[c->start + i];
+		var = &problem->variables[SOLVE_LIT_VAR(lit)];
+		if (var->resolved) {
+			sbuf_printf(sb, "%s%s%s(%c)%s", SOLVE_LIT_INVERSE(lit) ? "!" : "",
+					var->uid,
+					(var->unit->pkg->type == PKG_INSTALLED) ? "(l)" : "(r)",
+					(var->to_install) ? '+' : '-',
+					i + 1 < c->len ? " | " : ")");
 		}
 		else {
-			sbuf_printf(sb, "%s%s%s%s", it->inverse ? "!" : "",
-					it->var->uid,
-					(it->var->unit->pkg->type == PKG_INSTALLED) ? "(l)" : "(r)",
-					it->next ? " | " : ")");
+			sbuf_printf(sb, "%s%s%s%s", SOLVE_LIT_INVERSE(lit) ? "!" : "",
+					var->uid,
+					(var->unit->pkg->type == PKG_INSTALLED) ? "(l)" : "(r)",
+					i + 1 < c->len ? " | " : ")");
 		}
 	}
 	sbuf_finish(sb);
@@ -142,180 +145,184 @@ pkg_debug_print_rule (struct pkg_solve_item *rule)
 	sbuf_delete(sb);
 }
 
-/**
- * Propagate all units, must be called recursively
- * @param rules
- * @return true if there are units propagated
+static int
+pkg_solve_grow(void **ptr, size_t *cap, size_t need, size_t size)
+{
+	size_t ncap;
+	void *n;
+
+	if (need <= *cap)
+		return (EPKG_OK);
+
+	ncap = *cap ? *cap : 16;
+	while (ncap < need)
+		ncap *= 2;
+
+	n = realloc(*ptr, ncap * size);
+	if (n == NULL) {
+		pkg_emit_errno("realloc", "pkg_solve_grow");
+		return (EPKG_FATAL);
+	}
+	*ptr = n;
+	*cap = ncap;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Register literals lits[start] .. lits[start + len - 1] as a clause,
+ * returns its index or -1
  */
-static bool
-pkg_solve_propagate_units(struct pkg_solve_problem *problem, int *propagated)
+static int
+pkg_solve_clause_new(struct pkg_solve_problem *problem, size_t start,
+    unsigned int len, bool learnt)
 {
-	struct pkg_solve_item *it, *unresolved = NULL;
-	int solved_vars;
-	struct _pkg_solve_var_rule *rul;
-	struct pkg_solve_variable *var, *tvar;
-	bool ret;
+	struct pkg_solve_clause *c;
 
-	do {
-		solved_vars = 0;
-		HASH_ITER(hd, problem->variables_by_digest, var, tvar) {
-check_again:
-			/* Check for direct conflicts */
-			LL_FOREACH(var->rules, rul) {
-				unresolved = rul->rule;
-				if (unresolved->nresolved == unresolved->nitems) {
-					/* Check for direct conflict */
-					ret = false;
-					LL_FOREACH(unresolved, it) {
-						if (it->var->resolved) {
-							if (PKG_SOLVE_CHECK_ITEM(it)) {
-								ret = true;
-								break;
-							}
-						}
-					}
-					if (!ret) {
-						struct sbuf *err_msg = sbuf_new_auto();
-						sbuf_printf(err_msg, "cannot resolve conflict between ");
-						LL_FOREACH(unresolved, it) {
-							sbuf_printf(err_msg, "%s %s(want %s), ",
-									it->var->unit->pkg->type == PKG_INSTALLED ? "local" : "remote",
-											it->var->uid,
-											it->var->to_install ? "install" : "remove");
-						}
-						sbuf_finish(err_msg);
-						pkg_emit_error("%splease resolve it manually", sbuf_data(err_msg));
-						pkg_debug_print_rule(unresolved);
-						sbuf_delete(err_msg);
-						return (false);
-					}
-				}
-			}
-			LL_FOREACH(var->rules, rul) {
-				unresolved = rul->rule;
-				if (unresolved->nresolved == unresolved->nitems - 1) {
-					/* Check for unit */
-					ret = false;
-					LL_FOREACH(unresolved, it) {
-						if (it->var->resolved) {
-							if (PKG_SOLVE_CHECK_ITEM(it)) {
-								ret = true;
-								break;
-							}
-						}
-					}
-					if (!ret) {
-						/* This is a unit */
-						int resolved = 0;
-						LL_FOREACH(unresolved, it) {
-							if (!it->var->resolved) {
-								it->var->to_install = (!it->inverse);
-								it->var->resolved = true;
-								pkg_solve_update_var_resolved(it->var);
-								pkg_debug(2, "propagate %s-%s(%d) to %s",
-										it->var->uid, it->var->digest,
-										it->var->priority,
-										it->var->to_install ? "install" : "delete");
-								pkg_debug_print_rule(unresolved);
-								resolved ++;
-								break;
-							}
-						}
-						if (resolved == 0) {
-							pkg_debug_print_rule(unresolved);
-							assert (resolved > 0);
-						}
-						solved_vars ++;
-						(*propagated) ++;
-						/* We want to try propagating all clauses for a single variable */
-						goto check_again;
-					}
-				}
-			}
-		}
-	} while (solved_vars > 0);
+	if (pkg_solve_grow((void **)&problem->clauses, &problem->clauses_cap,
+	    problem->nclauses + 1, sizeof(*problem->clauses)) != EPKG_OK)
+		return (-1);
+
+	c = &problem->clauses[problem->nclauses];
+	c->start = start;
+	c->len = len;
+	c->learnt = learnt;
+	if (!learnt)
+		problem->rules_count ++;
 
-	return (true);
+	return (problem->nclauses ++);
 }
 
+/*
+ * Append a clause learned by the solver, returns its index or -1
+ */
+static int
+pkg_solve_clause_learn(struct pkg_solve_problem *problem,
+    const unsigned int *lits, unsigned int len)
+{
+	size_t start = problem->nlits;
 
-/**
- * Propagate pure clauses
+	if (pkg_solve_grow((void **)&problem->lits, &problem->lits_cap,
+	    problem->nlits + len, sizeof(*problem->lits)) != EPKG_OK)
+		return (-1);
+
+	memcpy(&problem->lits[start], lits, len * sizeof(*lits));
+	problem->nlits += len;
+
+	return (pkg_solve_clause_new(problem, start, len, true));
+}
+
+/*
+ * Rules are built literal by literal at the end of the arena
  */
-static bool
-pkg_solve_propagate_pure(struct pkg_solve_problem *problem)
+static void
+pkg_solve_rule_begin(struct pkg_solve_problem *problem)
 {
-	struct pkg_solve_variable *var, *tvar;
-	struct _pkg_solve_var_rule *rul;
-	struct pkg_solve_item *it;
-
-	HASH_ITER(hd, problem->variables_by_digest, var, tvar) {
-		if (var->nrules == 0) {
-			/* This variable is independent and should not change its state */
-			assert (var->rules == NULL);
-			var->to_install = (var->unit->pkg->type == PKG_INSTALLED);
-			var->resolved = true;
-			pkg_debug(2, "leave %s-%s(%d) to %s",
-					var->uid, var->digest,
-					var->priority, var->to_install ? "install" : "delete");
-		}
-		else {
-			LL_FOREACH(var->rules, rul) {
-				it = rul->rule;
-				if (it->nitems == 1 && it->nresolved == 0) {
-					it->var->to_install = (!it->inverse);
-					it->var->resolved = true;
-					pkg_debug(2, "requested %s-%s(%d) to %s",
-							it->var->uid, it->var->digest,
-							it->var->priority, it->var->to_install ? "install" : "delete");
-					pkg_solve_update_var_resolved(it->var);
-				}
-			}
-		}
+	problem->rule_start = problem->nlits;
+	problem->rule_tautology = false;
+}
+
+static int
+pkg_solve_rule_add(struct pkg_solve_problem *problem,
+    struct pkg_solve_variable *var, bool inverse)
+{
+	unsigned int lit;
+	size_t i;
+
+	lit = SOLVE_LIT(PKG_SOLVE_VAR_ID(problem, var), inverse);
+
+	/* Skip duplicates and drop rules that are always true */
+	for (i = problem->rule_start; i < problem->nlits; i ++) {
+		if (problem->lits[i] == SOLVE_LIT_NEG(lit))
+			problem->rule_tautology = true;
+		if (problem->lits[i] == lit || problem->rule_tautology)
+			return (EPKG_OK);
 	}
 
-	return (true);
+	if (pkg_solve_grow((void **)&problem->lits, &problem->lits_cap,
+	    problem->nlits + 1, sizeof(*problem->lits)) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	problem->lits[problem->nlits++] = lit;
+
+	return (EPKG_OK);
+}
+
+static void
+pkg_solve_rule_cancel(struct pkg_solve_problem *problem)
+{
+	problem->nlits = problem->rule_start;
 }
 
-/**
- * Test intermediate SAT guess
- * @param problem
- * @return true if guess is accepted
+static int
+pkg_solve_rule_end(struct pkg_solve_problem *problem, const char *desc)
+{
+	unsigned int len;
+	int idx;
+
+	len = problem->nlits - problem->rule_start;
+	if (problem->rule_tautology || len == 0) {
+		pkg_solve_rule_cancel(problem);
+		return (EPKG_OK);
+	}
+
+	idx = pkg_solve_clause_new(problem, problem->rule_start, len, false);
+	if (idx == -1) {
+		pkg_solve_rule_cancel(problem);
+		return (EPKG_FATAL);
+	}
+
+	pkg_debug(4, "solver: add %d-ary %s clause", len, desc);
+	pkg_debug_print_rule(problem, idx);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Build occurrence lists of rules once all of them are known
  */
-bool
-pkg_solve_test_guess(struct pkg_solve_problem *problem, struct pkg_solve_variable *var)
+static int
+pkg_solve_index_rules(struct pkg_solve_problem *problem)
 {
-	bool test = false;
-	struct _pkg_solve_var_rule *rul;
-	struct pkg_solve_item *it, *cur;
-
-	LL_FOREACH(var->rules, rul) {
-		it = rul->rule;
-		if (it->nitems != it->nresolved) {
-			/* Check guess */
-			test = false;
-			LL_FOREACH(it, cur) {
-				if (cur->var->resolved)
-					test |= cur->var->to_install ^ cur->inverse;
-				else if (cur->var->guess != -1)
-					test |= cur->var->guess ^ cur->inverse;
-				else {
-					/* Free variables are assumed as true */
-					test = true;
-					break;
-				}
-			}
-			if (!test) {
-				pkg_debug(2, "solver: guess test failed at variable %s, trying to %d",
-						var->uid, var->guess);
-				pkg_debug_print_rule(it);
-				return (false);
-			}
-		}
+	struct pkg_solve_clause *c;
+	size_t i, sum = 0;
+	unsigned int k, v;
+
+	free(problem->occ_start);
+	free(problem->occ);
+	problem->occ_start = calloc(problem->nvars + 1, sizeof(*problem->occ_start));
+	problem->occ = calloc(problem->nlits ? problem->nlits : 1,
+	    sizeof(*problem->occ));
+	if (problem->occ_start == NULL || problem->occ == NULL) {
+		pkg_emit_errno("calloc", "pkg_solve_index_rules");
+		return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < problem->nclauses; i ++) {
+		c = &problem->clauses[i];
+		if (c->learnt)
+			continue;
+		for (k = 0; k < c->len; k ++)
+			problem->occ_start[SOLVE_LIT_VAR(problem->lits[c->start + k])] ++;
 	}
+	/* Point each list to its end and fill it backwards */
+	for (v = 0; v < problem->nvars; v ++) {
+		sum += problem->occ_start[v];
+		problem->occ_start[v] = sum;
+	}
+	problem->occ_start[problem->nvars] = sum;
 
+	for (i = 0; i < problem->nclauses; i ++) {
+		c = &problem->clauses[i];
+		if (c->learnt)
+			continue;
+		for (k = 0; k < c->len; k ++) {
+			v = SOLVE_LIT_VAR(problem->lits[c->start + k]);
+			problem->occ[--problem->occ_start[v]] = i;
+		}
+	}
 
-	return (true);
+	return (EPKG_OK);
 }
 
 /*
@@ -347,213 +354,671 @@ pkg_solve_initial_guess(struct pkg_solve_problem *problem,
 	return (false);
 }
 
-/**
- * Try to solve sat problem
- * @param rules incoming rules to solve
- * @param nrules number of rules
- * @param nvars number of variables
- * @return
+/*
+ * CDCL engine
+ *
+ * Every clause of two or more literals watches its first two literals, so
+ * only the clauses watching a literal that has just become false are visited
+ * during propagation.  Learned clauses are appended to the problem.
  */
-bool
-pkg_solve_sat_problem(struct pkg_solve_problem *problem)
+
+#define SOLVE_UNDEF		-1
+#define SOLVE_NO_CONFLICT	-1
+#define SOLVE_FATAL		-2
+
+#define SOLVE_ACTIVITY_DECAY	0.95
+#define SOLVE_ACTIVITY_LIMIT	1e100
+
+struct pkg_solve_watch {
+	int *clauses;
+	size_t n;
+	size_t cap;
+};
+
+struct pkg_solve_cdcl {
+	struct pkg_solve_problem *problem;
+	unsigned int nvars;
+	struct pkg_solve_watch *watches;
+
+	/* Per variable state */
+	signed char *value;
+	bool *phase;
+	bool *seen;
+	int *level;
+	int *reason;
+	double *activity;
+
+	unsigned int *trail;
+	unsigned int ntrail;
+	unsigned int qhead;
+	unsigned int *trail_lim;
+	int nlevels;
+
+	/* Decision queue ordered by activity */
+	unsigned int *heap;
+	int *heap_pos;
+	unsigned int nheap;
+	double inc;
+
+	unsigned int *learnt;
+	int64_t decisions;
+	int64_t conflicts;
+};
+
+static inline int
+pkg_solve_cdcl_value(struct pkg_solve_cdcl *s, unsigned int lit)
 {
-	int propagated;
-	struct pkg_solve_variable *var, *tvar;
-	int64_t unresolved = 0, iters = 0;
-	bool rc, backtrack = false;
+	int val = s->value[SOLVE_LIT_VAR(lit)];
 
-	struct _solver_tree_elt {
-		struct pkg_solve_variable *var;
-		int guess;
-		struct _solver_tree_elt *prev, *next;
-	} *solver_tree = NULL, *elt;
+	if (val == SOLVE_UNDEF)
+		return (SOLVE_UNDEF);
 
+	return (val ^ (lit & 1));
+}
 
-	/* Obvious case */
-	if (problem->rules_count == 0)
-		return (true);
+static void
+pkg_solve_cdcl_assign(struct pkg_solve_cdcl *s, unsigned int lit, int reason)
+{
+	unsigned int v = SOLVE_LIT_VAR(lit);
 
-	/* Initially propagate explicit rules */
-	pkg_solve_propagate_pure(problem);
-	if (!pkg_solve_propagate_units(problem, &propagated)) {
-		pkg_emit_error("SAT: conflicting request, cannot solve");
-		return (false);
+	s->value[v] = !(lit & 1);
+	s->level[v] = s->nlevels;
+	s->reason[v] = reason;
+	s->trail[s->ntrail++] = lit;
+}
+
+static inline bool
+pkg_solve_cdcl_heap_less(struct pkg_solve_cdcl *s, unsigned int a,
+    unsigned int b)
+{
+	if (s->activity[a] != s->activity[b])
+		return (s->activity[a] > s->activity[b]);
+
+	/* Break ties by the order of variables to keep answers stable */
+	return (a < b);
+}
+
+static void
+pkg_solve_cdcl_heap_up(struct pkg_solve_cdcl *s, unsigned int i)
+{
+	unsigned int v = s->heap[i], parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!pkg_solve_cdcl_heap_less(s, v, s->heap[parent]))
+			break;
+		s->heap[i] = s->heap[parent];
+		s->heap_pos[s->heap[i]] = i;
+		i = parent;
 	}
+	s->heap[i] = v;
+	s->heap_pos[v] = i;
+}
 
-	/* Set initial guess */
-	elt = solver_tree;
+static void
+pkg_solve_cdcl_heap_down(struct pkg_solve_cdcl *s, unsigned int i)
+{
+	unsigned int v = s->heap[i], child;
 
-	/* DPLL Algorithm */
-	DL_FOREACH2(problem->variables_by_digest, var, hd.next) {
-		if (!var->resolved) {
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= s->nheap)
+			break;
+		if (child + 1 < s->nheap &&
+		    pkg_solve_cdcl_heap_less(s, s->heap[child + 1], s->heap[child]))
+			child ++;
+		if (!pkg_solve_cdcl_heap_less(s, s->heap[child], v))
+			break;
+		s->heap[i] = s->heap[child];
+		s->heap_pos[s->heap[i]] = i;
+		i = child;
+	}
+	s->heap[i] = v;
+	s->heap_pos[v] = i;
+}
 
-			if (backtrack) {
-				/* Shift var back */
-				var = tvar;
-				backtrack = false;
-			}
+static void
+pkg_solve_cdcl_heap_insert(struct pkg_solve_cdcl *s, unsigned int v)
+{
+	if (s->heap_pos[v] != -1)
+		return;
 
-			if (elt == NULL) {
-				/* Add new element to the backtracking queue */
-				elt = malloc (sizeof (*elt));
-				if (elt == NULL) {
-					pkg_emit_errno("malloc", "_solver_tree_elt");
-					LL_FREE(solver_tree, free);
-					return (false);
-				}
-				elt->var = var;
-				elt->guess = -1;
-				DL_APPEND(solver_tree, elt);
+	s->heap[s->nheap] = v;
+	s->heap_pos[v] = s->nheap;
+	s->nheap ++;
+	pkg_solve_cdcl_heap_up(s, s->nheap - 1);
+}
+
+static int
+pkg_solve_cdcl_heap_pop(struct pkg_solve_cdcl *s)
+{
+	unsigned int v;
+
+	if (s->nheap == 0)
+		return (-1);
+
+	v = s->heap[0];
+	s->heap_pos[v] = -1;
+	s->nheap --;
+	if (s->nheap > 0) {
+		s->heap[0] = s->heap[s->nheap];
+		s->heap_pos[s->heap[0]] = 0;
+		pkg_solve_cdcl_heap_down(s, 0);
+	}
+
+	return (v);
+}
+
+/*
+ * VSIDS: bump variables involved in a conflict, the increment grows after
+ * every conflict so that recent conflicts weigh more than old ones
+ */
+static void
+pkg_solve_cdcl_bump(struct pkg_solve_cdcl *s, unsigned int v)
+{
+	unsigned int i;
+
+	s->activity[v] += s->inc;
+	if (s->activity[v] > SOLVE_ACTIVITY_LIMIT) {
+		for (i = 0; i < s->nvars; i ++)
+			s->activity[i] *= 1 / SOLVE_ACTIVITY_LIMIT;
+		s->inc *= 1 / SOLVE_ACTIVITY_LIMIT;
+	}
+	if (s->heap_pos[v] != -1)
+		pkg_solve_cdcl_heap_up(s, s->heap_pos[v]);
+}
+
+static int
+pkg_solve_cdcl_watch(struct pkg_solve_cdcl *s, unsigned int lit, int clause)
+{
+	struct pkg_solve_watch *w = &s->watches[lit];
+
+	if (pkg_solve_grow((void **)&w->clauses, &w->cap, w->n + 1,
+	    sizeof(*w->clauses)) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	w->clauses[w->n++] = clause;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Watch the first two literals of a clause
+ */
+static int
+pkg_solve_cdcl_attach(struct pkg_solve_cdcl *s, int idx)
+{
+	struct pkg_solve_clause *c = &s->problem->clauses[idx];
+	unsigned int *lits = &s->problem->lits[c->start];
+
+	if (c->len < 2)
+		return (EPKG_OK);
+
+	if (pkg_solve_cdcl_watch(s, lits[0], idx) != EPKG_OK ||
+	    pkg_solve_cdcl_watch(s, lits[1], idx) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Propagate all assignments pending on the trail, returns the index of a
+ * conflicting clause, SOLVE_NO_CONFLICT or SOLVE_FATAL
+ */
+static int
+pkg_solve_cdcl_propagate(struct pkg_solve_cdcl *s)
+{
+	struct pkg_solve_problem *p = s->problem;
+	struct pkg_solve_watch *w;
+	unsigned int *c, false_lit, len, k;
+	size_t i, j;
+	int ci;
+	bool moved;
+
+	while (s->qhead < s->ntrail) {
+		false_lit = SOLVE_LIT_NEG(s->trail[s->qhead++]);
+		w = &s->watches[false_lit];
+
+		for (i = j = 0; i < w->n;) {
+			ci = w->clauses[i++];
+			c = &p->lits[p->clauses[ci].start];
+			len = p->clauses[ci].len;
+
+			/* Keep the false literal second */
+			if (c[0] == false_lit) {
+				c[0] = c[1];
+				c[1] = false_lit;
+			}
+			if (pkg_solve_cdcl_value(s, c[0]) == 1) {
+				w->clauses[j++] = ci;
+				continue;
 			}
-			assert (var == elt->var);
 
-			if (elt->guess == -1)
-				var->guess = pkg_solve_initial_guess(problem, var);
-			else
-				/* For analyzed variables we can only inverse previous guess */
-				var->guess = !elt->guess;
-
-			unresolved ++;
-			iters ++;
-			if (!pkg_solve_test_guess(problem, var)) {
-				if (elt->guess == -1) {
-					/* This is free variable, so we can assign true or false to it */
-					var->guess = !var->guess;
-					rc = pkg_solve_test_guess(problem, var);
-				}
-				else {
-					rc = false;
-				}
-				if (!rc) {
-					/* Need to backtrack */
-					iters ++;
-					if (elt == NULL || elt->prev->next == NULL) {
-						/* Cannot backtrack, UNSAT */
-						pkg_debug(1, "problem is UNSAT problem after %d guesses", iters);
-						LL_FREE(solver_tree, free);
-						return (false);
-					}
-					/* Set the current variable as free variable */
-					elt->guess = -1;
-					var->guess = -1;
-					/* Go to the previous level */
-					elt = elt->prev;
-					tvar = elt->var;
-					backtrack = true;
-					continue;
+			/* Look for another literal to watch */
+			moved = false;
+			for (k = 2; k < len; k ++) {
+				if (pkg_solve_cdcl_value(s, c[k]) != 0) {
+					c[1] = c[k];
+					c[k] = false_lit;
+					if (pkg_solve_cdcl_watch(s, c[1], ci) != EPKG_OK)
+						return (SOLVE_FATAL);
+					moved = true;
+					break;
 				}
 			}
+			if (moved)
+				continue;
 
-			/* Assign the current guess */
-			elt->guess = var->guess;
-			/* Move to the next elt */
-			elt = elt->next;
+			w->clauses[j++] = ci;
+			if (pkg_solve_cdcl_value(s, c[0]) == 0) {
+				/* Conflict, keep the rest of watches */
+				while (i < w->n)
+					w->clauses[j++] = w->clauses[i++];
+				w->n = j;
+				s->qhead = s->ntrail;
+				return (ci);
+			}
+			/* Unit */
+			pkg_solve_cdcl_assign(s, c[0], ci);
 		}
+		w->n = j;
 	}
 
-	pkg_debug(1, "solved SAT problem in %d guesses", iters);
+	return (SOLVE_NO_CONFLICT);
+}
 
-	HASH_ITER(hd, problem->variables_by_digest, var, tvar) {
-		if (!var->resolved) {
-			var->to_install = var->guess;
-			var->resolved = true;
+/*
+ * Derive a clause asserting the first unique implication point of the
+ * conflict, returns its length and stores the level to backjump to
+ */
+static unsigned int
+pkg_solve_cdcl_analyze(struct pkg_solve_cdcl *s, int confl, int *btlevel)
+{
+	struct pkg_solve_problem *p = s->problem;
+	unsigned int *c, lit = 0, nlearnt = 1, i, v, max;
+	int pathc = 0, idx = s->ntrail - 1;
+	bool first = true;
+
+	do {
+		c = &p->lits[p->clauses[confl].start];
+		/* The first literal of a reason clause is the implied one */
+		for (i = first ? 0 : 1; i < p->clauses[confl].len; i ++) {
+			v = SOLVE_LIT_VAR(c[i]);
+			if (s->seen[v] || s->level[v] == 0)
+				continue;
+			s->seen[v] = true;
+			pkg_solve_cdcl_bump(s, v);
+			if (s->level[v] >= s->nlevels)
+				pathc ++;
+			else
+				s->learnt[nlearnt++] = c[i];
 		}
+		first = false;
+
+		while (!s->seen[SOLVE_LIT_VAR(s->trail[idx])])
+			idx --;
+		lit = s->trail[idx--];
+		v = SOLVE_LIT_VAR(lit);
+		confl = s->reason[v];
+		s->seen[v] = false;
+		pathc --;
+	} while (pathc > 0);
+
+	s->learnt[0] = SOLVE_LIT_NEG(lit);
+
+	/* Watch the literal of the backjump level as the second one */
+	*btlevel = 0;
+	max = 1;
+	for (i = 1; i < nlearnt; i ++) {
+		v = SOLVE_LIT_VAR(s->learnt[i]);
+		s->seen[v] = false;
+		if (s->level[v] > *btlevel) {
+			*btlevel = s->level[v];
+			max = i;
+		}
+	}
+	if (nlearnt > 1) {
+		lit = s->learnt[1];
+		s->learnt[1] = s->learnt[max];
+		s->learnt[max] = lit;
+	}
+
+	return (nlearnt);
+}
+
+static void
+pkg_solve_cdcl_backjump(struct pkg_solve_cdcl *s, int level)
+{
+	unsigned int v;
+
+	if (s->nlevels <= level)
+		return;
+
+	while (s->ntrail > s->trail_lim[level]) {
+		v = SOLVE_LIT_VAR(s->trail[--s->ntrail]);
+		/* Remember the last polarity for the next decision */
+		s->phase[v] = s->value[v];
+		s->value[v] = SOLVE_UNDEF;
+		s->reason[v] = -1;
+		pkg_solve_cdcl_heap_insert(s, v);
+	}
+	s->qhead = s->ntrail;
+	s->nlevels = level;
+}
+
+static void
+pkg_solve_cdcl_report(struct pkg_solve_cdcl *s, int confl)
+{
+	struct pkg_solve_problem *p = s->problem;
+	struct pkg_solve_variable *var;
+	struct sbuf *err_msg;
+	unsigned int *c, i, v;
+
+	err_msg = sbuf_new_auto();
+	sbuf_printf(err_msg, "cannot resolve conflict between ");
+	c = &p->lits[p->clauses[confl].start];
+	for (i = 0; i < p->clauses[confl].len; i ++) {
+		v = SOLVE_LIT_VAR(c[i]);
+		var = &p->variables[v];
+		sbuf_printf(err_msg, "%s %s(want %s), ",
+				var->unit->pkg->type == PKG_INSTALLED ? "local" : "remote",
+				var->uid,
+				s->value[v] == 1 ? "install" : "remove");
 	}
+	sbuf_finish(err_msg);
+	pkg_emit_error("%splease resolve it manually", sbuf_data(err_msg));
+	sbuf_delete(err_msg);
+}
 
-	LL_FREE(solver_tree, free);
+static void
+pkg_solve_cdcl_free(struct pkg_solve_cdcl *s)
+{
+	unsigned int i;
 
-	return (true);
+	if (s->watches != NULL) {
+		for (i = 0; i < 2 * s->nvars; i ++)
+			free(s->watches[i].clauses);
+		free(s->watches);
+	}
+	free(s->value);
+	free(s->phase);
+	free(s->seen);
+	free(s->level);
+	free(s->reason);
+	free(s->activity);
+	free(s->trail);
+	free(s->trail_lim);
+	free(s->heap);
+	free(s->heap_pos);
+	free(s->learnt);
+}
+
+static int
+pkg_solve_cdcl_init(struct pkg_solve_cdcl *s, struct pkg_solve_problem *problem)
+{
+	unsigned int i, n;
+
+	memset(s, 0, sizeof(*s));
+	s->problem = problem;
+	s->inc = 1.0;
+	s->nvars = n = problem->nvars;
+
+	s->watches = calloc(2 * n, sizeof(*s->watches));
+	s->value = calloc(n, sizeof(*s->value));
+	s->phase = calloc(n, sizeof(*s->phase));
+	s->seen = calloc(n, sizeof(*s->seen));
+	s->level = calloc(n, sizeof(*s->level));
+	s->reason = calloc(n, sizeof(*s->reason));
+	s->activity = calloc(n, sizeof(*s->activity));
+	s->trail = calloc(n, sizeof(*s->trail));
+	s->trail_lim = calloc(n + 1, sizeof(*s->trail_lim));
+	s->heap = calloc(n, sizeof(*s->heap));
+	s->heap_pos = calloc(n, sizeof(*s->heap_pos));
+	s->learnt = calloc(n, sizeof(*s->learnt));
+
+	if (s->watches == NULL || s->value == NULL ||
+	    s->phase == NULL || s->seen == NULL || s->level == NULL ||
+	    s->reason == NULL || s->activity == NULL || s->trail == NULL ||
+	    s->trail_lim == NULL || s->heap == NULL || s->heap_pos == NULL ||
+	    s->learnt == NULL) {
+		pkg_emit_errno("calloc", "pkg_solve_cdcl");
+		return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < n; i ++) {
+		s->value[i] = SOLVE_UNDEF;
+		s->reason[i] = -1;
+		s->heap_pos[i] = -1;
+		/*
+		 * Decisions start from the previous answer when the problem is
+		 * resumed, and from the initial guess otherwise
+		 */
+		if (problem->variables[i].resolved)
+			s->phase[i] = problem->variables[i].to_install;
+		else
+			s->phase[i] = pkg_solve_initial_guess(problem,
+			    &problem->variables[i]);
+	}
+
+	return (EPKG_OK);
 }
 
 /*
- * Utilities to convert jobs to SAT rule
+ * Watch rules of the problem and assign requests at the top level, returns
+ * the index of a conflicting request, SOLVE_NO_CONFLICT or SOLVE_FATAL
  */
-
-static struct pkg_solve_item *
-pkg_solve_item_new(struct pkg_solve_variable *var)
+static int
+pkg_solve_cdcl_load(struct pkg_solve_cdcl *s)
 {
-	struct pkg_solve_item *result;
+	struct pkg_solve_problem *p = s->problem;
+	struct pkg_solve_variable *var;
+	unsigned int lit, i;
+	size_t idx;
 
-	result = calloc(1, sizeof(struct pkg_solve_item));
+	for (idx = 0; idx < p->nclauses; idx ++) {
+		if (pkg_solve_cdcl_attach(s, idx) != EPKG_OK)
+			return (SOLVE_FATAL);
+	}
 
-	if(result == NULL) {
-		pkg_emit_errno("calloc", "pkg_solve_item");
-		return (NULL);
+	for (i = 0; i < s->nvars; i ++) {
+		var = &p->variables[i];
+		if (p->occ_start[i] != p->occ_start[i + 1]) {
+			pkg_solve_cdcl_heap_insert(s, i);
+			continue;
+		}
+		/* This variable is independent and should not change its state */
+		pkg_solve_cdcl_assign(s,
+		    SOLVE_LIT(i, var->unit->pkg->type != PKG_INSTALLED), -1);
+		pkg_debug(2, "leave %s-%s(%d) to %s",
+				var->uid, var->digest,
+				var->priority, s->value[i] ? "install" : "delete");
 	}
 
-	result->var = var;
-	result->inverse = false;
+	/* Requests are unary rules */
+	for (idx = 0; idx < p->nclauses; idx ++) {
+		if (p->clauses[idx].len != 1)
+			continue;
 
-	return (result);
+		lit = p->lits[p->clauses[idx].start];
+		if (pkg_solve_cdcl_value(s, lit) == 0)
+			return (idx);
+		else if (pkg_solve_cdcl_value(s, lit) == SOLVE_UNDEF) {
+			pkg_solve_cdcl_assign(s, lit, idx);
+			var = &p->variables[SOLVE_LIT_VAR(lit)];
+			pkg_debug(2, "requested %s-%s(%d) to %s",
+					var->uid, var->digest,
+					var->priority,
+					SOLVE_LIT_INVERSE(lit) ? "delete" : "install");
+		}
+	}
+
+	return (SOLVE_NO_CONFLICT);
 }
 
-static struct pkg_solve_rule *
-pkg_solve_rule_new(void)
+/**
+ * Try to solve sat problem
+ * @param problem problem to solve
+ * @return true if the problem is satisfied
+ */
+bool
+pkg_solve_sat_problem(struct pkg_solve_problem *problem)
 {
-	struct pkg_solve_rule *result;
+	struct pkg_solve_cdcl s;
+	struct pkg_solve_variable *var;
+	unsigned int i, nlearnt;
+	int confl, btlevel, v;
+	bool ret = false;
 
-	result = calloc(1, sizeof(struct pkg_solve_rule));
+	/* Obvious case */
+	if (problem->rules_count == 0)
+		return (true);
 
-	if(result == NULL) {
-		pkg_emit_errno("calloc", "pkg_solve_rule");
-		return (NULL);
+	/* Rules might have been added since the previous run */
+	if (problem->occ_start == NULL &&
+	    pkg_solve_index_rules(problem) != EPKG_OK)
+		return (false);
+
+	if (pkg_solve_cdcl_init(&s, problem) != EPKG_OK)
+		goto out;
+
+	confl = pkg_solve_cdcl_load(&s);
+	if (confl == SOLVE_FATAL)
+		goto out;
+	else if (confl != SOLVE_NO_CONFLICT) {
+		pkg_solve_cdcl_report(&s, confl);
+		pkg_emit_error("SAT: conflicting request, cannot solve");
+		goto out;
 	}
 
-	return (result);
+	for (;;) {
+		confl = pkg_solve_cdcl_propagate(&s);
+		if (confl == SOLVE_FATAL)
+			goto out;
+
+		if (confl != SOLVE_NO_CONFLICT) {
+			s.conflicts ++;
+			if (s.nlevels == 0) {
+				/* Conflict does not depend on any decision, UNSAT */
+				pkg_solve_cdcl_report(&s, confl);
+				pkg_debug(1, "problem is UNSAT after %jd decisions and "
+						"%jd conflicts", (intmax_t)s.decisions,
+						(intmax_t)s.conflicts);
+				goto out;
+			}
+
+			nlearnt = pkg_solve_cdcl_analyze(&s, confl, &btlevel);
+			pkg_solve_cdcl_backjump(&s, btlevel);
+			confl = pkg_solve_clause_learn(problem, s.learnt, nlearnt);
+			if (confl == -1 || pkg_solve_cdcl_attach(&s, confl) != EPKG_OK)
+				goto out;
+			pkg_solve_cdcl_assign(&s, s.learnt[0], confl);
+			s.inc *= 1 / SOLVE_ACTIVITY_DECAY;
+			continue;
+		}
+
+		/* Pick the most active free variable */
+		do {
+			v = pkg_solve_cdcl_heap_pop(&s);
+		} while (v != -1 && s.value[v] != SOLVE_UNDEF);
+
+		if (v == -1)
+			break;
+
+		s.decisions ++;
+		s.trail_lim[s.nlevels++] = s.ntrail;
+		var = &problem->variables[v];
+		pkg_debug(4, "solver: guess %s-%s to %s at level %d",
+				var->uid, var->digest,
+				s.phase[v] ? "install" : "delete", s.nlevels);
+		pkg_solve_cdcl_assign(&s, SOLVE_LIT(v, !s.phase[v]), -1);
+	}
+
+	pkg_debug(1, "solved SAT problem in %jd decisions and %jd conflicts",
+			(intmax_t)s.decisions, (intmax_t)s.conflicts);
+
+	for (i = 0; i < s.nvars; i ++) {
+		var = &problem->variables[i];
+		var->to_install = (s.value[i] == 1);
+		var->resolved = true;
+	}
+	ret = true;
+
+out:
+	pkg_solve_cdcl_free(&s);
+
+	return (ret);
 }
 
+/*
+ * Utilities to convert jobs to SAT rule
+ */
+
 static struct pkg_solve_variable *
-pkg_solve_variable_new(struct pkg_job_universe_item *item)
+pkg_solve_variable_new(struct pkg_solve_problem *problem,
+		struct pkg_job_universe_item *item)
 {
 	struct pkg_solve_variable *result;
-	const char *digest, *uid;
-
-	result = calloc(1, sizeof(struct pkg_solve_variable));
 
-	if(result == NULL) {
-		pkg_emit_errno("calloc", "pkg_solve_variable");
+	if (problem->nvars >= problem->vars_cap) {
+		pkg_emit_error("solver: variable is out of universe, internal error");
 		return (NULL);
 	}
 
+	result = &problem->variables[problem->nvars++];
 	result->unit = item;
-	pkg_get(item->pkg, PKG_UNIQUEID, &uid, PKG_DIGEST, &digest);
-	/* XXX: Is it safe to save a ptr here ? */
-	result->digest = digest;
-	result->guess = -1;
-	result->uid = uid;
+	result->digest = item->digest;
+	result->uid = item->uid;
 	result->prev = result;
 
 	return (result);
 }
 
-static void
-pkg_solve_rule_free(struct pkg_solve_rule *rule)
+void
+pkg_solve_problem_free(struct pkg_solve_problem *problem)
 {
-	struct pkg_solve_item *it, *tmp;
+	HASH_CLEAR(hd, problem->variables_by_digest);
+	HASH_CLEAR(ho, problem->variables_by_uid);
+	free(problem->variables);
+	free(problem->lits);
+	free(problem->clauses);
+	free(problem->occ_start);
+	free(problem->occ);
+	free(problem);
+}
 
-	LL_FOREACH_SAFE(rule->items, it, tmp) {
-		free(it);
-	}
-	free(rule);
+/*
+ * Variables are hashed by the atoms of their universe item, see
+ * HASH_FIND_ATOM()
+ */
+#define HASH_FIND_VAR(hh, head, atom, out)				\
+	HASH_FIND(hh, (head), &(atom), sizeof(const char *), (out))
+#define HASH_ADD_VAR(hh, head, field, add)				\
+	HASH_ADD(hh, (head), field, sizeof(const char *), (add))
+
+static struct pkg_solve_variable *
+pkg_solve_find_uid(struct pkg_solve_problem *problem, const char *uid)
+{
+	struct pkg_solve_variable *var = NULL;
+	const char *atom;
+
+	atom = pkg_arena_interned(&problem->j->atoms, uid);
+	if (atom != NULL)
+		HASH_FIND_VAR(ho, problem->variables_by_uid, atom, var);
+
+	return (var);
 }
 
-void
-pkg_solve_problem_free(struct pkg_solve_problem *problem)
+static struct pkg_solve_variable *
+pkg_solve_find_digest(struct pkg_solve_problem *problem, const char *digest)
 {
-	struct pkg_solve_rule *r, *rtmp;
-	struct pkg_solve_variable *v, *vtmp;
-	struct _pkg_solve_var_rule *vrule, *vrtmp;
+	struct pkg_solve_variable *var = NULL;
+	const char *atom;
 
-	LL_FOREACH_SAFE(problem->rules, r, rtmp) {
-		pkg_solve_rule_free(r);
-	}
-	HASH_ITER(hd, problem->variables_by_digest, v, vtmp) {
-		HASH_DELETE(hd, problem->variables_by_digest, v);
-		LL_FOREACH_SAFE(v->rules, vrule, vrtmp) {
-			free(vrule);
-		}
-		free(v);
-	}
+	atom = pkg_arena_interned(&problem->j->atoms, digest);
+	if (atom != NULL)
+		HASH_FIND_VAR(hd, problem->variables_by_digest, atom, var);
+
+	return (var);
 }
 
 static int
@@ -562,31 +1027,28 @@ pkg_solve_add_universe_variable(struct pkg_solve_problem *problem,
 {
 	struct pkg_job_universe_item *unit, *cur;
 	struct pkg_solve_variable *nvar, *tvar = NULL, *found;
-	const char *digest;
 	struct pkg_jobs *j = problem->j;
 
-	HASH_FIND_STR(j->universe, uid, unit);
+	HASH_FIND_ATOM(j, j->universe, uid, unit);
 	/* If there is no package in universe, refuse continue */
 	if (unit == NULL) {
 		pkg_debug(2, "package %s is not found in universe", uid);
 		return (EPKG_FATAL);
 	}
 	/* Need to add a variable */
-	nvar = pkg_solve_variable_new(unit);
+	nvar = pkg_solve_variable_new(problem, unit);
 	if (nvar == NULL)
 		return (EPKG_FATAL);
 
-	HASH_ADD_KEYPTR(hd, problem->variables_by_digest, nvar->digest,
-			strlen(nvar->digest), nvar);
+	HASH_ADD_VAR(hd, problem->variables_by_digest, digest, nvar);
 
 	/*
 	 * Now we check the uid variable and if there is no such uid then
 	 * we need to add the whole conflict chain to it
 	 */
-	HASH_FIND(ho, problem->variables_by_uid, uid, strlen(uid), found);
+	HASH_FIND_VAR(ho, problem->variables_by_uid, nvar->uid, found);
 	if (found == NULL) {
-		HASH_ADD_KEYPTR(ho, problem->variables_by_uid, nvar->uid,
-				strlen(nvar->uid), nvar);
+		HASH_ADD_VAR(ho, problem->variables_by_uid, uid, nvar);
 		pkg_debug(4, "solver: add variable from universe with uid %s", nvar->uid);
 
 		/* Rewind to the beginning of the list */
@@ -594,17 +1056,16 @@ pkg_solve_add_universe_variable(struct pkg_solve_problem *problem,
 			unit = unit->prev;
 
 		LL_FOREACH (unit, cur) {
-			pkg_get(cur->pkg, PKG_DIGEST, &digest);
-			HASH_FIND(hd, problem->variables_by_digest, digest,
-					strlen(digest), found);
+			HASH_FIND_VAR(hd, problem->variables_by_digest, cur->digest,
+					found);
 			if (found == NULL) {
 				/* Add all alternatives as independent variables */
-				tvar = pkg_solve_variable_new(cur);
+				tvar = pkg_solve_variable_new(problem, cur);
 				if (tvar == NULL)
 					return (EPKG_FATAL);
 				DL_APPEND(nvar, tvar);
-				HASH_ADD_KEYPTR(hd, problem->variables_by_digest, tvar->digest,
-						strlen(tvar->digest), tvar);
+				HASH_ADD_VAR(hd, problem->variables_by_digest, digest,
+						tvar);
 				pkg_debug (4, "solver: add another variable with uid %s and digest %s",
 						tvar->uid, tvar->digest);
 			}
@@ -616,44 +1077,10 @@ pkg_solve_add_universe_variable(struct pkg_solve_problem *problem,
 	return (EPKG_OK);
 }
 
-static int
-pkg_solve_add_var_rules (struct pkg_solve_variable *var,
-		struct pkg_solve_item *rule, int nrules, bool iterate_vars,
-		const char *desc)
-{
-	struct _pkg_solve_var_rule *head = NULL;
-	struct pkg_solve_variable *tvar;
-
-	LL_FOREACH(var, tvar) {
-		pkg_debug(4, "solver: add %d-ary %s clause to variable %s-%s",
-							nrules, desc, tvar->uid, tvar->digest);
-		tvar->nrules += nrules;
-		head = calloc(1, sizeof (struct _pkg_solve_var_rule));
-		if (head == NULL) {
-			pkg_emit_errno("calloc", "_pkg_solve_var_rule");
-			return (EPKG_FATAL);
-		}
-		head->rule = rule;
-		LL_PREPEND(tvar->rules, head);
-		if (!iterate_vars)
-			break;
-	}
-	pkg_debug_print_rule(head->rule);
-
-	return (EPKG_OK);
-}
-
-#define RULE_ITEM_PREPEND(rule, item) do {									\
-	(item)->nitems = (rule)->items ? (rule)->items->nitems + 1 : 1;			\
-	LL_PREPEND((rule)->items, (item));										\
-} while (0)
-
 static int
 pkg_solve_handle_provide (struct pkg_solve_problem *problem,
-		struct pkg_job_provide *pr, struct pkg_solve_rule *rule, int *cnt)
+		struct pkg_job_provide *pr, int *cnt)
 {
-	struct pkg_solve_item *it = NULL;
-	const char *uid, *digest;
 	struct pkg_solve_variable *var;
 	struct pkg_job_universe_item *un, *cur;
 	struct pkg_shlib *sh;
@@ -666,25 +1093,19 @@ pkg_solve_handle_provide (struct pkg_solve_problem *problem,
 
 	LL_FOREACH(un, cur) {
 		/* For each provide */
-		pkg_get(un->pkg, PKG_DIGEST, &digest, PKG_UNIQUEID, &uid);
-		HASH_FIND(hd, problem->variables_by_digest, digest,
-				strlen(digest), var);
+		HASH_FIND_VAR(hd, problem->variables_by_digest, cur->digest, var);
 		if (var == NULL) {
-			if (pkg_solve_add_universe_variable(problem, uid,
+			if (pkg_solve_add_universe_variable(problem, cur->uid,
 					&var) != EPKG_OK)
 				continue;
 		}
 		/* Check if we have the specified require provided by this package */
-		HASH_FIND_STR(un->pkg->provides, pr->provide, sh);
+		HASH_FIND_STR(cur->pkg->provides, pr->provide, sh);
 		if (sh == NULL)
 			continue;
 
-		it = pkg_solve_item_new(var);
-		if (it == NULL)
+		if (pkg_solve_rule_add(problem, var, false) != EPKG_OK)
 			return (EPKG_FATAL);
-
-		it->inverse = false;
-		RULE_ITEM_PREPEND(rule, it);
 		(*cnt) ++;
 	}
 
@@ -698,8 +1119,6 @@ pkg_solve_add_pkg_rule(struct pkg_solve_problem *problem,
 	struct pkg_dep *dep, *dtmp;
 	struct pkg_conflict *conflict, *ctmp;
 	struct pkg *pkg;
-	struct pkg_solve_rule *rule;
-	struct pkg_solve_item *it = NULL;
 	struct pkg_solve_variable *var, *tvar, *cur_var;
 	struct pkg_shlib *shlib = NULL;
 	struct pkg_job_provide *pr, *prhead;
@@ -712,53 +1131,34 @@ pkg_solve_add_pkg_rule(struct pkg_solve_problem *problem,
 	LL_FOREACH(pvar, cur_var) {
 		pkg = cur_var->unit->pkg;
 		HASH_ITER(hh, pkg->deps, dep, dtmp) {
-			rule = NULL;
-			it = NULL;
 			var = NULL;
 
 			uid = dep->uid;
-			HASH_FIND(ho, problem->variables_by_uid, uid, strlen(uid), var);
+			var = pkg_solve_find_uid(problem, uid);
 			if (var == NULL) {
 				if (pkg_solve_add_universe_variable(problem, uid, &var) != EPKG_OK)
 					continue;
 			}
 			/* Dependency rule: (!A | B) */
-			rule = pkg_solve_rule_new();
-			if (rule == NULL)
-				goto err;
+			pkg_solve_rule_begin(problem);
 			/* !A */
-			it = pkg_solve_item_new(cur_var);
-			if (it == NULL)
+			if (pkg_solve_rule_add(problem, cur_var, true) != EPKG_OK)
 				goto err;
-
-			it->inverse = true;
-			RULE_ITEM_PREPEND(rule, it);
 			/* B1 | B2 | ... */
-			cnt = 1;
 			LL_FOREACH(var, tvar) {
-				it = pkg_solve_item_new(tvar);
-				if (it == NULL)
+				if (pkg_solve_rule_add(problem, tvar, false) != EPKG_OK)
 					goto err;
-
-				it->inverse = false;
-				RULE_ITEM_PREPEND(rule, it);
-				cnt ++;
 			}
-			pkg_solve_add_var_rules (var, rule->items, cnt, true, "dependency");
-			pkg_solve_add_var_rules (cur_var, rule->items, cnt, false, "dependency");
-
-			LL_PREPEND(problem->rules, rule);
-			problem->rules_count ++;
+			if (pkg_solve_rule_end(problem, "dependency") != EPKG_OK)
+				return (EPKG_FATAL);
 		}
 
 		/* Go through all conflicts */
 		HASH_ITER(hh, pkg->conflicts, conflict, ctmp) {
-			rule = NULL;
-			it = NULL;
 			var = NULL;
 
 			uid = pkg_conflict_uniqueid(conflict);
-			HASH_FIND(ho, problem->variables_by_uid, uid, strlen(uid), var);
+			var = pkg_solve_find_uid(problem, uid);
 			if (var == NULL) {
 				if (pkg_solve_add_universe_variable(problem, uid, &var) != EPKG_OK)
 					continue;
@@ -787,30 +1187,15 @@ pkg_solve_add_pkg_rule(struct pkg_solve_problem *problem,
 				}
 
 				/* Conflict rule: (!A | !Bx) */
-				rule = pkg_solve_rule_new();
-				if (rule == NULL)
-					goto err;
+				pkg_solve_rule_begin(problem);
 				/* !A */
-				it = pkg_solve_item_new(cur_var);
-				if (it == NULL)
+				if (pkg_solve_rule_add(problem, cur_var, true) != EPKG_OK)
 					goto err;
-
-				it->inverse = true;
-				RULE_ITEM_PREPEND(rule, it);
 				/* !Bx */
-				it = pkg_solve_item_new(tvar);
-				if (it == NULL)
+				if (pkg_solve_rule_add(problem, tvar, true) != EPKG_OK)
 					goto err;
-
-				it->inverse = true;
-				RULE_ITEM_PREPEND(rule, it);
-
-				LL_PREPEND(problem->rules, rule);
-				problem->rules_count ++;
-				pkg_solve_add_var_rules (tvar, rule->items, 2, false,
-						"explicit conflict");
-				pkg_solve_add_var_rules (cur_var, rule->items, 2, false,
-						"explicit conflict");
+				if (pkg_solve_rule_end(problem, "explicit conflict") != EPKG_OK)
+					return (EPKG_FATAL);
 			}
 		}
 
@@ -818,41 +1203,28 @@ pkg_solve_add_pkg_rule(struct pkg_solve_problem *problem,
 		shlib = NULL;
 		if (pkg->type != PKG_INSTALLED) {
 			while (pkg_shlibs_required(pkg, &shlib) == EPKG_OK) {
-				rule = NULL;
-				it = NULL;
-				var = NULL;
-				HASH_FIND_STR(j->provides, pkg_shlib_name(shlib), prhead);
+				HASH_FIND_ATOM(j, j->provides, pkg_shlib_name(shlib), prhead);
 				if (prhead != NULL) {
 					/* Require rule !A | P1 | P2 | P3 ... */
-					rule = pkg_solve_rule_new();
-					if (rule == NULL)
-						goto err;
+					pkg_solve_rule_begin(problem);
 					/* !A */
-					it = pkg_solve_item_new(cur_var);
-					if (it == NULL)
+					if (pkg_solve_rule_add(problem, cur_var, true) != EPKG_OK)
 						goto err;
-
-					it->inverse = true;
-					RULE_ITEM_PREPEND(rule, it);
 					/* B1 | B2 | ... */
 					cnt = 1;
 					LL_FOREACH(prhead, pr) {
-						if (pkg_solve_handle_provide (problem, pr, rule,
+						if (pkg_solve_handle_provide (problem, pr,
 								&cnt) != EPKG_OK)
 							goto err;
 					}
 
 					if (cnt > 1) {
-						pkg_solve_add_var_rules (var, rule->items, cnt, true, "provide");
-						pkg_solve_add_var_rules (cur_var, rule->items, cnt, false, "provide");
-
-						LL_PREPEND(problem->rules, rule);
-						problem->rules_count ++;
+						if (pkg_solve_rule_end(problem, "provide") != EPKG_OK)
+							return (EPKG_FATAL);
 					}
 					else {
 						/* Missing dependencies... */
-						free(it);
-						free(rule);
+						pkg_solve_rule_cancel(problem);
 					}
 				}
 				else {
@@ -877,29 +1249,15 @@ pkg_solve_add_pkg_rule(struct pkg_solve_problem *problem,
 			if (var != NULL) {
 				LL_FOREACH(var, tvar) {
 					/* Conflict rule: (!Ax | !Ay) */
-					rule = pkg_solve_rule_new();
-					if (rule == NULL)
-						goto err;
+					pkg_solve_rule_begin(problem);
 					/* !Ax */
-					it = pkg_solve_item_new(cur_var);
-					if (it == NULL)
+					if (pkg_solve_rule_add(problem, cur_var, true) != EPKG_OK)
 						goto err;
-
-					it->inverse = true;
-					RULE_ITEM_PREPEND(rule, it);
 					/* !Ay */
-					it = pkg_solve_item_new(tvar);
-					if (it == NULL)
+					if (pkg_solve_rule_add(problem, tvar, true) != EPKG_OK)
 						goto err;
-
-					it->inverse = true;
-					RULE_ITEM_PREPEND(rule, it);
-
-					LL_PREPEND(problem->rules, rule);
-					problem->rules_count ++;
-
-					pkg_solve_add_var_rules (tvar, rule->items, 2, false, "chain conflict");
-					pkg_solve_add_var_rules (cur_var, rule->items, 2, false, "chain conflict");
+					if (pkg_solve_rule_end(problem, "chain conflict") != EPKG_OK)
+						return (EPKG_FATAL);
 				}
 			}
 		}
@@ -907,12 +1265,7 @@ pkg_solve_add_pkg_rule(struct pkg_solve_problem *problem,
 
 	return (EPKG_OK);
 err:
-	if (it != NULL)
-		free(it);
-	if (var != NULL)
-		free(var);
-	if (rule != NULL)
-		pkg_solve_rule_free(rule);
+	pkg_solve_rule_cancel(problem);
 	return (EPKG_FATAL);
 }
 
@@ -922,29 +1275,27 @@ pkg_solve_add_universe_item(struct pkg_job_universe_item *un,
 {
 	struct pkg_job_universe_item *ucur;
 	struct pkg_solve_variable *var = NULL, *tvar;
-	const char *uid, *digest;
+	const char *uid;
 
 	/* Rewind universe pointer */
 	while (un->prev->next != NULL)
 		un = un->prev;
 
 	LL_FOREACH(un, ucur) {
-		pkg_get(ucur->pkg, PKG_UNIQUEID, &uid, PKG_DIGEST, &digest);
-		HASH_FIND(hd, problem->variables_by_digest, digest, strlen(digest), var);
+		uid = ucur->uid;
+		HASH_FIND_VAR(hd, problem->variables_by_digest, ucur->digest, var);
 		if (var == NULL) {
 			/* Add new variable */
-			var = pkg_solve_variable_new(ucur);
+			var = pkg_solve_variable_new(problem, ucur);
 			if (var == NULL)
 				return (EPKG_FATAL);
-			HASH_ADD_KEYPTR(hd, problem->variables_by_digest,
-					var->digest, strlen(var->digest), var);
+			HASH_ADD_VAR(hd, problem->variables_by_digest, digest, var);
 
 			/* Check uid */
-			HASH_FIND(ho, problem->variables_by_uid, uid, strlen(uid), tvar);
+			HASH_FIND_VAR(ho, problem->variables_by_uid, uid, tvar);
 			if (tvar == NULL) {
 				pkg_debug(4, "solver: add variable from universe with uid %s", var->uid);
-				HASH_ADD_KEYPTR(ho, problem->variables_by_uid,
-						var->uid, strlen(var->uid), var);
+				HASH_ADD_VAR(ho, problem->variables_by_uid, uid, var);
 			}
 			else {
 				/* Insert a variable to a chain */
@@ -952,7 +1303,7 @@ pkg_solve_add_universe_item(struct pkg_job_universe_item *un,
 			}
 		}
 	}
-	HASH_FIND(ho, problem->variables_by_uid, uid, strlen(uid), var);
+	HASH_FIND_VAR(ho, problem->variables_by_uid, uid, var);
 	/* Now `var' contains a variables chain related to this uid */
 	if (pkg_solve_add_pkg_rule(problem, var, true) == EPKG_FATAL)
 		return (EPKG_FATAL);
@@ -960,16 +1311,81 @@ pkg_solve_add_universe_item(struct pkg_job_universe_item *un,
 	return (EPKG_OK);
 }
 
+/*
+ * Variables are stored in a single array, so size it for the whole
+ * universe beforehand
+ */
+static unsigned int
+pkg_solve_universe_size(struct pkg_jobs *j)
+{
+	struct pkg_job_universe_item *un, *utmp, *cur;
+	unsigned int cnt = 0;
+
+	HASH_ITER(hh, j->universe, un, utmp) {
+		while (un->prev->next != NULL)
+			un = un->prev;
+		LL_FOREACH(un, cur)
+			cnt ++;
+	}
+
+	return (cnt);
+}
+
+/*
+ * Check whether a problem still describes the jobs it has been built for,
+ * it must be rebuilt if the universe or the requests have changed
+ */
+bool
+pkg_solve_problem_valid(struct pkg_solve_problem *problem)
+{
+	return (problem->j->generation == problem->generation);
+}
+
+/*
+ * Add a conflict discovered after the problem has been built: (!A | !B)
+ */
+int
+pkg_solve_add_conflict(struct pkg_solve_problem *problem, struct pkg *p1,
+		struct pkg *p2)
+{
+	struct pkg_solve_variable *v1, *v2;
+	const char *d1, *d2;
+
+	pkg_get(p1, PKG_DIGEST, &d1);
+	pkg_get(p2, PKG_DIGEST, &d2);
+	v1 = pkg_solve_find_digest(problem, d1);
+	v2 = pkg_solve_find_digest(problem, d2);
+	if (v1 == NULL || v2 == NULL) {
+		pkg_debug(2, "solver: conflict between %s and %s is out of the problem",
+				d1, d2);
+		return (EPKG_FATAL);
+	}
+
+	pkg_solve_rule_begin(problem);
+	if (pkg_solve_rule_add(problem, v1, true) != EPKG_OK ||
+	    pkg_solve_rule_add(problem, v2, true) != EPKG_OK) {
+		pkg_solve_rule_cancel(problem);
+		return (EPKG_FATAL);
+	}
+	if (pkg_solve_rule_end(problem, "registered conflict") != EPKG_OK)
+		return (EPKG_FATAL);
+
+	/* Occurrence lists are rebuilt on the next run */
+	free(problem->occ_start);
+	free(problem->occ);
+	problem->occ_start = NULL;
+	problem->occ = NULL;
+
+	return (EPKG_OK);
+}
+
 struct pkg_solve_problem *
 pkg_solve_jobs_to_sat(struct pkg_jobs *j)
 {
 	struct pkg_solve_problem *problem;
 	struct pkg_job_request *jreq, *jtmp;
-	struct pkg_solve_rule *rule;
-	struct pkg_solve_item *it;
 	struct pkg_job_universe_item *un, *utmp;
 	struct pkg_solve_variable *var;
-	const char *digest;
 
 	problem = calloc(1, sizeof(struct pkg_solve_problem));
 
@@ -979,21 +1395,28 @@ pkg_solve_jobs_to_sat(struct pkg_jobs *j)
 	}
 
 	problem->j = j;
+	problem->generation = j->generation;
+	problem->vars_cap = pkg_solve_universe_size(j);
+	problem->variables = calloc(problem->vars_cap ? problem->vars_cap : 1,
+	    sizeof(*problem->variables));
+
+	if (problem->variables == NULL) {
+		pkg_emit_errno("calloc", "pkg_solve_variable");
+		goto err;
+	}
 
 	/* Add requests */
 	HASH_ITER(hh, j->request_add, jreq, jtmp) {
 		if (jreq->skip)
 			continue;
 
-		rule = NULL;
-		it = NULL;
 		var = NULL;
 
 		if (pkg_solve_add_universe_item(jreq->item, problem) == EPKG_FATAL)
 			goto err;
 
-		pkg_get(jreq->item->pkg, PKG_DIGEST, &digest);
-		HASH_FIND(hd, problem->variables_by_digest, digest, strlen(digest), var);
+		HASH_FIND_VAR(hd, problem->variables_by_digest, jreq->item->digest,
+				var);
 
 		if (var == NULL) {
 			pkg_emit_error("solver: variable has not been added, internal error");
@@ -1003,33 +1426,23 @@ pkg_solve_jobs_to_sat(struct pkg_jobs *j)
 		pkg_debug(4, "solver: add variable from install request with uid %s-%s",
 						var->uid, var->digest);
 
-		it = pkg_solve_item_new(var);
-		if (it == NULL)
-			goto err;
-
-		rule = pkg_solve_rule_new();
-		if (rule == NULL)
-			goto err;
-
 		/* Requests are unary rules */
-		RULE_ITEM_PREPEND(rule, it);
-		pkg_solve_add_var_rules (var, it, 1, false, "unary add");
-		LL_PREPEND(problem->rules, rule);
-		problem->rules_count ++;
+		pkg_solve_rule_begin(problem);
+		if (pkg_solve_rule_add(problem, var, false) != EPKG_OK ||
+		    pkg_solve_rule_end(problem, "unary add") != EPKG_OK)
+			goto err;
 	}
 	HASH_ITER(hh, j->request_delete, jreq, jtmp) {
 		if (jreq->skip)
 			continue;
 
-		rule = NULL;
-		it = NULL;
 		var = NULL;
 
 		if (pkg_solve_add_universe_item(jreq->item, problem) == EPKG_FATAL)
 			goto err;
 
-		pkg_get(jreq->item->pkg, PKG_DIGEST, &digest);
-		HASH_FIND(hd, problem->variables_by_digest, digest, strlen(digest), var);
+		HASH_FIND_VAR(hd, problem->variables_by_digest, jreq->item->digest,
+				var);
 
 		if (var == NULL) {
 			pkg_emit_error("solver: variable has not been added, internal error");
@@ -1039,21 +1452,11 @@ pkg_solve_jobs_to_sat(struct pkg_jobs *j)
 		pkg_debug(4, "solver: add variable from delete request with uid %s-%s",
 				var->uid, var->digest);
 
-		it = pkg_solve_item_new(var);
-		if (it == NULL)
-			goto err;
-
-		it->inverse = true;
-
-		rule = pkg_solve_rule_new();
-		if (rule == NULL)
-			goto err;
-
 		/* Requests are unary rules */
-		RULE_ITEM_PREPEND(rule, it);
-		pkg_solve_add_var_rules (var, it, 1, false, "unary delete");
-		LL_PREPEND(problem->rules, rule);
-		problem->rules_count ++;
+		pkg_solve_rule_begin(problem);
+		if (pkg_solve_rule_add(problem, var, true) != EPKG_OK ||
+		    pkg_solve_rule_end(problem, "unary delete") != EPKG_OK)
+			goto err;
 	}
 
 	if (problem->rules_count == 0) {
@@ -1063,64 +1466,111 @@ pkg_solve_jobs_to_sat(struct pkg_jobs *j)
 
 	/* Parse universe */
 	HASH_ITER(hh, j->universe, un, utmp) {
-		rule = NULL;
-		it = NULL;
-		var = NULL;
-
 		/* Add corresponding variables */
 		if (pkg_solve_add_universe_item(un, problem) == EPKG_FATAL)
 			goto err;
 	}
 
+	if (pkg_solve_index_rules(problem) != EPKG_OK)
+		goto err;
+
 	return (problem);
 err:
-	if (it != NULL)
-		free(it);
-	if (var != NULL)
-		free(var);
-	if (rule != NULL)
-		pkg_solve_rule_free(rule);
+	pkg_solve_problem_free(problem);
 	return (NULL);
 }
 
-struct pkg_solve_ordered_variable {
-	struct pkg_solve_variable *var;
-	int order;
-	UT_hash_handle hh;
-};
+/*
+ * Solve a formula given as DIMACS literals, each clause terminated by 0,
+ * variable n standing for items[n - 1]: the engine can be checked on its
+ * own this way. On success model[n - 1] tells whether n is set.
+ */
+int
+pkg_solve_cnf(struct pkg_jobs *j, struct pkg_job_universe_item *items,
+    unsigned int nitems, const int *cnf, size_t len, bool *model)
+{
+	struct pkg_solve_problem *problem;
+	unsigned int i, v;
+	size_t k;
+	int ret = EPKG_FATAL;
+
+	problem = calloc(1, sizeof(struct pkg_solve_problem));
+	if (problem == NULL) {
+		pkg_emit_errno("calloc", "pkg_solve_problem");
+		return (EPKG_FATAL);
+	}
+
+	problem->j = j;
+	problem->vars_cap = nitems;
+	problem->variables = calloc(nitems ? nitems : 1,
+	    sizeof(*problem->variables));
+	if (problem->variables == NULL) {
+		pkg_emit_errno("calloc", "pkg_solve_variable");
+		goto out;
+	}
+
+	for (i = 0; i < nitems; i ++) {
+		if (pkg_solve_variable_new(problem, &items[i]) == NULL)
+			goto out;
+	}
+
+	pkg_solve_rule_begin(problem);
+	for (k = 0; k < len; k ++) {
+		if (cnf[k] == 0) {
+			if (pkg_solve_rule_end(problem, "cnf") != EPKG_OK)
+				goto out;
+			pkg_solve_rule_begin(problem);
+			continue;
+		}
+		v = abs(cnf[k]);
+		if (v > nitems) {
+			pkg_emit_error("solver: variable %d is out of range",
+			    cnf[k]);
+			goto out;
+		}
+		if (pkg_solve_rule_add(problem, &problem->variables[v - 1],
+		    cnf[k] < 0) != EPKG_OK)
+			goto out;
+	}
+	/* An unterminated clause is ignored */
+	pkg_solve_rule_cancel(problem);
+
+	if (pkg_solve_index_rules(problem) != EPKG_OK ||
+	    !pkg_solve_sat_problem(problem))
+		goto out;
+
+	for (i = 0; i < nitems; i ++)
+		model[i] = problem->variables[i].to_install;
+	ret = EPKG_OK;
+
+out:
+	pkg_solve_problem_free(problem);
+
+	return (ret);
+}
 
 int
 pkg_solve_dimacs_export(struct pkg_solve_problem *problem, FILE *f)
 {
-	struct pkg_solve_ordered_variable *ordered_variables = NULL, *nord;
-	struct pkg_solve_variable *var, *vtmp;
-	struct pkg_solve_rule *rule;
-	struct pkg_solve_item *it;
-	int cur_ord = 1;
-
-	/* Order variables */
-	HASH_ITER(hd, problem->variables_by_digest, var, vtmp) {
-		nord = calloc(1, sizeof(struct pkg_solve_ordered_variable));
-		nord->order = cur_ord ++;
-		nord->var = var;
-		HASH_ADD_PTR(ordered_variables, var, nord);
-	}
+	struct pkg_solve_clause *c;
+	unsigned int i, lit;
+	size_t idx;
 
-	fprintf(f, "p cnf %d %d\n", HASH_CNT(hd, problem->variables_by_digest),
-			problem->rules_count);
+	/* DIMACS variables are numbered from 1 */
+	fprintf(f, "p cnf %u %u\n", problem->nvars, problem->rules_count);
 
-	LL_FOREACH(problem->rules, rule) {
-		LL_FOREACH(rule->items, it) {
-			HASH_FIND_PTR(ordered_variables, &it->var, nord);
-			if (nord != NULL) {
-				fprintf(f, "%s%d ", (it->inverse ? "-" : ""), nord->order);
-			}
+	for (idx = 0; idx < problem->nclauses; idx ++) {
+		c = &problem->clauses[idx];
+		if (c->learnt)
+			continue;
+		for (i = 0; i < c->len; i ++) {
+			lit = problem->lits[c->start + i];
+			fprintf(f, "%s%u ", SOLVE_LIT_INVERSE(lit) ? "-" : "",
+					SOLVE_LIT_VAR(lit) + 1);
 		}
 		fprintf(f, "0\n");
 	}
 
-	HASH_FREE(ordered_variables, free);
-
 	return (EPKG_OK);
 }
 
@@ -1208,69 +1658,46 @@ pkg_solve_sat_to_jobs(struct pkg_solve_problem *problem)
 	return (EPKG_OK);
 }
 
+static void
+pkg_solve_set_sat_var(struct pkg_solve_problem *problem, const char *var_str)
+{
+	struct pkg_solve_variable *var;
+	long ord;
+
+	ord = labs(strtol(var_str, NULL, 10));
+	if (ord < 1 || (unsigned long)ord > problem->nvars)
+		return;
+
+	var = &problem->variables[ord - 1];
+	var->resolved = true;
+	var->to_install = (*var_str != '-');
+}
+
 int
 pkg_solve_parse_sat_output(FILE *f, struct pkg_solve_problem *problem, struct pkg_jobs *j)
 {
-	struct pkg_solve_ordered_variable *ordered_variables = NULL, *nord;
-	struct pkg_solve_variable *var, *vtmp;
-	int cur_ord = 1, ret = EPKG_OK;
+	int ret = EPKG_OK;
 	char *line = NULL, *var_str, *begin;
 	size_t linecap = 0;
 	ssize_t linelen;
 	bool got_sat = false, done = false;
 
-	/* Order variables */
-	HASH_ITER(hd, problem->variables_by_digest, var, vtmp) {
-		nord = calloc(1, sizeof(struct pkg_solve_ordered_variable));
-		nord->order = cur_ord ++;
-		nord->var = var;
-		HASH_ADD_INT(ordered_variables, order, nord);
-	}
-
 	while ((linelen = getline(&line, &linecap, f)) > 0) {
 		if (strncmp(line, "SAT", 3) == 0) {
 			got_sat = true;
 		}
-		else if (got_sat) {
-			begin = line;
+		else if (got_sat || strncmp(line, "v ", 2) == 0) {
+			begin = got_sat ? line : line + 2;
 			do {
 				var_str = strsep(&begin, " \t");
 				/* Skip unexpected lines */
 				if (var_str == NULL || (!isdigit(*var_str) && *var_str != '-'))
 					continue;
-				cur_ord = 0;
-				cur_ord = abs(strtol(var_str, NULL, 10));
-				if (cur_ord == 0) {
+				if (strtol(var_str, NULL, 10) == 0) {
 					done = true;
 					break;
 				}
-
-				HASH_FIND_INT(ordered_variables, &cur_ord, nord);
-				if (nord != NULL) {
-					nord->var->resolved = true;
-					nord->var->to_install = (*var_str != '-');
-				}
-			} while (begin != NULL);
-		}
-		else if (strncmp(line, "v ", 2) == 0) {
-			begin = line + 2;
-			do {
-				var_str = strsep(&begin, " \t");
-				/* Skip unexpected lines */
-				if (var_str == NULL || (!isdigit(*var_str) && *var_str != '-'))
-					continue;
-				cur_ord = 0;
-				cur_ord = abs(strtol(var_str, NULL, 10));
-				if (cur_ord == 0) {
-					done = true;
-					break;
-				}
-
-				HASH_FIND_INT(ordered_variables, &cur_ord, nord);
-				if (nord != NULL) {
-					nord->var->resolved = true;
-					nord->var->to_install = (*var_str != '-');
-				}
+				pkg_solve_set_sat_var(problem, var_str);
 			} while (begin != NULL);
 		}
 		else {
@@ -1286,7 +1713,6 @@ pkg_solve_parse_sat_output(FILE *f, struct pkg_solve_problem *problem, struct pk
 		ret = EPKG_FATAL;
 	}
 
-	HASH_FREE(ordered_variables, free);
 	if (line != NULL)
 		free(line);
 	return (ret);
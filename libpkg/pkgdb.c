@@ -73,7 +73,7 @@
 */
 
 #define DB_SCHEMA_MAJOR	0
-#define DB_SCHEMA_MINOR	27
+#define DB_SCHEMA_MINOR	28
 
 #define DBVERSION (DB_SCHEMA_MAJOR * 1000 + DB_SCHEMA_MINOR)
 
@@ -82,7 +82,7 @@ static void pkgdb_split_uid(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_split_version(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_regex_delete(void *);
 static int pkgdb_upgrade(struct pkgdb *);
-static void populate_pkg(sqlite3_stmt *stmt, struct pkg *pkg);
+static void populate_pkg(struct pkgdb_it *it, struct pkg *pkg);
 static void pkgdb_detach_remotes(sqlite3 *);
 static int sqlcmd_init(sqlite3 *db, __unused const char **err,
     __unused const void *noused);
@@ -135,8 +135,59 @@ static struct column_mapping {
 	{ NULL,		-1, PKG_SQLITE_STRING }
 };
 
+/*
+ * Return the statement for sql, prepared on first use and kept on the
+ * handle until pkgdb_close(); later calls get it back reset.
+ */
+static sqlite3_stmt *
+pkgdb_stmt_get(struct pkgdb *db, const char *sql)
+{
+	struct pkgdb_stmt	*s;
+
+	HASH_FIND_STR(db->stmts, sql, s);
+	if (s != NULL) {
+		sqlite3_reset(s->stmt);
+		sqlite3_clear_bindings(s->stmt);
+		return (s->stmt);
+	}
+
+	if ((s = calloc(1, sizeof(struct pkgdb_stmt))) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_stmt");
+		return (NULL);
+	}
+
+	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &s->stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite, sql);
+		free(s);
+		return (NULL);
+	}
+
+	if ((s->sql = strdup(sql)) == NULL) {
+		pkg_emit_errno("strdup", "pkgdb_stmt");
+		sqlite3_finalize(s->stmt);
+		free(s);
+		return (NULL);
+	}
+
+	HASH_ADD_KEYPTR(hh, db->stmts, s->sql, strlen(s->sql), s);
+	return (s->stmt);
+}
+
+static void
+pkgdb_stmt_finalize(struct pkgdb *db)
+{
+	struct pkgdb_stmt	*s, *stmp;
+
+	HASH_ITER(hh, db->stmts, s, stmp) {
+		HASH_DEL(db->stmts, s);
+		sqlite3_finalize(s->stmt);
+		free(s->sql);
+		free(s);
+	}
+}
+
 static int
-load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
+load_val(struct pkgdb *db, struct pkg *pkg, const char *sql, unsigned flags,
     int (*pkg_adddata)(struct pkg *pkg, const char *data), int list)
 {
 	sqlite3_stmt	*stmt;
@@ -149,10 +200,8 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db, sql);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -161,12 +210,12 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		pkg_adddata(pkg, sqlite3_column_text(stmt, 0));
 	}
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		if (list != -1)
 			pkg_list_free(pkg, list);
-		ERROR_SQLITE(db, sql);
+		ERROR_SQLITE(db->sqlite, sql);
 		return (EPKG_FATAL);
 	}
 
@@ -175,7 +224,7 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 }
 
 static int
-load_tag_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
+load_tag_val(struct pkgdb *db, struct pkg *pkg, const char *sql, unsigned flags,
 	     int (*pkg_addtagval)(struct pkg *pkg, const char *tag, const char *val),
 	     int list)
 {
@@ -189,10 +238,8 @@ load_tag_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db, sql);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -201,12 +248,12 @@ load_tag_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		pkg_addtagval(pkg, sqlite3_column_text(stmt, 0),
 			      sqlite3_column_text(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		if (list != -1)
 			pkg_list_free(pkg, list);
-		ERROR_SQLITE(db, sql);
+		ERROR_SQLITE(db->sqlite, sql);
 		return (EPKG_FATAL);
 	}
 
@@ -224,54 +271,81 @@ compare_column_func(const void *pkey, const void *pcolumn)
 	return strcmp(key, column->name);
 }
 
+/*
+ * Resolve the attribute of each column once per statement
+ */
+static int
+pkgdb_it_map_columns(struct pkgdb_it *it)
+{
+	int		 icol;
+
+	it->ncols = sqlite3_column_count(it->stmt);
+	it->columns = calloc(it->ncols ? it->ncols : 1, sizeof(*it->columns));
+	if (it->columns == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_it_map_columns");
+		return (EPKG_FATAL);
+	}
+
+	for (icol = 0; icol < it->ncols; icol++)
+		it->columns[icol] = bsearch(sqlite3_column_name(it->stmt, icol),
+		    columns, NELEM(columns) - 1, sizeof(columns[0]),
+		    compare_column_func);
+
+	return (EPKG_OK);
+}
+
 static void
-populate_pkg(sqlite3_stmt *stmt, struct pkg *pkg) {
+populate_pkg(struct pkgdb_it *it, struct pkg *pkg) {
+	sqlite3_stmt	*stmt = it->stmt;
 	int		 icol = 0;
-	const char	*colname;
+	const struct column_mapping *column;
 
 	assert(stmt != NULL);
 
-	for (icol = 0; icol < sqlite3_column_count(stmt); icol++) {
-		colname = sqlite3_column_name(stmt, icol);
-		struct column_mapping *column;
+	for (icol = 0; icol < it->ncols; icol++) {
+		column = it->columns[icol];
 		switch (sqlite3_column_type(stmt, icol)) {
 		case SQLITE_TEXT:
-			column = bsearch(colname, columns, NELEM(columns) - 1,
-					sizeof(columns[0]), compare_column_func);
 			if (column == NULL) {
-				pkg_emit_error("unknown column %s", colname);
+				pkg_emit_error("unknown column %s",
+				    sqlite3_column_name(stmt, icol));
+			}
+			else if ((int)column->type <= 0) {
+				/* Not an attribute */
 			}
 			else {
 				if (column->pkg_type == PKG_SQLITE_STRING)
-					pkg_set(pkg, column->type,
+					pkg_set_string(pkg, column->type,
 						sqlite3_column_text(stmt, icol));
 				else
 					pkg_emit_error("want string for column %s and got number",
-							colname);
+							column->name);
 			}
 			break;
 		case SQLITE_INTEGER:
-			column = bsearch(colname, columns, NELEM(columns) - 1,
-					sizeof(columns[0]), compare_column_func);
 			if (column == NULL) {
-				pkg_emit_error("Unknown column %s", colname);
+				pkg_emit_error("Unknown column %s",
+				    sqlite3_column_name(stmt, icol));
+			}
+			else if ((int)column->type <= 0) {
+				/* Not an attribute */
 			}
 			else {
 				if (column->pkg_type == PKG_SQLITE_INT64)
-					pkg_set(pkg, column->type,
+					pkg_set_int(pkg, column->type,
 						sqlite3_column_int64(stmt, icol));
 				else if (column->pkg_type == PKG_SQLITE_BOOL)
-					pkg_set(pkg, column->type,
+					pkg_set_bool(pkg, column->type,
 							(bool)sqlite3_column_int(stmt, icol));
 				else
 					pkg_emit_error("want number for column %s and got string",
-							colname);
+							column->name);
 			}
 			break;
 		case SQLITE_BLOB:
 		case SQLITE_FLOAT:
 			pkg_emit_error("wrong type for column: %s",
-			    colname);
+			    sqlite3_column_name(stmt, icol));
 			/* just ignore currently */
 			break;
 		case SQLITE_NULL:
@@ -591,7 +665,9 @@ pkgdb_init(sqlite3 *sdb)
 		"path TEXT PRIMARY KEY,"
 		"sha256 TEXT,"
 		"package_id INTEGER REFERENCES packages(id) ON DELETE CASCADE"
-			" ON UPDATE CASCADE"
+			" ON UPDATE CASCADE,"
+		"size INTEGER,"
+		"mtime INTEGER"
 	");"
 	"CREATE TABLE directories ("
 		"id INTEGER PRIMARY KEY,"
@@ -1282,6 +1358,8 @@ pkgdb_close(struct pkgdb *db)
 	if (db->prstmt_initialized)
 		prstmt_finalize(db);
 
+	pkgdb_stmt_finalize(db);
+
 	if (db->sqlite != NULL) {
 		assert(db->lock_count == 0);
 		if (db->type == PKGDB_REMOTE) {
@@ -1453,6 +1531,12 @@ pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type, short flags)
 	it->type = type;
 	it->flags = flags;
 	it->finished = 0;
+	it->columns = NULL;
+	it->ncols = 0;
+	it->batch = NULL;
+	it->nbatch = 0;
+	it->ibatch = 0;
+	it->eof = false;
 	return (it);
 }
 
@@ -1479,15 +1563,248 @@ static struct load_on_flag {
 	{ -1,			        NULL }
 };
 
-int
-pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, unsigned flags)
+static void
+load_batch_dep(struct pkg *pkg, sqlite3_stmt *stmt)
 {
-	struct pkg	*pkg;
-	int		 i;
+	pkg_adddep(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_text(stmt, 2),
+	    sqlite3_column_text(stmt, 3),
+	    sqlite3_column_int(stmt, 4));
+}
+
+static void
+load_batch_file(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addfile(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_text(stmt, 2), false);
+}
+
+static void
+load_batch_dir(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_adddir(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_int(stmt, 2), false);
+}
+
+static void
+load_batch_script(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addscript(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_int(stmt, 2));
+}
+
+/*
+ * Relations of installed packages that pkgdb_it_next() loads for a whole
+ * window at once. The first column is the package id, %s is replaced by
+ * the list of PKGDB_IT_WINDOW parameters.
+ */
+static struct load_batch {
+	unsigned	 flag;
+	int		 list;
+	const char	*sql;
+	void		(*add)(struct pkg *pkg, sqlite3_stmt *stmt);
+	int		(*adddata)(struct pkg *pkg, const char *data);
+	int		(*addtagval)(struct pkg *pkg, const char *tag,
+			    const char *val);
+} load_batch[] = {
+	{ PKG_LOAD_DEPS, PKG_DEPS,
+	  "SELECT d.package_id, d.name, d.origin, d.version, p.locked "
+	  "FROM main.deps AS d "
+	  "LEFT JOIN main.packages AS p ON p.origin = d.origin "
+	  "AND p.name = d.name "
+	  "WHERE d.package_id IN (%s) ORDER BY d.package_id, d.origin DESC",
+	  load_batch_dep, NULL, NULL },
+	{ PKG_LOAD_FILES, PKG_FILES,
+	  "SELECT package_id, path, sha256 "
+	  "FROM main.files "
+	  "WHERE package_id IN (%s) "
+	  "ORDER BY package_id, path ASC",
+	  load_batch_file, NULL, NULL },
+	{ PKG_LOAD_DIRS, PKG_DIRS,
+	  "SELECT package_id, path, try "
+	  "FROM main.pkg_directories, main.directories "
+	  "WHERE package_id IN (%s) "
+	  "AND directory_id = directories.id "
+	  "ORDER BY package_id, path DESC",
+	  load_batch_dir, NULL, NULL },
+	{ PKG_LOAD_SCRIPTS, -1,
+	  "SELECT package_id, script, type "
+	  "FROM main.pkg_script JOIN main.script USING(script_id) "
+	  "WHERE package_id IN (%s)",
+	  load_batch_script, NULL, NULL },
+	/* Like pkgdb_load_options(), which stops after the option values */
+	{ PKG_LOAD_OPTIONS, PKG_OPTIONS,
+	  "SELECT package_id, option, value "
+	  "FROM main.option JOIN main.pkg_option USING(option_id) "
+	  "WHERE package_id IN (%s) ORDER BY package_id, option",
+	  NULL, NULL, pkg_addoption },
+	{ PKG_LOAD_CATEGORIES, PKG_CATEGORIES,
+	  "SELECT package_id, name "
+	  "FROM main.pkg_categories, main.categories AS c "
+	  "WHERE package_id IN (%s) "
+	  "AND category_id = c.id "
+	  "ORDER BY package_id, name DESC",
+	  NULL, pkg_addcategory, NULL },
+	{ PKG_LOAD_LICENSES, PKG_LICENSES,
+	  "SELECT package_id, name "
+	  "FROM main.pkg_licenses, main.licenses AS l "
+	  "WHERE package_id IN (%s) "
+	  "AND license_id = l.id "
+	  "ORDER BY package_id, name DESC",
+	  NULL, pkg_addlicense, NULL },
+	{ PKG_LOAD_USERS, PKG_USERS,
+	  "SELECT package_id, users.name "
+	  "FROM main.pkg_users, main.users "
+	  "WHERE package_id IN (%s) "
+	  "AND user_id = users.id "
+	  "ORDER BY package_id, name DESC",
+	  NULL, pkg_adduser, NULL },
+	{ PKG_LOAD_SHLIBS_REQUIRED, PKG_SHLIBS_REQUIRED,
+	  "SELECT package_id, name "
+	  "FROM main.pkg_shlibs_required, main.shlibs AS s "
+	  "WHERE package_id IN (%s) "
+	  "AND shlib_id = s.id "
+	  "ORDER BY package_id, name DESC",
+	  NULL, pkg_addshlib_required, NULL },
+	{ PKG_LOAD_SHLIBS_PROVIDED, PKG_SHLIBS_PROVIDED,
+	  "SELECT package_id, name "
+	  "FROM main.pkg_shlibs_provided, main.shlibs AS s "
+	  "WHERE package_id IN (%s) "
+	  "AND shlib_id = s.id "
+	  "ORDER BY package_id, name DESC",
+	  NULL, pkg_addshlib_provided, NULL },
+	{ PKG_LOAD_ANNOTATIONS, PKG_ANNOTATIONS,
+	  "SELECT p.package_id, k.annotation AS tag, v.annotation AS value "
+	  "FROM main.pkg_annotation p "
+	  "JOIN main.annotation k ON (p.tag_id = k.annotation_id) "
+	  "JOIN main.annotation v ON (p.value_id = v.annotation_id) "
+	  "WHERE p.package_id IN (%s) "
+	  "ORDER BY p.package_id, tag, value",
+	  NULL, NULL, pkg_addannotation },
+	{ PKG_LOAD_CONFLICTS, PKG_CONFLICTS,
+	  "SELECT package_id, packages.origin "
+	  "FROM main.pkg_conflicts "
+	  "LEFT JOIN main.packages ON "
+	  "packages.id = pkg_conflicts.conflict_id "
+	  "WHERE package_id IN (%s)",
+	  NULL, pkg_addconflict, NULL },
+	{ 0, -1, NULL, NULL, NULL, NULL }
+};
+
+static bool
+pkgdb_it_batched(struct pkgdb_it *it, unsigned flags)
+{
+	int	i;
+
+	if (it->db == NULL || it->type != PKG_INSTALLED ||
+	    (it->flags & PKGDB_IT_FLAG_CYCLED))
+		return (false);
+
+	for (i = 0; load_batch[i].sql != NULL; i++)
+		if (flags & load_batch[i].flag)
+			return (true);
+
+	return (false);
+}
+
+/*
+ * Run one query per requested relation for the whole window and
+ * dispatch the rows to the packages by id
+ */
+static int
+pkgdb_it_load_batch(struct pkgdb_it *it, unsigned flags)
+{
+	struct load_batch	*lb;
+	struct sbuf		*in, *sql;
+	sqlite3_stmt		*stmt;
+	struct pkg		*pkg;
+	int64_t			 rowid, id;
+	int			 i, ret = EPKG_OK;
+
+	in = sbuf_new_auto();
+	sql = sbuf_new_auto();
+	for (i = 1; i <= PKGDB_IT_WINDOW; i++)
+		sbuf_printf(in, "%s?%d", i > 1 ? "," : "", i);
+	sbuf_finish(in);
+
+	for (lb = load_batch; lb->sql != NULL; lb++) {
+		if (!(flags & lb->flag))
+			continue;
+
+		sbuf_clear(sql);
+		sbuf_printf(sql, lb->sql, sbuf_get(in));
+		sbuf_finish(sql);
+
+		pkg_debug(4, "Pkgdb: running '%s'", sbuf_get(sql));
+		if ((stmt = pkgdb_stmt_get(it->db, sbuf_get(sql))) == NULL) {
+			ret = EPKG_FATAL;
+			break;
+		}
+
+		/* A short window repeats its last id */
+		for (i = 0; i < PKGDB_IT_WINDOW; i++) {
+			pkg = it->batch[MIN(i, it->nbatch - 1)];
+			pkg_get(pkg, PKG_ROWID, &rowid);
+			sqlite3_bind_int64(stmt, i + 1, rowid);
+		}
+
+		while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+			id = sqlite3_column_int64(stmt, 0);
+			for (i = 0; i < it->nbatch; i++) {
+				pkg = it->batch[i];
+				pkg_get(pkg, PKG_ROWID, &rowid);
+				if (rowid != id)
+					continue;
+				if (lb->add != NULL)
+					lb->add(pkg, stmt);
+				else if (lb->adddata != NULL)
+					lb->adddata(pkg,
+					    sqlite3_column_text(stmt, 1));
+				else
+					lb->addtagval(pkg,
+					    sqlite3_column_text(stmt, 1),
+					    sqlite3_column_text(stmt, 2));
+			}
+		}
+		sqlite3_reset(stmt);
+
+		if (ret != SQLITE_DONE) {
+			for (i = 0; i < it->nbatch; i++)
+				if (lb->list != -1)
+					pkg_list_free(it->batch[i], lb->list);
+			ERROR_SQLITE(it->sqlite, sbuf_get(sql));
+			ret = EPKG_FATAL;
+			break;
+		}
+
+		for (i = 0; i < it->nbatch; i++)
+			it->batch[i]->flags |= lb->flag;
+		ret = EPKG_OK;
+	}
+
+	sbuf_delete(in);
+	sbuf_delete(sql);
+
+	return (ret);
+}
+
+static int
+pkgdb_it_populate(struct pkgdb_it *it, struct pkg **pkg_p)
+{
+	const char	*digest;
 	int		 ret;
-	const char *digest;
 
-	assert(it != NULL);
+	if (*pkg_p == NULL) {
+		ret = pkg_new(pkg_p, it->type);
+		if (ret != EPKG_OK)
+			return (ret);
+	} else
+		pkg_reset(*pkg_p, it->type);
+
+	if (it->columns == NULL &&
+	    pkgdb_it_map_columns(it) != EPKG_OK)
+		return (EPKG_FATAL);
+	populate_pkg(it, *pkg_p);
 
 	/*
 	 * XXX:
@@ -1497,53 +1814,138 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, unsigned flags)
 	 * manifest digests and set it to NULL if it is invalid.
 	 *
 	 */
+	pkg_get(*pkg_p, PKG_DIGEST, &digest);
+	if (digest != NULL && !pkg_checksum_is_valid(digest, strlen(digest)))
+		pkg_set(*pkg_p, PKG_DIGEST, NULL);
 
-	if (it->finished && (it->flags & PKGDB_IT_FLAG_ONCE))
+	return (EPKG_OK);
+}
+
+/*
+ * Prefetch up to PKGDB_IT_WINDOW packages and load their relations
+ */
+static int
+pkgdb_it_fill(struct pkgdb_it *it, unsigned flags)
+{
+	int	ret;
+
+	if (it->batch == NULL) {
+		it->batch = calloc(PKGDB_IT_WINDOW, sizeof(struct pkg *));
+		if (it->batch == NULL) {
+			pkg_emit_errno("calloc", "pkgdb_it_fill");
+			return (EPKG_FATAL);
+		}
+	}
+
+	it->nbatch = it->ibatch = 0;
+	while (it->nbatch < PKGDB_IT_WINDOW) {
+		ret = sqlite3_step(it->stmt);
+		if (ret == SQLITE_DONE) {
+			it->eof = true;
+			break;
+		}
+		if (ret != SQLITE_ROW) {
+			ERROR_SQLITE(it->sqlite, "iterator");
+			it->nbatch = 0;
+			return (EPKG_FATAL);
+		}
+		ret = pkgdb_it_populate(it, &it->batch[it->nbatch]);
+		if (ret != EPKG_OK) {
+			it->nbatch = 0;
+			return (ret);
+		}
+		it->nbatch++;
+	}
+
+	if (it->nbatch == 0)
 		return (EPKG_END);
 
-	switch (sqlite3_step(it->stmt)) {
-	case SQLITE_ROW:
-		if (*pkg_p == NULL) {
-			ret = pkg_new(pkg_p, it->type);
-			if (ret != EPKG_OK)
-				return (ret);
-		} else
-			pkg_reset(*pkg_p, it->type);
-		pkg = *pkg_p;
-
-		populate_pkg(it->stmt, pkg);
-
-		pkg_get(pkg, PKG_DIGEST, &digest);
-		if (digest != NULL && !pkg_checksum_is_valid(digest, strlen(digest)))
-			pkg_set(pkg, PKG_DIGEST, NULL);
-
-		for (i = 0; load_on_flag[i].load != NULL; i++) {
-			if (flags & load_on_flag[i].flag) {
-				if (it->db != NULL) {
-					ret = load_on_flag[i].load(it->db, pkg);
-					if (ret != EPKG_OK)
-						return (ret);
-				}
-				else {
-					pkg_emit_error("invalid iterator passed to pkgdb_it_next");
-					return (EPKG_FATAL);
-				}
+	ret = pkgdb_it_load_batch(it, flags);
+	if (ret != EPKG_OK)
+		it->nbatch = 0;
+
+	return (ret);
+}
+
+static int
+pkgdb_it_load(struct pkgdb_it *it, struct pkg *pkg, unsigned flags)
+{
+	int	i;
+	int	ret;
+
+	for (i = 0; load_on_flag[i].load != NULL; i++) {
+		if (flags & load_on_flag[i].flag) {
+			if (it->db != NULL) {
+				ret = load_on_flag[i].load(it->db, pkg);
+				if (ret != EPKG_OK)
+					return (ret);
+			}
+			else {
+				pkg_emit_error("invalid iterator passed to pkgdb_it_next");
+				return (EPKG_FATAL);
 			}
 		}
+	}
+
+	return (EPKG_OK);
+}
 
+static int
+pkgdb_it_done(struct pkgdb_it *it)
+{
+	it->eof = false;
+	it->finished ++;
+	if (it->flags & PKGDB_IT_FLAG_CYCLED) {
+		sqlite3_reset(it->stmt);
 		return (EPKG_OK);
+	}
+	else {
+		if (it->flags & PKGDB_IT_FLAG_AUTO)
+			pkgdb_it_free(it);
+		return (EPKG_END);
+	}
+}
+
+int
+pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, unsigned flags)
+{
+	struct pkg	*pkg;
+	int		 ret;
+
+	assert(it != NULL);
+
+	if (it->ibatch < it->nbatch) {
+		/* Hand out the prefetched package, keep the caller's one */
+		pkg = it->batch[it->ibatch];
+		it->batch[it->ibatch++] = *pkg_p;
+		*pkg_p = pkg;
+		return (pkgdb_it_load(it, pkg, flags));
+	}
+
+	if (it->finished && (it->flags & PKGDB_IT_FLAG_ONCE))
+		return (EPKG_END);
+
+	if (it->eof)
+		return (pkgdb_it_done(it));
+
+	if (pkgdb_it_batched(it, flags)) {
+		ret = pkgdb_it_fill(it, flags);
+		if (ret == EPKG_END)
+			return (pkgdb_it_done(it));
+		if (ret != EPKG_OK)
+			return (ret);
+		return (pkgdb_it_next(it, pkg_p, flags));
+	}
+
+	switch (sqlite3_step(it->stmt)) {
+	case SQLITE_ROW:
+		ret = pkgdb_it_populate(it, pkg_p);
+		if (ret != EPKG_OK)
+			return (ret);
+
+		return (pkgdb_it_load(it, *pkg_p, flags));
 	case SQLITE_DONE:
-		it->finished ++;
-		if (it->flags & PKGDB_IT_FLAG_CYCLED) {
-			sqlite3_reset(it->stmt);
-			return (EPKG_OK);
-		}
-		else {
-			if (it->flags & PKGDB_IT_FLAG_AUTO)
-				pkgdb_it_free(it);
-			return (EPKG_END);
-		}
-		break;
+		return (pkgdb_it_done(it));
 	default:
 		ERROR_SQLITE(it->sqlite, "iterator");
 		return (EPKG_FATAL);
@@ -1557,16 +1959,26 @@ pkgdb_it_reset(struct pkgdb_it *it)
 		return;
 
 	it->finished = 0;
+	it->nbatch = it->ibatch = 0;
+	it->eof = false;
 	sqlite3_reset(it->stmt);
 }
 
 void
 pkgdb_it_free(struct pkgdb_it *it)
 {
+	int	i;
+
 	if (it == NULL)
 		return;
 
 	sqlite3_finalize(it->stmt);
+	free(it->columns);
+	if (it->batch != NULL) {
+		for (i = 0; i < PKGDB_IT_WINDOW; i++)
+			pkg_free(it->batch[i]);
+		free(it->batch);
+	}
 	free(it);
 }
 
@@ -1886,16 +2298,14 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 		pkg_get(pkg, PKG_REPONAME, &reponame);
 		sqlite3_snprintf(sizeof(sql), sql, reposql, reponame);
 		pkg_debug(4, "Pkgdb: running '%s'", sql);
-		ret = sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL);
+		stmt = pkgdb_stmt_get(db, sql);
 	} else {
 		pkg_debug(4, "Pkgdb: running '%s'", mainsql);
-		ret = sqlite3_prepare_v2(db->sqlite, mainsql, -1, &stmt, NULL);
+		stmt = pkgdb_stmt_get(db, mainsql);
 	}
 
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, sql);
+	if (stmt == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -1906,7 +2316,7 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 			   sqlite3_column_text(stmt, 2),
 			   sqlite3_column_int(stmt, 3));
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DEPS);
@@ -1951,16 +2361,14 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 		pkg_get(pkg, PKG_REPONAME, &reponame);
 		sqlite3_snprintf(sizeof(sql), sql, reposql, reponame, reponame);
 		pkg_debug(4, "Pkgdb: running '%s'", sql);
-		ret = sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL);
+		stmt = pkgdb_stmt_get(db, sql);
 	} else {
 		pkg_debug(4, "Pkgdb: running '%s'", mainsql);
-		ret = sqlite3_prepare_v2(db->sqlite, mainsql, -1, &stmt, NULL);
+		stmt = pkgdb_stmt_get(db, mainsql);
 	}
 
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, mainsql);
+	if (stmt == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ORIGIN, &origin);
 	sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_STATIC);
@@ -1971,7 +2379,7 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 			    sqlite3_column_text(stmt, 2),
 			    sqlite3_column_int(stmt, 3));
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_RDEPS);
@@ -1990,10 +2398,12 @@ pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 	int		 ret;
 	int64_t		 rowid;
 	const char	 sql[] = ""
-		"SELECT path, sha256 "
+		"SELECT path, sha256, size, mtime "
 		"FROM files "
 		"WHERE package_id = ?1 "
 		"ORDER BY PATH ASC";
+	struct pkg_file	*f;
+	const char	*path;
 
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
@@ -2002,19 +2412,22 @@ pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, sql);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
 
 	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
-		pkg_addfile(pkg, sqlite3_column_text(stmt, 0),
-		    sqlite3_column_text(stmt, 1), false);
+		path = sqlite3_column_text(stmt, 0);
+		pkg_addfile(pkg, path, sqlite3_column_text(stmt, 1), false);
+		HASH_FIND_STR(pkg->files, path, f);
+		if (f != NULL) {
+			f->size = sqlite3_column_int64(stmt, 2);
+			f->mtime = sqlite3_column_int64(stmt, 3);
+		}
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_FILES);
@@ -2046,10 +2459,8 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, sql);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -2059,7 +2470,7 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 		    sqlite3_column_int(stmt, 1), false);
 	}
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DIRS);
 		ERROR_SQLITE(db->sqlite, sql);
@@ -2092,7 +2503,7 @@ pkgdb_load_license(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_LICENSES,
+	return (load_val(db, pkg, sql, PKG_LOAD_LICENSES,
 	    pkg_addlicense, PKG_LICENSES));
 }
 
@@ -2117,7 +2528,7 @@ pkgdb_load_category(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_CATEGORIES,
+	return (load_val(db, pkg, sql, PKG_LOAD_CATEGORIES,
 	    pkg_addcategory, PKG_CATEGORIES));
 }
 
@@ -2137,7 +2548,7 @@ pkgdb_load_user(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_USERS,
+	ret = load_val(db, pkg, sql, PKG_LOAD_USERS,
 	    pkg_adduser, PKG_USERS);
 
 	/* TODO get user uidstr from local database */
@@ -2167,14 +2578,15 @@ pkgdb_load_group(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_GROUPS,
+	ret = load_val(db, pkg, sql, PKG_LOAD_GROUPS,
 	    pkg_addgroup, PKG_GROUPS);
 
 	while (pkg_groups(pkg, &g) == EPKG_OK) {
 		grp = getgrnam(pkg_group_name(g));
 		if (grp == NULL)
 			continue;
-		strlcpy(g->gidstr, gr_make(grp), sizeof(g->gidstr));
+		free(g->gidstr);
+		g->gidstr = gr_make(grp);
 	}
 
 	return (ret);
@@ -2201,7 +2613,7 @@ pkgdb_load_shlib_required(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_SHLIBS_REQUIRED,
+	return (load_val(db, pkg, sql, PKG_LOAD_SHLIBS_REQUIRED,
 	    pkg_addshlib_required, PKG_SHLIBS_REQUIRED));
 }
 
@@ -2227,7 +2639,7 @@ pkgdb_load_shlib_provided(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_SHLIBS_PROVIDED,
+	return (load_val(db, pkg, sql, PKG_LOAD_SHLIBS_PROVIDED,
 	    pkg_addshlib_provided, PKG_SHLIBS_PROVIDED));
 }
 
@@ -2255,7 +2667,7 @@ pkgdb_load_annotations(struct pkgdb *db, struct pkg *pkg)
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main",
                     "main", "main");
 
-	return (load_tag_val(db->sqlite, pkg, sql, PKG_LOAD_ANNOTATIONS,
+	return (load_tag_val(db, pkg, sql, PKG_LOAD_ANNOTATIONS,
 		   pkg_addannotation, PKG_ANNOTATIONS));
 }
 
@@ -2277,10 +2689,8 @@ pkgdb_load_scripts(struct pkgdb *db, struct pkg *pkg)
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite, sql);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -2289,7 +2699,7 @@ pkgdb_load_scripts(struct pkgdb *db, struct pkg *pkg)
 		pkg_addscript(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_int(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 
 	if (ret != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite, sql);
@@ -2379,7 +2789,7 @@ pkgdb_load_options(struct pkgdb *db, struct pkg *pkg)
 		}
 
 		pkg_debug(4, "Pkgdb> adding option");
-		ret = load_tag_val(db->sqlite, pkg, sql, PKG_LOAD_OPTIONS,
+		ret = load_tag_val(db, pkg, sql, PKG_LOAD_OPTIONS,
 				   pkg_addtagval, PKG_OPTIONS);
 		if (ret != EPKG_OK)
 			break;
@@ -2399,7 +2809,7 @@ pkgdb_load_mtree(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
+	return (load_val(db, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
 }
 
 int
@@ -2423,7 +2833,7 @@ pkgdb_load_conflicts(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_CONFLICTS,
+	return (load_val(db, pkg, sql, PKG_LOAD_CONFLICTS,
 			pkg_addconflict, PKG_CONFLICTS));
 }
 
@@ -2446,7 +2856,7 @@ pkgdb_load_provides(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_PROVIDES,
+	return (load_val(db, pkg, sql, PKG_LOAD_PROVIDES,
 			pkg_addconflict, PKG_PROVIDES));
 }
 
@@ -2484,6 +2894,7 @@ typedef enum _sql_prstmt_index {
 	PROVIDE,
 	FTS_APPEND,
 	UPDATE_DIGEST,
+	UPDATE_FILE_STAT,
 	PRSTMT_LAST,
 } sql_prstmt_index;
 
@@ -2691,6 +3102,11 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 		NULL,
 		"UPDATE packages SET manifestdigest=?1 WHERE id=?2;",
 		"TI"
+	},
+	[UPDATE_FILE_STAT] = {
+		NULL,
+		"UPDATE files SET size=?1, mtime=?2 WHERE path=?3;",
+		"IIT"
 	}
 	/* PRSTMT_LAST */
 };
@@ -2857,6 +3273,7 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete, int forced)
 	}
 
 	package_id = sqlite3_last_insert_rowid(s);
+	pkg_set(pkg, PKG_ROWID, package_id);
 
 	if (run_prstmt(FTS_APPEND, package_id, name, version, origin) != SQLITE_DONE) {
 		ERROR_SQLITE(s, SQL(FTS_APPEND));
@@ -3313,6 +3730,31 @@ pkgdb_set_pkg_digest(struct pkgdb *db, struct pkg *pkg)
 	return (EPKG_OK);
 }
 
+/*
+ * Record the size and modification time the files had once extracted,
+ * so that checksums only need to be verified when they changed.
+ */
+int
+pkgdb_set_files_stat(struct pkgdb *db, struct pkg *pkg)
+{
+	struct pkg_file *f = NULL;
+
+	assert(pkg != NULL);
+	assert(db != NULL);
+
+	while (pkg_files(pkg, &f) == EPKG_OK) {
+		if (f->mtime == 0)
+			continue;
+		if (run_prstmt(UPDATE_FILE_STAT, f->size, (int64_t)f->mtime,
+		    pkg_file_path(f)) != SQLITE_DONE) {
+			ERROR_SQLITE(db->sqlite, SQL(UPDATE_FILE_STAT));
+			return (EPKG_FATAL);
+		}
+	}
+
+	return (EPKG_OK);
+}
+
 int
 pkgdb_modify_annotation(struct pkgdb *db, struct pkg *pkg, const char *tag,
         const char *value)
@@ -53,17 +53,6 @@
 #include "private/pkgdb.h"
 #include "private/repodb.h"
 
-/* The package repo schema major revision */
-#define REPO_SCHEMA_MAJOR 2
-
-/* The package repo schema minor revision.
-   Minor schema changes don't prevent older pkgng
-   versions accessing the repo. */
-#define REPO_SCHEMA_MINOR 10
-
-/* REPO_SCHEMA_VERSION=2007 */
-#define REPO_SCHEMA_VERSION (REPO_SCHEMA_MAJOR * 1000 + REPO_SCHEMA_MINOR)
-
 typedef enum _sql_prstmt_index {
 	PKG = 0,
 	DEPS,
@@ -82,6 +71,12 @@ typedef enum _sql_prstmt_index {
 	VERSION,
 	DELETE,
 	FTS_APPEND,
+	CAT_ID,
+	LIC_ID,
+	OPT_ID,
+	SHLIB_REQD_ID,
+	SHLIB_PROV_ID,
+	ANNOTATE_ID,
 	PRSTMT_LAST,
 } sql_prstmt_index;
 
@@ -187,10 +182,65 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 		"INSERT OR ROLLBACK INTO pkg_search(id, name, origin) "
 		"VALUES (?1, ?2 || '-' || ?3, ?4);",
 		"ITTT"
+	},
+	/* Variants used while bulk loading, when the ids are known */
+	[CAT_ID] = {
+		NULL,
+		"INSERT OR ROLLBACK INTO pkg_categories(package_id, category_id) "
+		"VALUES (?1, ?2)",
+		"II",
+	},
+	[LIC_ID] = {
+		NULL,
+		"INSERT OR ROLLBACK INTO pkg_licenses(package_id, license_id) "
+		"VALUES (?1, ?2)",
+		"II",
+	},
+	[OPT_ID] = {
+		NULL,
+		"INSERT OR ROLLBACK INTO pkg_option (option_id, value, package_id) "
+		"VALUES (?1, ?2, ?3)",
+		"ITI",
+	},
+	[SHLIB_REQD_ID] = {
+		NULL,
+		"INSERT OR ROLLBACK INTO pkg_shlibs_required(package_id, shlib_id) "
+		"VALUES (?1, ?2)",
+		"II",
+	},
+	[SHLIB_PROV_ID] = {
+		NULL,
+		"INSERT OR ROLLBACK INTO pkg_shlibs_provided(package_id, shlib_id) "
+		"VALUES (?1, ?2)",
+		"II",
+	},
+	[ANNOTATE_ID] = {
+		NULL,
+		"INSERT OR ROLLBACK INTO pkg_annotation(package_id, tag_id, value_id) "
+		"VALUES (?1, ?2, ?3)",
+		"III",
 	}
 	/* PRSTMT_LAST */
 };
 
+/*
+ * While a fresh repo is bulk loaded, the ids of categories, licenses,
+ * shlibs, options and annotations are remembered here instead of being
+ * looked up with a sub-select for every row.
+ */
+struct repo_intern {
+	char		*name;
+	int64_t		 id;
+	UT_hash_handle	 hh;
+};
+
+static bool bulk_load = false;
+static struct repo_intern *categories_map = NULL;
+static struct repo_intern *licenses_map = NULL;
+static struct repo_intern *options_map = NULL;
+static struct repo_intern *shlibs_map = NULL;
+static struct repo_intern *annotations_map = NULL;
+
 
 static void
 file_exists(sqlite3_context *ctx, int argc, sqlite3_value **argv)
@@ -301,6 +351,49 @@ run_prepared_statement(sql_prstmt_index s, ...)
 	return (retcode);
 }
 
+static void
+repo_intern_free(struct repo_intern **map)
+{
+	struct repo_intern *ent, *tmp;
+
+	HASH_ITER(hh, *map, ent, tmp) {
+		HASH_DEL(*map, ent);
+		free(ent->name);
+		free(ent);
+	}
+}
+
+/*
+ * Return the id of name, inserting it with the statement s the first
+ * time it is seen.  Only valid on a freshly created database, where the
+ * map knows about every row of the table.
+ */
+static int
+repo_intern_id(sqlite3 *sqlite, struct repo_intern **map, sql_prstmt_index s,
+    const char *name, int64_t *id)
+{
+	struct repo_intern *ent;
+	int ret;
+
+	HASH_FIND_STR(*map, name, ent);
+	if (ent == NULL) {
+		if ((ret = run_prepared_statement(s, name)) != SQLITE_DONE)
+			return (ret);
+
+		if ((ent = malloc(sizeof(*ent))) == NULL ||
+		    (ent->name = strdup(name)) == NULL) {
+			free(ent);
+			pkg_emit_errno("malloc", "repo_intern");
+			return (SQLITE_NOMEM);
+		}
+		ent->id = sqlite3_last_insert_rowid(sqlite);
+		HASH_ADD_KEYPTR(hh, *map, ent->name, strlen(ent->name), ent);
+	}
+	*id = ent->id;
+
+	return (SQLITE_DONE);
+}
+
 void
 pkgdb_repo_finalize_statements(void)
 {
@@ -315,6 +408,14 @@ pkgdb_repo_finalize_statements(void)
 			STMT(i) = NULL;
 		}
 	}
+
+	bulk_load = false;
+	repo_intern_free(&categories_map);
+	repo_intern_free(&licenses_map);
+	repo_intern_free(&options_map);
+	repo_intern_free(&shlibs_map);
+	repo_intern_free(&annotations_map);
+
 	return;
 }
 
@@ -322,58 +423,111 @@ int
 pkgdb_repo_open(const char *repodb, bool force, sqlite3 **sqlite,
 	bool *incremental)
 {
-	bool db_not_open;
 	int reposcver;
 	int retcode = EPKG_OK;
 
-	if (access(repodb, R_OK) == 0)
-		*incremental = true;
-	else
-		*incremental = false;
+	*sqlite = NULL;
+	*incremental = false;
 
-	sqlite3_initialize();
-	db_not_open = true;
-	while (db_not_open) {
-		if (sqlite3_open(repodb, sqlite) != SQLITE_OK) {
-			sqlite3_shutdown();
-			return (EPKG_FATAL);
-		}
+	if (access(repodb, R_OK) != 0)
+		return (EPKG_OK);
 
-		db_not_open = false;
+	sqlite3_initialize();
+	if (sqlite3_open(repodb, sqlite) != SQLITE_OK) {
+		sqlite3_shutdown();
+		return (EPKG_FATAL);
+	}
 
-		/* If the schema is too old, or we're forcing a full
-			   update, then we cannot do an incremental update.
-			   Delete the existing repo, and promote this to a
-			   full update */
-		if (!*incremental)
-			continue;
-		retcode = get_repo_user_version(*sqlite, "main", &reposcver);
-		if (retcode != EPKG_OK)
-			return (EPKG_FATAL);
-		if (force || reposcver != REPO_SCHEMA_VERSION) {
-			if (reposcver != REPO_SCHEMA_VERSION)
-				pkg_emit_error("re-creating repo to upgrade schema version "
-						"from %d to %d", reposcver,
-						REPO_SCHEMA_VERSION);
-			sqlite3_close(*sqlite);
-			unlink(repodb);
-			*incremental = false;
-			db_not_open = true;
-		}
+	/* If the schema is too old, or we're forcing a full
+	   update, then we cannot do an incremental update.
+	   Delete the existing repo, and promote this to a
+	   full update */
+	retcode = get_repo_user_version(*sqlite, "main", &reposcver);
+	if (retcode != EPKG_OK)
+		return (EPKG_FATAL);
+	if (force || reposcver != REPO_SCHEMA_VERSION) {
+		if (reposcver != REPO_SCHEMA_VERSION)
+			pkg_emit_error("re-creating repo to upgrade schema version "
+					"from %d to %d", reposcver,
+					REPO_SCHEMA_VERSION);
+		sqlite3_close(*sqlite);
+		*sqlite = NULL;
+		unlink(repodb);
+		return (EPKG_OK);
 	}
 
 	sqlite3_create_function(*sqlite, "file_exists", 2, SQLITE_ANY, NULL,
 	    file_exists, NULL, NULL);
+	*incremental = true;
 
-	if (!*incremental) {
-		retcode = sql_exec(*sqlite, initsql, REPO_SCHEMA_VERSION);
-		if (retcode != EPKG_OK)
-			return (retcode);
+	return (EPKG_OK);
+}
+
+int
+pkgdb_repo_open_bulk(const char *repodb, sqlite3 **sqlite)
+{
+	int retcode;
+
+	/* Leftover of an interrupted update */
+	if (unlink(repodb) == -1 && errno != ENOENT) {
+		pkg_emit_errno("unlink", repodb);
+		return (EPKG_FATAL);
 	}
 
+	sqlite3_initialize();
+	if (sqlite3_open(repodb, sqlite) != SQLITE_OK) {
+		sqlite3_shutdown();
+		return (EPKG_FATAL);
+	}
+
+	sqlite3_create_function(*sqlite, "file_exists", 2, SQLITE_ANY, NULL,
+	    file_exists, NULL, NULL);
+
+	retcode = sql_exec(*sqlite, initsql, REPO_SCHEMA_VERSION);
+	if (retcode != EPKG_OK)
+		return (retcode);
+
+	/*
+	 * Nobody else can see this file until it is renamed into place,
+	 * so a crash only costs the temporary file: no need for a journal
+	 * on disk nor for syncing.  The journal is kept in memory so that
+	 * the REPO savepoint can still be rolled back.
+	 */
+	retcode = sql_exec(*sqlite, "PRAGMA journal_mode=memory");
+	if (retcode != EPKG_OK)
+		return (retcode);
+
+	retcode = sql_exec(*sqlite, "PRAGMA synchronous=off");
+	if (retcode != EPKG_OK)
+		return (retcode);
+
+	retcode = sql_exec(*sqlite, "PRAGMA foreign_keys=on");
+	if (retcode != EPKG_OK)
+		return (retcode);
+
+	retcode = initialize_prepared_statements(*sqlite);
+	if (retcode != EPKG_OK)
+		return (retcode);
+
+	bulk_load = true;
+
 	return (EPKG_OK);
 }
 
+int
+pkgdb_repo_bulk_finish(sqlite3 *sqlite)
+{
+	int retcode;
+
+	assert(bulk_load);
+
+	retcode = sql_exec(sqlite, repo_indexsql);
+	if (retcode != EPKG_OK)
+		return (retcode);
+
+	return (sql_exec(sqlite, "PRAGMA synchronous=default"));
+}
+
 int
 pkgdb_repo_init(sqlite3 *sqlite)
 {
@@ -483,7 +637,7 @@ pkgdb_repo_add_package(struct pkg *pkg, const char *pkg_path,
 	struct pkg_shlib	*shlib    = NULL;
 	const pkg_object	*obj, *licenses, *categories, *annotations;
 	pkg_iter		 it;
-	int64_t			 package_id;
+	int64_t			 package_id, id, value_id;
 
 	pkg_get(pkg, PKG_ORIGIN, &origin, PKG_NAME, &name,
 			    PKG_VERSION, &version, PKG_COMMENT, &comment,
@@ -522,7 +676,8 @@ try_again:
 	}
 	package_id = sqlite3_last_insert_rowid(sqlite);
 
-	if (run_prepared_statement (FTS_APPEND, package_id,
+	/* pkg_search is filled at once by pkgdb_repo_bulk_finish() */
+	if (!bulk_load && run_prepared_statement (FTS_APPEND, package_id,
 			name, version, origin) != SQLITE_DONE) {
 		ERROR_SQLITE(sqlite, SQL(FTS_APPEND));
 		return (EPKG_FATAL);
@@ -542,10 +697,19 @@ try_again:
 
 	it = NULL;
 	while ((obj = pkg_object_iterate(categories, &it))) {
-		ret = run_prepared_statement(CAT1, pkg_object_string(obj));
-		if (ret == SQLITE_DONE)
-			ret = run_prepared_statement(CAT2, package_id,
+		if (bulk_load) {
+			ret = repo_intern_id(sqlite, &categories_map, CAT1,
+			    pkg_object_string(obj), &id);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(CAT_ID,
+				    package_id, id);
+		} else {
+			ret = run_prepared_statement(CAT1,
 			    pkg_object_string(obj));
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(CAT2, package_id,
+				    pkg_object_string(obj));
+		}
 		if (ret != SQLITE_DONE)
 		{
 			ERROR_SQLITE(sqlite, SQL(CAT2));
@@ -555,10 +719,19 @@ try_again:
 
 	it = NULL;
 	while ((obj = pkg_object_iterate(licenses, &it))) {
-		ret = run_prepared_statement(LIC1, pkg_object_string(obj));
-		if (ret == SQLITE_DONE)
-			ret = run_prepared_statement(LIC2, package_id,
+		if (bulk_load) {
+			ret = repo_intern_id(sqlite, &licenses_map, LIC1,
+			    pkg_object_string(obj), &id);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(LIC_ID,
+				    package_id, id);
+		} else {
+			ret = run_prepared_statement(LIC1,
 			    pkg_object_string(obj));
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(LIC2, package_id,
+				    pkg_object_string(obj));
+		}
 		if (ret != SQLITE_DONE) {
 			ERROR_SQLITE(sqlite, SQL(LIC2));
 			return (EPKG_FATAL);
@@ -566,10 +739,20 @@ try_again:
 	}
 	option = NULL;
 	while (pkg_options(pkg, &option) == EPKG_OK) {
-		ret = run_prepared_statement(OPT1, pkg_option_opt(option));
-		if (ret == SQLITE_DONE)
-		    ret = run_prepared_statement(OPT2, pkg_option_opt(option),
-				pkg_option_value(option), package_id);
+		if (bulk_load) {
+			ret = repo_intern_id(sqlite, &options_map, OPT1,
+			    pkg_option_opt(option), &id);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(OPT_ID, id,
+				    pkg_option_value(option), package_id);
+		} else {
+			ret = run_prepared_statement(OPT1,
+			    pkg_option_opt(option));
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(OPT2,
+				    pkg_option_opt(option),
+				    pkg_option_value(option), package_id);
+		}
 		if(ret != SQLITE_DONE) {
 			ERROR_SQLITE(sqlite, SQL(OPT2));
 			return (EPKG_FATAL);
@@ -580,10 +763,18 @@ try_again:
 	while (pkg_shlibs_required(pkg, &shlib) == EPKG_OK) {
 		const char *shlib_name = pkg_shlib_name(shlib);
 
-		ret = run_prepared_statement(SHLIB1, shlib_name);
-		if (ret == SQLITE_DONE)
-			ret = run_prepared_statement(SHLIB_REQD, package_id,
-					shlib_name);
+		if (bulk_load) {
+			ret = repo_intern_id(sqlite, &shlibs_map, SHLIB1,
+			    shlib_name, &id);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(SHLIB_REQD_ID,
+				    package_id, id);
+		} else {
+			ret = run_prepared_statement(SHLIB1, shlib_name);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(SHLIB_REQD,
+				    package_id, shlib_name);
+		}
 		if (ret != SQLITE_DONE) {
 			ERROR_SQLITE(sqlite, SQL(SHLIB_REQD));
 			return (EPKG_FATAL);
@@ -594,10 +785,18 @@ try_again:
 	while (pkg_shlibs_provided(pkg, &shlib) == EPKG_OK) {
 		const char *shlib_name = pkg_shlib_name(shlib);
 
-		ret = run_prepared_statement(SHLIB1, shlib_name);
-		if (ret == SQLITE_DONE)
-			ret = run_prepared_statement(SHLIB_PROV, package_id,
-					shlib_name);
+		if (bulk_load) {
+			ret = repo_intern_id(sqlite, &shlibs_map, SHLIB1,
+			    shlib_name, &id);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(SHLIB_PROV_ID,
+				    package_id, id);
+		} else {
+			ret = run_prepared_statement(SHLIB1, shlib_name);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(SHLIB_PROV,
+				    package_id, shlib_name);
+		}
 		if (ret != SQLITE_DONE) {
 			ERROR_SQLITE(sqlite, SQL(SHLIB_PROV));
 			return (EPKG_FATAL);
@@ -609,12 +808,24 @@ try_again:
 		const char *note_tag = pkg_object_key(obj);
 		const char *note_val = pkg_object_string(obj);
 
-		ret = run_prepared_statement(ANNOTATE1, note_tag);
-		if (ret == SQLITE_DONE)
-			ret = run_prepared_statement(ANNOTATE1, note_val);
-		if (ret == SQLITE_DONE)
-			ret = run_prepared_statement(ANNOTATE2, package_id,
-				  note_tag, note_val);
+		if (bulk_load) {
+			ret = repo_intern_id(sqlite, &annotations_map,
+			    ANNOTATE1, note_tag, &id);
+			if (ret == SQLITE_DONE)
+				ret = repo_intern_id(sqlite, &annotations_map,
+				    ANNOTATE1, note_val, &value_id);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(ANNOTATE_ID,
+				    package_id, id, value_id);
+		} else {
+			ret = run_prepared_statement(ANNOTATE1, note_tag);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(ANNOTATE1,
+				    note_val);
+			if (ret == SQLITE_DONE)
+				ret = run_prepared_statement(ANNOTATE2,
+				    package_id, note_tag, note_val);
+		}
 		if (ret != SQLITE_DONE) {
 			ERROR_SQLITE(sqlite, SQL(ANNOTATE2));
 			return (EPKG_FATAL);
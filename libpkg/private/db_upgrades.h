@@ -635,6 +635,10 @@ static struct db_upgrades {
 	"CREATE INDEX IF NOT EXISTS packages_uid ON packages(name, origin COLLATE NOCASE);"
 	"CREATE INDEX IF NOT EXISTS packages_version ON packages(name, version);"
 	},
+	{28,
+	"ALTER TABLE files ADD COLUMN size INTEGER;"
+	"ALTER TABLE files ADD COLUMN mtime INTEGER;"
+	},
 	/* Mark the end of the array */
 	{ -1, NULL }
 
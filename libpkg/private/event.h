@@ -29,6 +29,14 @@
 #ifndef _PKG_EVENT
 #define _PKG_EVENT
 
+/* A message kept aside by pkg_emit_hold() */
+struct pkg_event_held {
+	int type;
+	int level;
+	char *msg;
+	struct pkg_event_held *prev, *next;
+};
+
 void pkg_emit_error(const char *fmt, ...);
 void pkg_emit_notice(const char *fmt, ...);
 void pkg_emit_errno(const char *func, const char *arg);
@@ -66,4 +74,8 @@ int pkg_emit_query_select(const char *msg, const char **items, int ncnt, int def
 void pkg_emit_progress_start(const char *fmt, ...);
 void pkg_emit_progress_tick(int64_t current, int64_t total);
 
+void pkg_emit_hold(struct pkg_event_held **list);
+void pkg_emit_held(struct pkg_event_held *list);
+void pkg_emit_held_free(struct pkg_event_held *list);
+
 #endif
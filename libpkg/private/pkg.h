@@ -126,14 +126,29 @@
 
 extern int eventpipe;
 
+/*
+ * Value of a scalar attribute, typed after pkg_keys[]
+ */
+struct pkg_field {
+	bool		 set;
+	union {
+		char		*str;
+		int64_t		 num;
+		bool		 boolean;
+		ucl_object_t	*obj;
+	} v;
+};
+
 struct pkg {
-	ucl_object_t	*fields;
+	struct pkg_field fields[PKG_NUM_FIELDS];
 	bool		 direct;
 	struct sbuf	*scripts[PKG_NUM_SCRIPTS];
 	struct pkg_dep		*deps;
 	struct pkg_dep		*rdeps;
 	struct pkg_file		*files;
+	struct pkg_arena	 files_arena;
 	struct pkg_dir		*dirs;
+	struct pkg_arena	 dirs_arena;
 	struct pkg_option	*options;
 	struct pkg_user		*users;
 	struct pkg_group	*groups;
@@ -174,21 +189,26 @@ struct pkg_provide {
 	UT_hash_handle	hh;
 };
 
+/*
+ * Files and directories live in the arena of their list in struct pkg,
+ * owners are interned there too
+ */
 struct pkg_file {
-	char		 path[MAXPATHLEN];
+	const char	*path;
 	int64_t		 size;
+	time_t		 mtime;		/* once installed, 0 if unknown */
 	char		 sum[SHA256_DIGEST_LENGTH * 2 + 1];
-	char		 uname[MAXLOGNAME];
-	char		 gname[MAXLOGNAME];
+	const char	*uname;
+	const char	*gname;
 	bool		 keep;
 	mode_t		 perm;
 	UT_hash_handle	 hh;
 };
 
 struct pkg_dir {
-	char		 path[MAXPATHLEN];
-	char		 uname[MAXLOGNAME];
-	char		 gname[MAXLOGNAME];
+	const char	*path;
+	const char	*uname;
+	const char	*gname;
 	mode_t		 perm;
 	bool		 keep;
 	bool		 try;
@@ -205,6 +225,9 @@ struct pkg_option {
 
 struct pkg_job_universe_item {
 	struct pkg *pkg;
+	/* Atoms of the package uid and digest */
+	const char *uid;
+	const char *digest;
 	struct job_pattern *jp;
 	int priority;
 	bool reinstall;
@@ -214,6 +237,7 @@ struct pkg_job_universe_item {
 
 struct pkg_job_request {
 	struct pkg_job_universe_item *item;
+	const char *uid;
 	bool skip;
 	UT_hash_handle hh;
 };
@@ -252,10 +276,27 @@ struct pkg_jobs {
 	int count;
 	int total;
 	int conflicts_registered;
+	/* Bumped whenever the universe or the requests change */
+	unsigned int generation;
+	struct pkg_solve_problem *problem;
 	const char *	 reponame;
 	struct job_pattern *patterns;
+	/* Uids, digests and provides interned for the tables above */
+	struct pkg_arena atoms;
 };
 
+/*
+ * The universe, seen, provides and request tables are keyed by the
+ * address of the atom interned in j->atoms, a string that has never been
+ * interned cannot be in any of them.
+ */
+#define HASH_FIND_ATOM(j, head, str, out) do {				\
+	const char *_atom = pkg_arena_interned(&(j)->atoms, (str));	\
+	(out) = NULL;							\
+	if (_atom != NULL)						\
+		HASH_FIND_PTR((head), &_atom, (out));			\
+} while (0)
+
 struct job_pattern {
 	char		*pattern;
 	char		*path;
@@ -266,13 +307,13 @@ struct job_pattern {
 
 struct pkg_user {
 	char		 name[MAXLOGNAME];
-	char		 uidstr[8192];/* taken from pw_util.c */
+	char		*uidstr;
 	UT_hash_handle	hh;
 };
 
 struct pkg_group {
 	char		 name[MAXLOGNAME];
-	char		 gidstr[8192]; /* taken from gw_util.c */
+	char		*gidstr;
 	UT_hash_handle	hh;
 };
 
@@ -341,6 +382,7 @@ struct pkg_repo {
 		int in;
 		int out;
 		pid_t pid;
+		char *pending; /* file already asked for, reply not read */
 	} sshio;
 
 	struct pkg_repo_meta *meta;
@@ -421,16 +463,45 @@ static struct pkg_key {
 	[PKG_OLD_DIGEST] = { "olddigest", UCL_STRING },
 };
 
+ucl_object_t *pkg_attr_to_ucl(const struct pkg *pkg, pkg_attr attr);
+
+/*
+ * Transfer state handed down to the fetch loop. Every byte written is
+ * accounted in `done' and, when `hash' is set, fed to `sha' so the
+ * checksum is known once the transfer ends. A transfer starting at a
+ * non zero `offset' resumes a partial file, `offset' is reset to 0 if
+ * the server sends the whole file instead. The resumed bytes count in
+ * `done' too, it is only updated atomically so that another thread can
+ * follow the progress. Batched transfers do not
+ * report through pkg_emit_fetching(), and a transfer is abandoned as
+ * soon as `*cancel' becomes true. Over ssh, `next' names the file the
+ * caller will ask for right after this one so the request can be sent
+ * ahead of time.
+ */
+struct pkg_fetch_ctx {
+	volatile int64_t done;
+	volatile bool *cancel;
+	bool batched;
+	bool hash;
+	off_t offset;
+	const char *next;
+	SHA256_CTX sha;
+};
+
 int pkg_fetch_file_to_fd(struct pkg_repo *repo, const char *url,
-		int dest, time_t *t);
-int pkg_repo_fetch_package(struct pkg *pkg);
+		int dest, time_t *t, struct pkg_fetch_ctx *ctx);
+int pkg_repo_fetch_package(struct pkg *pkg, struct pkg_fetch_ctx *ctx);
+bool pkg_repo_fetch_next(struct pkg *pkg, char *url, size_t urllen);
 FILE* pkg_repo_fetch_remote_extract_tmp(struct pkg_repo *repo,
 		const char *filename, time_t *t, int *rc);
+int pkg_repo_fetch_remote_extract_fd(struct pkg_repo *repo,
+		const char *filename, time_t *t, int dest_fd);
 int pkg_repo_fetch_meta(struct pkg_repo *repo, time_t *t);
 
 struct pkg_repo_meta *pkg_repo_meta_default(void);
 int pkg_repo_meta_load(const char *file, struct pkg_repo_meta **target);
 void pkg_repo_meta_free(struct pkg_repo_meta *meta);
+ucl_object_t *pkg_repo_meta_to_ucl(struct pkg_repo_meta *meta);
 
 typedef enum {
 	HASH_UNKNOWN,
@@ -454,17 +525,18 @@ int pkg_delete_user_group(struct pkgdb *db, struct pkg *pkg);
 
 int pkg_open2(struct pkg **p, struct archive **a, struct archive_entry **ae,
 	      const char *path, struct pkg_manifest_key *keys, int flags, int fd);
+int pkg_open_cksum(struct pkg **p, const char *path,
+	      struct pkg_manifest_key *keys, int flags,
+	      char cksum[SHA256_DIGEST_LENGTH * 2 + 1]);
 
 void pkg_list_free(struct pkg *, pkg_list);
 
 int pkg_dep_new(struct pkg_dep **);
 void pkg_dep_free(struct pkg_dep *);
 
-int pkg_file_new(struct pkg_file **);
-void pkg_file_free(struct pkg_file *);
+int pkg_file_new(struct pkg_arena *, struct pkg_file **);
 
-int pkg_dir_new(struct pkg_dir **);
-void pkg_dir_free(struct pkg_dir *);
+int pkg_dir_new(struct pkg_arena *, struct pkg_dir **);
 
 int pkg_option_new(struct pkg_option **);
 void pkg_option_free(struct pkg_option *);
@@ -511,6 +583,12 @@ int pkg_conflicts_integrity_check(struct pkg_jobs *j);
 void pkg_conflicts_register(struct pkg *p1, struct pkg *p2,
 		enum pkg_conflict_type type);
 
+bool pkg_solve_problem_valid(struct pkg_solve_problem *problem);
+int pkg_solve_add_conflict(struct pkg_solve_problem *problem, struct pkg *p1,
+		struct pkg *p2);
+int pkg_solve_cnf(struct pkg_jobs *j, struct pkg_job_universe_item *items,
+		unsigned int nitems, const int *cnf, size_t len, bool *model);
+
 typedef void (*conflict_func_cb)(const char *, const char *, void *);
 int pkgdb_integrity_append(struct pkgdb *db, struct pkg *p,
 		conflict_func_cb cb, void *cbdata);
@@ -519,6 +597,9 @@ struct pkgdb_it *pkgdb_integrity_conflict_local(struct pkgdb *db,
 						const char *uniqueid);
 
 int pkg_set_mtree(struct pkg *, const char *mtree);
+int pkg_set_string(struct pkg *pkg, pkg_attr attr, const char *str);
+int pkg_set_int(struct pkg *pkg, pkg_attr attr, int64_t val);
+int pkg_set_bool(struct pkg *pkg, pkg_attr attr, bool val);
 
 /* pkgdb commands */
 int sql_exec(sqlite3 *, const char *, ...);
@@ -549,14 +630,44 @@ int pkgdb_update_provides(struct pkg *pkg, int64_t package_id, sqlite3 *s);
 int pkgdb_insert_annotations(struct pkg *pkg, int64_t package_id, sqlite3 *s);
 int pkgdb_register_finale(struct pkgdb *db, int retcode);
 int pkgdb_set_pkg_digest(struct pkgdb *db, struct pkg *pkg);
+int pkgdb_set_files_stat(struct pkgdb *db, struct pkg *pkg);
 
 int pkg_register_shlibs(struct pkg *pkg, const char *root);
 
 int pkg_emit_manifest_sbuf(struct pkg*, struct sbuf *, short, char **);
 int pkg_emit_filelist(struct pkg *, FILE *);
+int pkg_emit_filelist_sbuf(struct pkg *, struct sbuf **);
 
 int do_extract_mtree(char *mtree, const char *prefix);
 
+/*
+ * An installation cut in three steps so the files of several packages
+ * can be extracted at once: pkg_add_begin() and pkg_add_end() touch the
+ * database and run the scripts and must be called in order from a single
+ * thread, pkg_add_extract() may run from any thread. pkg_add_end() has
+ * to be called whatever pkg_add_begin() returned, it releases the context
+ * and returns the outcome of the whole installation. Without `progress'
+ * the extraction does not report its progress.
+ */
+struct pkg_add_ctx {
+	struct pkgdb *db;
+	struct pkg *pkg;
+	struct archive *a;
+	struct archive_entry *ae;
+	const char *location;
+	unsigned flags;
+	bool extract;
+	bool registered;
+	bool progress;
+	int retcode;
+};
+
+int pkg_add_begin(struct pkg_add_ctx *ctx, struct pkgdb *db, const char *path,
+    unsigned flags, struct pkg_manifest_key *keys, const char *location,
+    struct pkg *remote);
+int pkg_add_extract(struct pkg_add_ctx *ctx);
+int pkg_add_end(struct pkg_add_ctx *ctx);
+
 int pkg_repo_update_binary_pkgs(struct pkg_repo *repo, bool force);
 
 bool ucl_object_emit_sbuf(const ucl_object_t *obj, enum ucl_emitter emit_type,
@@ -32,13 +32,25 @@
 
 #include "sqlite3.h"
 
+#include <uthash.h>
+
+/* Prepared statement cached on the handle, keyed by its SQL text */
+struct pkgdb_stmt {
+	char		*sql;
+	sqlite3_stmt	*stmt;
+	UT_hash_handle	 hh;
+};
+
 struct pkgdb {
 	sqlite3		*sqlite;
 	pkgdb_t		 type;
 	int		 lock_count;
 	bool		 prstmt_initialized;
+	struct pkgdb_stmt *stmts;
 };
 
+struct column_mapping;
+
 struct pkgdb_it {
 	struct pkgdb	*db;
 	sqlite3	*sqlite;
@@ -46,8 +58,19 @@ struct pkgdb_it {
 	short	type;
 	short	flags;
 	short	finished;
+	/* Attribute of each column of stmt, resolved on the first row */
+	const struct column_mapping **columns;
+	int	ncols;
+	/* Window of packages prefetched to batch the relation loading */
+	struct pkg	**batch;
+	int	nbatch;
+	int	ibatch;
+	bool	eof;
 };
 
+/* Number of packages whose relations are loaded by a single query */
+#define PKGDB_IT_WINDOW 64
+
 #define PKGDB_IT_FLAG_CYCLED (0x1)
 #define PKGDB_IT_FLAG_ONCE (0x1 << 1)
 #define PKGDB_IT_FLAG_AUTO (0x1 << 2)
@@ -68,17 +91,33 @@ struct pkgdb_it *pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type, short
 void pkgshell_open(const char **r);
 
 /**
- * Open repodb for specified path
+ * Open an existing repodb for specified path
  * @param repodb path of repodb
- * @param force create repository if not exists
+ * @param force discard the existing repository
  * @param sqlite destination db pointer
- * @param incremental if this param is set to false, then database was re-created
- *  and thus needs to be updated
+ * @param incremental if this param is set to false, then there is no usable
+ *  database (it has been removed if it existed) and sqlite is NULL: a new one
+ *  has to be built with pkgdb_repo_open_bulk()
  * @return EPKG_OK if succeed
  */
 int pkgdb_repo_open(const char *repodb, bool force, sqlite3 **sqlite,
 	bool *incremental);
 
+/**
+ * Create a new repodb meant to be bulk loaded, no pkgdb_repo_init() needed
+ * @param repodb path of a temporary file, renamed into place once loaded
+ * @param sqlite destination db pointer
+ * @return EPKG_OK if succeed
+ */
+int pkgdb_repo_open_bulk(const char *repodb, sqlite3 **sqlite);
+
+/**
+ * Build the indexes deferred by pkgdb_repo_open_bulk()
+ * @param sqlite sqlite pointer
+ * @return EPKG_OK if succeed
+ */
+int pkgdb_repo_bulk_finish(sqlite3 *sqlite);
+
 /**
  * Init repository for pkgdb_repo* functions
  * @param sqlite sqlite object
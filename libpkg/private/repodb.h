@@ -39,6 +39,27 @@ static const char repo_digests_file[] = "digests";
 static const char repo_digests_archive[] = "digests";
 static const char repo_conflicts_file[] = "conflicts";
 static const char repo_conflicts_archive[] = "conflicts";
+static const char repo_index_file[] = "packagesite.index";
+static const char repo_fulldb_file[] = "fulldb.sqlite";
+static const char repo_fulldb_archive[] = "fulldb";
+static const char repo_meta_file[] = "meta";
+static const char repo_meta_archive[] = "meta";
+/* followed by -<revision> */
+static const char repo_delta_archive[] = "packagesite-delta";
+
+/* How many revisions clients may catch up on with deltas */
+#define REPO_DELTA_MAX 32
+
+/* The package repo schema major revision */
+#define REPO_SCHEMA_MAJOR 2
+
+/* The package repo schema minor revision.
+   Minor schema changes don't prevent older pkgng
+   versions accessing the repo. */
+#define REPO_SCHEMA_MINOR 10
+
+/* REPO_SCHEMA_VERSION=2007 */
+#define REPO_SCHEMA_VERSION (REPO_SCHEMA_MAJOR * 1000 + REPO_SCHEMA_MINOR)
 
 static const char initsql[] = ""
 	"CREATE TABLE packages ("
@@ -175,17 +196,26 @@ static const char initsql[] = ""
 	    "  ON DELETE RESTRICT ON UPDATE RESTRICT,"
 	    "UNIQUE(package_id, provide_id)"
 	");"
+	"CREATE UNIQUE INDEX packages_digest ON packages(manifestdigest);"
+	/* FTS search table */
+	"CREATE VIRTUAL TABLE pkg_search USING fts4(id, name, origin);"
+
+	"PRAGMA user_version=%d;"
+	;
+
+/*
+ * Secondary indexes and the FTS content are only built once a new repo
+ * has been loaded, which is much cheaper than maintaining them row by row
+ */
+static const char repo_indexsql[] = ""
 	"CREATE INDEX packages_origin ON packages(origin COLLATE NOCASE);"
 	"CREATE INDEX packages_name ON packages(name COLLATE NOCASE);"
 	"CREATE INDEX packages_uid_nocase ON packages(name COLLATE NOCASE, origin COLLATE NOCASE);"
 	"CREATE INDEX packages_version_nocase ON packages(name COLLATE NOCASE, version);"
 	"CREATE INDEX packages_uid ON packages(name, origin);"
 	"CREATE INDEX packages_version ON packages(name, version);"
-	"CREATE UNIQUE INDEX packages_digest ON packages(manifestdigest);"
-	/* FTS search table */
-	"CREATE VIRTUAL TABLE pkg_search USING fts4(id, name, origin);"
-
-	"PRAGMA user_version=%d;"
+	"INSERT INTO pkg_search SELECT id, name || '-' || version, origin "
+	    "FROM packages;"
 	;
 
 struct repo_changes {
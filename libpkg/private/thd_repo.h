@@ -30,36 +30,74 @@
 #include <sys/types.h>
 #include <pthread.h>
 
+/*
+ * One package of the previous catalogue, as recorded in the repo index.
+ * The offsets point into the previous packagesite and filesite files.
+ */
+struct pkg_repo_index_entry {
+	char *path;
+	char *origin;
+	char *digest;
+	off_t size;
+	time_t mtime;
+	ino_t ino;
+	long manifest_pos;
+	long manifest_length;
+	long files_pos;
+	long files_length;
+	UT_hash_handle hh;
+};
+
 struct pkg_result {
 	struct pkg *pkg;
+	struct pkg_repo_index_entry *cached; /* unchanged since last run */
+	char *origin;
+	char *digest;
+	struct sbuf *manifest; /* serialized compact manifest */
+	struct sbuf *files; /* serialized file list */
+	long files_pos; /* where the file list went in filesite */
+	long files_length;
 	char path[MAXPATHLEN];
 	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
 	off_t size;
+	time_t mtime;
+	ino_t ino;
 	int retcode; /* to pass errors */
 	struct pkg_result *next, *prev;
 };
 
+/* A package archive found while scanning the repository */
+struct pkg_repo_file {
+	char *path;
+	off_t size;
+	time_t mtime;
+	ino_t ino;
+};
+
 struct thd_data {
 	char *root_path;
-	unsigned int max_results;
-
-	/*
-	 * `fts_m' protects `fts' and `stop'
-	 */
-	pthread_mutex_t fts_m;
-	FTS *fts;
-	bool stop;
 	bool read_files;
 
+	/* read-only once the workers are started */
+	struct pkg_repo_index_entry *index;
+	struct pkg_repo_file *files;
+	unsigned int num_files;
+
+	/* index of the next file to read, claimed atomically by workers */
+	volatile unsigned int next_file;
+
 	/*
-	 * `results_m' protects `results', `thd_finished' and `num_results'
+	 * Bounded ring of results, protected by `ring_m': workers wait on
+	 * `ring_room' while it is full and the main thread, which is the
+	 * only consumer, waits on `ring_filled' while it is empty.
 	 */
-	pthread_mutex_t results_m;
-	pthread_cond_t has_result;
-	pthread_cond_t has_room;
-	struct pkg_result *results;
-	unsigned int num_results;
-	int thd_finished;
+	struct pkg_result **ring;
+	unsigned int ring_size;
+	unsigned int ring_head; /* oldest result */
+	unsigned int ring_count;
+	pthread_mutex_t ring_m;
+	pthread_cond_t ring_room;
+	pthread_cond_t ring_filled;
 };
 
 void read_pkg_file(void *);
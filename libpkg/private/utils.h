@@ -79,6 +79,18 @@ struct rsa_key {
 	RSA *key;
 };
 
+struct pkg_arena_chunk;
+struct pkg_arena_str;
+
+/*
+ * Bump allocator whose memory is only released all at once, with a table
+ * of interned strings living in the arena itself
+ */
+struct pkg_arena {
+	struct pkg_arena_chunk	*chunks;
+	struct pkg_arena_str	*strings;
+};
+
 
 void sbuf_init(struct sbuf **);
 int sbuf_set(struct sbuf **, const char *);
@@ -87,16 +99,25 @@ void sbuf_reset(struct sbuf *);
 void sbuf_free(struct sbuf *);
 ssize_t sbuf_size(struct sbuf *);
 
+void *pkg_arena_alloc(struct pkg_arena *, size_t);
+char *pkg_arena_strdup(struct pkg_arena *, const char *);
+const char *pkg_arena_intern(struct pkg_arena *, const char *);
+const char *pkg_arena_interned(struct pkg_arena *, const char *);
+void pkg_arena_free(struct pkg_arena *);
+
 int mkdirs(const char *path);
 int file_to_buffer(const char *, char **, off_t *);
 int format_exec_cmd(char **, const char *, const char *, const char *, char *);
 int is_dir(const char *);
 int is_conf_file(const char *path, char *newpath, size_t len);
 
+void sha256_hash(unsigned char[SHA256_DIGEST_LENGTH],
+    char[SHA256_DIGEST_LENGTH * 2 + 1]);
 void sha256_buf(char *, size_t len, char[SHA256_DIGEST_LENGTH * 2 +1]);
 void sha256_buf_bin(char *, size_t len, char[SHA256_DIGEST_LENGTH]);
 int sha256_file(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
 int sha256_fd(int fd, char[SHA256_DIGEST_LENGTH * 2 +1]);
+int sha256_read(int fd, char[SHA256_DIGEST_LENGTH * 2 +1]);
 int md5_file(const char *, char[MD5_DIGEST_LENGTH * 2 +1]);
 
 int rsa_new(struct rsa_key **, pem_password_cb *, char *path);
@@ -117,6 +138,7 @@ int set_nameserver(const char *nsname);
 ucl_object_t *yaml_to_ucl(const char *file, const char *buffer, size_t len);
 void set_blocking(int fd);
 void set_nonblocking(int fd);
+int get_workers_count(void);
 void print_trace(void);
 
 pid_t process_spawn_pipe(FILE *inout[2], const char *command);
@@ -49,10 +49,11 @@ pkg_sshserve(int fd)
 {
 	struct stat st;
 	char *line = NULL;
-	char *file, *age;
+	char *file, *age, *offstr;
 	size_t linecap = 0, r;
 	ssize_t linelen;
 	time_t mtime = 0;
+	off_t offset;
 	const char *errstr;
 	int ffd;
 	char buf[BUFSIZ];
@@ -93,7 +94,7 @@ pkg_sshserve(int fd)
 		}
 
 		if (age == NULL) {
-			printf("ko: bad command get, expecting 'get file age'\n");
+			printf("ko: bad command get, expecting 'get file age [offset]'\n");
 			continue;
 		}
 
@@ -109,10 +110,26 @@ pkg_sshserve(int fd)
 		}
 
 		if (age == NULL) {
-			printf("ko: bad command get, expecting 'get file age'\n");
+			printf("ko: bad command get, expecting 'get file age [offset]'\n");
 			continue;
 		}
 
+		/* an optional offset asks for the tail of the file only */
+		offset = 0;
+		offstr = age;
+		while (*offstr != '\0' && !isspace(*offstr))
+			offstr++;
+		if (*offstr != '\0') {
+			*offstr++ = '\0';
+			while (isspace(*offstr))
+				offstr++;
+			offset = strtonum(offstr, 0, LONG_MAX, &errstr);
+			if (errstr) {
+				printf("ko: bad number %s: %s\n", offstr, errstr);
+				continue;
+			}
+		}
+
 		mtime = strtonum(age, 0, LONG_MAX, &errstr);
 		if (errstr) {
 			printf("ko: bad number %s: %s\n", age, errstr);
@@ -147,12 +164,23 @@ pkg_sshserve(int fd)
 			continue;
 		}
 
+		if (offset > st.st_size) {
+			printf("ko: bad offset\n");
+			continue;
+		}
+
 		if ((ffd = openat(fd, file, O_RDONLY)) == -1) {
 			printf("ko: file not found\n");
 			continue;
 		}
 
-		printf("ok: %" PRIdMAX "\n", (intmax_t)st.st_size);
+		if (offset > 0 && lseek(ffd, offset, SEEK_SET) == -1) {
+			close(ffd);
+			printf("ko: bad offset\n");
+			continue;
+		}
+
+		printf("ok: %" PRIdMAX "\n", (intmax_t)(st.st_size - offset));
 
 		while ((r = read(ffd, buf, sizeof(buf))) > 0)
 			fwrite(buf, 1, r, stdout);
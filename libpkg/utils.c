@@ -30,6 +30,7 @@
 
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/sysctl.h>
 #include <stdio.h>
 
 #include <assert.h>
@@ -115,6 +116,113 @@ sbuf_size(struct sbuf *buf)
 	return 0;
 }
 
+#define ARENA_ALIGN	16
+#define ARENA_CHUNK	(64 * 1024)
+
+struct pkg_arena_chunk {
+	struct pkg_arena_chunk	*next;
+	size_t			 used;
+	size_t			 size;
+};
+
+struct pkg_arena_str {
+	UT_hash_handle		 hh;
+	char			 str[];
+};
+
+#define ARENA_HDR	roundup(sizeof(struct pkg_arena_chunk), ARENA_ALIGN)
+
+void *
+pkg_arena_alloc(struct pkg_arena *a, size_t len)
+{
+	struct pkg_arena_chunk	*c = a->chunks;
+	size_t			 size;
+	void			*p;
+
+	len = roundup(len, ARENA_ALIGN);
+
+	if (c == NULL || c->size - c->used < len) {
+		size = MAX(len, ARENA_CHUNK);
+		if ((c = malloc(ARENA_HDR + size)) == NULL) {
+			pkg_emit_errno("malloc", "pkg_arena");
+			return (NULL);
+		}
+		c->used = 0;
+		c->size = size;
+		/* Keep filling the current chunk after an oversized one */
+		if (a->chunks != NULL && len > ARENA_CHUNK) {
+			c->next = a->chunks->next;
+			a->chunks->next = c;
+		} else {
+			c->next = a->chunks;
+			a->chunks = c;
+		}
+	}
+
+	p = (char *)c + ARENA_HDR + c->used;
+	c->used += len;
+
+	return (p);
+}
+
+char *
+pkg_arena_strdup(struct pkg_arena *a, const char *str)
+{
+	size_t	 len = strlen(str) + 1;
+	char	*p;
+
+	if ((p = pkg_arena_alloc(a, len)) != NULL)
+		memcpy(p, str, len);
+
+	return (p);
+}
+
+const char *
+pkg_arena_intern(struct pkg_arena *a, const char *str)
+{
+	struct pkg_arena_str	*s;
+	size_t			 len;
+
+	HASH_FIND_STR(a->strings, str, s);
+	if (s != NULL)
+		return (s->str);
+
+	len = strlen(str);
+	if ((s = pkg_arena_alloc(a, sizeof(*s) + len + 1)) == NULL)
+		return (NULL);
+	memset(&s->hh, 0, sizeof(s->hh));
+	memcpy(s->str, str, len + 1);
+	HASH_ADD_KEYPTR(hh, a->strings, s->str, len, s);
+
+	return (s->str);
+}
+
+/*
+ * Return the interned copy of str, or NULL if it has never been interned
+ */
+const char *
+pkg_arena_interned(struct pkg_arena *a, const char *str)
+{
+	struct pkg_arena_str	*s;
+
+	HASH_FIND_STR(a->strings, str, s);
+
+	return (s != NULL ? s->str : NULL);
+}
+
+void
+pkg_arena_free(struct pkg_arena *a)
+{
+	struct pkg_arena_chunk	*c, *next;
+
+	HASH_CLEAR(hh, a->strings);
+	for (c = a->chunks; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->chunks = NULL;
+}
+
 int
 mkdirs(const char *_path)
 {
@@ -344,7 +452,7 @@ md5_file(const char *path, char out[MD5_DIGEST_LENGTH * 2 + 1])
 	return (EPKG_OK);
 }
 
-static void
+void
 sha256_hash(unsigned char hash[SHA256_DIGEST_LENGTH],
     char out[SHA256_DIGEST_LENGTH * 2 + 1])
 {
@@ -392,6 +500,32 @@ sha256_buf_bin(char *buf, size_t len, char hash[SHA256_DIGEST_LENGTH])
 	SHA256_Final(hash, &sha256);
 }
 
+/*
+ * Hash the rest of fd without reporting anything: worker threads record
+ * the failure, errno is left set, so that it is reported in order.
+ */
+int
+sha256_read(int fd, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	char buffer[BUFSIZ];
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	SHA256_CTX sha256;
+	ssize_t r;
+
+	out[0] = '\0';
+
+	SHA256_Init(&sha256);
+	while ((r = read(fd, buffer, sizeof(buffer))) > 0)
+		SHA256_Update(&sha256, buffer, r);
+	if (r == -1)
+		return (EPKG_FATAL);
+
+	SHA256_Final(hash, &sha256);
+	sha256_hash(hash, out);
+
+	return (EPKG_OK);
+}
+
 int
 sha256_fd(int fd, char out[SHA256_DIGEST_LENGTH * 2 + 1])
 {
@@ -648,6 +782,28 @@ set_blocking(int fd)
 	}
 }
 
+/*
+ * Number of threads to use for the parallel parts of pkg, as configured by
+ * WORKERS_COUNT or, when unset, one per CPU.
+ */
+int
+get_workers_count(void)
+{
+	int num_workers;
+	size_t len;
+
+	num_workers = pkg_object_int(pkg_config_get("WORKERS_COUNT"));
+	if (num_workers > 0)
+		return (num_workers);
+
+	len = sizeof(num_workers);
+	if (sysctlbyname("hw.ncpu", &num_workers, &len, NULL, 0) == -1 ||
+	    num_workers < 1)
+		num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (num_workers > 0 ? num_workers : 1);
+}
+
 /* Spawn a process from pfunc, returning it's pid. The fds array passed will
  * be filled with two descriptors: fds[0] will read from the child process,
  * and fds[1] will write to it.
@@ -51,11 +51,15 @@ struct deps_entry {
 
 STAILQ_HEAD(deps_head, deps_entry);
 
+/* packages whose checksums are verified together */
+#define CHECKSUMS_BATCH	128
+
 static int check_deps(struct pkgdb *db, struct pkg *pkg, struct deps_head *dh, bool noinstall);
 static void add_missing_dep(struct pkg_dep *d, struct deps_head *dh, int *nbpkgs);
 static void deps_free(struct deps_head *dh);
 static int fix_deps(struct pkgdb *db, struct deps_head *dh, int nbpkgs, bool yes);
 static void check_summary(struct pkgdb *db, struct deps_head *dh);
+static int check_checksums(struct pkg **batch, int *nbatch, unsigned flags);
 
 static int
 check_deps(struct pkgdb *db, struct pkg *p, struct deps_head *dh, bool noinstall)
@@ -240,10 +244,23 @@ check_summary(struct pkgdb *db, struct deps_head *dh)
 	pkg_free(pkg);
 }
 
+static int
+check_checksums(struct pkg **batch, int *nbatch, unsigned flags)
+{
+	int i, ret;
+
+	ret = pkg_test_filesums(batch, *nbatch, flags);
+	for (i = 0; i < *nbatch; i++)
+		pkg_free(batch[i]);
+	*nbatch = 0;
+
+	return (ret);
+}
+
 void
 usage_check(void)
 {
-	fprintf(stderr, "Usage: pkg check [-Bdsr] [-vy] [-a | -Cgix <pattern>]\n\n");
+	fprintf(stderr, "Usage: pkg check [-Bdsr] [-mvy] [-a | -Cgix <pattern>]\n\n");
 	fprintf(stderr, "For more information see 'pkg help check'.\n");
 }
 
@@ -265,6 +282,9 @@ exec_check(int argc, char **argv)
 	int nbpkgs = 0;
 	int i;
 	int verbose = 0;
+	struct pkg *batch[CHECKSUMS_BATCH];
+	int nbatch = 0;
+	unsigned sumflags = 0;
 
 	struct option longopts[] = {
 		{ "all",		no_argument,	NULL,	'a' },
@@ -273,6 +293,7 @@ exec_check(int argc, char **argv)
 		{ "dependencies",	no_argument,	NULL,	'd' },
 		{ "glob",		no_argument,	NULL,	'g' },
 		{ "case-insensitive",	no_argument,	NULL,	'i' },
+		{ "modified",		no_argument,	NULL,	'm' },
 		{ "dry-run",		no_argument,	NULL,	'n' },
 		{ "recompute",		no_argument,	NULL,	'r' },
 		{ "checksums",		no_argument,	NULL,	's' },
@@ -284,7 +305,7 @@ exec_check(int argc, char **argv)
 
 	struct deps_head dh = STAILQ_HEAD_INITIALIZER(dh);
 
-	while ((ch = getopt_long(argc, argv, "aBCdginrsvxy", longopts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "aBCdgimnrsvxy", longopts, NULL)) != -1) {
 		switch (ch) {
 		case 'a':
 			match = MATCH_ALL;
@@ -306,6 +327,9 @@ exec_check(int argc, char **argv)
 		case 'i':
 			pkgdb_set_case_sensitivity(false);
 			break;
+		case 'm':
+			sumflags |= PKG_FILESUM_MODIFIED;
+			break;
 		case 'n':
 			noinstall = true;
 			break;
@@ -389,9 +413,18 @@ exec_check(int argc, char **argv)
 			if (checksums) {
 				if (verbose)
 					pkg_printf("Checking checksums: %n\n", pkg);
-				if (pkg_test_filesum(pkg) != EPKG_OK) {
-					rc = EX_DATAERR;
-				}
+				/*
+				 * The files of several packages are checked
+				 * at once, unless -r is about to update the
+				 * checksums of this one or -v needs the
+				 * mismatches to follow the package name.
+				 */
+				if (recompute || verbose) {
+					if (pkg_test_filesums(&pkg, 1,
+					    sumflags) != EPKG_OK)
+						rc = EX_DATAERR;
+				} else
+					batch[nbatch++] = pkg;
 			}
 			if (recompute) {
 				if (pkgdb_upgrade_lock(db, PKGDB_LOCK_ADVISORY,
@@ -422,7 +455,18 @@ exec_check(int argc, char **argv)
 					rc = EX_TEMPFAIL;
 				}
 			}
+			if (checksums && !recompute && !verbose) {
+				/* kept until its batch is checked */
+				pkg = NULL;
+				if (nbatch == CHECKSUMS_BATCH &&
+				    check_checksums(batch, &nbatch, sumflags) !=
+				    EPKG_OK)
+					rc = EX_DATAERR;
+			}
 		}
+		if (nbatch > 0 &&
+		    check_checksums(batch, &nbatch, sumflags) != EPKG_OK)
+			rc = EX_DATAERR;
 
 		if (dcheck && nbpkgs > 0 && !noinstall) {
 			printf("\n>>> Missing package dependencies were detected.\n");
@@ -38,7 +38,7 @@
 void
 usage_repo(void)
 {
-	fprintf(stderr, "Usage: pkg repo [-lq] [-o output-dir] <repo-path> "
+	fprintf(stderr, "Usage: pkg repo [-Ddilq] [-o output-dir] <repo-path> "
 	    "[<rsa-key>|signing_command: <the command>]\n\n");
 	fprintf(stderr, "For more information see 'pkg help repo'.\n");
 }
@@ -91,17 +91,32 @@ exec_repo(int argc, char **argv)
 	int	 pos = 0;
 	int	 ch;
 	bool	 filelist = false;
+	bool	 fulldb = false;
+	bool	 delta = false;
+	bool	 incremental = false;
 	char	*output_dir = NULL;
 
 	struct option longopts[] = {
+		{ "database",	no_argument,		NULL,	'd' },
+		{ "deltas",	no_argument,		NULL,	'D' },
+		{ "incremental", no_argument,		NULL,	'i' },
 		{ "list-files", no_argument,		NULL,	'l' },
 		{ "output-dir", required_argument,	NULL,	'o' },
 		{ "quiet",	no_argument,		NULL,	'q' },
 		{ NULL,		0,			NULL,	0   },
 	};
 
-	while ((ch = getopt_long(argc, argv, "lo:q", longopts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "Ddilo:q", longopts, NULL)) != -1) {
 		switch (ch) {
+		case 'D':
+			delta = true;
+			break;
+		case 'd':
+			fulldb = true;
+			break;
+		case 'i':
+			incremental = true;
+			break;
 		case 'l':
 			filelist = true;
 			break;
@@ -134,9 +149,11 @@ exec_repo(int argc, char **argv)
 
 	if (!quiet) {
 		printf("Generating repository catalog in %s:  ", argv[0]);
-		ret = pkg_create_repo(argv[0], output_dir, filelist, progress, &pos);
+		ret = pkg_create_repo(argv[0], output_dir, filelist,
+		    incremental, progress, &pos);
 	} else
-		ret = pkg_create_repo(argv[0], output_dir, filelist, NULL, NULL);
+		ret = pkg_create_repo(argv[0], output_dir, filelist,
+		    incremental, NULL, NULL);
 
 	if (ret != EPKG_OK) {
 		printf("Cannot create repository catalogue\n");
@@ -147,7 +164,7 @@ exec_repo(int argc, char **argv)
 	}
 	
 	if (pkg_finish_repo(output_dir, password_cb, argv + 1, argc - 1,
-	    filelist) != EPKG_OK)
+	    filelist, fulldb, delta) != EPKG_OK)
 		return (EX_DATAERR);
 
 	return (EX_OK);
@@ -0,0 +1,82 @@
+#! /usr/bin/env atf-sh
+
+atf_test_case modified_upgraded
+modified_upgraded_head() {
+	atf_set "descr" "pkg check -sm after an upgrade from db version 27"
+}
+
+modified_upgraded_body() {
+        export PKG_DBDIR=$HOME/pkg
+        export INSTALL_AS_USER=yes
+
+	mkdir -p $PKG_DBDIR || atf_fail "can't create $PKG_DBDIR"
+
+	echo test > $HOME/file
+	cat > $HOME/test.yaml << EOF
+name: test
+origin: test/test
+version: 1
+maintainer: test
+categories: [test]
+comment: a test
+www: http://test
+prefix: $HOME
+desc: |-
+  This is a test
+files:
+  $HOME/file: f2ca1bb6c7e907d06dafe4687e579fce76b37e4e93b7605022da52e6ccc26fd2
+EOF
+
+	atf_check \
+	    -o match:"^Installing test-1\.\.\." \
+	    -e empty \
+	    -s exit:0 \
+	    pkg register -t -M $HOME/test.yaml
+
+	# Back to the files table of version 27, without size and mtime
+	atf_check \
+	    -o ignore \
+	    -e ignore \
+	    -s exit:0 \
+	    pkg shell << EOF
+CREATE TABLE files27 (path TEXT PRIMARY KEY, sha256 TEXT,
+    package_id INTEGER REFERENCES packages(id) ON DELETE CASCADE
+    ON UPDATE CASCADE);
+INSERT INTO files27 SELECT path, sha256, package_id FROM files;
+DROP TABLE files;
+ALTER TABLE files27 RENAME TO files;
+PRAGMA user_version = 27;
+EOF
+
+	# An empty file of the epoch would pass for a zero stat
+	: > $HOME/file
+	TZ=UTC touch -t 197001010000.00 $HOME/file
+
+	atf_check \
+	    -o ignore \
+	    -e match:"test-1: checksum mismatch for $HOME/file" \
+	    -s exit:65 \
+	    pkg check -sm -a
+
+	atf_check \
+	    -o match:"^28$" \
+	    -e ignore \
+	    -s exit:0 \
+	    pkg shell << EOF
+PRAGMA user_version;
+EOF
+
+	atf_check \
+	    -o match:"^1$" \
+	    -e ignore \
+	    -s exit:0 \
+	    pkg shell << EOF
+SELECT count(*) FROM files WHERE size IS NULL AND mtime IS NULL;
+EOF
+}
+
+atf_init_test_cases() {
+        . $(atf_get_srcdir)/test_environment
+
+	atf_add_test_case modified_upgraded
+}
@@ -0,0 +1,165 @@
+/*-
+ * Copyright (c) 2014 Baptiste Daroussin <bapt@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atf-c.h>
+#include <pkg.h>
+#include <private/pkg.h>
+
+ATF_TC(arena_alloc);
+
+ATF_TC_HEAD(arena_alloc, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg_arena_alloc() returns aligned, distinct blocks");
+}
+
+ATF_TC_BODY(arena_alloc, tc)
+{
+	struct pkg_arena	 a;
+	char			*p[1000], *big, *next;
+	size_t			 i, len;
+
+	memset(&a, 0, sizeof(a));
+
+	/* enough small blocks to need several chunks */
+	for (i = 0; i < 1000; i++) {
+		len = 1 + i % 200;
+		p[i] = pkg_arena_alloc(&a, len);
+		ATF_REQUIRE(p[i] != NULL);
+		ATF_REQUIRE_EQ(0, (uintptr_t)p[i] % 16);
+		memset(p[i], i % 256, len);
+	}
+	for (i = 0; i < 1000; i++) {
+		len = 1 + i % 200;
+		ATF_REQUIRE_EQ((char)(i % 256), p[i][0]);
+		ATF_REQUIRE_EQ((char)(i % 256), p[i][len - 1]);
+	}
+
+	/* an oversized block does not replace the chunk being filled */
+	big = pkg_arena_alloc(&a, 1024 * 1024);
+	ATF_REQUIRE(big != NULL);
+	memset(big, 0, 1024 * 1024);
+	next = pkg_arena_alloc(&a, 16);
+	ATF_REQUIRE(next != NULL);
+	ATF_REQUIRE(next < big || next >= big + 1024 * 1024);
+	ATF_REQUIRE_EQ(p[999] + 208, next);
+
+	pkg_arena_free(&a);
+	ATF_REQUIRE(a.chunks == NULL);
+
+	/* the arena can be used again once released */
+	ATF_REQUIRE(pkg_arena_alloc(&a, 1) != NULL);
+	pkg_arena_free(&a);
+}
+
+ATF_TC(arena_strdup);
+
+ATF_TC_HEAD(arena_strdup, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg_arena_strdup() copies strings into the arena");
+}
+
+ATF_TC_BODY(arena_strdup, tc)
+{
+	struct pkg_arena	 a;
+	char			 buf[32];
+	char			*s1, *s2;
+
+	memset(&a, 0, sizeof(a));
+
+	snprintf(buf, sizeof(buf), "/usr/local/bin/pkg");
+	s1 = pkg_arena_strdup(&a, buf);
+	s2 = pkg_arena_strdup(&a, buf);
+	buf[0] = '\0';
+
+	ATF_REQUIRE_STREQ("/usr/local/bin/pkg", s1);
+	ATF_REQUIRE_STREQ("/usr/local/bin/pkg", s2);
+	ATF_REQUIRE(s1 != s2);
+	ATF_REQUIRE_STREQ("", pkg_arena_strdup(&a, ""));
+
+	pkg_arena_free(&a);
+}
+
+ATF_TC(arena_intern);
+
+ATF_TC_HEAD(arena_intern, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg_arena_intern() keeps one copy of every string");
+}
+
+ATF_TC_BODY(arena_intern, tc)
+{
+	struct pkg_arena	 a;
+	const char		*atoms[500];
+	char			 buf[32];
+	unsigned int		 i;
+
+	memset(&a, 0, sizeof(a));
+
+	ATF_REQUIRE(pkg_arena_interned(&a, "devel/pkg") == NULL);
+
+	for (i = 0; i < 500; i++) {
+		snprintf(buf, sizeof(buf), "category/port%u", i);
+		atoms[i] = pkg_arena_intern(&a, buf);
+		ATF_REQUIRE(atoms[i] != NULL);
+		ATF_REQUIRE(atoms[i] != buf);
+		ATF_REQUIRE_STREQ(buf, atoms[i]);
+	}
+
+	/* the same string gives the same atom, whatever its address */
+	for (i = 0; i < 500; i++) {
+		snprintf(buf, sizeof(buf), "category/port%u", i);
+		ATF_REQUIRE_EQ(atoms[i], pkg_arena_intern(&a, buf));
+		ATF_REQUIRE_EQ(atoms[i], pkg_arena_interned(&a, buf));
+	}
+
+	/* looking an atom up does not intern it */
+	ATF_REQUIRE(pkg_arena_interned(&a, "category/port500") == NULL);
+	ATF_REQUIRE(pkg_arena_interned(&a, "category/port500") == NULL);
+	ATF_REQUIRE(pkg_arena_interned(&a, "") == NULL);
+	ATF_REQUIRE_STREQ("", pkg_arena_intern(&a, ""));
+	ATF_REQUIRE(pkg_arena_interned(&a, "") != NULL);
+
+	/* nothing survives the release of the arena */
+	pkg_arena_free(&a);
+	ATF_REQUIRE(a.strings == NULL);
+	ATF_REQUIRE(pkg_arena_interned(&a, "category/port0") == NULL);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, arena_alloc);
+	ATF_TP_ADD_TC(tp, arena_strdup);
+	ATF_TP_ADD_TC(tp, arena_intern);
+
+	return (atf_no_error());
+}
@@ -0,0 +1,228 @@
+/*-
+ * Copyright (c) 2014 Baptiste Daroussin <bapt@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atf-c.h>
+#include <pkg.h>
+#include <private/pkg.h>
+
+#define NPKGS	3
+#define NFILES	50
+
+static struct sbuf *reported;
+
+/*
+ * Keep one line per mismatch or error, in the order they are reported
+ */
+static int
+event_callback(void *data, struct pkg_event *ev)
+{
+	switch (ev->type) {
+	case PKG_EVENT_FILE_MISMATCH:
+		sbuf_printf(reported, "mismatch %s\n",
+		    pkg_file_path(ev->e_file_mismatch.file));
+		break;
+	case PKG_EVENT_ERRNO:
+		sbuf_printf(reported, "%s %s %d\n", ev->e_errno.func,
+		    ev->e_errno.arg, ev->e_errno.no);
+		break;
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+static void
+write_file(const char *path, const char *content)
+{
+	FILE	*f;
+
+	ATF_REQUIRE((f = fopen(path, "w")) != NULL);
+	fputs(content, f);
+	ATF_REQUIRE_EQ(0, fclose(f));
+}
+
+/*
+ * Create the files of `npkgs' packages with their checksums, and record
+ * their size and mtime as an installation does
+ */
+static void
+make_pkgs(struct pkg **pkgs, int npkgs, int nfiles)
+{
+	struct pkg_file	*f;
+	struct stat	 st;
+	char		 path[MAXPATHLEN], sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	int		 n, i;
+
+	for (n = 0; n < npkgs; n++) {
+		ATF_REQUIRE_EQ(EPKG_OK, pkg_new(&pkgs[n], PKG_INSTALLED));
+		for (i = 0; i < nfiles; i++) {
+			snprintf(path, sizeof(path), "p%d.f%02d", n, i);
+			write_file(path, path);
+			ATF_REQUIRE_EQ(EPKG_OK, sha256_file(path, sum));
+			ATF_REQUIRE_EQ(EPKG_OK,
+			    pkg_addfile(pkgs[n], path, sum, false));
+		}
+		f = NULL;
+		while (pkg_files(pkgs[n], &f) == EPKG_OK) {
+			ATF_REQUIRE_EQ(0, lstat(pkg_file_path(f), &st));
+			f->size = st.st_size;
+			f->mtime = st.st_mtime;
+		}
+	}
+}
+
+static void
+free_pkgs(struct pkg **pkgs, int npkgs)
+{
+	int	 n;
+
+	for (n = 0; n < npkgs; n++)
+		pkg_free(pkgs[n]);
+}
+
+ATF_TC(filesums_batch);
+
+ATF_TC_HEAD(filesums_batch, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg_test_filesums() reports the problems of a batch in order");
+}
+
+ATF_TC_BODY(filesums_batch, tc)
+{
+	struct pkg	*pkgs[NPKGS];
+	char		 expected[BUFSIZ];
+
+	reported = sbuf_new_auto();
+	pkg_event_register(event_callback, NULL);
+
+	/* enough files to have them checked by several threads */
+	make_pkgs(pkgs, NPKGS, NFILES);
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_test_filesums(pkgs, NPKGS, 0));
+	sbuf_finish(reported);
+	ATF_REQUIRE_STREQ("", sbuf_data(reported));
+
+	write_file("p2.f40", "changed");
+	write_file("p0.f07", "changed");
+	ATF_REQUIRE_EQ(0, unlink("p1.f13"));
+	write_file("p0.f31", "changed");
+	/* can be opened but not read */
+	ATF_REQUIRE_EQ(0, unlink("p1.f20"));
+	ATF_REQUIRE_EQ(0, mkdir("p1.f20", 0755));
+
+	sbuf_clear(reported);
+	ATF_REQUIRE_EQ(EPKG_FATAL, pkg_test_filesums(pkgs, NPKGS, 0));
+	sbuf_finish(reported);
+	snprintf(expected, sizeof(expected),
+	    "mismatch p0.f07\n"
+	    "mismatch p0.f31\n"
+	    "lstat p1.f13 %d\n"
+	    "read p1.f20 %d\n"
+	    "mismatch p2.f40\n", ENOENT, EISDIR);
+	ATF_REQUIRE_STREQ(expected, sbuf_data(reported));
+
+	/* a single package only reports its own files */
+	sbuf_clear(reported);
+	ATF_REQUIRE_EQ(EPKG_FATAL, pkg_test_filesum(pkgs[2]));
+	sbuf_finish(reported);
+	ATF_REQUIRE_STREQ("mismatch p2.f40\n", sbuf_data(reported));
+
+	free_pkgs(pkgs, NPKGS);
+	sbuf_delete(reported);
+}
+
+ATF_TC(filesums_modified);
+
+ATF_TC_HEAD(filesums_modified, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "PKG_FILESUM_MODIFIED only hashes the files whose stat changed");
+}
+
+ATF_TC_BODY(filesums_modified, tc)
+{
+	struct pkg	*pkgs[1];
+	struct pkg_file	*f;
+	struct stat	 st;
+	struct timeval	 tv[2];
+
+	reported = sbuf_new_auto();
+	pkg_event_register(event_callback, NULL);
+
+	make_pkgs(pkgs, 1, 3);
+
+	/* same size and mtime, the change goes unnoticed */
+	ATF_REQUIRE_EQ(0, lstat("p0.f00", &st));
+	write_file("p0.f00", "P0.F00");
+	tv[0].tv_sec = tv[1].tv_sec = st.st_mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	ATF_REQUIRE_EQ(0, utimes("p0.f00", tv));
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_test_filesums(pkgs, 1, PKG_FILESUM_MODIFIED));
+	ATF_REQUIRE_EQ(EPKG_FATAL, pkg_test_filesums(pkgs, 1, 0));
+
+	/* a file with no recorded stat is always hashed */
+	f = NULL;
+	while (pkg_files(pkgs[0], &f) == EPKG_OK) {
+		if (strcmp(pkg_file_path(f), "p0.f00") == 0)
+			f->mtime = 0;
+	}
+	sbuf_clear(reported);
+	ATF_REQUIRE_EQ(EPKG_FATAL,
+	    pkg_test_filesums(pkgs, 1, PKG_FILESUM_MODIFIED));
+	sbuf_finish(reported);
+	ATF_REQUIRE_STREQ("mismatch p0.f00\n", sbuf_data(reported));
+
+	/* a different size is enough to hash the file */
+	write_file("p0.f01", "longer than before");
+	ATF_REQUIRE_EQ(0, utimes("p0.f01", tv));
+	sbuf_clear(reported);
+	ATF_REQUIRE_EQ(EPKG_FATAL,
+	    pkg_test_filesums(pkgs, 1, PKG_FILESUM_MODIFIED));
+	sbuf_finish(reported);
+	ATF_REQUIRE_STREQ("mismatch p0.f00\nmismatch p0.f01\n",
+	    sbuf_data(reported));
+
+	free_pkgs(pkgs, 1);
+	sbuf_delete(reported);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, filesums_batch);
+	ATF_TP_ADD_TC(tp, filesums_modified);
+
+	return (atf_no_error());
+}
@@ -0,0 +1,313 @@
+/*-
+ * Copyright (c) 2014 Vsevolod Stakhov <vsevolod@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atf-c.h>
+#include <pkg.h>
+#include <private/pkg.h>
+
+struct catalogue_entry {
+	const char *origin;
+	const char *digest;
+};
+
+/*
+ * Write the files pkg_create_repo() would leave in the current directory,
+ * one single line manifest per package
+ */
+static void
+write_catalogue(const struct catalogue_entry *entries, size_t n)
+{
+	FILE	*manifests, *digests, *conflicts;
+	long	 offset, length;
+	size_t	 i;
+
+	ATF_REQUIRE((manifests = fopen("packagesite.yaml", "w")) != NULL);
+	ATF_REQUIRE((digests = fopen("digests", "w")) != NULL);
+	ATF_REQUIRE((conflicts = fopen("conflicts", "w")) != NULL);
+
+	for (i = 0; i < n; i++) {
+		offset = ftell(manifests);
+		fprintf(manifests, "{\"origin\":\"%s\",\"version\":\"%s\"}\n",
+		    entries[i].origin, entries[i].digest);
+		length = ftell(manifests) - offset;
+		fprintf(digests, "%s:%s:%ld:0:%ld\n", entries[i].origin,
+		    entries[i].digest, offset, length);
+	}
+
+	fclose(manifests);
+	fclose(digests);
+	fclose(conflicts);
+}
+
+/*
+ * Return the content of the file `name' packed in `path', or NULL
+ */
+static char *
+read_archive_file(const char *path, const char *name)
+{
+	struct archive		*a;
+	struct archive_entry	*ae;
+	char			*buf = NULL;
+	int64_t			 size;
+
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_tar(a);
+	if (archive_read_open_filename(a, path, 4096) == ARCHIVE_OK) {
+		while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+			if (strcmp(archive_entry_pathname(ae), name) != 0)
+				continue;
+			size = archive_entry_size(ae);
+			ATF_REQUIRE((buf = calloc(1, size + 1)) != NULL);
+			ATF_REQUIRE_EQ(size, archive_read_data(a, buf, size));
+			break;
+		}
+	}
+	archive_read_free(a);
+
+	return (buf);
+}
+
+static struct pkg_repo_meta *
+read_meta(void)
+{
+	struct pkg_repo_meta	*meta;
+	char			*buf;
+	FILE			*f;
+
+	ATF_REQUIRE((buf = read_archive_file("meta.txz", "meta")) != NULL);
+	ATF_REQUIRE((f = fopen("meta.ucl", "w")) != NULL);
+	fputs(buf, f);
+	fclose(f);
+	free(buf);
+
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_repo_meta_load("meta.ucl", &meta));
+
+	return (meta);
+}
+
+static bool
+exists(const char *path)
+{
+	struct stat	 st;
+
+	return (stat(path, &st) == 0);
+}
+
+ATF_TC(meta_revision);
+
+ATF_TC_HEAD(meta_revision, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "the revision and source identifier of a meta are kept");
+}
+
+ATF_TC_BODY(meta_revision, tc)
+{
+	struct pkg_repo_meta	*meta, *loaded;
+	ucl_object_t		*obj;
+	unsigned char		*str;
+	FILE			*f;
+
+	ATF_REQUIRE((meta = pkg_repo_meta_default()) != NULL);
+	meta->source_identifier = strdup("5433a1e0.2a5f");
+	meta->revision = 12;
+	meta->fulldb = strdup("fulldb.sqlite");
+
+	obj = pkg_repo_meta_to_ucl(meta);
+	str = ucl_object_emit(obj, UCL_EMIT_CONFIG);
+	ATF_REQUIRE((f = fopen("meta", "w")) != NULL);
+	fputs((char *)str, f);
+	fclose(f);
+	free(str);
+	ucl_object_unref(obj);
+
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_repo_meta_load("meta", &loaded));
+	ATF_REQUIRE_EQ(12, loaded->revision);
+	ATF_REQUIRE_STREQ("5433a1e0.2a5f", loaded->source_identifier);
+	ATF_REQUIRE_STREQ("fulldb.sqlite", loaded->fulldb);
+	pkg_repo_meta_free(loaded);
+
+	/* a meta without revision does not announce any delta */
+	meta->revision = 0;
+	free(meta->source_identifier);
+	meta->source_identifier = NULL;
+	obj = pkg_repo_meta_to_ucl(meta);
+	ATF_REQUIRE(ucl_object_find_key(obj, "revision") == NULL);
+	ATF_REQUIRE(ucl_object_find_key(obj, "source_identifier") == NULL);
+	ucl_object_unref(obj);
+
+	pkg_repo_meta_free(meta);
+}
+
+ATF_TC(delta_chain);
+
+ATF_TC_HEAD(delta_chain, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg repo -D publishes the changes since the previous run");
+}
+
+ATF_TC_BODY(delta_chain, tc)
+{
+	const struct catalogue_entry first[] = {
+		{ "devel/a", "1" },
+		{ "devel/b", "1" },
+		{ "devel/c", "1" },
+	};
+	const struct catalogue_entry second[] = {
+		{ "devel/a", "1" },
+		{ "devel/b", "2" },
+		{ "devel/d", "1" },
+	};
+	const struct catalogue_entry third[] = {
+		{ "devel/a", "1" },
+		{ "devel/a", "3" },
+		{ "devel/b", "2" },
+		{ "devel/d", "1" },
+	};
+	struct pkg_repo_meta	*meta;
+	char			*source, *delta;
+
+	/* the first run starts a chain and has nothing to compare with */
+	write_catalogue(first, 3);
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_finish_repo(".", NULL, NULL, 0, false, false, true));
+	ATF_REQUIRE(exists("packagesite.txz"));
+	ATF_REQUIRE(!exists("packagesite-delta-1.txz"));
+	meta = read_meta();
+	ATF_REQUIRE_EQ(1, meta->revision);
+	ATF_REQUIRE(meta->source_identifier != NULL);
+	source = strdup(meta->source_identifier);
+	pkg_repo_meta_free(meta);
+
+	write_catalogue(second, 3);
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_finish_repo(".", NULL, NULL, 0, false, false, true));
+	meta = read_meta();
+	ATF_REQUIRE_EQ(2, meta->revision);
+	ATF_REQUIRE_STREQ(source, meta->source_identifier);
+	pkg_repo_meta_free(meta);
+
+	/* unchanged packages are left out, the manifest follows the digest */
+	delta = read_archive_file("packagesite-delta-2.txz",
+	    "packagesite-delta-2");
+	ATF_REQUIRE(delta != NULL);
+	ATF_REQUIRE_STREQ(
+	    "-:devel/c\n"
+	    "+:devel/b:2:{\"origin\":\"devel/b\",\"version\":\"2\"}\n"
+	    "+:devel/d:1:{\"origin\":\"devel/d\",\"version\":\"1\"}\n",
+	    delta);
+	free(delta);
+
+	/* nothing changed, the delta is empty but the chain goes on */
+	write_catalogue(second, 3);
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_finish_repo(".", NULL, NULL, 0, false, false, true));
+	ATF_REQUIRE(exists("packagesite-delta-2.txz"));
+	delta = read_archive_file("packagesite-delta-3.txz",
+	    "packagesite-delta-3");
+	ATF_REQUIRE(delta != NULL);
+	ATF_REQUIRE_STREQ("", delta);
+	free(delta);
+
+	/* packages sharing an origin never get the origin removed */
+	write_catalogue(third, 4);
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_finish_repo(".", NULL, NULL, 0, false, false, true));
+	write_catalogue(third, 4);
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_finish_repo(".", NULL, NULL, 0, false, false, true));
+	delta = read_archive_file("packagesite-delta-5.txz",
+	    "packagesite-delta-5");
+	ATF_REQUIRE(delta != NULL);
+	ATF_REQUIRE(strstr(delta, "-:") == NULL);
+	free(delta);
+
+	free(source);
+}
+
+ATF_TC(delta_dropped);
+
+ATF_TC_HEAD(delta_dropped, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg repo without -D removes the deltas and their meta");
+}
+
+ATF_TC_BODY(delta_dropped, tc)
+{
+	const struct catalogue_entry first[] = {
+		{ "devel/a", "1" },
+	};
+	const struct catalogue_entry second[] = {
+		{ "devel/a", "2" },
+	};
+	struct pkg_repo_meta	*meta;
+
+	write_catalogue(first, 1);
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_finish_repo(".", NULL, NULL, 0, false, false, true));
+	write_catalogue(second, 1);
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_finish_repo(".", NULL, NULL, 0, false, false, true));
+	ATF_REQUIRE(exists("packagesite-delta-2.txz"));
+	ATF_REQUIRE(exists("meta.txz"));
+
+	/* clients must not apply deltas against this catalogue */
+	write_catalogue(first, 1);
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_finish_repo(".", NULL, NULL, 0, false, false, false));
+	ATF_REQUIRE(!exists("packagesite-delta-2.txz"));
+	ATF_REQUIRE(!exists("meta.txz"));
+
+	/* a later -D run starts a new chain */
+	write_catalogue(second, 1);
+	ATF_REQUIRE_EQ(EPKG_OK,
+	    pkg_finish_repo(".", NULL, NULL, 0, false, false, true));
+	meta = read_meta();
+	ATF_REQUIRE_EQ(1, meta->revision);
+	pkg_repo_meta_free(meta);
+	ATF_REQUIRE(!exists("packagesite-delta-1.txz"));
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, meta_revision);
+	ATF_TP_ADD_TC(tp, delta_chain);
+	ATF_TP_ADD_TC(tp, delta_dropped);
+
+	return (atf_no_error());
+}
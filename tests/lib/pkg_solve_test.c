@@ -0,0 +1,231 @@
+/*-
+ * Copyright (c) 2014 Vsevolod Stakhov <vsevolod@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atf-c.h>
+#include <pkg.h>
+#include <private/pkg.h>
+
+#define MAXVARS		10
+#define MAXCLAUSES	40
+#define MAXLEN		4
+#define NINSTANCES	2000
+
+struct cnf {
+	unsigned int nvars;
+	size_t len;
+	int lits[MAXCLAUSES * (MAXLEN + 1)];
+};
+
+static struct pkg_jobs jobs;
+static struct pkg_job_universe_item items[MAXVARS];
+static char uids[MAXVARS][16];
+
+static void
+universe_init(pkg_jobs_t type)
+{
+	unsigned int	 i;
+
+	memset(&jobs, 0, sizeof(jobs));
+	jobs.type = type;
+
+	for (i = 0; i < MAXVARS; i++) {
+		memset(&items[i], 0, sizeof(items[i]));
+		/* odd variables start from an installed package */
+		ATF_REQUIRE_EQ(EPKG_OK, pkg_new(&items[i].pkg,
+		    i % 2 ? PKG_INSTALLED : PKG_REMOTE));
+		snprintf(uids[i], sizeof(uids[i]), "test/v%u", i + 1);
+		items[i].uid = items[i].digest = uids[i];
+		items[i].prev = &items[i];
+	}
+}
+
+static void
+universe_free(void)
+{
+	unsigned int	 i;
+
+	for (i = 0; i < MAXVARS; i++)
+		pkg_free(items[i].pkg);
+}
+
+static void
+cnf_random(struct cnf *f)
+{
+	unsigned int	 nclauses, len, c, k;
+
+	f->nvars = 1 + random() % MAXVARS;
+	nclauses = 1 + random() % MAXCLAUSES;
+	f->len = 0;
+
+	for (c = 0; c < nclauses; c++) {
+		len = 1 + random() % MAXLEN;
+		/* few unit clauses, they make most instances trivial */
+		if (len == 1 && random() % 4 != 0)
+			len = 2;
+		for (k = 0; k < len; k++) {
+			f->lits[f->len] = 1 + random() % f->nvars;
+			if (random() % 2)
+				f->lits[f->len] = -f->lits[f->len];
+			f->len++;
+		}
+		f->lits[f->len++] = 0;
+	}
+}
+
+static bool
+cnf_satisfied(const struct cnf *f, const bool *model)
+{
+	size_t	 k;
+	bool	 sat = false;
+	int	 lit;
+
+	for (k = 0; k < f->len; k++) {
+		lit = f->lits[k];
+		if (lit == 0) {
+			if (!sat)
+				return (false);
+			sat = false;
+		} else if (model[abs(lit) - 1] == (lit > 0))
+			sat = true;
+	}
+
+	return (true);
+}
+
+static bool
+cnf_brute_force(const struct cnf *f)
+{
+	bool		 model[MAXVARS];
+	unsigned int	 m, i;
+
+	for (m = 0; m < (1U << f->nvars); m++) {
+		for (i = 0; i < f->nvars; i++)
+			model[i] = (m >> i) & 1;
+		if (cnf_satisfied(f, model))
+			return (true);
+	}
+
+	return (false);
+}
+
+static void
+check_random(pkg_jobs_t type, unsigned int seed)
+{
+	struct cnf	 f;
+	bool		 model[MAXVARS];
+	unsigned int	 n, nsat = 0;
+	bool		 sat;
+
+	universe_init(type);
+	srandom(seed);
+
+	for (n = 0; n < NINSTANCES; n++) {
+		cnf_random(&f);
+		sat = cnf_brute_force(&f);
+		if (sat)
+			nsat++;
+		ATF_REQUIRE_EQ_MSG(sat, pkg_solve_cnf(&jobs, items, f.nvars,
+		    f.lits, f.len, model) == EPKG_OK,
+		    "instance %u: the solver and brute force disagree", n);
+		if (sat)
+			ATF_REQUIRE_MSG(cnf_satisfied(&f, model),
+			    "instance %u: the model does not satisfy the "
+			    "formula", n);
+	}
+
+	/* both outcomes must have been exercised */
+	ATF_REQUIRE(nsat > 0 && nsat < NINSTANCES);
+
+	universe_free();
+}
+
+ATF_TC(brute_force_install);
+
+ATF_TC_HEAD(brute_force_install, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "CDCL engine agrees with brute force on random formulas");
+}
+
+ATF_TC_BODY(brute_force_install, tc)
+{
+	check_random(PKG_JOBS_INSTALL, 1);
+}
+
+ATF_TC(brute_force_upgrade);
+
+ATF_TC_HEAD(brute_force_upgrade, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "CDCL engine agrees with brute force with the upgrade guesses");
+}
+
+ATF_TC_BODY(brute_force_upgrade, tc)
+{
+	check_random(PKG_JOBS_UPGRADE, 2);
+}
+
+ATF_TC(unsat_core);
+
+ATF_TC_HEAD(unsat_core, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "CDCL engine needs to learn clauses to refute a formula");
+}
+
+ATF_TC_BODY(unsat_core, tc)
+{
+	/* every assignment of 3 variables is excluded by one clause */
+	int all[] = {
+		 1,  2,  3, 0,   1,  2, -3, 0,   1, -2,  3, 0,   1, -2, -3, 0,
+		-1,  2,  3, 0,  -1,  2, -3, 0,  -1, -2,  3, 0,  -1, -2, -3, 0,
+	};
+	bool model[MAXVARS];
+
+	universe_init(PKG_JOBS_INSTALL);
+
+	ATF_REQUIRE_EQ(EPKG_FATAL, pkg_solve_cnf(&jobs, items, 3, all,
+	    sizeof(all) / sizeof(all[0]), model));
+	/* without its last clause the formula has a single model */
+	ATF_REQUIRE_EQ(EPKG_OK, pkg_solve_cnf(&jobs, items, 3, all,
+	    sizeof(all) / sizeof(all[0]) - 4, model));
+	ATF_REQUIRE(model[0] && model[1] && model[2]);
+
+	universe_free();
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, brute_force_install);
+	ATF_TP_ADD_TC(tp, brute_force_upgrade);
+	ATF_TP_ADD_TC(tp, unsat_core);
+
+	return (atf_no_error());
+}